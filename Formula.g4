@@ -4,13 +4,27 @@ main
     : expr EOF
     ;
 
+// tokens are labelled: the AST is built by a parse listener while parsing,
+// with parse tree construction disabled, so tokens are reachable only via labels
 expr
     : '(' expr ')'  # Parens
-    | (ADD | SUB) expr  # UnaryOp
-    | expr (MUL | DIV) expr  # BinaryOp
-    | expr (ADD | SUB) expr  # BinaryOp
-    | CELL  # Cell
-    | NUMBER  # Literal
+    | op=(ADD | SUB) expr  # UnaryOp
+    | expr op=(MUL | DIV) expr  # BinaryOp
+    | expr op=(ADD | SUB) expr  # BinaryOp
+    | expr op=(EQ | NE | LT | LE | GT | GE) expr  # BinaryOp
+    | name=FUNCTION '(' (args+=arg (',' args+=arg)*)? ')'  # Function
+    | sheet=SHEET? value=CELL  # Cell
+    | value=RANGE  # Range
+    | value=(NAME | FUNCTION)  # Name
+    | value=NUMBER  # Literal
+    ;
+
+// a range of the same sheet is also an operand of array arithmetic (A1:A9*2);
+// ranges of other sheets and strings (criteria) are only valid as function arguments
+arg
+    : sheet=SHEET? value=RANGE  # RangeArg
+    | value=STRING  # StringArg
+    | expr  # ExprArg
     ;
 
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
@@ -26,5 +40,18 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+EQ: '=' ;
+NE: '<>' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
 CELL: [A-Z]+[0-9]+ ;
+RANGE: [A-Z]+[0-9]+ ':' [A-Z]+[0-9]+ ;
+FUNCTION: [A-Z]+ ;
+STRING: '"' ~["\r\n]* '"' ;
+// a name cannot start like a cell reference; FUNCTION without '(' is a name too
+NAME: [A-Z]* [a-z_] [A-Za-z0-9_]* ;
+// sheet prefix of a reference to another sheet: Sheet1!A1, Sheet1!A1:B2
+SHEET: [A-Za-z_] [A-Za-z0-9_]* '!' ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
@@ -3,10 +3,23 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "aggregate.h"
+#include "elementwise.h"
+#include "nan_box.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <optional>
+#include <random>
 #include <sstream>
 #include <stdexcept>
 #include <cstdlib>
@@ -14,6 +27,7 @@
 namespace ASTImpl {
 
     enum ExprPrecedence {
+        EP_COMPARE,
         EP_ADD,
         EP_SUB,
         EP_MUL,
@@ -31,12 +45,31 @@ namespace ASTImpl {
     };
 
     constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-            {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-            {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-            {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-            {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-            {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-            {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+            {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+            {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+            {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+            {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+            {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+            {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+            {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    };
+
+    // Число в записи формулы так же, как его выводит ostream с настройками
+    // по умолчанию (printf "%g"), но без потока.
+    void AppendNumber(std::string& out, double value) {
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value,
+                                    std::chars_format::general, 6);
+        out.append(buffer, result.ptr);
+    }
+
+    struct EvaluationContext {
+        const FormulaAST::CellLookup& cells;
+        const FormulaAST::RangeLookup& ranges;
+        const FormulaAST::MatchLookup& matches;
+        const FormulaAST::CriteriaLookup& criteria;
+        const FormulaAST::SheetLookup& sheets;
+        const FormulaAST::NameLookup& names;
     };
 
     class Expr {
@@ -44,36 +77,122 @@ namespace ASTImpl {
         virtual ~Expr() = default;
 
         virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
+        virtual void DoPrintFormula(std::string& out, ExprPrecedence precedence) const = 0;
+
+        [[nodiscard]] virtual double Evaluate(const EvaluationContext& context) const = 0;
+
+        // Область, которую узел задаёт для функции: у области — она сама, у
+        // ссылки — область из одной ячейки.
+        [[nodiscard]] virtual std::optional<Range> AsRange() const {
+            return std::nullopt;
+        }
+
+        // Условие, которое узел задаёт строкой; у остальных узлов его нет.
+        [[nodiscard]] virtual std::optional<Criteria> AsCriteria() const {
+            return std::nullopt;
+        }
+
+        // Несвязанное имя, которое задаёт узел; у остальных узлов его нет.
+        [[nodiscard]] virtual std::optional<std::string_view> AsName() const {
+            return std::nullopt;
+        }
+
+        // Лист, к которому относится ссылка или область узла, если он не свой.
+        [[nodiscard]] virtual std::optional<std::string_view> AsSheet() const {
+            return std::nullopt;
+        }
+
+        // Дописывает в out несвязанные имена узла и его потомков.
+        virtual void CollectNames(std::vector<std::string>& out) const {}
+
+        // Дописывает в out ссылки узла и его потомков на другие листы.
+        virtual void CollectSheetReferences(std::vector<SheetRange>& out) const {}
+
+        // Вызывает ли узел или его потомки изменчивую функцию (NOW, RAND).
+        [[nodiscard]] virtual bool IsVolatile() const {
+            return false;
+        }
+
+        // Размер значения узла в формуле-массиве: nullopt — одно число,
+        // Size{0, 0} — арифметика над областями разного размера.
+        [[nodiscard]] virtual std::optional<Size> GetArraySize() const {
+            return std::nullopt;
+        }
+
+        // Дописывает в out программу узла для формулы-массива: области —
+        // командами Range, арифметику над ними — её командами. Часть без
+        // областей вычисляется сразу и становится одной командой Number.
+        // Возвращает размер значения узла, как GetArraySize.
+        virtual std::optional<Size> CompileArray(const EvaluationContext& context,
+                                                 std::vector<FormulaAST::Instruction>& out) const {
+            out.push_back({FormulaAST::Instruction::Code::Number, Evaluate(context)});
+            return std::nullopt;
+        }
+
+        // Заменяет имена среди потомков значениями, см. BindName.
+        virtual void BindNames(const NameResolver& resolver, std::vector<Position>& cells,
+                               std::vector<Range>& ranges) {}
+
+        virtual void Linearize(std::vector<FormulaAST::Instruction>& out) const = 0;
+
+        // Копия поддерева.
+        [[nodiscard]] virtual std::unique_ptr<Expr> Clone() const = 0;
 
-        [[nodiscard]] virtual double Evaluate(const FormulaAST::CellLookup&) const = 0;
+        // Дописывает в out ссылки, которые читаются при любом вычислении
+        // узла, то есть не только в ветвях IF и IFERROR.
+        virtual void CollectStaticCells(std::vector<Position>& out) const {}
 
         [[nodiscard]] virtual ExprPrecedence GetPrecedence() const = 0;
 
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+        void PrintFormula(std::string& out, ExprPrecedence parent_precedence,
                           bool right_child = false) const {
             auto precedence = GetPrecedence();
             auto mask = right_child ? PR_RIGHT : PR_LEFT;
             bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
             if (parens_needed) {
-                out << '(';
+                out += '(';
             }
 
             DoPrintFormula(out, precedence);
 
             if (parens_needed) {
-                out << ')';
+                out += ')';
             }
         }
     };
 
+    // Размер результата операции над значениями размеров lhs и rhs: число
+    // участвует в каждом элементе массива, массивы должны совпадать.
+    std::optional<Size> MergeArraySizes(std::optional<Size> lhs, std::optional<Size> rhs) {
+        if (!lhs || !rhs) {
+            return lhs ? lhs : rhs;
+        }
+        return *lhs == *rhs ? lhs : Size{0, 0};
+    }
+
+    // Заменяет node значением имени, если node — имя, известное resolver,
+    // иначе связывает имена среди его потомков. Ячейки и области имён
+    // дописываются в cells и ranges.
+    void BindName(std::unique_ptr<Expr>& node, const NameResolver& resolver,
+                  std::vector<Position>& cells, std::vector<Range>& ranges);
+
     class NumberExpr final : public Expr {
     public:
         explicit NumberExpr(double value) : value_(value) {}
         void Print(std::ostream& out) const override { out << value_; }
-        void DoPrintFormula(std::ostream& out, ExprPrecedence) const override { out << value_; }
+        void DoPrintFormula(std::string& out, ExprPrecedence) const override {
+            AppendNumber(out, value_);
+        }
         [[nodiscard]] ExprPrecedence GetPrecedence() const override { return EP_ATOM; }
-        [[nodiscard]] double Evaluate(const FormulaAST::CellLookup&) const override { return value_; }
+        [[nodiscard]] double Evaluate(const EvaluationContext&) const override { return value_; }
+
+        void Linearize(std::vector<FormulaAST::Instruction>& out) const override {
+            out.push_back({FormulaAST::Instruction::Code::Number, value_});
+        }
+
+        [[nodiscard]] std::unique_ptr<Expr> Clone() const override {
+            return std::make_unique<NumberExpr>(value_);
+        }
 
     private:
         double value_;
@@ -96,8 +215,8 @@ namespace ASTImpl {
             out << ')';
         }
 
-        void DoPrintFormula(std::ostream& out, ExprPrecedence p) const override {
-            out << static_cast<char>(type_);
+        void DoPrintFormula(std::string& out, ExprPrecedence p) const override {
+            out += static_cast<char>(type_);
             operand_->PrintFormula(out, p);
         }
 
@@ -105,26 +224,66 @@ namespace ASTImpl {
             return EP_UNARY;
         }
 
-        [[nodiscard]] double Evaluate(const FormulaAST::CellLookup& lookup) const override {
-            double value = operand_->Evaluate(lookup);
-            double result = 0.0;
+        [[nodiscard]] double Evaluate(const EvaluationContext& context) const override {
+            double value = operand_->Evaluate(context);
 
             switch (type_) {
                 case UnaryPlus:
-                    result = +value;
-                    break;
+                    return NanBox::Plus(value);
                 case UnaryMinus:
-                    result = -value;
-                    break;
+                    return NanBox::Negate(value);
                 default:
                     assert(false);
+                    return value;
             }
+        }
+
+        void Linearize(std::vector<FormulaAST::Instruction>& out) const override {
+            using Code = FormulaAST::Instruction::Code;
+            operand_->Linearize(out);
+            out.push_back({type_ == UnaryMinus ? Code::UnaryMinus : Code::UnaryPlus});
+        }
+
+        void CollectStaticCells(std::vector<Position>& out) const override {
+            operand_->CollectStaticCells(out);
+        }
+
+        void CollectNames(std::vector<std::string>& out) const override {
+            operand_->CollectNames(out);
+        }
+
+        void CollectSheetReferences(std::vector<SheetRange>& out) const override {
+            operand_->CollectSheetReferences(out);
+        }
+
+        [[nodiscard]] bool IsVolatile() const override {
+            return operand_->IsVolatile();
+        }
+
+        [[nodiscard]] std::optional<Size> GetArraySize() const override {
+            return operand_->GetArraySize();
+        }
 
-            if (!std::isfinite(result)) {
-                throw FormulaError(FormulaError::Category::Arithmetic);
+        std::optional<Size> CompileArray(const EvaluationContext& context,
+                                         std::vector<FormulaAST::Instruction>& out) const override {
+            using Code = FormulaAST::Instruction::Code;
+            const auto size = operand_->CompileArray(context, out);
+            if (!size) {
+                double& value = out.back().number;
+                value = type_ == UnaryMinus ? NanBox::Negate(value) : NanBox::Plus(value);
+                return std::nullopt;
             }
+            out.push_back({type_ == UnaryMinus ? Code::UnaryMinus : Code::UnaryPlus});
+            return size;
+        }
 
-            return result;
+        void BindNames(const NameResolver& resolver, std::vector<Position>& cells,
+                       std::vector<Range>& ranges) override {
+            BindName(operand_, resolver, cells, ranges);
+        }
+
+        [[nodiscard]] std::unique_ptr<Expr> Clone() const override {
+            return std::make_unique<UnaryOpExpr>(type_, operand_->Clone());
         }
 
     private:
@@ -154,9 +313,9 @@ namespace ASTImpl {
             out << ')';
         }
 
-        void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        void DoPrintFormula(std::string& out, ExprPrecedence precedence) const override {
             lhs_->PrintFormula(out, precedence);
-            out << static_cast<char>(type_);
+            out += static_cast<char>(type_);
             rhs_->PrintFormula(out, precedence, true);
         }
 
@@ -177,36 +336,202 @@ namespace ASTImpl {
             }
         }
 
-        [[nodiscard]] double Evaluate(const FormulaAST::CellLookup& lookup) const override {
-            double lhs = lhs_->Evaluate(lookup);
-            double rhs = rhs_->Evaluate(lookup);
-            double result = 0.0;
+        [[nodiscard]] double Evaluate(const EvaluationContext& context) const override {
+            return Apply(lhs_->Evaluate(context), rhs_->Evaluate(context));
+        }
+
+        void Linearize(std::vector<FormulaAST::Instruction>& out) const override {
+            lhs_->Linearize(out);
+            rhs_->Linearize(out);
+            out.push_back({GetCode()});
+        }
+
+        std::optional<Size> CompileArray(const EvaluationContext& context,
+                                         std::vector<FormulaAST::Instruction>& out) const override {
+            const auto lhs = lhs_->CompileArray(context, out);
+            const auto rhs = rhs_->CompileArray(context, out);
+            if (!lhs && !rhs) {
+                const double value = out.back().number;
+                out.pop_back();
+                out.back().number = Apply(out.back().number, value);
+                return std::nullopt;
+            }
+            out.push_back({GetCode()});
+            return MergeArraySizes(lhs, rhs);
+        }
+
+        void CollectStaticCells(std::vector<Position>& out) const override {
+            lhs_->CollectStaticCells(out);
+            rhs_->CollectStaticCells(out);
+        }
+
+        void CollectNames(std::vector<std::string>& out) const override {
+            lhs_->CollectNames(out);
+            rhs_->CollectNames(out);
+        }
+
+        void CollectSheetReferences(std::vector<SheetRange>& out) const override {
+            lhs_->CollectSheetReferences(out);
+            rhs_->CollectSheetReferences(out);
+        }
+
+        [[nodiscard]] bool IsVolatile() const override {
+            return lhs_->IsVolatile() || rhs_->IsVolatile();
+        }
+
+        [[nodiscard]] std::optional<Size> GetArraySize() const override {
+            return MergeArraySizes(lhs_->GetArraySize(), rhs_->GetArraySize());
+        }
+
+        void BindNames(const NameResolver& resolver, std::vector<Position>& cells,
+                       std::vector<Range>& ranges) override {
+            BindName(lhs_, resolver, cells, ranges);
+            BindName(rhs_, resolver, cells, ranges);
+        }
+
+        [[nodiscard]] std::unique_ptr<Expr> Clone() const override {
+            return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(), rhs_->Clone());
+        }
+
+    private:
 
+        [[nodiscard]] double Apply(double lhs, double rhs) const {
             switch (type_) {
                 case Add:
-                    result = lhs + rhs;
-                    break;
+                    return NanBox::Add(lhs, rhs);
                 case Subtract:
-                    result = lhs - rhs;
-                    break;
+                    return NanBox::Subtract(lhs, rhs);
                 case Multiply:
-                    result = lhs * rhs;
-                    break;
+                    return NanBox::Multiply(lhs, rhs);
                 case Divide:
-                    if (rhs == 0.0) {
-                        throw FormulaError(FormulaError::Category::Arithmetic);
-                    }
-                    result = lhs / rhs;
-                    break;
+                    // Деление на ноль даёт бесконечность или NaN, то есть #ARITHM!.
+                    return NanBox::Divide(lhs, rhs);
                 default:
                     assert(false);
+                    return lhs;
             }
+        }
 
-            if (!std::isfinite(result)) {
-                throw FormulaError(FormulaError::Category::Arithmetic);
+        [[nodiscard]] FormulaAST::Instruction::Code GetCode() const {
+            using Code = FormulaAST::Instruction::Code;
+            switch (type_) {
+                case Add:
+                    return Code::Add;
+                case Subtract:
+                    return Code::Subtract;
+                case Multiply:
+                    return Code::Multiply;
+                case Divide:
+                    return Code::Divide;
+                default:
+                    assert(false);
+                    return Code::Add;
             }
+        }
 
-            return result;
+        Type type_;
+        std::unique_ptr<Expr> lhs_;
+        std::unique_ptr<Expr> rhs_;
+    };
+
+    // Сравнение двух чисел: 1, если оно верно, иначе 0. Ошибка операнда,
+    // сначала левого, становится результатом. Сравнения связывают слабее
+    // арифметики и левоассоциативны: 1<2=1 — это (1<2)=1.
+    class CompareExpr final : public Expr {
+    public:
+        using Type = Criteria::Compare;
+
+        CompareExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+                : type_(type)
+                , lhs_(std::move(lhs))
+                , rhs_(std::move(rhs)) {}
+
+        void Print(std::ostream& out) const override {
+            out << '(' << Criteria::GetSign(type_) << ' ';
+            lhs_->Print(out);
+            out << ' ';
+            rhs_->Print(out);
+            out << ')';
+        }
+
+        void DoPrintFormula(std::string& out, ExprPrecedence precedence) const override {
+            lhs_->PrintFormula(out, precedence);
+            out += Criteria::GetSign(type_);
+            rhs_->PrintFormula(out, precedence, true);
+        }
+
+        [[nodiscard]] ExprPrecedence GetPrecedence() const override {
+            return EP_COMPARE;
+        }
+
+        [[nodiscard]] double Evaluate(const EvaluationContext& context) const override {
+            const double lhs = lhs_->Evaluate(context);
+            const double rhs = rhs_->Evaluate(context);
+            if (NanBox::IsError(lhs)) {
+                return lhs;
+            }
+            if (NanBox::IsError(rhs)) {
+                return rhs;
+            }
+            return Criteria(type_, rhs).Matches(lhs) ? 1.0 : 0.0;
+        }
+
+        void Linearize(std::vector<FormulaAST::Instruction>& out) const override {
+            using Code = FormulaAST::Instruction::Code;
+            lhs_->Linearize(out);
+            rhs_->Linearize(out);
+
+            Code code = Code::Equal;
+            switch (type_) {
+                case Type::Equal:
+                    code = Code::Equal;
+                    break;
+                case Type::NotEqual:
+                    code = Code::NotEqual;
+                    break;
+                case Type::Less:
+                    code = Code::Less;
+                    break;
+                case Type::LessOrEqual:
+                    code = Code::LessOrEqual;
+                    break;
+                case Type::Greater:
+                    code = Code::Greater;
+                    break;
+                case Type::GreaterOrEqual:
+                    code = Code::GreaterOrEqual;
+                    break;
+            }
+            out.push_back({code});
+        }
+
+        void CollectStaticCells(std::vector<Position>& out) const override {
+            lhs_->CollectStaticCells(out);
+            rhs_->CollectStaticCells(out);
+        }
+
+        void CollectNames(std::vector<std::string>& out) const override {
+            lhs_->CollectNames(out);
+            rhs_->CollectNames(out);
+        }
+
+        void CollectSheetReferences(std::vector<SheetRange>& out) const override {
+            lhs_->CollectSheetReferences(out);
+            rhs_->CollectSheetReferences(out);
+        }
+
+        [[nodiscard]] bool IsVolatile() const override {
+            return lhs_->IsVolatile() || rhs_->IsVolatile();
+        }
+
+        void BindNames(const NameResolver& resolver, std::vector<Position>& cells,
+                       std::vector<Range>& ranges) override {
+            BindName(lhs_, resolver, cells, ranges);
+            BindName(rhs_, resolver, cells, ranges);
+        }
+
+        [[nodiscard]] std::unique_ptr<Expr> Clone() const override {
+            return std::make_unique<CompareExpr>(type_, lhs_->Clone(), rhs_->Clone());
         }
 
     private:
@@ -217,190 +542,2196 @@ namespace ASTImpl {
 
     class CellExpr final : public Expr {
     public:
-        explicit CellExpr(Position pos, std::string raw)
-                : pos_(pos)
-                , text_(std::move(raw)) {}
+        explicit CellExpr(Position pos)
+                : pos_(pos) {}
 
-        void Print(std::ostream& out) const override { out << text_; }
+        void Print(std::ostream& out) const override { out << pos_.ToString(); }
 
-        void DoPrintFormula(std::ostream& out, ExprPrecedence) const override {
-            out << text_;
+        void DoPrintFormula(std::string& out, ExprPrecedence) const override {
+            char buffer[Position::MAX_STRING_LENGTH];
+            out.append(buffer, pos_.ToChars(buffer));
         }
 
         [[nodiscard]] ExprPrecedence GetPrecedence() const override {
             return EP_ATOM;
         }
 
-        [[nodiscard]] double Evaluate(const FormulaAST::CellLookup& lookup) const override {
+        [[nodiscard]] double Evaluate(const EvaluationContext& context) const override {
             if (!pos_.IsValid()) {
-                throw FormulaError(FormulaError::Category::Ref);
+                return NanBox::FromError(FormulaError::Category::Ref);
             }
 
-            auto value = lookup(pos_);
+            return context.cells(pos_);
+        }
+
+        [[nodiscard]] std::optional<Range> AsRange() const override {
+            return Range{pos_, pos_};
+        }
 
-            if (auto* err = std::get_if<FormulaError>(&value)) {
-                throw *err;
-            }
+        void Linearize(std::vector<FormulaAST::Instruction>& out) const override {
+            out.push_back({FormulaAST::Instruction::Code::Cell, 0.0, pos_});
+        }
 
-            return std::get<double>(value);
+        void CollectStaticCells(std::vector<Position>& out) const override {
+            out.push_back(pos_);
+        }
+
+        [[nodiscard]] std::unique_ptr<Expr> Clone() const override {
+            return std::make_unique<CellExpr>(pos_);
         }
 
     private:
         Position pos_;
-        std::string text_;
     };
 
-    class ParseASTListener final : public FormulaBaseListener {
+    // Область ячеек. В аргументе функции значение области целиком вычисляет
+    // сама функция, в арифметике формулы-массива область читается по
+    // столбцам. Там, где ждут одно число, область даёт #VALUE!.
+    class RangeExpr final : public Expr {
     public:
-        ParseASTListener() = default;
+        explicit RangeExpr(Range range)
+                : range_(range) {}
 
-        std::unique_ptr<Expr> MoveRoot() {
-            assert(args_.size() == 1);
-            auto root = std::move(args_.front());
-            args_.clear();
+        void Print(std::ostream& out) const override { out << range_.ToString(); }
 
-            return root;
+        void DoPrintFormula(std::string& out, ExprPrecedence) const override {
+            char buffer[2 * Position::MAX_STRING_LENGTH + 1];
+            size_t length = range_.first.ToChars(buffer);
+            buffer[length++] = ':';
+            length += range_.last.ToChars(buffer + length);
+            out.append(buffer, length);
         }
 
-        std::forward_list<Position> MoveCells() {
-            return std::move(cells_);
+        [[nodiscard]] ExprPrecedence GetPrecedence() const override {
+            return EP_ATOM;
         }
 
-        void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-            double value = 0;
-            auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-            std::istringstream in(valueStr);
-            in >> value;
-            if (!in) {
-                throw ParsingError("Invalid number: " + valueStr);
-            }
+        [[nodiscard]] double Evaluate(const EvaluationContext&) const override {
+            return NanBox::FromError(FormulaError::Category::Value);
+        }
 
-            args_.push_back(std::make_unique<NumberExpr>(value));
+        [[nodiscard]] std::optional<Range> AsRange() const override {
+            return range_;
         }
 
-        void exitCell(FormulaParser::CellContext* ctx) override {
-            auto value_str = ctx->CELL()->getSymbol()->getText();
-            auto value = Position::FromString(value_str);
-            if (!value.IsValid()) {
-                throw FormulaException("Invalid position: " + value_str);
-            }
+        [[nodiscard]] std::optional<Size> GetArraySize() const override {
+            return range_.GetSize();
+        }
 
-            cells_.push_front(value);
-            args_.push_back(std::make_unique<CellExpr>(value, value_str));
+        std::optional<Size> CompileArray(const EvaluationContext&,
+                                         std::vector<FormulaAST::Instruction>& out) const override {
+            Linearize(out);
+            return range_.GetSize();
         }
 
-        void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-            assert(!args_.empty());
+        void Linearize(std::vector<FormulaAST::Instruction>& out) const override {
+            FormulaAST::Instruction instruction{FormulaAST::Instruction::Code::Range};
+            instruction.range = range_;
+            out.push_back(instruction);
+        }
 
-            auto operand = std::move(args_.back());
+        [[nodiscard]] std::unique_ptr<Expr> Clone() const override {
+            return std::make_unique<RangeExpr>(range_);
+        }
 
-            UnaryOpExpr::Type type;
-            if (ctx->SUB()) {
-                type = UnaryOpExpr::UnaryMinus;
-            } else {
-                assert(ctx->ADD() != nullptr);
-                type = UnaryOpExpr::UnaryPlus;
+    private:
+        Range range_;
+    };
+
+    // Ячейка или область другого листа книги: Лист1!A1, Лист1!A1:B2. Ячейка
+    // читается через SheetLookup, область, как и своя, вычисляется функцией.
+    // Ссылка на лист, которого нет, даёт #REF!.
+    class SheetReferenceExpr final : public Expr {
+    public:
+        SheetReferenceExpr(std::string_view sheet, Range range, bool cell)
+                : sheet_(sheet)
+                , range_(range)
+                , cell_(cell) {}
+
+        void Print(std::ostream& out) const override {
+            out << sheet_ << '!' << (cell_ ? range_.first.ToString() : range_.ToString());
+        }
+
+        void DoPrintFormula(std::string& out, ExprPrecedence) const override {
+            out += sheet_;
+            out += '!';
+            char buffer[2 * Position::MAX_STRING_LENGTH + 1];
+            size_t length = range_.first.ToChars(buffer);
+            if (!cell_) {
+                buffer[length++] = ':';
+                length += range_.last.ToChars(buffer + length);
             }
+            out.append(buffer, length);
+        }
 
-            args_.back() = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+        [[nodiscard]] ExprPrecedence GetPrecedence() const override {
+            return EP_ATOM;
         }
 
-        void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-            assert(args_.size() >= 2);
+        [[nodiscard]] double Evaluate(const EvaluationContext& context) const override {
+            if (!cell_) {
+                return NanBox::FromError(FormulaError::Category::Value);
+            }
+            const SheetInterface* sheet = context.sheets(sheet_);
+            if (!sheet || !range_.first.IsValid()) {
+                return NanBox::FromError(FormulaError::Category::Ref);
+            }
+            return NanBox::FromValue(ReadCellAsNumber(sheet->GetCell(range_.first)));
+        }
 
-            auto rhs = std::move(args_.back());
-            args_.pop_back();
+        [[nodiscard]] std::optional<Range> AsRange() const override {
+            return range_;
+        }
 
-            auto lhs = std::move(args_.back());
+        [[nodiscard]] std::optional<std::string_view> AsSheet() const override {
+            return sheet_;
+        }
 
-            BinaryOpExpr::Type type;
-            if (ctx->ADD()) {
-                type = BinaryOpExpr::Add;
-            } else if (ctx->SUB()) {
-                type = BinaryOpExpr::Subtract;
-            } else if (ctx->MUL()) {
-                type = BinaryOpExpr::Multiply;
-            } else {
-                assert(ctx->DIV() != nullptr);
-                type = BinaryOpExpr::Divide;
-            }
+        void CollectSheetReferences(std::vector<SheetRange>& out) const override {
+            out.push_back({sheet_, range_});
+        }
 
-            args_.back() = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+        void Linearize(std::vector<FormulaAST::Instruction>& out) const override {
+            FormulaAST::Instruction instruction{FormulaAST::Instruction::Code::SheetReference};
+            instruction.range = range_;
+            out.push_back(instruction);
+        }
+
+        [[nodiscard]] std::unique_ptr<Expr> Clone() const override {
+            return std::make_unique<SheetReferenceExpr>(sheet_, range_, cell_);
         }
 
     private:
-        std::vector<std::unique_ptr<Expr>> args_;
-        std::forward_list<Position> cells_;
+        std::string sheet_;
+        Range range_;
+        bool cell_;
     };
 
-    class BailErrorListener : public antlr4::BaseErrorListener {
+    // Строка-условие. Как и область, встречается только как аргумент
+    // функции; там, где функция ждёт число, даёт #VALUE!.
+    class CriteriaExpr final : public Expr {
     public:
-        void syntaxError(antlr4::Recognizer*,
-                         antlr4::Token*,
-                         size_t, size_t,
-                         const std::string& msg,
-                         std::exception_ptr) override {
-            throw ParsingError("Error when lexing: " + msg);
+        CriteriaExpr(std::string_view text, Criteria criteria)
+                : text_(text)
+                , criteria_(criteria) {}
+
+        void Print(std::ostream& out) const override { out << '"' << text_ << '"'; }
+
+        void DoPrintFormula(std::string& out, ExprPrecedence) const override {
+            out += '"';
+            out += text_;
+            out += '"';
         }
-    };
 
-} // namespace ASTImpl
+        [[nodiscard]] ExprPrecedence GetPrecedence() const override {
+            return EP_ATOM;
+        }
 
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
+        [[nodiscard]] double Evaluate(const EvaluationContext&) const override {
+            return NanBox::FromError(FormulaError::Category::Value);
+        }
+
+        [[nodiscard]] std::optional<Criteria> AsCriteria() const override {
+            return criteria_;
+        }
+
+        void Linearize(std::vector<FormulaAST::Instruction>& out) const override {
+            FormulaAST::Instruction instruction{FormulaAST::Instruction::Code::Criteria};
+            instruction.criteria = criteria_;
+            out.push_back(instruction);
+        }
+
+        [[nodiscard]] std::unique_ptr<Expr> Clone() const override {
+            return std::make_unique<CriteriaExpr>(text_, criteria_);
+        }
 
-    ANTLRInputStream input(in);
+    private:
+        std::string text_;
+        Criteria criteria_;
+    };
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+    // Имя листа, которое ещё не связано со значением: FormulaAST::BindNames
+    // заменяет его числом, ссылкой или областью. Несвязанное имя даёт
+    // #NAME?, а на месте области функция возвращает эту ошибку.
+    class NameExpr final : public Expr {
+    public:
+        explicit NameExpr(std::string_view name)
+                : name_(name) {}
 
-    CommonTokenStream tokens(&lexer);
+        void Print(std::ostream& out) const override { out << name_; }
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+        void DoPrintFormula(std::string& out, ExprPrecedence) const override {
+            out += name_;
+        }
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+        [[nodiscard]] ExprPrecedence GetPrecedence() const override {
+            return EP_ATOM;
+        }
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
-}
+        [[nodiscard]] double Evaluate(const EvaluationContext& context) const override {
+            return context.names(name_);
+        }
 
-FormulaAST ParseFormulaAST(const std::string& s) {
-    std::istringstream in(s);
-    try {
-        return ParseFormulaAST(in);
-    } catch (const std::exception& e) {
-        throw FormulaException(e.what());
-    }
-}
+        [[nodiscard]] std::optional<std::string_view> AsName() const override {
+            return name_;
+        }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                       std::forward_list<Position> cells)
-        : root_expr_(std::move(root_expr))
-        , cells_(std::move(cells))
-{}
+        void CollectNames(std::vector<std::string>& out) const override {
+            out.push_back(name_);
+        }
 
-FormulaAST::~FormulaAST() = default;
+        void Linearize(std::vector<FormulaAST::Instruction>& out) const override {
+            FormulaAST::Instruction instruction{FormulaAST::Instruction::Code::Name};
+            instruction.name = name_;
+            out.push_back(instruction);
+        }
 
-double FormulaAST::Execute(const CellLookup& lookup) const {
-    return root_expr_->Evaluate(lookup);
-}
+        [[nodiscard]] std::unique_ptr<Expr> Clone() const override {
+            return std::make_unique<NameExpr>(name_);
+        }
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
-}
+    private:
+        std::string name_;
+    };
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
+    void BindName(std::unique_ptr<Expr>& node, const NameResolver& resolver,
+                  std::vector<Position>& cells, std::vector<Range>& ranges) {
+        const auto name = node->AsName();
+        if (!name) {
+            node->BindNames(resolver, cells, ranges);
+            return;
+        }
+        // Значения имён-чисел и неопределённых имён даёт NameLookup.
+        const auto value = resolver(*name);
+        if (!value || std::holds_alternative<double>(*value)) {
+            return;
+        }
+        if (const auto* pos = std::get_if<Position>(&*value)) {
+            cells.push_back(*pos);
+            node = std::make_unique<CellExpr>(*pos);
+        } else {
+            const Range& range = std::get<Range>(*value);
+            ranges.push_back(range);
+            node = std::make_unique<RangeExpr>(range);
+        }
+    }
+
+    // Имя листа из лексемы SHEET: без завершающего '!'.
+    std::string_view GetSheetName(std::string_view token) {
+        assert(!token.empty() && token.back() == '!');
+        return token.substr(0, token.size() - 1);
+    }
+
+    // Разбирает лексему STRING как условие. Кавычки в text входят.
+    std::optional<Criteria> ParseCriteriaLiteral(std::string_view text) {
+        assert(text.size() >= 2 && text.front() == '"' && text.back() == '"');
+        return Criteria::Parse(text.substr(1, text.size() - 2));
+    }
+
+    constexpr size_t UNLIMITED = std::numeric_limits<size_t>::max();
+
+    struct FunctionInfo {
+        FormulaFunction function;
+        std::string_view name;
+        size_t min_arguments;
+        size_t max_arguments;
+        // Бит i установлен, если i-й аргумент должен быть областью или ссылкой.
+        uint32_t range_arguments;
+        // Бит i установлен, если i-й аргумент может быть условием-строкой.
+        uint32_t criteria_arguments = 0;
+    };
+
+    constexpr FunctionInfo FUNCTIONS[] = {
+            {FormulaFunction::Sum, "SUM", 1, UNLIMITED, 0},
+            {FormulaFunction::Min, "MIN", 1, UNLIMITED, 0},
+            {FormulaFunction::Max, "MAX", 1, UNLIMITED, 0},
+            {FormulaFunction::Average, "AVERAGE", 1, UNLIMITED, 0},
+            {FormulaFunction::Count, "COUNT", 1, UNLIMITED, 0},
+            {FormulaFunction::Vlookup, "VLOOKUP", 3, 4, 0b10},
+            {FormulaFunction::Match, "MATCH", 2, 3, 0b10},
+            {FormulaFunction::Index, "INDEX", 2, 3, 0b1},
+            {FormulaFunction::SumIf, "SUMIF", 2, 3, 0b101, 0b10},
+            {FormulaFunction::CountIf, "COUNTIF", 2, 2, 0b1, 0b10},
+            {FormulaFunction::AverageIf, "AVERAGEIF", 2, 3, 0b101, 0b10},
+            {FormulaFunction::If, "IF", 2, 3, 0},
+            {FormulaFunction::IfError, "IFERROR", 2, 2, 0},
+            {FormulaFunction::Now, "NOW", 0, 0, 0},
+            {FormulaFunction::Rand, "RAND", 0, 0, 0},
+    };
+
+    const FunctionInfo& GetFunctionInfo(FormulaFunction function) {
+        return FUNCTIONS[static_cast<size_t>(function)];
+    }
+
+    // Текущий момент в днях от 30.12.1899 с долей дня, как дата в таблицах.
+    double EvaluateNow() {
+        constexpr double UNIX_EPOCH_DAY = 25569.0;
+        constexpr double SECONDS_PER_DAY = 86400.0;
+        const auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+        return UNIX_EPOCH_DAY + std::chrono::duration<double>(since_epoch).count() / SECONDS_PER_DAY;
+    }
+
+    // Случайное число из [0, 1). Генератор у каждого потока свой: листы
+    // книги вычисляются параллельно.
+    double EvaluateRand() {
+        thread_local std::mt19937_64 generator(std::random_device{}());
+        return std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+    }
+
+    // Контекст вычисления для областей другого листа книги: ячейки и
+    // области читаются из sheet.
+    class SheetEvaluationContext {
+    public:
+        SheetEvaluationContext(const SheetInterface& sheet, const FormulaAST::SheetLookup& sheets,
+                               const FormulaAST::NameLookup& names)
+                : cells_([&sheet](const Position& pos) {
+                    if (!pos.IsValid()) {
+                        return NanBox::FromError(FormulaError::Category::Ref);
+                    }
+                    return NanBox::FromValue(ReadCellAsNumber(sheet.GetCell(pos)));
+                })
+                , ranges_([&sheet](const Range& range, Aggregate& aggregate) {
+                    return sheet.AggregateRange(range, aggregate);
+                })
+                , matches_([&sheet](const Range& vector, double key, LookupMatch match) {
+                    return sheet.FindInRange(vector, key, match);
+                })
+                , criteria_([&sheet](const Range& range, const Criteria& criteria,
+                                     const Range& values, Aggregate& aggregate) {
+                    return sheet.AggregateRangeIf(range, criteria, values, aggregate);
+                })
+                , context_{cells_, ranges_, matches_, criteria_, sheets, names} {}
+
+        SheetEvaluationContext(const SheetEvaluationContext&) = delete;
+        SheetEvaluationContext& operator=(const SheetEvaluationContext&) = delete;
+
+        [[nodiscard]] const EvaluationContext& Get() const {
+            return context_;
+        }
+
+    private:
+        FormulaAST::CellLookup cells_;
+        FormulaAST::RangeLookup ranges_;
+        FormulaAST::MatchLookup matches_;
+        FormulaAST::CriteriaLookup criteria_;
+        EvaluationContext context_;
+    };
+
+    // Вызов функции.
+    //
+    // Агрегатные функции вычисляют аргументы слева направо, каждая область
+    // сворачивается целиком через RangeLookup. Значения читаются по тем же
+    // правилам, что и отдельные ссылки: пустая ячейка — ноль, текст — число
+    // или #VALUE!. Первая встретившаяся ошибка становится результатом;
+    // бесконечный или неопределённый результат даёт #ARITHM!. Исключение —
+    // COUNT: он считает значения-числа, не считая пустых ячеек и ошибок, и
+    // ошибок не возвращает.
+    //
+    // Функции поиска ищут ключ через MatchLookup и возвращают значение
+    // ячейки (VLOOKUP, INDEX) или её номер в области (MATCH), начиная с 1:
+    // * VLOOKUP(ключ; таблица; столбец; [приблизительно = 1]) ищет ключ в
+    //   первом столбце таблицы: точно или наибольшее не большее значение;
+    // * MATCH(ключ; область; [тип = 1]) ищет в одном столбце или строке:
+    //   тип 1 — наибольшее не большее, 0 — точно, -1 — наименьшее не меньшее;
+    // * INDEX(область; строка; [столбец]) — ячейка области; у области из
+    //   одной строки единственный номер задаёт столбец.
+    // Ошибка в скалярном аргументе становится результатом, отсутствие ключа
+    // даёт #N/A, номер за пределами области — #REF!.
+    //
+    // Функции с условием — SUMIF(область; условие; [значения]),
+    // COUNTIF(область; условие), AVERAGEIF(область; условие; [значения]) —
+    // отбирают ячейки области по условию через CriteriaLookup и сворачивают
+    // значения на тех же местах области значений (по умолчанию — самой
+    // области) по правилам агрегатных функций. Область значений должна быть
+    // того же размера, иначе результат — #VALUE!. Ошибки в области условия
+    // лишь не удовлетворяют ему; AVERAGEIF без отобранных ячеек даёт #ARITHM!.
+    //
+    // Условные функции вычисляют только выбранную ветвь:
+    // * IF(условие; да; [нет = 0]) — «да», если условие не равно нулю;
+    //   ошибка в условии становится результатом;
+    // * IFERROR(значение; замена) — значение или, если это ошибка, замена.
+    // Ссылки, которые встречаются только в ветвях, — условные: см.
+    // FormulaAST::GetConditionalCells.
+    //
+    // Изменчивые функции без аргументов: NOW() — текущий момент в днях от
+    // 30.12.1899, RAND() — случайное число из [0, 1). Их значение хранится
+    // в ячейке до следующего Sheet::Tick.
+    //
+    // Область любого из этих аргументов может быть областью другого листа;
+    // тогда функция читает её из того листа, а если его нет, возвращает #REF!.
+    class FunctionExpr final : public Expr {
+    public:
+        FunctionExpr(FormulaFunction function, std::vector<std::unique_ptr<Expr>> args)
+                : function_(function)
+                , args_(std::move(args)) {}
+
+        void Print(std::ostream& out) const override {
+            out << '(' << GetFunctionInfo(function_).name;
+            for (const auto& arg : args_) {
+                out << ' ';
+                arg->Print(out);
+            }
+            out << ')';
+        }
+
+        void DoPrintFormula(std::string& out, ExprPrecedence) const override {
+            out += GetFunctionInfo(function_).name;
+            out += '(';
+            for (size_t i = 0; i < args_.size(); ++i) {
+                if (i > 0) {
+                    out += ',';
+                }
+                args_[i]->PrintFormula(out, EP_ATOM);
+            }
+            out += ')';
+        }
+
+        [[nodiscard]] ExprPrecedence GetPrecedence() const override {
+            return EP_ATOM;
+        }
+
+        [[nodiscard]] double Evaluate(const EvaluationContext& context) const override {
+            // На месте области может стоять имя, которое не определено или
+            // обозначает число.
+            const uint32_t range_arguments = GetFunctionInfo(function_).range_arguments;
+            for (size_t i = 0; range_arguments >> i != 0; ++i) {
+                if ((range_arguments >> i & 1) != 0 && i < args_.size() && !args_[i]->AsRange()) {
+                    const double value = args_[i]->Evaluate(context);
+                    return NanBox::IsError(value) ? value
+                                                  : NanBox::FromError(FormulaError::Category::Value);
+                }
+            }
+
+            switch (function_) {
+                case FormulaFunction::Vlookup:
+                    return EvaluateVlookup(context);
+                case FormulaFunction::Match:
+                    return EvaluateMatch(context);
+                case FormulaFunction::Index:
+                    return EvaluateIndex(context);
+                case FormulaFunction::SumIf:
+                case FormulaFunction::CountIf:
+                case FormulaFunction::AverageIf:
+                    return EvaluateIf(context);
+                case FormulaFunction::If: {
+                    const double condition = args_[0]->Evaluate(context);
+                    if (NanBox::IsError(condition)) {
+                        return condition;
+                    }
+                    return condition != 0 ? args_[1]->Evaluate(context)
+                                          : EvaluateOptional(context, 2, 0.0);
+                }
+                case FormulaFunction::IfError: {
+                    const double value = args_[0]->Evaluate(context);
+                    return NanBox::IsError(value) ? args_[1]->Evaluate(context) : value;
+                }
+                case FormulaFunction::Now:
+                    return EvaluateNow();
+                case FormulaFunction::Rand:
+                    return EvaluateRand();
+                default:
+                    return EvaluateAggregate(context);
+            }
+        }
+
+        void Linearize(std::vector<FormulaAST::Instruction>& out) const override {
+            for (const auto& arg : args_) {
+                arg->Linearize(out);
+            }
+            FormulaAST::Instruction instruction{FormulaAST::Instruction::Code::Function};
+            instruction.function = function_;
+            instruction.argument_count = args_.size();
+            out.push_back(instruction);
+        }
+
+        void CollectStaticCells(std::vector<Position>& out) const override {
+            const bool conditional = function_ == FormulaFunction::If
+                                     || function_ == FormulaFunction::IfError;
+            for (size_t i = 0; i < (conditional ? 1 : args_.size()); ++i) {
+                args_[i]->CollectStaticCells(out);
+            }
+        }
+
+        void CollectNames(std::vector<std::string>& out) const override {
+            for (const auto& arg : args_) {
+                arg->CollectNames(out);
+            }
+        }
+
+        void CollectSheetReferences(std::vector<SheetRange>& out) const override {
+            for (const auto& arg : args_) {
+                arg->CollectSheetReferences(out);
+            }
+        }
+
+        [[nodiscard]] bool IsVolatile() const override {
+            return function_ == FormulaFunction::Now || function_ == FormulaFunction::Rand
+                   || std::any_of(args_.begin(), args_.end(),
+                                  [](const auto& arg) { return arg->IsVolatile(); });
+        }
+
+        void BindNames(const NameResolver& resolver, std::vector<Position>& cells,
+                       std::vector<Range>& ranges) override {
+            for (auto& arg : args_) {
+                BindName(arg, resolver, cells, ranges);
+            }
+        }
+
+        [[nodiscard]] std::unique_ptr<Expr> Clone() const override {
+            std::vector<std::unique_ptr<Expr>> args;
+            args.reserve(args_.size());
+            for (const auto& arg : args_) {
+                args.push_back(arg->Clone());
+            }
+            return std::make_unique<FunctionExpr>(function_, std::move(args));
+        }
+
+    private:
+        [[nodiscard]] double EvaluateAggregate(const EvaluationContext& context) const {
+            const bool count_only = function_ == FormulaFunction::Count;
+
+            Aggregate aggregate;
+            size_t empty = 0;
+            for (size_t i = 0; i < args_.size(); ++i) {
+                if (auto range = args_[i]->AsRange()) {
+                    std::optional<SheetEvaluationContext> other;
+                    if (const auto* range_context = GetRangeContext(context, i, other)) {
+                        empty += range_context->ranges(*range, aggregate);
+                    } else {
+                        aggregate.Add(NanBox::FromError(FormulaError::Category::Ref));
+                    }
+                } else {
+                    aggregate.Add(args_[i]->Evaluate(context));
+                }
+                if (!count_only && aggregate.HasError()) {
+                    return aggregate.GetError();
+                }
+            }
+
+            switch (function_) {
+                case FormulaFunction::Sum:
+                    return NanBox::FromResult(aggregate.GetSum());
+                case FormulaFunction::Min:
+                    return NanBox::FromResult(aggregate.GetMin());
+                case FormulaFunction::Max:
+                    return NanBox::FromResult(aggregate.GetMax());
+                case FormulaFunction::Average:
+                    return NanBox::FromResult(aggregate.GetSum()
+                                              / static_cast<double>(aggregate.GetNumberCount()));
+                case FormulaFunction::Count:
+                    return static_cast<double>(aggregate.GetNumberCount() - empty);
+                default:
+                    break;
+            }
+            assert(false);
+            return 0.0;
+        }
+
+        [[nodiscard]] double EvaluateVlookup(const EvaluationContext& context) const {
+            const Range table = *args_[1]->AsRange();
+            const double key = args_[0]->Evaluate(context);
+            const double column = args_[2]->Evaluate(context);
+            const double approximate = EvaluateOptional(context, 3, 1.0);
+            for (double value : {key, column, approximate}) {
+                if (NanBox::IsError(value)) {
+                    return value;
+                }
+            }
+
+            if (!(std::trunc(column) >= 1)) {
+                return NanBox::FromError(FormulaError::Category::Value);
+            }
+            const auto col = ToIndex(column, table.GetSize().cols);
+            if (!col) {
+                return NanBox::FromError(FormulaError::Category::Ref);
+            }
+
+            std::optional<SheetEvaluationContext> other;
+            const auto* table_context = GetRangeContext(context, 1, other);
+            if (!table_context) {
+                return NanBox::FromError(FormulaError::Category::Ref);
+            }
+            const Range keys{table.first, {table.last.row, table.first.col}};
+            const auto offset = table_context->matches(
+                    keys, key, approximate != 0 ? LookupMatch::LessOrEqual : LookupMatch::Exact);
+            if (!offset) {
+                return NanBox::FromError(FormulaError::Category::NotAvailable);
+            }
+            return table_context->cells({table.first.row + *offset, table.first.col + *col - 1});
+        }
+
+        [[nodiscard]] double EvaluateMatch(const EvaluationContext& context) const {
+            const Range vector = *args_[1]->AsRange();
+            const double key = args_[0]->Evaluate(context);
+            const double type = EvaluateOptional(context, 2, 1.0);
+            for (double value : {key, type}) {
+                if (NanBox::IsError(value)) {
+                    return value;
+                }
+            }
+
+            const Size size = vector.GetSize();
+            if (size.rows != 1 && size.cols != 1) {
+                return NanBox::FromError(FormulaError::Category::NotAvailable);
+            }
+            const LookupMatch match = type > 0   ? LookupMatch::LessOrEqual
+                                      : type < 0 ? LookupMatch::GreaterOrEqual
+                                                 : LookupMatch::Exact;
+            std::optional<SheetEvaluationContext> other;
+            const auto* vector_context = GetRangeContext(context, 1, other);
+            if (!vector_context) {
+                return NanBox::FromError(FormulaError::Category::Ref);
+            }
+            const auto offset = vector_context->matches(vector, key, match);
+            if (!offset) {
+                return NanBox::FromError(FormulaError::Category::NotAvailable);
+            }
+            return *offset + 1.0;
+        }
+
+        [[nodiscard]] double EvaluateIndex(const EvaluationContext& context) const {
+            const Range range = *args_[0]->AsRange();
+            double row = args_[1]->Evaluate(context);
+            double column = EvaluateOptional(context, 2, 1.0);
+            for (double value : {row, column}) {
+                if (NanBox::IsError(value)) {
+                    return value;
+                }
+            }
+
+            const Size size = range.GetSize();
+            if (args_.size() == 2 && size.rows == 1) {
+                std::swap(row, column);
+            }
+            const auto row_index = ToIndex(row, size.rows);
+            const auto col_index = ToIndex(column, size.cols);
+            std::optional<SheetEvaluationContext> other;
+            const auto* range_context = GetRangeContext(context, 0, other);
+            if (!row_index || !col_index || !range_context) {
+                return NanBox::FromError(FormulaError::Category::Ref);
+            }
+            return range_context->cells({range.first.row + *row_index - 1,
+                                         range.first.col + *col_index - 1});
+        }
+
+        [[nodiscard]] double EvaluateIf(const EvaluationContext& context) const {
+            const Range range = *args_[0]->AsRange();
+            auto criteria = args_[1]->AsCriteria();
+            if (!criteria) {
+                const double operand = args_[1]->Evaluate(context);
+                if (NanBox::IsError(operand)) {
+                    return operand;
+                }
+                criteria.emplace(Criteria::Compare::Equal, operand);
+            }
+
+            const Range values = args_.size() > 2 ? *args_[2]->AsRange() : range;
+            if (!(values.GetSize() == range.GetSize())) {
+                return NanBox::FromError(FormulaError::Category::Value);
+            }
+
+            // Область значений на том же листе, что и область условия, — это
+            // проверяется при разборе.
+            std::optional<SheetEvaluationContext> other;
+            const auto* range_context = GetRangeContext(context, 0, other);
+            if (!range_context) {
+                return NanBox::FromError(FormulaError::Category::Ref);
+            }
+            Aggregate aggregate;
+            const size_t matched = range_context->criteria(range, *criteria, values, aggregate);
+            if (function_ == FormulaFunction::CountIf) {
+                return static_cast<double>(matched);
+            }
+            if (aggregate.HasError()) {
+                return aggregate.GetError();
+            }
+            if (function_ == FormulaFunction::SumIf) {
+                return NanBox::FromResult(aggregate.GetSum());
+            }
+            return NanBox::FromResult(aggregate.GetSum()
+                                      / static_cast<double>(aggregate.GetNumberCount()));
+        }
+
+        // Контекст, в котором читается область аргумента index: свой или, для
+        // области другого листа, контекст того листа в other. nullptr, если
+        // такого листа нет.
+        const EvaluationContext* GetRangeContext(
+                const EvaluationContext& context, size_t index,
+                std::optional<SheetEvaluationContext>& other) const {
+            const auto sheet_name = args_[index]->AsSheet();
+            if (!sheet_name) {
+                return &context;
+            }
+            const SheetInterface* sheet = context.sheets(*sheet_name);
+            if (!sheet) {
+                return nullptr;
+            }
+            return &other.emplace(*sheet, context.sheets, context.names).Get();
+        }
+
+        // Значение необязательного аргумента или fallback, если его нет.
+        [[nodiscard]] double EvaluateOptional(const EvaluationContext& context, size_t index,
+                                              double fallback) const {
+            return index < args_.size() ? args_[index]->Evaluate(context) : fallback;
+        }
+
+        // Номер строки или столбца, отсчитываемый от 1, с отброшенной дробной
+        // частью; nullopt, если он вне [1, limit].
+        static std::optional<int> ToIndex(double value, int limit) {
+            const double index = std::trunc(value);
+            if (!(index >= 1 && index <= limit)) {
+                return std::nullopt;
+            }
+            return static_cast<int>(index);
+        }
+
+        FormulaFunction function_;
+        std::vector<std::unique_ptr<Expr>> args_;
+    };
+
+    // Значение лексемы NUMBER так, как его читает istream; nullopt, если
+    // число не представимо. Обычно хватает from_chars, к потоку приходится
+    // обращаться только при выходе за диапазон double: переполнение
+    // считается ошибкой, а потеря значимости — нет.
+    std::optional<double> TryReadNumberLiteral(std::string_view text) {
+        double value = 0;
+        auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (ec == std::errc() && ptr == text.data() + text.size()) {
+            return value;
+        }
+
+        std::istringstream in{std::string(text)};
+        in >> value;
+        if (!in) {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    // Проверяет имя функции, число её аргументов и то, что на месте области
+    // стоит область, ссылка или имя. При ошибке возвращает nullopt и записывает её
+    // описание в message.
+    std::optional<FormulaFunction> FindFunction(std::string_view name,
+                                                const std::vector<std::unique_ptr<Expr>>& args,
+                                                std::string& message) {
+        auto function = FindFormulaFunction(name);
+        if (!function) {
+            message = "Unknown function: " + std::string(name);
+            return std::nullopt;
+        }
+
+        const FunctionInfo& info = GetFunctionInfo(*function);
+        auto count = [](size_t n) {
+            return std::to_string(n) + (n == 1 ? " argument" : " arguments");
+        };
+        if (args.size() < info.min_arguments) {
+            message = "Function " + std::string(name) + " requires at least "
+                      + count(info.min_arguments);
+        } else if (args.size() > info.max_arguments) {
+            message = "Function " + std::string(name) + " accepts at most "
+                      + count(info.max_arguments);
+        } else {
+            for (size_t i = 0; i < args.size(); ++i) {
+                if ((info.range_arguments >> i & 1) != 0 && !args[i]->AsRange()
+                    && !args[i]->AsName()) {
+                    message = "Function " + std::string(name) + " requires a range as argument "
+                              + std::to_string(i + 1);
+                    return std::nullopt;
+                }
+                if ((info.criteria_arguments >> i & 1) == 0 && args[i]->AsCriteria()) {
+                    message = "Function " + std::string(name)
+                              + " does not accept a string as argument " + std::to_string(i + 1);
+                    return std::nullopt;
+                }
+            }
+            // Условие и значения функций с условием сопоставляются по местам,
+            // поэтому обе области должны быть на одном листе.
+            if (info.criteria_arguments != 0 && args.size() > 2
+                && args[0]->AsSheet() != args[2]->AsSheet()) {
+                message = "Function " + std::string(name)
+                          + " requires both ranges on the same sheet";
+                return std::nullopt;
+            }
+            return function;
+        }
+        return std::nullopt;
+    }
+
+    // Строит AST прямо во время разбора: парсер вызывает exit-методы сразу
+    // по завершении правила, дерево разбора не строится. Эти вызовы приходят
+    // и при раскрутке стека после синтаксической ошибки, причём из
+    // деструкторов, поэтому слушатель не бросает исключений: он запоминает
+    // первую ошибку и пропускает неполные узлы. Ошибка бросается из MoveRoot,
+    // если синтаксических ошибок не нашлось.
+    class ParseASTListener final : public FormulaBaseListener {
+    public:
+        ParseASTListener() = default;
+
+        void Reset() {
+            args_.clear();
+            cells_.clear();
+            ranges_.clear();
+            error_.reset();
+        }
+
+        std::unique_ptr<Expr> MoveRoot() {
+            if (error_) {
+                throw ParsingError(std::move(*error_));
+            }
+            assert(args_.size() == 1);
+            auto root = std::move(args_.front());
+            args_.clear();
+
+            return root;
+        }
+
+        std::vector<Position> MoveCells() {
+            return std::move(cells_);
+        }
+
+        std::vector<Range> MoveRanges() {
+            return std::move(ranges_);
+        }
+
+        void exitLiteral(FormulaParser::LiteralContext* ctx) override {
+            if (error_ || !ctx->value) {
+                return;
+            }
+
+            auto value_str = ctx->value->getText();
+            auto value = TryReadNumberLiteral(value_str);
+            if (!value) {
+                Fail(ctx->value, "Invalid number: " + value_str);
+                return;
+            }
+            args_.push_back(std::make_unique<NumberExpr>(*value));
+        }
+
+        void exitCell(FormulaParser::CellContext* ctx) override {
+            if (error_ || !ctx->value) {
+                return;
+            }
+
+            auto value_str = ctx->value->getText();
+            auto value = Position::FromString(value_str);
+            if (!value.IsValid()) {
+                Fail(ctx->value, "Invalid position: " + value_str);
+                return;
+            }
+
+            if (ctx->sheet) {
+                args_.push_back(std::make_unique<SheetReferenceExpr>(
+                        GetSheetName(ctx->sheet->getText()), Range{value, value}, true));
+                return;
+            }
+            cells_.push_back(value);
+            args_.push_back(std::make_unique<CellExpr>(value));
+        }
+
+        void exitName(FormulaParser::NameContext* ctx) override {
+            if (error_ || !ctx->value) {
+                return;
+            }
+            args_.push_back(std::make_unique<NameExpr>(ctx->value->getText()));
+        }
+
+        void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
+            if (error_ || !ctx->op || args_.empty()) {
+                return;
+            }
+
+            auto operand = std::move(args_.back());
+
+            UnaryOpExpr::Type type;
+            if (ctx->op->getType() == FormulaParser::SUB) {
+                type = UnaryOpExpr::UnaryMinus;
+            } else {
+                assert(ctx->op->getType() == FormulaParser::ADD);
+                type = UnaryOpExpr::UnaryPlus;
+            }
+
+            args_.back() = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+        }
+
+        void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+            if (error_ || !ctx->op || args_.size() < 2) {
+                return;
+            }
+
+            auto rhs = std::move(args_.back());
+            args_.pop_back();
+
+            auto lhs = std::move(args_.back());
+
+            if (const auto compare = GetCompare(ctx->op->getType())) {
+                args_.back() = std::make_unique<CompareExpr>(*compare, std::move(lhs),
+                                                             std::move(rhs));
+                return;
+            }
+
+            BinaryOpExpr::Type type;
+            switch (ctx->op->getType()) {
+                case FormulaParser::ADD:
+                    type = BinaryOpExpr::Add;
+                    break;
+                case FormulaParser::SUB:
+                    type = BinaryOpExpr::Subtract;
+                    break;
+                case FormulaParser::MUL:
+                    type = BinaryOpExpr::Multiply;
+                    break;
+                default:
+                    assert(ctx->op->getType() == FormulaParser::DIV);
+                    type = BinaryOpExpr::Divide;
+            }
+
+            args_.back() = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+        }
+
+        void exitRange(FormulaParser::RangeContext* ctx) override {
+            if (error_ || !ctx->value) {
+                return;
+            }
+            PushRange(nullptr, ctx->value);
+        }
+
+        void exitRangeArg(FormulaParser::RangeArgContext* ctx) override {
+            if (error_ || !ctx->value) {
+                return;
+            }
+            PushRange(ctx->sheet, ctx->value);
+        }
+
+        void exitStringArg(FormulaParser::StringArgContext* ctx) override {
+            if (error_ || !ctx->value) {
+                return;
+            }
+
+            auto value_str = ctx->value->getText();
+            auto criteria = ParseCriteriaLiteral(value_str);
+            if (!criteria) {
+                Fail(ctx->value, "Invalid criteria: " + value_str);
+                return;
+            }
+
+            args_.push_back(std::make_unique<CriteriaExpr>(
+                    std::string_view(value_str).substr(1, value_str.size() - 2), *criteria));
+        }
+
+        void exitFunction(FormulaParser::FunctionContext* ctx) override {
+            const size_t count = ctx->args.size();
+            if (error_ || !ctx->name || args_.size() < count) {
+                return;
+            }
+
+            std::vector<std::unique_ptr<Expr>> function_args(
+                    std::make_move_iterator(args_.end() - static_cast<ptrdiff_t>(count)),
+                    std::make_move_iterator(args_.end()));
+            args_.resize(args_.size() - count);
+
+            auto name = ctx->name->getText();
+            std::string message;
+            auto function = FindFunction(name, function_args, message);
+            if (!function) {
+                Fail(ctx->name, std::move(message));
+                return;
+            }
+            args_.push_back(std::make_unique<FunctionExpr>(*function, std::move(function_args)));
+        }
+
+    private:
+        static std::optional<Criteria::Compare> GetCompare(size_t token_type) {
+            switch (token_type) {
+                case FormulaParser::EQ:
+                    return Criteria::Compare::Equal;
+                case FormulaParser::NE:
+                    return Criteria::Compare::NotEqual;
+                case FormulaParser::LT:
+                    return Criteria::Compare::Less;
+                case FormulaParser::LE:
+                    return Criteria::Compare::LessOrEqual;
+                case FormulaParser::GT:
+                    return Criteria::Compare::Greater;
+                case FormulaParser::GE:
+                    return Criteria::Compare::GreaterOrEqual;
+                default:
+                    return std::nullopt;
+            }
+        }
+
+        void Fail(const antlr4::Token* token, std::string message) {
+            error_ = FormulaDiagnostic{token->getStartIndex(), std::move(message), {}};
+        }
+
+        // Область из лексемы RANGE; sheet — лексема SHEET или nullptr.
+        void PushRange(const antlr4::Token* sheet, const antlr4::Token* token) {
+            auto value_str = token->getText();
+            auto value = Range::FromString(value_str);
+            if (!value.IsValid()) {
+                Fail(token, "Invalid range: " + value_str);
+                return;
+            }
+
+            if (sheet) {
+                args_.push_back(std::make_unique<SheetReferenceExpr>(
+                        GetSheetName(sheet->getText()), value, false));
+                return;
+            }
+            ranges_.push_back(value);
+            args_.push_back(std::make_unique<RangeExpr>(value));
+        }
+
+        std::vector<std::unique_ptr<Expr>> args_;
+        std::vector<Position> cells_;
+        std::vector<Range> ranges_;
+        std::optional<FormulaDiagnostic> error_;
+    };
+
+
+    // Лексические правила Formula.g4, общие для рукописного разбора и
+    // быстрого пути.
+    bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    bool IsLetter(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    // Символ, с которого имя отличается от ссылки и функции: [a-z_].
+    bool IsNameMark(char c) {
+        return (c >= 'a' && c <= 'z') || c == '_';
+    }
+
+    bool IsNameChar(char c) {
+        return IsLetter(c) || IsNameMark(c) || (c >= '0' && c <= '9');
+    }
+
+    // NAME: [A-Z]* [a-z_] [A-Za-z0-9_]*. Возвращает pos, если имя не
+    // начинается в этой позиции.
+    size_t LexName(std::string_view text, size_t pos) {
+        size_t end = pos;
+        while (end < text.size() && IsLetter(text[end])) {
+            ++end;
+        }
+        if (end == text.size() || !IsNameMark(text[end])) {
+            return pos;
+        }
+        while (end < text.size() && IsNameChar(text[end])) {
+            ++end;
+        }
+        return end;
+    }
+
+    // SHEET: [A-Za-z_] [A-Za-z0-9_]* '!'. Возвращает pos, если имя листа не
+    // начинается в этой позиции.
+    size_t LexSheet(std::string_view text, size_t pos) {
+        if (pos == text.size() || !(IsLetter(text[pos]) || IsNameMark(text[pos]))) {
+            return pos;
+        }
+        size_t end = pos + 1;
+        while (end < text.size() && IsNameChar(text[end])) {
+            ++end;
+        }
+        return end < text.size() && text[end] == '!' ? end + 1 : pos;
+    }
+
+    bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    size_t SkipDigits(std::string_view text, size_t pos) {
+        while (pos < text.size() && IsDigit(text[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    // Возвращает pos, если число не начинается в этой позиции.
+    size_t LexNumber(std::string_view text, size_t pos) {
+        size_t end = SkipDigits(text, pos);
+        if (end + 1 < text.size() && text[end] == '.' && IsDigit(text[end + 1])) {
+            end = SkipDigits(text, end + 1);
+        } else if (end == pos) {
+            return pos;
+        }
+
+        if (end < text.size() && (text[end] == 'e' || text[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < text.size() && (text[exponent] == '+' || text[exponent] == '-')) {
+                ++exponent;
+            }
+            const size_t exponent_end = SkipDigits(text, exponent);
+            if (exponent_end != exponent) {
+                end = exponent_end;
+            }
+        }
+        return end;
+    }
+
+    // Рукописный разбор грамматики Formula.g4: лексер читает строку на месте,
+    // парсер Пратта сразу строит узлы AST. Принимаются те же строки, что и
+    // ANTLR-разбором, и получаются те же деревья.
+    class PrattParser {
+    public:
+        explicit PrattParser(std::string_view text)
+                : text_(text) {}
+
+        // Разбор без исключений. При ошибке возвращает nullopt, а её описание
+        // записывает в diagnostic. Как и при разборе через ANTLR,
+        // синтаксическая ошибка важнее некорректного числа или ссылки,
+        // встретившихся раньше неё.
+        std::optional<FormulaAST> Parse(FormulaDiagnostic& diagnostic) {
+            std::unique_ptr<Expr> root;
+            if (Advance()) {
+                root = ParseExpr(0);
+            }
+            if (root && token_.kind != Token::End) {
+                root = Fail(token_.offset, "extraneous input " + Describe(token_),
+                            {"<EOF>", "'+'", "'-'", "'*'", "'/'", "'='", "'<>'", "'<'", "'<='", "'>'", "'>='"});
+            }
+
+            if (!error_) {
+                error_ = std::move(invalid_operand_);
+            }
+            if (error_) {
+                diagnostic = std::move(*error_);
+                return std::nullopt;
+            }
+            return FormulaAST(std::move(root), std::move(cells_), std::move(ranges_));
+        }
+
+    private:
+        struct Token {
+            enum Kind {
+                End,
+                Number,
+                Cell,
+                Range,
+                String,
+                Function,
+                Name,
+                Sheet,
+                Comma,
+                Add,
+                Sub,
+                Mul,
+                Div,
+                Compare,
+                LeftParen,
+                RightParen,
+            };
+
+            Kind kind = End;
+            std::string_view text;
+            size_t offset = 0;
+        };
+
+        // Сила связывания операций: чем больше, тем раньше операция применяется.
+        static constexpr int COMPARE = 1;
+        static constexpr int ADDITIVE = 2;
+        static constexpr int MULTIPLICATIVE = 3;
+        static constexpr int UNARY = 4;
+
+        static std::string Describe(const Token& token) {
+            if (token.kind == Token::End) {
+                return "<EOF>";
+            }
+            return "'" + std::string(token.text) + "'";
+        }
+
+        // Запоминает первую синтаксическую ошибку. Возвращает пустой узел,
+        // чтобы разбор можно было прервать простым return.
+        std::unique_ptr<Expr> Fail(size_t offset, std::string message,
+                                   std::vector<std::string> expected = {}) {
+            if (!error_) {
+                error_ = FormulaDiagnostic{offset, std::move(message), std::move(expected)};
+            }
+            return nullptr;
+        }
+
+        // Лексемы выделяются по правилу самого длинного совпадения, как в
+        // лексере ANTLR. Возвращает false при ошибке лексера.
+        bool Advance() {
+            size_t pos = pos_;
+            while (pos < text_.size() && IsSpace(text_[pos])) {
+                ++pos;
+            }
+
+            if (pos == text_.size()) {
+                token_ = {Token::End, {}, pos};
+                pos_ = pos;
+                return true;
+            }
+
+            const char c = text_[pos];
+            size_t end = pos + 1;
+            Token::Kind kind;
+            switch (c) {
+                case '+':
+                    kind = Token::Add;
+                    break;
+                case '-':
+                    kind = Token::Sub;
+                    break;
+                case '*':
+                    kind = Token::Mul;
+                    break;
+                case '/':
+                    kind = Token::Div;
+                    break;
+                case '=':
+                    kind = Token::Compare;
+                    break;
+                case '<':
+                    kind = Token::Compare;
+                    if (end < text_.size() && (text_[end] == '>' || text_[end] == '=')) {
+                        ++end;
+                    }
+                    break;
+                case '>':
+                    kind = Token::Compare;
+                    if (end < text_.size() && text_[end] == '=') {
+                        ++end;
+                    }
+                    break;
+                case '(':
+                    kind = Token::LeftParen;
+                    break;
+                case ')':
+                    kind = Token::RightParen;
+                    break;
+                case ',':
+                    kind = Token::Comma;
+                    break;
+                case '"':
+                    // STRING: '"' ~["\r\n]* '"'
+                    kind = Token::String;
+                    end = text_.find_first_of("\"\r\n", pos + 1);
+                    if (end == std::string_view::npos) {
+                        return LexerError(pos, text_.size());
+                    }
+                    if (text_[end] != '"') {
+                        return LexerError(pos, end + 1);
+                    }
+                    ++end;
+                    break;
+                default:
+                    // Лист длиннее любой другой лексемы с того же места: он
+                    // заканчивается на '!'. Имя не может совпасть по длине с
+                    // другими лексемами: за его прописными буквами идёт
+                    // [a-z_], а не цифра.
+                    if (const size_t sheet_end = LexSheet(text_, pos); sheet_end != pos) {
+                        kind = Token::Sheet;
+                        end = sheet_end;
+                    } else if (const size_t name_end = LexName(text_, pos); name_end != pos) {
+                        kind = Token::Name;
+                        end = name_end;
+                    } else if (IsLetter(c)) {
+                        end = LexCell(pos);
+                        if (end == pos) {
+                            kind = Token::Function;
+                            end = SkipLetters(pos);
+                        } else {
+                            kind = Token::Cell;
+                            // RANGE: CELL ':' CELL, иначе ':' остаётся
+                            // нераспознанным символом.
+                            if (end < text_.size() && text_[end] == ':') {
+                                const size_t range_end = LexCell(end + 1);
+                                if (range_end != end + 1) {
+                                    kind = Token::Range;
+                                    end = range_end;
+                                }
+                            }
+                        }
+                    } else if (IsDigit(c) || c == '.') {
+                        kind = Token::Number;
+                        end = LexNumber(text_, pos);
+                        if (end == pos) {
+                            return LexerError(pos, pos + 1);
+                        }
+                    } else {
+                        return LexerError(pos, pos + 1);
+                    }
+            }
+
+            token_ = {kind, text_.substr(pos, end - pos), pos};
+            pos_ = end;
+            return true;
+        }
+
+        size_t SkipLetters(size_t pos) const {
+            while (pos < text_.size() && IsLetter(text_[pos])) {
+                ++pos;
+            }
+            return pos;
+        }
+
+        // CELL: [A-Z]+[0-9]+. Возвращает pos, если ссылка не начинается в
+        // этой позиции.
+        size_t LexCell(size_t pos) const {
+            const size_t digits = SkipLetters(pos);
+            const size_t end = SkipDigits(text_, digits);
+            return digits == pos || end == digits ? pos : end;
+        }
+
+        bool LexerError(size_t begin, size_t end) {
+            Fail(begin, "token recognition error at: '"
+                        + std::string(text_.substr(begin, end - begin)) + "'");
+            return false;
+        }
+
+        // Некорректное число или ссылка не прерывает разбор: о них
+        // сообщается, только если синтаксических ошибок нет.
+        void InvalidOperand(size_t offset, std::string message) {
+            if (!invalid_operand_) {
+                invalid_operand_ = FormulaDiagnostic{offset, std::move(message), {}};
+            }
+        }
+
+        std::unique_ptr<Expr> ParseNumber() {
+            const auto number = TryReadNumberLiteral(token_.text);
+            if (!number) {
+                InvalidOperand(token_.offset, "Invalid number: " + std::string(token_.text));
+            }
+            return std::make_unique<NumberExpr>(number.value_or(0.0));
+        }
+
+        // Вид следующей лексемы; текущая лексема не меняется. Ошибка лексера
+        // запоминается так же, как при обычном чтении.
+        Token::Kind PeekKind() {
+            const size_t pos = pos_;
+            const Token token = token_;
+            const Token::Kind kind = Advance() ? token_.kind : Token::End;
+            pos_ = pos;
+            token_ = token;
+            return kind;
+        }
+
+        // SHEET? CELL. Ссылки на другие листы не входят в cells_.
+        std::unique_ptr<Expr> ParseCell() {
+            std::optional<Token> sheet;
+            if (token_.kind == Token::Sheet) {
+                sheet = token_;
+                if (!Advance()) {
+                    return nullptr;
+                }
+                if (token_.kind != Token::Cell) {
+                    return Fail(token_.offset, "mismatched input " + Describe(token_), {"CELL"});
+                }
+            }
+
+            auto pos = Position::FromString(token_.text);
+            if (!pos.IsValid()) {
+                InvalidOperand(token_.offset, "Invalid position: " + std::string(token_.text));
+            } else if (!sheet) {
+                cells_.push_back(pos);
+            }
+            if (sheet) {
+                return std::make_unique<SheetReferenceExpr>(GetSheetName(sheet->text),
+                                                            Range{pos, pos}, true);
+            }
+            return std::make_unique<CellExpr>(pos);
+        }
+
+        // SHEET? RANGE; за лексемой SHEET, если она есть, заведомо идёт RANGE.
+        std::unique_ptr<Expr> ParseRange() {
+            std::optional<Token> sheet;
+            if (token_.kind == Token::Sheet) {
+                sheet = token_;
+                if (!Advance()) {
+                    return nullptr;
+                }
+            }
+
+            auto range = Range::FromString(token_.text);
+            if (!range.IsValid()) {
+                InvalidOperand(token_.offset, "Invalid range: " + std::string(token_.text));
+            } else if (!sheet) {
+                ranges_.push_back(range);
+            }
+            if (sheet) {
+                return std::make_unique<SheetReferenceExpr>(GetSheetName(sheet->text), range,
+                                                            false);
+            }
+            return std::make_unique<RangeExpr>(range);
+        }
+
+        std::unique_ptr<Expr> ParseString() {
+            auto criteria = ParseCriteriaLiteral(token_.text);
+            if (!criteria) {
+                InvalidOperand(token_.offset, "Invalid criteria: " + std::string(token_.text));
+            }
+            return std::make_unique<CriteriaExpr>(
+                    token_.text.substr(1, token_.text.size() - 2),
+                    criteria.value_or(Criteria(Criteria::Compare::Equal, 0.0)));
+        }
+
+        // arg: SHEET? RANGE | STRING | expr. Возвращает пустой узел при
+        // синтаксической ошибке.
+        std::unique_ptr<Expr> ParseArgument(bool first) {
+            // SHEET RANGE — область другого листа, SHEET CELL начинает
+            // выражение. Область своего листа тоже разбирается как выражение:
+            // за ней может идти арифметика.
+            const bool sheet_range = token_.kind == Token::Sheet && PeekKind() == Token::Range;
+            switch (sheet_range ? Token::Range : token_.kind) {
+                case Token::Range:
+                    if (!sheet_range) {
+                        return ParseArgumentExpr();
+                    }
+                    [[fallthrough]];
+                case Token::String: {
+                    auto arg = sheet_range ? ParseRange() : ParseString();
+                    if (!arg || !Advance()) {
+                        return nullptr;
+                    }
+                    if (token_.kind != Token::Comma && token_.kind != Token::RightParen) {
+                        return Fail(token_.offset, "mismatched input " + Describe(token_),
+                                    {"')'", "','"});
+                    }
+                    return arg;
+                }
+                case Token::Number:
+                case Token::Cell:
+                case Token::Function:
+                case Token::Name:
+                case Token::Sheet:
+                case Token::Add:
+                case Token::Sub:
+                case Token::LeftParen:
+                    return ParseArgumentExpr();
+                default:
+                    std::vector<std::string> expected{"'('", "NUMBER", "'+'", "'-'", "CELL",
+                                                      "RANGE", "FUNCTION", "STRING", "NAME",
+                                                      "SHEET"};
+                    if (first) {
+                        expected.insert(expected.begin() + 1, "')'");
+                    }
+                    return Fail(token_.offset, "mismatched input " + Describe(token_),
+                                std::move(expected));
+            }
+        }
+
+        // Аргумент-выражение: за ним идёт ',' или ')'.
+        std::unique_ptr<Expr> ParseArgumentExpr() {
+            auto expr = ParseExpr(0);
+            if (expr && token_.kind != Token::Comma && token_.kind != Token::RightParen) {
+                return Fail(token_.offset, "mismatched input " + Describe(token_),
+                            {"')'", "','", "'+'", "'-'", "'*'", "'/'",
+                             "'='", "'<>'", "'<'", "'<='", "'>'", "'>='"});
+            }
+            return expr;
+        }
+
+        // FUNCTION '(' (arg (',' arg)*)? ')', текущая лексема — '('.
+        // Неизвестное имя и нехватка аргументов, как и некорректные операнды,
+        // не прерывают разбор. Оставляет текущей лексемой закрывающую скобку.
+        std::unique_ptr<Expr> ParseFunction(const Token& name) {
+            if (!Advance()) {
+                return nullptr;
+            }
+
+            std::vector<std::unique_ptr<Expr>> args;
+            if (token_.kind != Token::RightParen) {
+                while (true) {
+                    auto arg = ParseArgument(args.empty());
+                    if (!arg) {
+                        return nullptr;
+                    }
+                    args.push_back(std::move(arg));
+                    // За аргументом всегда идёт ',' или ')'.
+                    if (token_.kind == Token::RightParen) {
+                        break;
+                    }
+                    if (!Advance()) {
+                        return nullptr;
+                    }
+                }
+            }
+
+            std::string message;
+            const auto function = FindFunction(name.text, args, message);
+            if (!function) {
+                InvalidOperand(name.offset, std::move(message));
+            }
+            return std::make_unique<FunctionExpr>(function.value_or(FormulaFunction::Sum),
+                                                  std::move(args));
+        }
+
+        std::unique_ptr<Expr> ParsePrefix() {
+            std::unique_ptr<Expr> result;
+            switch (token_.kind) {
+                case Token::Number:
+                    result = ParseNumber();
+                    break;
+                case Token::Cell:
+                case Token::Sheet:
+                    result = ParseCell();
+                    if (!result) {
+                        return nullptr;
+                    }
+                    break;
+                case Token::Range:
+                    result = ParseRange();
+                    break;
+                case Token::Function: {
+                    const Token name = token_;
+                    if (!Advance()) {
+                        return nullptr;
+                    }
+                    // Без скобки за ним FUNCTION — имя.
+                    if (token_.kind != Token::LeftParen) {
+                        return std::make_unique<NameExpr>(name.text);
+                    }
+                    result = ParseFunction(name);
+                    if (!result) {
+                        return nullptr;
+                    }
+                    break;
+                }
+                case Token::Name:
+                    result = std::make_unique<NameExpr>(token_.text);
+                    break;
+                case Token::Add:
+                case Token::Sub: {
+                    const auto type = token_.kind == Token::Sub ? UnaryOpExpr::UnaryMinus
+                                                                : UnaryOpExpr::UnaryPlus;
+                    if (!Advance()) {
+                        return nullptr;
+                    }
+                    auto operand = ParseExpr(UNARY);
+                    if (!operand) {
+                        return nullptr;
+                    }
+                    return std::make_unique<UnaryOpExpr>(type, std::move(operand));
+                }
+                case Token::LeftParen:
+                    if (!Advance()) {
+                        return nullptr;
+                    }
+                    result = ParseExpr(0);
+                    if (!result) {
+                        return nullptr;
+                    }
+                    if (token_.kind != Token::RightParen) {
+                        return Fail(token_.offset, "missing ')' at " + Describe(token_),
+                                    {"')'", "'+'", "'-'", "'*'", "'/'",
+                                 "'='", "'<>'", "'<'", "'<='", "'>'", "'>='"});
+                    }
+                    break;
+                default:
+                    return Fail(token_.offset, "mismatched input " + Describe(token_),
+                                {"'('", "NUMBER", "'+'", "'-'", "CELL", "RANGE", "FUNCTION",
+                                 "NAME", "SHEET"});
+            }
+            if (!Advance()) {
+                return nullptr;
+            }
+            return result;
+        }
+
+        std::unique_ptr<Expr> ParseExpr(int min_power) {
+            auto lhs = ParsePrefix();
+            while (lhs) {
+                if (token_.kind == Token::Compare) {
+                    if (COMPARE <= min_power) {
+                        return lhs;
+                    }
+                    const auto compare = Criteria::FindCompare(token_.text);
+                    assert(compare);
+                    if (!Advance()) {
+                        return nullptr;
+                    }
+                    auto rhs = ParseExpr(COMPARE);
+                    if (!rhs) {
+                        return nullptr;
+                    }
+                    lhs = std::make_unique<CompareExpr>(*compare, std::move(lhs), std::move(rhs));
+                    continue;
+                }
+
+                BinaryOpExpr::Type type;
+                int power;
+                switch (token_.kind) {
+                    case Token::Add:
+                        type = BinaryOpExpr::Add;
+                        power = ADDITIVE;
+                        break;
+                    case Token::Sub:
+                        type = BinaryOpExpr::Subtract;
+                        power = ADDITIVE;
+                        break;
+                    case Token::Mul:
+                        type = BinaryOpExpr::Multiply;
+                        power = MULTIPLICATIVE;
+                        break;
+                    case Token::Div:
+                        type = BinaryOpExpr::Divide;
+                        power = MULTIPLICATIVE;
+                        break;
+                    default:
+                        return lhs;
+                }
+                // Операции одного уровня левоассоциативны.
+                if (power <= min_power) {
+                    return lhs;
+                }
+                if (!Advance()) {
+                    return nullptr;
+                }
+                auto rhs = ParseExpr(power);
+                if (!rhs) {
+                    return nullptr;
+                }
+                lhs = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+            }
+            return nullptr;
+        }
+
+        std::string_view text_;
+        size_t pos_ = 0;
+        Token token_;
+        std::vector<Position> cells_;
+        std::vector<Range> ranges_;
+        std::optional<FormulaDiagnostic> error_;
+        std::optional<FormulaDiagnostic> invalid_operand_;
+    };
+
+    // Быстрый путь для самых частых формул: одна ссылка, одно число или
+    // операция над двумя такими операндами (=B7, =42, =A1*B1). Всё
+    // остальное, в том числе любые ошибки, разбирается полностью.
+    class TrivialFormulaScanner {
+    public:
+        explicit TrivialFormulaScanner(std::string_view text)
+                : text_(text) {}
+
+        std::optional<FormulaAST> Scan() {
+            auto lhs = ScanOperand();
+            if (!lhs) {
+                return std::nullopt;
+            }
+            SkipSpaces();
+            if (pos_ == text_.size()) {
+                return FormulaAST(std::move(lhs), std::move(cells_));
+            }
+
+            BinaryOpExpr::Type type;
+            switch (text_[pos_]) {
+                case '+':
+                    type = BinaryOpExpr::Add;
+                    break;
+                case '-':
+                    type = BinaryOpExpr::Subtract;
+                    break;
+                case '*':
+                    type = BinaryOpExpr::Multiply;
+                    break;
+                case '/':
+                    type = BinaryOpExpr::Divide;
+                    break;
+                default:
+                    return std::nullopt;
+            }
+            ++pos_;
+
+            auto rhs = ScanOperand();
+            if (!rhs) {
+                return std::nullopt;
+            }
+            SkipSpaces();
+            if (pos_ != text_.size()) {
+                return std::nullopt;
+            }
+            return FormulaAST(std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs)),
+                              std::move(cells_));
+        }
+
+    private:
+        void SkipSpaces() {
+            while (pos_ < text_.size() && IsSpace(text_[pos_])) {
+                ++pos_;
+            }
+        }
+
+        // Пустой узел, если операнд другого вида или некорректен. Лексема,
+        // склеенная с соседней (A1B2, 1.5.5), тоже отвергается: после
+        // операнда ожидаются только пробелы, операция или конец строки.
+        std::unique_ptr<Expr> ScanOperand() {
+            SkipSpaces();
+            if (pos_ == text_.size()) {
+                return nullptr;
+            }
+
+            const size_t begin = pos_;
+            if (IsLetter(text_[begin])) {
+                size_t end = begin;
+                while (end < text_.size() && IsLetter(text_[end])) {
+                    ++end;
+                }
+                const size_t digits = end;
+                end = SkipDigits(text_, end);
+                if (end == digits) {
+                    return nullptr;
+                }
+                const auto pos = Position::FromString(text_.substr(begin, end - begin));
+                if (!pos.IsValid()) {
+                    return nullptr;
+                }
+                pos_ = end;
+                cells_.push_back(pos);
+                return std::make_unique<CellExpr>(pos);
+            }
+
+            const size_t end = LexNumber(text_, begin);
+            if (end == begin) {
+                return nullptr;
+            }
+            double value = 0;
+            auto [ptr, ec] = std::from_chars(text_.data() + begin, text_.data() + end, value);
+            if (ec != std::errc() || ptr != text_.data() + end) {
+                return nullptr;
+            }
+            pos_ = end;
+            return std::make_unique<NumberExpr>(value);
+        }
+
+        std::string_view text_;
+        size_t pos_ = 0;
+        std::vector<Position> cells_;
+    };
+
+    class BailErrorListener : public antlr4::BaseErrorListener {
+    public:
+        void syntaxError(antlr4::Recognizer*,
+                         antlr4::Token*,
+                         size_t, size_t,
+                         const std::string& msg,
+                         std::exception_ptr e) override {
+            FormulaDiagnostic diagnostic{std::string::npos, msg, {}};
+            try {
+                if (e) {
+                    std::rethrow_exception(e);
+                }
+            } catch (antlr4::LexerNoViableAltException& error) {
+                diagnostic.offset = error.getStartIndex();
+            } catch (...) {
+            }
+            throw ParsingError(std::move(diagnostic));
+        }
+    };
+
+} // namespace ASTImpl
+
+namespace {
+    std::atomic<FormulaParserBackend> parser_backend{FormulaParserBackend::Pratt};
+
+    // Лексер и парсер ANTLR одного потока. Создаются один раз и перед
+    // каждым разбором перенастраиваются на новую строку. AST строит
+    // слушатель во время разбора; узлы контекстов правил освобождаются разом
+    // при сбросе парсера.
+    class AntlrParserContext {
+    public:
+        AntlrParserContext()
+                : lexer_(&input_)
+                , tokens_(&lexer_)
+                , parser_(&tokens_)
+        {
+            lexer_.removeErrorListeners();
+            lexer_.addErrorListener(&error_listener_);
+            parser_.setErrorHandler(std::make_shared<antlr4::BailErrorStrategy>());
+            parser_.removeErrorListeners();
+            parser_.setBuildParseTree(false);
+            parser_.addParseListener(&listener_);
+        }
+
+        FormulaAST Parse(std::string_view expression) {
+            input_.load(expression.data(), expression.size());
+            lexer_.setInputStream(&input_);
+            tokens_.setTokenSource(&lexer_);
+            parser_.setTokenStream(&tokens_);
+            listener_.Reset();
+
+            try {
+                ParseMain();
+            } catch (const antlr4::ParseCancellationException& error) {
+                throw ParsingError(DescribeSyntaxError(error));
+            }
+            parser_.reset();
+
+            auto root = listener_.MoveRoot();
+            return FormulaAST(std::move(root), listener_.MoveCells(), listener_.MoveRanges());
+        }
+
+        // Кеши предсказания общие для всех экземпляров лексера и парсера.
+        void ClearPredictionCaches() {
+            lexer_.getInterpreter<antlr4::atn::LexerATNSimulator>()->clearDFA();
+            parser_.getInterpreter<antlr4::atn::ParserATNSimulator>()->clearDFA();
+        }
+
+    private:
+        // Сначала разбор с дешёвым предсказанием SLL. Если оно не справилось,
+        // тот же поток лексем разбирается заново с полным LL: только такая
+        // ошибка считается синтаксической. Ошибки лексера не повторяются.
+        void ParseMain() {
+            using antlr4::atn::PredictionMode;
+
+            auto* interpreter = parser_.getInterpreter<antlr4::atn::ParserATNSimulator>();
+            interpreter->setPredictionMode(PredictionMode::SLL);
+            try {
+                parser_.main();
+            } catch (const antlr4::ParseCancellationException&) {
+                parser_.reset();
+                listener_.Reset();
+                interpreter->setPredictionMode(PredictionMode::LL);
+                parser_.main();
+            }
+        }
+
+        // Позиция и ожидавшиеся лексемы берутся из исходной ошибки
+        // распознавания, вложенной в исключение BailErrorStrategy.
+        FormulaDiagnostic DescribeSyntaxError(const antlr4::ParseCancellationException& error) {
+            FormulaDiagnostic diagnostic{std::string::npos, "syntax error", {}};
+            try {
+                std::rethrow_if_nested(error);
+            } catch (const antlr4::RecognitionException& cause) {
+                if (const auto* token = cause.getOffendingToken()) {
+                    const bool at_end = token->getType() == antlr4::Token::EOF;
+                    diagnostic.offset = token->getStartIndex();
+                    diagnostic.message = at_end ? "mismatched input <EOF>"
+                                                : "mismatched input '" + token->getText() + "'";
+                }
+                for (auto type : cause.getExpectedTokens().toList()) {
+                    const auto token_type = static_cast<size_t>(type);
+                    diagnostic.expected.push_back(
+                            token_type == antlr4::Token::EOF
+                            ? "<EOF>" : parser_.getVocabulary().getDisplayName(token_type));
+                }
+            } catch (...) {
+            }
+            return diagnostic;
+        }
+
+        antlr4::ANTLRInputStream input_;
+        ASTImpl::BailErrorListener error_listener_;
+        ASTImpl::ParseASTListener listener_;
+        FormulaLexer lexer_;
+        antlr4::CommonTokenStream tokens_;
+        FormulaParser parser_;
+    };
+
+    AntlrParserContext& GetAntlrParserContext() {
+        thread_local AntlrParserContext context;
+        return context;
+    }
+
+    FormulaAST ParseFormulaASTWithAntlr(std::string_view expression) {
+        return GetAntlrParserContext().Parse(expression);
+    }
+} // namespace
+
+void ClearAntlrPredictionCaches() {
+    GetAntlrParserContext().ClearPredictionCaches();
+}
+
+void SetFormulaParserBackend(FormulaParserBackend backend) {
+    parser_backend = backend;
+}
+
+FormulaParserBackend GetFormulaParserBackend() {
+    return parser_backend;
+}
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    const std::string text(std::istreambuf_iterator<char>(in), {});
+    FormulaDiagnostic diagnostic;
+    auto ast = TryParseFormulaAST(text, GetFormulaParserBackend(), diagnostic);
+    if (!ast) {
+        throw ParsingError(std::move(diagnostic));
+    }
+    return std::move(*ast);
+}
+
+FormulaAST ParseFormulaAST(const std::string& s) {
+    return ParseFormulaAST(s, GetFormulaParserBackend());
+}
+
+FormulaAST ParseFormulaAST(std::string_view expression, FormulaParserBackend backend) {
+    FormulaDiagnostic diagnostic;
+    auto ast = TryParseFormulaAST(expression, backend, diagnostic);
+    if (!ast) {
+        throw FormulaException(diagnostic.ToString());
+    }
+    return std::move(*ast);
+}
+
+std::optional<FormulaAST> TryParseFormulaAST(std::string_view expression,
+                                             FormulaParserBackend backend,
+                                             FormulaDiagnostic& diagnostic) {
+    if (backend == FormulaParserBackend::Pratt) {
+        return ASTImpl::PrattParser(expression).Parse(diagnostic);
+    }
+
+    // Разбор через ANTLR сообщает об ошибках исключениями.
+    try {
+        return ParseFormulaASTWithAntlr(expression);
+    } catch (const ParsingError& e) {
+        diagnostic = e.GetDiagnostic();
+    } catch (const std::exception& e) {
+        diagnostic = FormulaDiagnostic{std::string::npos, e.what(), {}};
+    }
+    return std::nullopt;
+}
+
+std::optional<FormulaAST> TryParseTrivialFormula(std::string_view expression) {
+    return ASTImpl::TrivialFormulaScanner(expression).Scan();
+}
+
+ParsingError::ParsingError(FormulaDiagnostic diagnostic)
+        : std::runtime_error(diagnostic.ToString())
+        , diagnostic_(std::move(diagnostic)) {
+}
+
+const FormulaDiagnostic& ParsingError::GetDiagnostic() const {
+    return diagnostic_;
+}
+
+std::string_view GetFormulaFunctionName(FormulaFunction function) {
+    return ASTImpl::GetFunctionInfo(function).name;
+}
+
+std::optional<FormulaFunction> FindFormulaFunction(std::string_view name) {
+    for (const auto& info : ASTImpl::FUNCTIONS) {
+        if (info.name == name) {
+            return info.function;
+        }
+    }
+    return std::nullopt;
+}
+
+bool IsValidFormulaName(std::string_view name) {
+    if (name.empty()) {
+        return false;
+    }
+    return ASTImpl::LexName(name, 0) == name.size()
+           || std::all_of(name.begin(), name.end(), ASTImpl::IsLetter);
+}
+
+bool IsValidSheetName(std::string_view name) {
+    return !name.empty() && (ASTImpl::IsLetter(name[0]) || ASTImpl::IsNameMark(name[0]))
+           && std::all_of(name.begin(), name.end(), ASTImpl::IsNameChar);
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
+                       std::vector<Position> cells,
+                       std::vector<Range> ranges)
+        : root_expr_(std::move(root_expr))
+        , cells_(std::move(cells))
+        , ranges_(std::move(ranges))
+{
+    NormalizeReferences();
+}
+
+void FormulaAST::NormalizeReferences() {
+    std::sort(cells_.begin(), cells_.end());
+    cells_.erase(std::unique(cells_.begin(), cells_.end()), cells_.end());
+    cells_.shrink_to_fit();
+
+    std::sort(ranges_.begin(), ranges_.end());
+    ranges_.erase(std::unique(ranges_.begin(), ranges_.end()), ranges_.end());
+    ranges_.shrink_to_fit();
+
+    if (cells_.empty()) {
+        return;
+    }
+    std::vector<Position> static_cells;
+    root_expr_->CollectStaticCells(static_cells);
+    std::sort(static_cells.begin(), static_cells.end());
+    conditional_cells_.clear();
+    std::set_difference(cells_.begin(), cells_.end(), static_cells.begin(), static_cells.end(),
+                        std::back_inserter(conditional_cells_));
+}
+
+std::vector<std::string> FormulaAST::GetNames() const {
+    std::vector<std::string> names;
+    root_expr_->CollectNames(names);
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    return names;
+}
+
+bool FormulaAST::IsVolatile() const {
+    return root_expr_->IsVolatile();
+}
+
+std::optional<Size> FormulaAST::GetArraySize() const {
+    // Все области своего листа перечислены в ranges_: без них формула
+    // заведомо не массив, и дерево обходить не нужно.
+    if (ranges_.empty()) {
+        return std::nullopt;
+    }
+    const auto size = root_expr_->GetArraySize();
+    if (!size || size->rows == 0) {
+        return std::nullopt;
+    }
+    return size;
+}
+
+std::vector<SheetRange> FormulaAST::GetSheetReferences() const {
+    std::vector<SheetRange> references;
+    root_expr_->CollectSheetReferences(references);
+    std::sort(references.begin(), references.end());
+    references.erase(std::unique(references.begin(), references.end()), references.end());
+    return references;
+}
+
+FormulaAST FormulaAST::Clone() const {
+    return FormulaAST(root_expr_->Clone(), cells_, ranges_);
+}
+
+void FormulaAST::BindNames(const NameResolver& resolver) {
+    ASTImpl::BindName(root_expr_, resolver, cells_, ranges_);
+    NormalizeReferences();
+}
+
+FormulaAST::FormulaAST(FormulaAST&&) noexcept = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) noexcept = default;
+FormulaAST::~FormulaAST() = default;
+
+double FormulaAST::Execute(const CellLookup& lookup, const RangeLookup& range_lookup,
+                           const MatchLookup& match_lookup,
+                           const CriteriaLookup& criteria_lookup,
+                           const SheetLookup& sheet_lookup,
+                           const NameLookup& name_lookup) const {
+    return root_expr_->Evaluate(
+            {lookup, range_lookup, match_lookup, criteria_lookup, sheet_lookup, name_lookup});
+}
+
+void FormulaAST::ExecuteArray(const CellLookup& lookup, const RangeLookup& range_lookup,
+                              const MatchLookup& match_lookup,
+                              const CriteriaLookup& criteria_lookup,
+                              const SheetLookup& sheet_lookup, const NameLookup& name_lookup,
+                              const ColumnLookup& column_lookup, double* out) const {
+    using Code = Instruction::Code;
+    const ASTImpl::EvaluationContext context{lookup, range_lookup, match_lookup, criteria_lookup,
+                                             sheet_lookup, name_lookup};
+    // Размеры узлов и значения частей без областей находятся один раз.
+    std::vector<Instruction> program;
+    const auto size = root_expr_->CompileArray(context, program);
+    assert(size && size->rows > 0);
+
+    size_t depth = 0;
+    size_t max_depth = 0;
+    for (const Instruction& instruction : program) {
+        if (instruction.code == Code::Number || instruction.code == Code::Range) {
+            max_depth = std::max(max_depth, ++depth);
+        } else if (instruction.code != Code::UnaryPlus && instruction.code != Code::UnaryMinus) {
+            --depth;
+        }
+    }
+
+    // Элементы идут блоками по CHUNK подряд по столбцам, так что и высокий,
+    // и широкий массив вычисляются одними вызовами векторных операций.
+    // Нижний операнд стека пишет прямо в out, остальные — в свои буферы.
+    constexpr size_t CHUNK = 1024;
+    struct Operand {
+        double* values;
+        // Число, ещё не размноженное по values.
+        bool is_scalar;
+        double scalar;
+    };
+    std::vector<double> buffers((max_depth - 1) * CHUNK);
+    std::vector<Operand> stack(max_depth);
+
+    const auto rows = static_cast<size_t>(size->rows);
+    const size_t total = rows * static_cast<size_t>(size->cols);
+    for (size_t begin = 0; begin < total; begin += CHUNK) {
+        const size_t count = std::min(CHUNK, total - begin);
+        auto values = [&](size_t level) {
+            return level == 0 ? out + begin : buffers.data() + (level - 1) * CHUNK;
+        };
+        auto broadcast = [&](Operand& operand) {
+            if (operand.is_scalar) {
+                std::fill(operand.values, operand.values + count, operand.scalar);
+                operand.is_scalar = false;
+            }
+        };
+
+        depth = 0;
+        for (const Instruction& instruction : program) {
+            switch (instruction.code) {
+                case Code::Number:
+                    stack[depth] = {values(depth), true, instruction.number};
+                    ++depth;
+                    break;
+                case Code::Range: {
+                    Operand& operand = stack[depth];
+                    operand = {values(depth), false, 0.0};
+                    ++depth;
+                    // Блок может начинаться в середине столбца и захватывать
+                    // несколько столбцов.
+                    for (size_t index = begin; index < begin + count;) {
+                        const size_t col = index / rows;
+                        const size_t row = index % rows;
+                        const size_t length = std::min(rows - row, begin + count - index);
+                        column_lookup(instruction.range.first.col + static_cast<int>(col),
+                                      instruction.range.first.row + static_cast<int>(row),
+                                      length, operand.values + (index - begin));
+                        index += length;
+                    }
+                    break;
+                }
+                case Code::UnaryPlus:
+                    Elementwise::Plus(stack[depth - 1].values, stack[depth - 1].values, count);
+                    break;
+                case Code::UnaryMinus:
+                    Elementwise::Negate(stack[depth - 1].values, stack[depth - 1].values, count);
+                    break;
+                default: {
+                    Operand& lhs = stack[depth - 2];
+                    Operand& rhs = stack[depth - 1];
+                    broadcast(lhs);
+                    broadcast(rhs);
+                    switch (instruction.code) {
+                        case Code::Add:
+                            Elementwise::Add(lhs.values, rhs.values, lhs.values, count);
+                            break;
+                        case Code::Subtract:
+                            Elementwise::Subtract(lhs.values, rhs.values, lhs.values, count);
+                            break;
+                        case Code::Multiply:
+                            Elementwise::Multiply(lhs.values, rhs.values, lhs.values, count);
+                            break;
+                        default:
+                            assert(instruction.code == Code::Divide);
+                            Elementwise::Divide(lhs.values, rhs.values, lhs.values, count);
+                    }
+                    --depth;
+                }
+            }
+        }
+        assert(depth == 1 && !stack[0].is_scalar);
+    }
+}
+
+void FormulaAST::Print(std::ostream& out) const {
+    root_expr_->Print(out);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out) const {
+    std::string text;
+    PrintFormula(text);
+    out << text;
+}
+
+void FormulaAST::PrintFormula(std::string& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-const std::forward_list<Position>& FormulaAST::GetRawReferencedCells() const {
-    return cells_;
+std::vector<FormulaAST::Instruction> FormulaAST::Linearize() const {
+    std::vector<Instruction> result;
+    root_expr_->Linearize(result);
+    return result;
 }
 
 void FormulaAST::PrintCells(std::ostream &out) const {
@@ -3,50 +3,244 @@
 #include "formula.h"
 #include "FormulaLexer.h"
 #include "common.h"
+#include "criteria.h"
 
-#include <forward_list>
 #include <functional>
 #include <memory>
+#include <optional>
 #include <ostream>
+#include <string>
+#include <string_view>
 #include <vector>
 
 namespace ASTImpl {
 class Expr;
 }
 
+class Aggregate;
+
 class ParsingError : public std::runtime_error {
-    using std::runtime_error::runtime_error;
+public:
+    explicit ParsingError(FormulaDiagnostic diagnostic);
+
+    [[nodiscard]] const FormulaDiagnostic& GetDiagnostic() const;
+
+private:
+    FormulaDiagnostic diagnostic_;
 };
 
+// Встроенные функции формул.
+enum class FormulaFunction {
+    Sum,
+    Min,
+    Max,
+    Average,
+    Count,
+    Vlookup,
+    Match,
+    Index,
+    SumIf,
+    CountIf,
+    AverageIf,
+    If,
+    IfError,
+    // Изменчивые функции: значение меняется без изменения ячеек, см.
+    // Sheet::Tick.
+    Now,
+    Rand,
+};
+
+// Имя функции в записи формулы и функция по имени.
+std::string_view GetFormulaFunctionName(FormulaFunction function);
+std::optional<FormulaFunction> FindFormulaFunction(std::string_view name);
+
 class FormulaAST {
 public:
-    using CellLookup = std::function<FormulaInterface::Value(const Position&)>;
+    // Значения ячеек и результат вычисления представлены в виде NanBox:
+    // ошибки закодированы внутри double.
+    using CellLookup = std::function<double(const Position&)>;
+
+    // Добавляет значения области range в aggregate так, как если бы они
+    // добавлялись по одному при построчном обходе, и возвращает число пустых
+    // ячеек. Пустая ячейка читается как ноль.
+    using RangeLookup = std::function<size_t(const Range& range, Aggregate& aggregate)>;
 
+    // Ищет key в области из одного столбца или строки, см.
+    // SheetInterface::FindInRange.
+    using MatchLookup = std::function<std::optional<int>(const Range& vector, double key,
+                                                         LookupMatch match)>;
+
+    // Сворачивает значения values, для которых ячейка range на том же месте
+    // удовлетворяет criteria, см. SheetInterface::AggregateRangeIf.
+    using CriteriaLookup = std::function<size_t(const Range& range, const Criteria& criteria,
+                                                const Range& values, Aggregate& aggregate)>;
+
+    // Другой лист книги по имени; nullptr, если такого листа нет.
+    using SheetLookup = std::function<const SheetInterface*(std::string_view sheet)>;
+
+    // Значение имени-числа, с которым связана формула; у неопределённого
+    // или несвязанного имени — #NAME?.
+    using NameLookup = std::function<double(std::string_view name)>;
+
+    // Записывает в out значения count ячеек столбца col начиная со строки
+    // row, см. SheetInterface::ReadColumn.
+    using ColumnLookup = std::function<void(int col, int row, size_t count, double* out)>;
+
+    // Шаг формулы в обратной польской записи.
+    struct Instruction {
+        enum class Code {
+            Number,
+            Cell,
+            UnaryPlus,
+            UnaryMinus,
+            Add,
+            Subtract,
+            Multiply,
+            Divide,
+            // Сравнения дают 1 или 0.
+            Equal,
+            NotEqual,
+            Less,
+            LessOrEqual,
+            Greater,
+            GreaterOrEqual,
+            Range,
+            Criteria,
+            Function,
+            // Имя; в name — оно само, значение даёт NameLookup.
+            Name,
+            // Ячейка или область другого листа; в range — её область.
+            SheetReference,
+        };
+
+        Code code;
+        double number = 0.0;
+        Position cell = Position::NONE;
+        // Для Range — область, для Criteria — условие, для Function — функция
+        // и число её аргументов на стеке.
+        Range range = {};
+        Criteria criteria = {Criteria::Compare::Equal, 0.0};
+        FormulaFunction function = FormulaFunction::Sum;
+        size_t argument_count = 0;
+        std::string_view name = {};
+    };
+
+    // Ссылки и области могут идти в любом порядке и повторяться: AST хранит
+    // их отсортированными и без повторов.
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+                        std::vector<Position> cells,
+                        std::vector<Range> ranges = {});
+    FormulaAST(FormulaAST&&) noexcept;
+    FormulaAST& operator=(FormulaAST&&) noexcept;
     ~FormulaAST();
 
-    [[nodiscard]] double Execute(const CellLookup& lookup) const;
+    [[nodiscard]] double Execute(const CellLookup& lookup, const RangeLookup& range_lookup,
+                                 const MatchLookup& match_lookup,
+                                 const CriteriaLookup& criteria_lookup,
+                                 const SheetLookup& sheet_lookup,
+                                 const NameLookup& name_lookup) const;
+    // Вычисляет формулу-массив (см. GetArraySize) в out: значения по
+    // столбцам, сначала все строки первого столбца. Области читаются
+    // столбцами через column_lookup, арифметика над ними идёт векторно
+    // блоками фиксированной длины, остальные части формулы вычисляются
+    // один раз.
+    void ExecuteArray(const CellLookup& lookup, const RangeLookup& range_lookup,
+                      const MatchLookup& match_lookup, const CriteriaLookup& criteria_lookup,
+                      const SheetLookup& sheet_lookup, const NameLookup& name_lookup,
+                      const ColumnLookup& column_lookup, double* out) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
+    // Дописывает каноническую запись формулы в out, без потоков.
+    void PrintFormula(std::string& out) const;
 
-    [[nodiscard]] const std::forward_list<Position>& GetRawReferencedCells() const;
+    [[nodiscard]] std::vector<Instruction> Linearize() const;
 
-    std::forward_list<Position>& GetCells() {
+    // Ячейки, на которые ссылается формула отдельными ссылками, по
+    // возрастанию и без повторов.
+    [[nodiscard]] const std::vector<Position>& GetReferencedCells() const {
         return cells_;
     }
 
-    [[nodiscard]] const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    // Области, которые формула передаёт функциям, по возрастанию и без повторов.
+    [[nodiscard]] const std::vector<Range>& GetReferencedRanges() const {
+        return ranges_;
     }
 
+    // Ссылки из GetReferencedCells, которые читаются только в ветвях IF и
+    // IFERROR, по возрастанию.
+    [[nodiscard]] const std::vector<Position>& GetConditionalCells() const {
+        return conditional_cells_;
+    }
+
+    // Ссылки на другие листы, по возрастанию и без повторов. Ячейки и
+    // области других листов не входят в GetReferencedCells и
+    // GetReferencedRanges.
+    [[nodiscard]] std::vector<SheetRange> GetSheetReferences() const;
+
+    // Вызывает ли формула NOW или RAND.
+    [[nodiscard]] bool IsVolatile() const;
+
+    // Размер результата формулы-массива — арифметики над областями своего
+    // листа: A1:A9*B1:B9, -A1:B2, A1:A9*2+SUM(B1:B9). Области в ней должны
+    // быть одного размера, а числа и ссылки участвуют в каждом элементе.
+    // nullopt у обычной формулы, а также если размеры областей разные: тогда
+    // формула вычисляется как обычная и область в ней даёт #VALUE!.
+    [[nodiscard]] std::optional<Size> GetArraySize() const;
+
+    // Имена, которые ещё не связаны со значениями, по возрастанию и без
+    // повторов.
+    [[nodiscard]] std::vector<std::string> GetNames() const;
+
+    // Заменяет имена ячеек и областей, известные resolver, ссылками прямо
+    // в дереве и добавляет их к ссылкам формулы. Имена-числа остаются в
+    // дереве: их значения при вычислении даёт NameLookup, поэтому дерево
+    // одного выражения разделяют формулы с разными значениями имён.
+    void BindNames(const NameResolver& resolver);
+
+    // Копия дерева с теми же числами и ссылками.
+    [[nodiscard]] FormulaAST Clone() const;
+
 private:
+    // Сортирует ссылки и области, убирает повторы и выделяет условные ссылки.
+    void NormalizeReferences();
+
     std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
+    std::vector<Position> conditional_cells_;
+};
+
+// Реализация разбора формул. Pratt — рукописный парсер, используется по
+// умолчанию; Antlr — парсер, сгенерированный по Formula.g4, служит эталоном.
+enum class FormulaParserBackend {
+    Antlr,
+    Pratt,
 };
 
+void SetFormulaParserBackend(FormulaParserBackend backend);
+FormulaParserBackend GetFormulaParserBackend();
+
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+FormulaAST ParseFormulaAST(const std::string& in_str);
+
+// Разбор выбранной реализацией; ошибки разбора бросаются как FormulaException.
+FormulaAST ParseFormulaAST(std::string_view expression, FormulaParserBackend backend);
+
+// Разбор без исключений: при ошибке возвращает nullopt и заполняет
+// diagnostic. Рукописный парсер не бросает исключений вовсе, ошибки ANTLR
+// перехватываются внутри.
+std::optional<FormulaAST> TryParseFormulaAST(std::string_view expression,
+                                             FormulaParserBackend backend,
+                                             FormulaDiagnostic& diagnostic);
+
+// Быстрый разбор формул вида «ссылка», «число» и «операнд op операнд».
+// Возвращает nullopt, если выражение другого вида или содержит ошибку:
+// тогда его нужно разобрать полностью. Если разбор удался, дерево то же,
+// что и при полном разборе.
+std::optional<FormulaAST> TryParseTrivialFormula(std::string_view expression);
+
+// Сбрасывает кеши предсказания (DFA) лексера и парсера ANTLR: следующие
+// разборы снова будут «холодными». Кеши общие для всех потоков, поэтому
+// вызывать можно, только когда никто не разбирает формулы.
+void ClearAntlrPredictionCaches();
\ No newline at end of file
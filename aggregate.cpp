@@ -0,0 +1,193 @@
+#include "aggregate.h"
+
+#include "nan_box.h"
+#include "simd.h"
+
+#include <cmath>
+
+void Aggregate::Add(const double* values, size_t count) {
+    size_t i = 0;
+#if defined(__AVX2__) || defined(SPREADSHEET_SSE2)
+    using namespace Simd;
+
+    if (count >= LANES) {
+        Vec sum = Splat(0.0);
+        Vec min = Splat(min_);
+        Vec max = Splat(max_);
+        int nan = 0;
+        for (; i + LANES <= count; i += LANES) {
+            const Vec value = Load(values + i);
+            sum = Simd::Add(sum, value);
+            min = Min(min, value);
+            max = Max(max, value);
+            nan |= NanMask(value);
+        }
+
+        if (nan != 0) {
+            // Среди значений есть ошибка или NaN: порядок важен, поэтому
+            // порция сворачивается заново по одному значению.
+            i = 0;
+        } else {
+            double lanes[LANES];
+            Store(lanes, sum);
+            double partial = 0.0;
+            for (double lane : lanes) {
+                partial += lane;
+            }
+            sum_ += partial;
+
+            Store(lanes, min);
+            for (double lane : lanes) {
+                min_ = lane < min_ ? lane : min_;
+            }
+            Store(lanes, max);
+            for (double lane : lanes) {
+                max_ = lane > max_ ? lane : max_;
+            }
+            numbers_ += i;
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        AddScalar(values[i]);
+    }
+}
+
+void Aggregate::Add(double value) {
+    AddScalar(value);
+}
+
+void Aggregate::AddSummary(size_t count, double sum, double min, double max, bool has_nan) {
+    if (count == 0) {
+        return;
+    }
+    numbers_ += count;
+    sum_ += sum;
+    min_ = min < min_ ? min : min_;
+    max_ = max > max_ ? max : max_;
+    has_nan_ = has_nan_ || has_nan;
+}
+
+size_t Aggregate::AddIf(const double* keys, const double* values, size_t count,
+                        const Criteria& criteria) {
+    size_t matched = 0;
+    size_t i = 0;
+#if defined(__AVX2__) || defined(SPREADSHEET_SSE2)
+    using Compare = Criteria::Compare;
+    const double operand = criteria.GetOperand();
+    // Операция выбирается один раз на порцию, а не на каждую дорожку; лямбда
+    // вместо указателя на функцию даёт встроить сравнение в цикл.
+    auto add = [&](auto compare) {
+        return AddIfVector(keys, values, count, operand, compare, i);
+    };
+    using Simd::Vec;
+    switch (criteria.GetCompare()) {
+        case Compare::Equal:
+            matched = add([](Vec a, Vec b) { return Simd::CmpEq(a, b); });
+            break;
+        case Compare::NotEqual:
+            matched = add([](Vec a, Vec b) { return Simd::CmpNeq(a, b); });
+            break;
+        case Compare::Less:
+            matched = add([](Vec a, Vec b) { return Simd::CmpLt(a, b); });
+            break;
+        case Compare::LessOrEqual:
+            matched = add([](Vec a, Vec b) { return Simd::CmpLe(a, b); });
+            break;
+        case Compare::Greater:
+            matched = add([](Vec a, Vec b) { return Simd::CmpGt(a, b); });
+            break;
+        case Compare::GreaterOrEqual:
+            matched = add([](Vec a, Vec b) { return Simd::CmpGe(a, b); });
+            break;
+    }
+#endif
+    for (; i < count; ++i) {
+        if (criteria.Matches(keys[i])) {
+            ++matched;
+            AddScalar(values[i]);
+        }
+    }
+    return matched;
+}
+
+template <typename Compare>
+size_t Aggregate::AddIfVector(const double* keys, const double* values, size_t count,
+                              double operand, Compare compare, size_t& processed) {
+    processed = 0;
+#if defined(__AVX2__) || defined(SPREADSHEET_SSE2)
+    using namespace Simd;
+
+    if (count < LANES) {
+        return 0;
+    }
+
+    const Vec key = Splat(operand);
+    const Vec zero = Splat(0.0);
+    const Vec inf = Splat(std::numeric_limits<double>::infinity());
+    const Vec negative_inf = Splat(-std::numeric_limits<double>::infinity());
+    Vec sum = zero;
+    Vec min = Splat(min_);
+    Vec max = Splat(max_);
+    size_t matched = 0;
+    int nan = 0;
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        const Vec mask = compare(Load(keys + i), key);
+        const Vec value = Load(values + i);
+        const int lanes = MoveMask(mask);
+        nan |= NanMask(value) & lanes;
+        sum = Simd::Add(sum, Select(mask, value, zero));
+        min = Min(min, Select(mask, value, inf));
+        max = Max(max, Select(mask, value, negative_inf));
+        matched += PopCount(lanes);
+    }
+
+    // Среди отобранных значений есть ошибка или NaN: порция сворачивается
+    // заново по одному значению, чтобы сохранить порядок.
+    if (nan != 0) {
+        return 0;
+    }
+
+    double lanes[LANES];
+    Store(lanes, sum);
+    double partial = 0.0;
+    for (double lane : lanes) {
+        partial += lane;
+    }
+    sum_ += partial;
+
+    Store(lanes, min);
+    for (double lane : lanes) {
+        min_ = lane < min_ ? lane : min_;
+    }
+    Store(lanes, max);
+    for (double lane : lanes) {
+        max_ = lane > max_ ? lane : max_;
+    }
+    numbers_ += matched;
+    processed = i;
+    return matched;
+#else
+    return 0;
+#endif
+}
+
+void Aggregate::AddScalar(double value) {
+    if (NanBox::IsError(value)) {
+        if (!has_error_) {
+            has_error_ = true;
+            error_ = value;
+        }
+        return;
+    }
+
+    ++numbers_;
+    sum_ += value;
+    if (std::isnan(value)) {
+        has_nan_ = true;
+        return;
+    }
+    min_ = value < min_ ? value : min_;
+    max_ = value > max_ ? value : max_;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "criteria.h"
+
+#include <cstddef>
+#include <limits>
+
+// Свёртка значений для функций SUM, MIN, MAX, AVERAGE и COUNT. Значения в
+// виде NanBox поступают порциями в порядке вычисления аргументов; из ошибок
+// запоминается первая. Порции без ошибок и NaN сворачиваются векторными
+// операциями.
+class Aggregate {
+public:
+    void Add(const double* values, size_t count);
+    void Add(double value);
+    // Добавляет заранее посчитанную свёртку count чисел без ошибок.
+    void AddSummary(size_t count, double sum, double min, double max, bool has_nan);
+    // Добавляет values[i] для тех i, у которых keys[i] удовлетворяет
+    // criteria, и возвращает их число. Сравнение и накопление идут
+    // векторными операциями.
+    size_t AddIf(const double* keys, const double* values, size_t count,
+                 const Criteria& criteria);
+
+    // Число значений, не являющихся ошибками.
+    [[nodiscard]] size_t GetNumberCount() const {
+        return numbers_;
+    }
+
+    [[nodiscard]] bool HasError() const {
+        return has_error_;
+    }
+
+    // Первая ошибка в виде NanBox.
+    [[nodiscard]] double GetError() const {
+        return error_;
+    }
+
+    // Сумма, минимум и максимум чисел. Если среди чисел был NaN, минимум и
+    // максимум тоже NaN.
+    [[nodiscard]] double GetSum() const {
+        return sum_;
+    }
+
+    [[nodiscard]] double GetMin() const {
+        return has_nan_ ? std::numeric_limits<double>::quiet_NaN() : min_;
+    }
+
+    [[nodiscard]] double GetMax() const {
+        return has_nan_ ? std::numeric_limits<double>::quiet_NaN() : max_;
+    }
+
+private:
+    void AddScalar(double value);
+
+    template <typename Compare>
+    size_t AddIfVector(const double* keys, const double* values, size_t count,
+                       double operand, Compare compare, size_t& processed);
+
+    double sum_ = 0.0;
+    double min_ = std::numeric_limits<double>::infinity();
+    double max_ = -std::numeric_limits<double>::infinity();
+    size_t numbers_ = 0;
+    double error_ = 0.0;
+    bool has_error_ = false;
+    bool has_nan_ = false;
+};
@@ -0,0 +1,106 @@
+#include "allocation_counter.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+    constexpr size_t HEADER = alignof(std::max_align_t);
+    constexpr size_t ARENA_SIZE = size_t{64} << 20;
+
+    std::atomic<bool> enabled{false};
+    std::atomic<uintptr_t> arena{0};
+    std::atomic<size_t> arena_used{0};
+    std::atomic<long long> live_bytes{0};
+    std::atomic<long long> allocations{0};
+    std::atomic<long long> allocated_bytes{0};
+
+    void* Allocate(std::size_t size) {
+        if (!enabled.load(std::memory_order_relaxed)) {
+            void* ptr = std::malloc(size == 0 ? 1 : size);
+            if (!ptr) {
+                throw std::bad_alloc();
+            }
+            return ptr;
+        }
+
+        const size_t block = (size + 2 * HEADER - 1) / HEADER * HEADER;
+        const size_t offset = arena_used.fetch_add(block, std::memory_order_relaxed);
+        if (offset + block > ARENA_SIZE) {
+            throw std::bad_alloc();
+        }
+        char* raw = reinterpret_cast<char*>(arena.load(std::memory_order_relaxed) + offset);
+        *reinterpret_cast<std::size_t*>(raw) = size;
+        live_bytes.fetch_add(static_cast<long long>(size), std::memory_order_relaxed);
+        allocated_bytes.fetch_add(static_cast<long long>(size), std::memory_order_relaxed);
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return raw + HEADER;
+    }
+
+    // Блоки из области учёта узнаются по адресу, поэтому их можно
+    // освобождать и после конца Scope.
+    void Deallocate(void* ptr) noexcept {
+        const uintptr_t address = reinterpret_cast<uintptr_t>(ptr);
+        const uintptr_t begin = arena.load(std::memory_order_relaxed);
+        if (begin == 0 || address < begin || address >= begin + ARENA_SIZE) {
+            std::free(ptr);
+            return;
+        }
+        const auto* raw = reinterpret_cast<const std::size_t*>(address - HEADER);
+        live_bytes.fetch_sub(static_cast<long long>(*raw), std::memory_order_relaxed);
+    }
+
+} // namespace
+
+namespace AllocationCounter {
+
+    Scope::Scope() {
+        if (arena.load() == 0) {
+            void* memory = std::malloc(ARENA_SIZE);
+            if (!memory) {
+                throw std::bad_alloc();
+            }
+            arena = reinterpret_cast<uintptr_t>(memory);
+        }
+        enabled = true;
+    }
+
+    Scope::~Scope() {
+        enabled = false;
+    }
+
+    long long GetLiveBytes() {
+        return live_bytes;
+    }
+
+    long long GetAllocations() {
+        return allocations;
+    }
+
+    long long GetAllocatedBytes() {
+        return allocated_bytes;
+    }
+
+} // namespace AllocationCounter
+
+void* operator new(std::size_t size) { return Allocate(size); }
+void* operator new[](std::size_t size) { return Allocate(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return Allocate(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+void operator delete(void* ptr) noexcept { Deallocate(ptr); }
+void operator delete[](void* ptr) noexcept { Deallocate(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { Deallocate(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { Deallocate(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { Deallocate(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { Deallocate(ptr); }
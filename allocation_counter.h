@@ -0,0 +1,25 @@
+#pragma once
+
+// Учёт динамической памяти для тестов и замеров расхода памяти. Глобальные
+// new и delete заменены в allocation_counter.cpp, но считаются только
+// выделения внутри Scope: такие блоки берутся из отдельной области,
+// снабжаются заголовком с размером и не используются повторно. Вне Scope
+// new и delete — это malloc и free без заголовков и счётчиков, поэтому
+// замеры времени идут на обычном распределителе.
+namespace AllocationCounter {
+    // Включает учёт на время своей жизни. Области вложенными не бывают.
+    class Scope {
+    public:
+        Scope();
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    // Байты блоков, выделенных внутри областей учёта и ещё не освобождённых.
+    long long GetLiveBytes();
+    // Число выделений и их байты внутри областей учёта, с начала работы.
+    long long GetAllocations();
+    long long GetAllocatedBytes();
+}
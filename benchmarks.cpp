@@ -0,0 +1,1123 @@
+#include "benchmarks.h"
+
+#include "FormulaAST.h"
+#include "aggregate.h"
+#include "allocation_counter.h"
+#include "common.h"
+#include "formula.h"
+#include "formula_batch.h"
+#include "log_duration.h"
+#include "sheet.h"
+#include "workbook.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+
+    // Лента правок, в которой одни и те же формулы записываются снова и
+    // снова: каждая ячейка столбца попеременно получает одно из нескольких
+    // выражений.
+    void BenchFormulaRewrites(std::ostream& out, size_t cache_capacity) {
+        constexpr int ROWS = 2000;
+        constexpr int ROUNDS = 10;
+        const std::vector<std::string> formulas = {
+                "=A1 + B1 * 2",
+                "=(A2 - B2) / 4",
+                "=A3*A3 + B3*B3 + C3*C3",
+                "=1 + 2 * (3 - 4 / (5 + 6))",
+        };
+
+        SetFormulaCacheCapacity(cache_capacity);
+        ClearFormulaCache();
+
+        auto sheet = CreateSheet();
+        {
+            LOG_DURATION_STREAM("formula rewrites, cache capacity "
+                                + std::to_string(cache_capacity), out);
+            for (int round = 0; round < ROUNDS; ++round) {
+                for (int row = 0; row < ROWS; ++row) {
+                    const auto& text = formulas[(row + round) % formulas.size()];
+                    sheet->SetCell(Position{row, 4}, text);
+                }
+            }
+        }
+
+        const auto stats = GetFormulaCacheStats();
+        out << "  hits: " << stats.hits << ", misses: " << stats.misses << std::endl;
+    }
+
+    // Вычисление столбца =A{i}*B{i}+C{i}: по одной формуле и пачкой.
+    // Высота листа ограничена Position::MAX_ROWS, поэтому длинный столбец
+    // разложен на несколько столбцов той же формы.
+    void BenchColumnBatchEvaluation(std::ostream& out) {
+        constexpr int ROWS = Position::MAX_ROWS;
+        constexpr int COLUMNS = 4;
+
+        auto sheet = CreateSheet();
+        std::vector<std::unique_ptr<FormulaInterface>> formulas;
+        std::vector<Position> origins;
+        for (int block = 0; block < COLUMNS; ++block) {
+            const int base = block * 4;
+            for (int row = 0; row < ROWS; ++row) {
+                sheet->SetCell(Position{row, base}, std::to_string(row % 97));
+                sheet->SetCell(Position{row, base + 1}, std::to_string(row % 89) + ".5");
+                sheet->SetCell(Position{row, base + 2}, std::to_string(row % 13));
+
+                auto ref = [&](int col) { return Position{row, base + col}.ToString(); };
+                formulas.push_back(ParseFormula(ref(0) + "*" + ref(1) + "+" + ref(2)));
+                origins.push_back(Position{row, base + 3});
+            }
+        }
+
+        const auto cells = std::to_string(formulas.size());
+        double checksum = 0;
+        {
+            LOG_DURATION_STREAM("column =A*B+C, one by one, " + cells + " cells", out);
+            for (const auto& formula : formulas) {
+                checksum += std::get<double>(formula->Evaluate(*sheet));
+            }
+        }
+        {
+            LOG_DURATION_STREAM("column =A*B+C, batched, " + cells + " cells", out);
+            FormulaBatchEvaluator batch(*sheet);
+            for (size_t i = 0; i < formulas.size(); ++i) {
+                batch.Add(origins[i], *formulas[i]);
+            }
+            for (const auto& value : batch.Evaluate()) {
+                checksum -= std::get<double>(value);
+            }
+        }
+        out << "  checksum difference: " << checksum << std::endl;
+    }
+
+    // Чистая пропускная способность векторного вычисления формы на
+    // миллионе дорожек с уже собранными входами.
+    void BenchBatchKernel(std::ostream& out) {
+        constexpr size_t LANES = 1 << 20;
+
+        auto formula = ParseFormula("A1*B1+C1");
+        FormulaShape shape(*formula->GetAST(), Position{0, 3});
+
+        std::vector<std::vector<double>> values(3, std::vector<double>(LANES));
+        std::vector<FormulaShape::ErrorCode> no_errors(LANES, FormulaShape::NO_ERROR);
+        for (size_t i = 0; i < LANES; ++i) {
+            values[0][i] = static_cast<double>(i % 97);
+            values[1][i] = static_cast<double>(i % 89) + 0.5;
+            values[2][i] = static_cast<double>(i % 13);
+        }
+
+        std::vector<double> result(LANES);
+        std::vector<FormulaShape::ErrorCode> errors(LANES);
+        constexpr int REPEATS = 20;
+        {
+            LOG_DURATION_STREAM("kernel =A*B+C, " + std::to_string(REPEATS) + " x "
+                                + std::to_string(LANES) + " lanes", out);
+            for (int i = 0; i < REPEATS; ++i) {
+                shape.Evaluate({values[0].data(), values[1].data(), values[2].data()},
+                               {no_errors.data(), no_errors.data(), no_errors.data()},
+                               LANES, result.data(), errors.data());
+            }
+        }
+    }
+
+    // Свёртка области функцией SUM против цепочки сложений тех же ячеек, а
+    // также сама векторная свёртка против поэлементной.
+    void BenchRangeAggregates(std::ostream& out) {
+        constexpr int ROWS = 4096;
+        constexpr int REPEATS = 200;
+
+        auto sheet = CreateSheet();
+        std::string chain;
+        for (int row = 0; row < ROWS; ++row) {
+            const Position pos{row, 0};
+            sheet->SetCell(pos, std::to_string(row % 100));
+            chain += (row > 0 ? "+" : "") + pos.ToString();
+        }
+        const auto sum = ParseFormula("SUM(A1:A" + std::to_string(ROWS) + ")");
+        const auto added = ParseFormula(chain);
+
+        double total = 0.0;
+        for (const auto* formula : {sum.get(), added.get()}) {
+            const std::string name = formula == sum.get() ? "SUM(range)" : "chained '+'";
+            LOG_DURATION_STREAM(std::to_string(REPEATS) + " x " + name + " over "
+                                + std::to_string(ROWS) + " cells", out);
+            for (int i = 0; i < REPEATS; ++i) {
+                total += std::get<double>(formula->Evaluate(*sheet));
+            }
+        }
+
+        constexpr size_t VALUES = 1 << 20;
+        std::vector<double> values(VALUES);
+        for (size_t i = 0; i < VALUES; ++i) {
+            values[i] = static_cast<double>(i % 1000) * 0.5;
+        }
+        constexpr int KERNEL_REPEATS = 50;
+        {
+            LOG_DURATION_STREAM("aggregate " + std::to_string(KERNEL_REPEATS) + " x "
+                                + std::to_string(VALUES) + " values, vector", out);
+            for (int i = 0; i < KERNEL_REPEATS; ++i) {
+                Aggregate aggregate;
+                aggregate.Add(values.data(), values.size());
+                total += aggregate.GetSum() + aggregate.GetMax();
+            }
+        }
+        {
+            LOG_DURATION_STREAM("aggregate " + std::to_string(KERNEL_REPEATS) + " x "
+                                + std::to_string(VALUES) + " values, scalar", out);
+            for (int i = 0; i < KERNEL_REPEATS; ++i) {
+                Aggregate aggregate;
+                for (double value : values) {
+                    aggregate.Add(value);
+                }
+                total += aggregate.GetSum() + aggregate.GetMax();
+            }
+        }
+        out << "  checksum: " << total << std::endl;
+    }
+
+    // Чтение числовых текстовых ячеек формулами: разбор текста при каждом
+    // чтении (как раньше) против классификации, выполненной при записи.
+    void BenchTextCellReads(std::ostream& out) {
+        constexpr int ROWS = Position::MAX_ROWS;
+        constexpr int REPEATS = 50;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < ROWS; ++row) {
+            sheet->SetCell(Position{row, 0}, std::to_string(row) + ".25");
+        }
+
+        const auto reads = std::to_string(ROWS * REPEATS);
+        double checksum = 0;
+        {
+            LOG_DURATION_STREAM("text cell reads via strtod, " + reads + " reads", out);
+            for (int i = 0; i < REPEATS; ++i) {
+                for (int row = 0; row < ROWS; ++row) {
+                    auto value = sheet->GetCell(Position{row, 0})->GetValue();
+                    checksum += std::strtod(std::get<std::string>(value).c_str(), nullptr);
+                }
+            }
+        }
+        {
+            LOG_DURATION_STREAM("text cell reads, classified once, " + reads + " reads", out);
+            for (int i = 0; i < REPEATS; ++i) {
+                for (int row = 0; row < ROWS; ++row) {
+                    auto value = ReadCellAsNumber(sheet->GetCell(Position{row, 0}));
+                    checksum -= std::get<double>(value);
+                }
+            }
+        }
+        out << "  checksum difference: " << checksum << std::endl;
+    }
+
+    // Корпус различных формул для измерения скорости разбора.
+    std::vector<std::string> MakeParsingCorpus(size_t size) {
+        const std::vector<std::string> templates = {
+                "{0}", "{0}+{1}", "{0}*{1}+{2}", "({0}-{1})/4.5",
+                "-{0}*2+{1}/(3-{2})", "1.25e3*({0}+{1}+{2})-{0}/7",
+        };
+
+        std::vector<std::string> corpus;
+        corpus.reserve(size);
+        for (size_t i = 0; corpus.size() < size; ++i) {
+            std::string formula = templates[i % templates.size()];
+            for (int k = 0; k < 3; ++k) {
+                const std::string placeholder = "{" + std::to_string(k) + "}";
+                const auto ref = Position{static_cast<int>(i % 1000),
+                                          static_cast<int>(i % 26) + k}.ToString();
+                for (auto at = formula.find(placeholder); at != std::string::npos;
+                     at = formula.find(placeholder)) {
+                    formula.replace(at, placeholder.size(), ref);
+                }
+            }
+            corpus.push_back(std::move(formula));
+        }
+        return corpus;
+    }
+
+    // Те же формулы с синтаксической ошибкой в конце: разбор доходит до
+    // последней лексемы и только там отказывает.
+    std::vector<std::string> MakeInvalidParsingCorpus(const std::vector<std::string>& valid) {
+        std::vector<std::string> corpus;
+        corpus.reserve(valid.size());
+        for (size_t i = 0; i < valid.size(); ++i) {
+            switch (i % 3) {
+                case 0:
+                    corpus.push_back(valid[i] + "+");
+                    break;
+                case 1:
+                    corpus.push_back("(" + valid[i]);
+                    break;
+                default:
+                    corpus.push_back(valid[i] + ")");
+            }
+        }
+        return corpus;
+    }
+
+    void BenchFormulaParsing(std::ostream& out) {
+        constexpr size_t FORMULAS = 100000;
+        const auto valid = MakeParsingCorpus(FORMULAS);
+        const auto invalid = MakeInvalidParsingCorpus(valid);
+
+        size_t references = 0;
+        size_t errors = 0;
+        for (auto backend : {FormulaParserBackend::Antlr, FormulaParserBackend::Pratt}) {
+            const std::string name = backend == FormulaParserBackend::Antlr ? "antlr" : "pratt";
+            {
+                LOG_DURATION_STREAM("parse " + std::to_string(FORMULAS)
+                                    + " valid formulas, " + name, out);
+                for (const auto& formula : valid) {
+                    references += ParseFormulaAST(formula, backend).GetReferencedCells().size();
+                }
+            }
+            {
+                LOG_DURATION_STREAM("parse " + std::to_string(FORMULAS)
+                                    + " invalid formulas, " + name, out);
+                for (const auto& formula : invalid) {
+                    try {
+                        references += ParseFormulaAST(formula, backend).GetReferencedCells().size();
+                    } catch (const FormulaException&) {
+                        ++errors;
+                    }
+                }
+            }
+        }
+        out << "  references parsed: " << references << ", errors: " << errors << std::endl;
+    }
+
+    // Число выделений и байты на один разбор для каждой реализации. Учёт
+    // включён только здесь и на время замеров не влияет.
+    void BenchParseAllocations(std::ostream& out) {
+        const std::vector<std::string> corpus = {
+                "A1+B2*C3", "(A1-B2)/4.5", "-A1*2+B1/(3-C1)", "1.25e3*(A1+B1+C1)",
+        };
+
+        for (auto backend : {FormulaParserBackend::Antlr, FormulaParserBackend::Pratt}) {
+            // Первый разбор прогревает кеши предсказания и контекст потока.
+            for (const auto& expression : corpus) {
+                ParseFormulaAST(expression, backend);
+            }
+
+            constexpr int ROUNDS = 100;
+            AllocationCounter::Scope counting;
+            const long long allocations = AllocationCounter::GetAllocations();
+            const long long bytes = AllocationCounter::GetAllocatedBytes();
+            for (int i = 0; i < ROUNDS; ++i) {
+                for (const auto& expression : corpus) {
+                    ParseFormulaAST(expression, backend);
+                }
+            }
+            const long long parses = ROUNDS * static_cast<long long>(corpus.size());
+            out << (backend == FormulaParserBackend::Antlr ? "antlr" : "pratt")
+                << ": allocations per parse: "
+                << (AllocationCounter::GetAllocations() - allocations) / parses
+                << ", bytes per parse: "
+                << (AllocationCounter::GetAllocatedBytes() - bytes) / parses << std::endl;
+        }
+    }
+
+    // Прежние Position::ToString и Position::FromString: строка растёт
+    // вставкой в начало, номер строки читается через istringstream.
+    std::string LegacyPositionToString(Position pos) {
+        if (!pos.IsValid()) {
+            return "";
+        }
+        std::string result;
+        result.reserve(17);
+        for (int c = pos.col; c >= 0; c = c / 26 - 1) {
+            result.insert(result.begin(), static_cast<char>('A' + c % 26));
+        }
+        result += std::to_string(pos.row + 1);
+        return result;
+    }
+
+    Position LegacyPositionFromString(std::string_view str) {
+        auto it = std::find_if(str.begin(), str.end(), [](const char c) {
+            return !(std::isalpha(c) && std::isupper(c));
+        });
+        auto letters = str.substr(0, it - str.begin());
+        auto digits = str.substr(it - str.begin());
+        if (letters.empty() || digits.empty() || letters.size() > 3
+            || !std::isdigit(digits[0])) {
+            return Position::NONE;
+        }
+        int row;
+        std::istringstream row_in{std::string{digits}};
+        if (!(row_in >> row) || !row_in.eof()) {
+            return Position::NONE;
+        }
+        int col = 0;
+        for (char ch : letters) {
+            col = col * 26 + ch - 'A' + 1;
+        }
+        return {row - 1, col - 1};
+    }
+
+    // Запись и разбор позиций: прежние функции, новые по одной и пакетом
+    // (список ссылок через запятую).
+    void BenchPositionCodec(std::ostream& out) {
+        constexpr size_t COUNT = 1000000;
+        std::vector<Position> positions;
+        positions.reserve(COUNT);
+        for (size_t i = 0; i < COUNT; ++i) {
+            positions.push_back({static_cast<int>(i * 7919 % Position::MAX_ROWS),
+                                 static_cast<int>(i * 104729 % Position::MAX_COLS)});
+        }
+        std::vector<std::string> texts;
+        texts.reserve(COUNT);
+        for (const auto& pos : positions) {
+            texts.push_back(pos.ToString());
+        }
+
+        const auto count = std::to_string(COUNT);
+        size_t checksum = 0;
+        {
+            LOG_DURATION_STREAM("encode " + count + " positions, legacy", out);
+            for (const auto& pos : positions) {
+                checksum += LegacyPositionToString(pos).size();
+            }
+        }
+        {
+            LOG_DURATION_STREAM("encode " + count + " positions, ToString", out);
+            for (const auto& pos : positions) {
+                checksum -= pos.ToString().size();
+            }
+        }
+        std::string joined(COUNT * (Position::MAX_STRING_LENGTH + 1), '\0');
+        {
+            LOG_DURATION_STREAM("encode " + count + " positions, batch", out);
+            joined.resize(PositionsToChars(positions.data(), COUNT, ',', joined.data()));
+        }
+
+        {
+            LOG_DURATION_STREAM("decode " + count + " positions, legacy", out);
+            for (const auto& text : texts) {
+                checksum += LegacyPositionFromString(text).col;
+            }
+        }
+        {
+            LOG_DURATION_STREAM("decode " + count + " positions, FromString", out);
+            for (const auto& text : texts) {
+                checksum -= Position::FromString(text).col;
+            }
+        }
+        std::vector<Position> decoded(COUNT);
+        {
+            LOG_DURATION_STREAM("decode " + count + " positions, batch", out);
+            decoded.resize(PositionsFromChars(joined, ',', decoded.data()));
+        }
+        out << "  checksum: " << checksum << ", batch round trip: "
+            << (decoded == positions ? "ok" : "mismatch") << std::endl;
+    }
+
+    // Канонизация выражений: печать AST через ostringstream и в строку, затем
+    // полный круг ParseFormula -> GetExpression без кэша.
+    void BenchExpressionRoundTrip(std::ostream& out) {
+        constexpr size_t FORMULAS = 100000;
+        const auto corpus = MakeParsingCorpus(FORMULAS);
+        std::vector<FormulaAST> asts;
+        asts.reserve(corpus.size());
+        for (const auto& formula : corpus) {
+            asts.push_back(ParseFormulaAST(formula, FormulaParserBackend::Pratt));
+        }
+
+        const auto count = std::to_string(FORMULAS);
+        size_t length = 0;
+        {
+            LOG_DURATION_STREAM("print " + count + " formulas, ostringstream", out);
+            for (const auto& ast : asts) {
+                std::ostringstream stream;
+                ast.PrintFormula(stream);
+                length += stream.str().size();
+            }
+        }
+        {
+            LOG_DURATION_STREAM("print " + count + " formulas, string", out);
+            for (const auto& ast : asts) {
+                std::string text;
+                ast.PrintFormula(text);
+                length -= text.size();
+            }
+        }
+
+        SetFormulaCacheCapacity(0);
+        ClearFormulaCache();
+        {
+            LOG_DURATION_STREAM("round trip " + count + " formulas, no cache", out);
+            for (const auto& formula : corpus) {
+                length += ParseFormula(formula)->GetExpression().size();
+            }
+        }
+        out << "  canonical characters: " << length << std::endl;
+    }
+
+    // Разбор формул простейших видов (=B7, =42, =A1*B1): быстрым путём и
+    // полным разбором, затем через ParseFormula с выключенным кэшем.
+    void BenchTrivialFormulaParsing(std::ostream& out) {
+        constexpr size_t FORMULAS = 100000;
+        const char* ops = "+-*/";
+        std::vector<std::string> corpus;
+        corpus.reserve(FORMULAS);
+        for (size_t i = 0; i < FORMULAS; ++i) {
+            const Position lhs{static_cast<int>(i % 1000), static_cast<int>(i % 26)};
+            const Position rhs{static_cast<int>(i % 997), static_cast<int>(i % 7)};
+            switch (i % 3) {
+                case 0:
+                    corpus.push_back(lhs.ToString());
+                    break;
+                case 1:
+                    corpus.push_back(std::to_string(i % 1000));
+                    break;
+                default:
+                    corpus.push_back(lhs.ToString() + ops[i % 4] + rhs.ToString());
+            }
+        }
+
+        size_t references = 0;
+        {
+            LOG_DURATION_STREAM("parse " + std::to_string(FORMULAS)
+                                + " trivial formulas, fast path", out);
+            for (const auto& formula : corpus) {
+                references += TryParseTrivialFormula(formula)->GetReferencedCells().size();
+            }
+        }
+        for (auto backend : {FormulaParserBackend::Antlr, FormulaParserBackend::Pratt}) {
+            const std::string name = backend == FormulaParserBackend::Antlr ? "antlr" : "pratt";
+            LOG_DURATION_STREAM("parse " + std::to_string(FORMULAS)
+                                + " trivial formulas, " + name, out);
+            for (const auto& formula : corpus) {
+                references += ParseFormulaAST(formula, backend).GetReferencedCells().size();
+            }
+        }
+
+        SetFormulaCacheCapacity(0);
+        ClearFormulaCache();
+        {
+            LOG_DURATION_STREAM("ParseFormula " + std::to_string(FORMULAS)
+                                + " trivial formulas, no cache", out);
+            for (const auto& formula : corpus) {
+                references += ParseFormula(formula)->GetReferencedCells().size();
+            }
+        }
+        const auto stats = GetFormulaCacheStats();
+        out << "  references parsed: " << references << ", fast path: " << stats.fast_path
+            << " of " << stats.misses << std::endl;
+    }
+
+    // Задержка первых разборов после запуска: с пустыми кешами предсказания
+    // ANTLR и после встроенного прогрева.
+    void BenchParserWarmUp(std::ostream& out) {
+        constexpr size_t FIRST_PARSES = 1000;
+        const auto corpus = MakeParsingCorpus(FIRST_PARSES);
+        const std::string name = "first " + std::to_string(FIRST_PARSES) + " antlr parses, ";
+
+        auto parse_corpus = [&] {
+            for (const auto& formula : corpus) {
+                ParseFormulaAST(formula, FormulaParserBackend::Antlr);
+            }
+        };
+
+        ClearAntlrPredictionCaches();
+        {
+            LOG_DURATION_STREAM(name + "cold", out);
+            parse_corpus();
+        }
+
+        ClearAntlrPredictionCaches();
+        {
+            LOG_DURATION_STREAM("built-in parser warm-up", out);
+            WarmUpFormulaParser();
+        }
+        {
+            LOG_DURATION_STREAM(name + "warm", out);
+            parse_corpus();
+        }
+    }
+
+    // Проверка выгрузки, в которой все формулы ошибочны: через исключения
+    // ParseFormula и через ValidateFormula.
+    void BenchFormulaValidation(std::ostream& out) {
+        constexpr size_t FORMULAS = 100000;
+        const auto invalid = MakeInvalidParsingCorpus(MakeParsingCorpus(FORMULAS));
+        const std::string count = std::to_string(FORMULAS);
+
+        size_t rejected = 0;
+        {
+            LOG_DURATION_STREAM("reject " + count + " invalid formulas via exceptions", out);
+            for (const auto& formula : invalid) {
+                try {
+                    ParseFormula(formula);
+                } catch (const FormulaException&) {
+                    ++rejected;
+                }
+            }
+        }
+        {
+            LOG_DURATION_STREAM("reject " + count + " invalid formulas via ValidateFormula", out);
+            for (const auto& formula : invalid) {
+                rejected += ValidateFormula(formula).has_value();
+            }
+        }
+        out << "  rejected: " << rejected << std::endl;
+    }
+
+    // Загрузка листа с различными формулами: по одной через SetCell и
+    // пакетом через SetCells в 1..N потоках. Кэш формул очищается перед
+    // каждым прогоном, чтобы каждая формула разбиралась заново.
+    // 100k формул, каждая из которых суммирует окно в 10k ячеек (1000 строк
+    // на 10 столбцов). С ребром на каждую ячейку окна зависимостей было бы
+    // 10^9; индекс хранит по отрезку на столбец окна.
+    void BenchRangeDependencies(std::ostream& out) {
+        constexpr int FORMULAS = 100000;
+        constexpr int WINDOW_ROWS = 1000;
+        constexpr int WINDOW_COLS = 10;
+        constexpr int DATA_ROWS = 2 * WINDOW_ROWS;
+        constexpr int DATA_COLS = 2 * WINDOW_COLS;
+
+        Sheet sheet;
+        for (int row = 0; row < DATA_ROWS; ++row) {
+            for (int col = 0; col < DATA_COLS; ++col) {
+                sheet.SetCell({row, col}, std::to_string((row + col) % 10));
+            }
+        }
+
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.reserve(FORMULAS);
+        for (int i = 0; i < FORMULAS; ++i) {
+            const Position first{i % WINDOW_ROWS, (i / WINDOW_ROWS) % WINDOW_COLS};
+            const Position last{first.row + WINDOW_ROWS - 1, first.col + WINDOW_COLS - 1};
+            cells.emplace_back(Position{i % WINDOW_ROWS, 2 * DATA_COLS + i / WINDOW_ROWS},
+                               "=SUM(" + Range{first, last}.ToString() + ")");
+        }
+
+        {
+            LOG_DURATION_STREAM("load " + std::to_string(FORMULAS) + " SUM formulas over "
+                                + std::to_string(WINDOW_ROWS * WINDOW_COLS) + "-cell windows",
+                                out);
+            sheet.SetCells(std::move(cells));
+        }
+        out << "  range index entries: " << sheet.GetRangeDependencyCount() << std::endl;
+
+        constexpr int EVALUATED = 100;
+        double total = 0.0;
+        {
+            LOG_DURATION_STREAM("evaluate " + std::to_string(EVALUATED) + " of them", out);
+            for (int i = 0; i < EVALUATED; ++i) {
+                const Position pos{i * 7 % WINDOW_ROWS, 2 * DATA_COLS + i % 100};
+                total += std::get<double>(sheet.GetCell(pos)->GetValue());
+            }
+        }
+
+        constexpr int EDITS = 20;
+        std::vector<Cell*> dependents;
+        {
+            LOG_DURATION_STREAM(std::to_string(EDITS) + " edits inside the windows", out);
+            for (int i = 0; i < EDITS; ++i) {
+                const Position pos{WINDOW_ROWS / 2 + i * 37, i % DATA_COLS};
+                sheet.SetCell(pos, std::to_string(i));
+            }
+        }
+        {
+            LOG_DURATION_STREAM(std::to_string(EDITS) + " range dependent lookups", out);
+            for (int i = 0; i < EDITS; ++i) {
+                const Position pos{WINDOW_ROWS / 2 + i * 37, i % DATA_COLS};
+                sheet.FindRangeDependents(pos, dependents);
+            }
+        }
+        out << "  dependents found: " << dependents.size() << ", checksum: " << total
+            << std::endl;
+    }
+
+    // Нарастающий итог: B(i) = SUM(A1:A(i)) по всему столбцу. Поячеечное
+    // чтение областей даёт квадратичное время, индекс столбца — O(n log n).
+    void BenchColumnIndexes(std::ostream& out, bool enabled) {
+        constexpr int ROWS = 8192;
+        const std::string mode = enabled ? "column indexes" : "cell scan";
+
+        Sheet sheet;
+        sheet.SetColumnIndexesEnabled(enabled);
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.reserve(2 * ROWS);
+        for (int row = 0; row < ROWS; ++row) {
+            cells.emplace_back(Position{row, 0}, std::to_string(row % 100));
+            cells.emplace_back(Position{row, 1},
+                               "=SUM(A1:" + Position{row, 0}.ToString() + ")");
+        }
+        sheet.SetCells(std::move(cells));
+
+        auto evaluate_all = [&]() {
+            double total = 0.0;
+            for (int row = 0; row < ROWS; ++row) {
+                total += std::get<double>(sheet.GetCell({row, 1})->GetValue());
+            }
+            return total;
+        };
+
+        double total = 0.0;
+        {
+            LOG_DURATION_STREAM(std::to_string(ROWS) + " running totals, " + mode, out);
+            total += evaluate_all();
+        }
+        {
+            LOG_DURATION_STREAM("edit A1 and re-evaluate, " + mode, out);
+            sheet.SetCell({0, 0}, "1");
+            total += evaluate_all();
+        }
+        out << "  checksum: " << total << std::endl;
+    }
+
+    // Соединение со справочником: каждая формула ищет свой ключ в столбце
+    // ключей точно (VLOOKUP) и приблизительно (MATCH). Без индекса каждый
+    // поиск читает столбец целиком.
+    void BenchLookups(std::ostream& out, bool enabled) {
+        constexpr int ROWS = 4096;
+        constexpr int LOOKUPS = 4096;
+        const std::string mode = enabled ? "lookup indexes" : "cell scan";
+
+        Sheet sheet;
+        sheet.SetColumnIndexesEnabled(enabled);
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < ROWS; ++row) {
+            // Ключи различны и идут вразброс: 2 * (row * 1531 mod ROWS).
+            cells.emplace_back(Position{row, 0}, std::to_string(2 * (row * 1531 % ROWS)));
+            cells.emplace_back(Position{row, 1}, std::to_string(row));
+        }
+        const std::string table = "A1:" + Position{ROWS - 1, 1}.ToString();
+        for (int i = 0; i < LOOKUPS; ++i) {
+            const std::string key = std::to_string(i * 7 % (2 * ROWS));
+            cells.emplace_back(Position{i, 3}, "=VLOOKUP(" + key + "," + table + ",2,0)");
+            cells.emplace_back(Position{i, 4}, "=MATCH(" + key + ",A1:"
+                                                       + Position{ROWS - 1, 0}.ToString()
+                                                       + ",-1)");
+        }
+        sheet.SetCells(std::move(cells));
+
+        double total = 0.0;
+        {
+            LOG_DURATION_STREAM(std::to_string(2 * LOOKUPS) + " lookups in "
+                                + std::to_string(ROWS) + " rows, " + mode,
+                                out);
+            for (int i = 0; i < LOOKUPS; ++i) {
+                for (int col : {3, 4}) {
+                    const auto value = sheet.GetCell({i, col})->GetValue();
+                    if (const double* number = std::get_if<double>(&value)) {
+                        total += *number;
+                    }
+                }
+            }
+        }
+        out << "  checksum: " << total << std::endl;
+    }
+
+    void BenchCriteria(std::ostream& out, bool enabled) {
+        constexpr int ROWS = Position::MAX_ROWS;
+        // Без индексов каждая формула читает столбец по ячейкам: формул меньше.
+        const int formulas = enabled ? 10000 : 500;
+        const std::string mode = enabled ? "column indexes" : "cell scan";
+
+        Sheet sheet;
+        sheet.SetColumnIndexesEnabled(enabled);
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < ROWS; ++row) {
+            cells.emplace_back(Position{row, 0}, std::to_string(row * 7919 % 1000));
+            cells.emplace_back(Position{row, 1}, std::to_string(row % 100));
+        }
+        const std::string keys = "A1:" + Position{ROWS - 1, 0}.ToString();
+        const std::string values = "B1:" + Position{ROWS - 1, 1}.ToString();
+        for (int i = 0; i < formulas; ++i) {
+            const std::string key = std::to_string(i % 1000);
+            cells.emplace_back(Position{i, 3}, i % 2 == 0
+                                                   ? "=SUMIF(" + keys + ",\"" + key + "\","
+                                                             + values + ")"
+                                                   : "=COUNTIF(" + keys + ",\">" + key + "\")");
+        }
+        sheet.SetCells(std::move(cells));
+
+        double total = 0.0;
+        {
+            LOG_DURATION_STREAM(std::to_string(formulas) + " criteria formulas over "
+                                + std::to_string(ROWS) + " rows, " + mode,
+                                out);
+            for (int i = 0; i < formulas; ++i) {
+                const auto value = sheet.GetCell({i, 3})->GetValue();
+                if (const double* number = std::get_if<double>(&value)) {
+                    total += *number;
+                }
+            }
+        }
+        out << "  checksum: " << total << std::endl;
+    }
+
+    // Формулы ссылаются на общую ячейку только в ветви, которая не
+    // выбирается. С IF её правка не сбрасывает ни одного значения; с той же
+    // логикой на арифметике сравнений пересчитываются все формулы.
+    void BenchConditionalDependencies(std::ostream& out, bool conditional) {
+        constexpr int FORMULAS = 10000;
+        constexpr int EDITS = 100;
+        const std::string mode = conditional ? "IF" : "arithmetic";
+
+        Sheet sheet;
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.emplace_back(Position{0, 2}, "1");
+        for (int i = 0; i < FORMULAS; ++i) {
+            const std::string row = std::to_string(i + 1);
+            cells.emplace_back(Position{i, 0}, "1");
+            cells.emplace_back(Position{i, 1}, std::to_string(i % 100));
+            cells.emplace_back(Position{i, 3},
+                               conditional ? "=IF(A" + row + ">0,B" + row + "*2,C1*3)"
+                                           : "=(A" + row + ">0)*B" + row + "*2+(A" + row
+                                                     + "<=0)*C1*3");
+        }
+        sheet.SetCells(std::move(cells));
+
+        auto read_all = [&] {
+            double total = 0.0;
+            for (int i = 0; i < FORMULAS; ++i) {
+                const auto value = sheet.GetCell({i, 3})->GetValue();
+                if (const double* number = std::get_if<double>(&value)) {
+                    total += *number;
+                }
+            }
+            return total;
+        };
+        read_all();
+
+        double total = 0.0;
+        {
+            LOG_DURATION_STREAM(std::to_string(EDITS) + " edits of a cell in untaken branches of "
+                                + std::to_string(FORMULAS) + " formulas, " + mode,
+                                out);
+            for (int edit = 0; edit < EDITS; ++edit) {
+                sheet.SetCell({0, 2}, std::to_string(edit + 2));
+                total += read_all();
+            }
+        }
+        out << "  checksum: " << total << std::endl;
+    }
+
+    // Общий множитель формул — имя-константа или ячейка. Значение константы
+    // хранится в самих формулах: у общей ячейки нет тысяч зависимых,
+    // формулы вычисляются пачкой, а смена значения меняет его на месте
+    // только в формулах, использующих имя.
+    void BenchNamedConstant(std::ostream& out, bool named) {
+        constexpr int FORMULAS = 10000;
+        constexpr int EDITS = 100;
+        const std::string mode = named ? "name" : "cell";
+        const std::string factor = named ? "TaxRate" : "C1";
+
+        Sheet sheet;
+        sheet.DefineName("TaxRate", 1.0);
+        sheet.SetCell({0, 2}, "1");
+        double total = 0.0;
+        {
+            LOG_DURATION_STREAM("load and evaluate " + std::to_string(FORMULAS)
+                                + " formulas with a shared factor, " + mode,
+                                out);
+            std::vector<std::pair<Position, std::string>> cells;
+            for (int i = 0; i < FORMULAS; ++i) {
+                const std::string row = std::to_string(i + 1);
+                cells.emplace_back(Position{i, 0}, std::to_string(i % 100));
+                cells.emplace_back(Position{i, 1}, "=A" + row + "*" + factor);
+            }
+            sheet.SetCells(std::move(cells));
+            sheet.Recalculate();
+        }
+
+        auto read_all = [&] {
+            double sum = 0.0;
+            for (int i = 0; i < FORMULAS; ++i) {
+                const auto value = sheet.GetCell({i, 1})->GetValue();
+                if (const double* number = std::get_if<double>(&value)) {
+                    sum += *number;
+                }
+            }
+            return sum;
+        };
+        {
+            LOG_DURATION_STREAM(std::to_string(EDITS) + " changes of the shared factor of "
+                                + std::to_string(FORMULAS) + " formulas, " + mode,
+                                out);
+            for (int edit = 0; edit < EDITS; ++edit) {
+                if (named) {
+                    sheet.DefineName("TaxRate", edit + 2.0);
+                } else {
+                    sheet.SetCell({0, 2}, std::to_string(edit + 2));
+                }
+                total += read_all();
+            }
+        }
+        out << "  checksum: " << total << std::endl;
+    }
+
+    // Книга из 50 листов: лист исходных данных и листы расчёта, каждый из
+    // которых читает исходные данные отдельными ссылками и областями. После
+    // изменения исходных данных листы расчёта друг от друга не зависят и
+    // вычисляются одновременно.
+    void BenchWorkbookRecalculation(std::ostream& out) {
+        constexpr int SHEETS = 50;
+        constexpr int ROWS = 2000;
+        constexpr int EDITS = 5;
+
+        Workbook book;
+        Sheet& inputs = book.AddSheet("Inputs");
+        std::vector<Sheet*> sheets;
+        {
+            LOG_DURATION_STREAM("load a workbook of " + std::to_string(SHEETS) + " sheets, "
+                                + std::to_string((SHEETS - 1) * ROWS * 3) + " formulas",
+                                out);
+            for (int row = 0; row < ROWS; ++row) {
+                inputs.SetCell({row, 0}, std::to_string(row % 97));
+            }
+            for (int s = 1; s < SHEETS; ++s) {
+                Sheet& sheet = book.AddSheet("Model" + std::to_string(s));
+                std::vector<std::pair<Position, std::string>> cells;
+                for (int row = 0; row < ROWS; ++row) {
+                    const std::string r = std::to_string(row + 1);
+                    cells.emplace_back(Position{row, 0}, std::to_string(s));
+                    cells.emplace_back(Position{row, 1}, "=Inputs!A" + r + "*A" + r);
+                    cells.emplace_back(Position{row, 2}, "=B" + r + "+SUM(Inputs!A1:A" + r + ")");
+                    cells.emplace_back(Position{row, 3}, "=C" + r + "/(1+A" + r + ")");
+                }
+                sheet.SetCells(std::move(cells));
+                sheets.push_back(&sheet);
+            }
+        }
+
+        std::vector<size_t> thread_counts = {1};
+        if (const size_t cores = std::thread::hardware_concurrency(); cores > 1) {
+            thread_counts.push_back(cores);
+        }
+        for (size_t threads : thread_counts) {
+            double total = 0.0;
+            {
+                LOG_DURATION_STREAM(std::to_string(EDITS) + " input changes and recalculations, "
+                                    + std::to_string(threads) + " threads",
+                                    out);
+                for (int edit = 0; edit < EDITS; ++edit) {
+                    inputs.SetCell({0, 0}, std::to_string(edit + 100));
+                    book.Recalculate(threads);
+                    for (const Sheet* sheet : sheets) {
+                        const auto value = sheet->GetCell({ROWS - 1, 3})->GetValue();
+                        if (const double* number = std::get_if<double>(&value)) {
+                            total += *number;
+                        }
+                    }
+                }
+            }
+            out << "  checksum: " << total << std::endl;
+        }
+    }
+
+    // Лист моделирования: миллион формул, из которых 1% вызывает RAND(), и
+    // ещё 1% читает соседнюю изменчивую ячейку. Шаг времени вычисляет заново
+    // только эти 2%; для сравнения — тот же сброс и обход всего листа через
+    // Recalculate.
+    void BenchVolatileTick(std::ostream& out) {
+        constexpr int ROWS = Position::MAX_ROWS;
+        constexpr int COLUMNS = 62;
+        constexpr int TICKS = 10;
+
+        auto is_volatile = [](int row, int col) {
+            return col > 0 && (row * COLUMNS + col) % 100 == 0;
+        };
+
+        Sheet sheet;
+        size_t formulas = 0;
+        {
+            std::vector<std::pair<Position, std::string>> cells;
+            cells.reserve(static_cast<size_t>(ROWS) * COLUMNS);
+            for (int row = 0; row < ROWS; ++row) {
+                const std::string r = std::to_string(row + 1);
+                cells.emplace_back(Position{row, 0}, std::to_string(row % 89));
+                for (int col = 1; col < COLUMNS; ++col) {
+                    const std::string c = std::to_string(col);
+                    if (is_volatile(row, col)) {
+                        cells.emplace_back(Position{row, col}, "=RAND()*" + c);
+                    } else if (is_volatile(row, col - 1)) {
+                        cells.emplace_back(Position{row, col},
+                                           "=" + Position{row, col - 1}.ToString() + "*2");
+                    } else {
+                        cells.emplace_back(Position{row, col}, "=A" + r + "*" + c + "+1");
+                    }
+                }
+            }
+            formulas = cells.size() - ROWS;
+            LOG_DURATION_STREAM("load and evaluate " + std::to_string(formulas) + " formulas",
+                                out);
+            sheet.SetCells(std::move(cells));
+            sheet.Recalculate();
+        }
+        out << "  volatile formulas: " << sheet.GetVolatileCount() << std::endl;
+
+        auto checksum = [&] {
+            double sum = 0.0;
+            for (int row = 0; row < ROWS; row += 97) {
+                for (int col = 1; col < COLUMNS; ++col) {
+                    const auto value = sheet.GetCell({row, col})->GetValue();
+                    if (const double* number = std::get_if<double>(&value)) {
+                        sum += *number;
+                    }
+                }
+            }
+            return sum;
+        };
+
+        size_t recalculated = 0;
+        {
+            LOG_DURATION_STREAM(std::to_string(TICKS) + " ticks, targeted", out);
+            for (int tick = 0; tick < TICKS; ++tick) {
+                recalculated += sheet.Tick();
+            }
+        }
+        out << "  formulas per tick: " << recalculated / TICKS << " of " << formulas
+            << ", checksum > 0: " << (checksum() > 0) << std::endl;
+
+        {
+            LOG_DURATION_STREAM(std::to_string(TICKS) + " ticks, whole-sheet Recalculate", out);
+            for (int tick = 0; tick < TICKS; ++tick) {
+                std::unordered_set<Cell*> dirty;
+                sheet.InvalidateVolatile(dirty);
+                sheet.Recalculate();
+            }
+        }
+        out << "  checksum > 0: " << (checksum() > 0) << std::endl;
+    }
+
+    void BenchBulkLoad(std::ostream& out) {
+        constexpr int ROWS = Position::MAX_ROWS;
+        constexpr int COLUMNS = 8;
+
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.reserve(ROWS * COLUMNS);
+        for (int col = 0; col < COLUMNS; ++col) {
+            for (int row = 0; row < ROWS; ++row) {
+                auto ref = [&](int offset) { return Position{row, 20 + offset}.ToString(); };
+                cells.emplace_back(Position{row, col},
+                                   "=" + ref(col % 3) + "*" + std::to_string(col + 2) + "+("
+                                   + ref(3) + "-" + ref(4) + ")/" + std::to_string(row + 1));
+            }
+        }
+        const std::string count = std::to_string(cells.size());
+
+        ClearFormulaCache();
+        {
+            auto sheet = CreateSheet();
+            LOG_DURATION_STREAM("load " + count + " formulas via SetCell", out);
+            for (const auto& [pos, text] : cells) {
+                sheet->SetCell(pos, text);
+            }
+        }
+
+        const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+            ClearFormulaCache();
+            auto sheet = CreateSheet();
+            auto copy = cells;
+            LOG_DURATION_STREAM("load " + count + " formulas via SetCells, "
+                                + std::to_string(threads) + " threads", out);
+            sheet->SetCells(std::move(copy), threads);
+        }
+    }
+
+    // Столбец произведений на весь лист: формула-массив в одной ячейке
+    // против формулы в каждой строке. Формула-массив читает столбцы входов
+    // целиком и вычисляет их векторно, зато правка одного входа вычисляет
+    // заново весь массив и сбрасывает все разлитые ячейки.
+    void BenchArrayFormula(std::ostream& out) {
+        constexpr int ROWS = Position::MAX_ROWS;
+        constexpr int EDITS = 20;
+
+        for (bool array : {false, true}) {
+            Sheet sheet;
+            std::vector<std::pair<Position, std::string>> cells;
+            cells.reserve(static_cast<size_t>(ROWS) * 3);
+            for (int row = 0; row < ROWS; ++row) {
+                cells.emplace_back(Position{row, 0}, std::to_string(row % 97));
+                cells.emplace_back(Position{row, 1}, std::to_string(row % 13 + 1));
+                if (!array) {
+                    const std::string r = std::to_string(row + 1);
+                    cells.emplace_back(Position{row, 2}, "=A" + r + "*B" + r + "+1");
+                }
+            }
+            if (array) {
+                cells.emplace_back(Position{0, 2}, "=A1:A" + std::to_string(ROWS) + "*B1:B"
+                                                           + std::to_string(ROWS) + "+1");
+            }
+            const std::string kind = array ? "one array formula" : "per-cell formulas";
+
+            double total = 0.0;
+            auto sum_column = [&] {
+                for (int row = 0; row < ROWS; ++row) {
+                    const auto value = sheet.GetCell({row, 2})->GetValue();
+                    if (const double* number = std::get_if<double>(&value)) {
+                        total += *number;
+                    }
+                }
+            };
+            {
+                LOG_DURATION_STREAM("load and evaluate " + std::to_string(ROWS) + " rows, " + kind,
+                                    out);
+                sheet.SetCells(std::move(cells));
+                sum_column();
+            }
+            {
+                LOG_DURATION_STREAM(std::to_string(EDITS) + " input changes and column reads, "
+                                    + kind,
+                                    out);
+                for (int edit = 0; edit < EDITS; ++edit) {
+                    sheet.SetCell({edit, 0}, std::to_string(edit + 100));
+                    sum_column();
+                }
+            }
+            out << "  checksum: " << total << std::endl;
+        }
+    }
+
+} // namespace
+
+void RunBenchmarks(std::ostream& out) {
+    const size_t cache_capacity = GetFormulaCacheStats().capacity;
+
+    BenchFormulaRewrites(out, 0);
+    BenchFormulaRewrites(out, cache_capacity);
+    BenchColumnBatchEvaluation(out);
+    BenchBatchKernel(out);
+    BenchRangeAggregates(out);
+    BenchTextCellReads(out);
+    BenchPositionCodec(out);
+    BenchFormulaParsing(out);
+    BenchParseAllocations(out);
+    BenchTrivialFormulaParsing(out);
+    BenchExpressionRoundTrip(out);
+    BenchParserWarmUp(out);
+    BenchFormulaValidation(out);
+    BenchBulkLoad(out);
+    BenchRangeDependencies(out);
+    BenchColumnIndexes(out, false);
+    BenchColumnIndexes(out, true);
+    BenchLookups(out, false);
+    BenchLookups(out, true);
+    BenchCriteria(out, false);
+    BenchCriteria(out, true);
+    BenchConditionalDependencies(out, false);
+    BenchConditionalDependencies(out, true);
+    BenchNamedConstant(out, false);
+    BenchNamedConstant(out, true);
+    BenchWorkbookRecalculation(out);
+    BenchVolatileTick(out);
+    BenchArrayFormula(out);
+
+    SetFormulaCacheCapacity(cache_capacity);
+    ClearFormulaCache();
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <iosfwd>
+
+// Нагрузочные замеры. Запускаются командой `spreadsheet --bench`, результаты
+// печатаются в переданный поток.
+void RunBenchmarks(std::ostream& out);
@@ -1,5 +1,11 @@
 #include "cell.h"
+#include "nan_box.h"
 #include "sheet.h"
+#include "workbook.h"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
 
 class Cell::Impl {
 public:
@@ -8,6 +14,16 @@ public:
     [[nodiscard]] virtual Value GetValue(const Sheet& sheet) const = 0;
     [[nodiscard]] virtual std::string GetText() const = 0;
     [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const { return {}; }
+    [[nodiscard]] virtual std::vector<Range> GetReferencedRanges() const { return {}; }
+    [[nodiscard]] virtual std::vector<Position> GetConditionalCells() const { return {}; }
+    [[nodiscard]] virtual std::vector<SheetRange> GetSheetReferences() const { return {}; }
+    [[nodiscard]] virtual const FormulaInterface* GetFormula() const { return nullptr; }
+    [[nodiscard]] virtual NumericValue GetNumericValue() const { return 0.0; }
+    [[nodiscard]] virtual bool IsEmpty() const { return false; }
+    [[nodiscard]] virtual std::optional<Size> GetArraySize() const { return std::nullopt; }
+    [[nodiscard]] virtual const Cell* GetSpillAnchor() const { return nullptr; }
+    // См. FormulaInterface::SetNameValue.
+    virtual bool SetNameValue(std::string_view name, double value) { return false; }
 };
 
 class Cell::EmptyImpl : public Impl {
@@ -19,37 +35,63 @@ public:
     [[nodiscard]] std::string GetText() const override {
         return {};
     }
+
+    [[nodiscard]] bool IsEmpty() const override {
+        return true;
+    }
 };
 
 class Cell::TextImpl : public Impl {
 public:
     explicit TextImpl(std::string text)
-            : text_(std::move(text)) {}
+            : text_(std::move(text))
+            , number_(Classify(GetVisibleText())) {}
 
     [[nodiscard]] Value GetValue(const Sheet&) const override {
-        if (!text_.empty() && text_[0] == ESCAPE_SIGN) {
-            return text_.substr(1);
-        }
-        return text_;
+        return std::string(GetVisibleText());
     }
 
     [[nodiscard]] std::string GetText() const override {
         return text_;
     }
+
+    [[nodiscard]] NumericValue GetNumericValue() const override {
+        return number_;
+    }
+
 private:
+    [[nodiscard]] std::string_view GetVisibleText() const {
+        std::string_view text = text_;
+        if (!text.empty() && text[0] == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        return text;
+    }
+
+    static NumericValue Classify(std::string_view text) {
+        if (text.empty()) {
+            return 0.0;
+        }
+        if (auto number = ParseNumberText(text)) {
+            return *number;
+        }
+        return FormulaError(FormulaError::Category::Value);
+    }
+
     std::string text_;
+    NumericValue number_;
 };
 
 class Cell::FormulaImpl : public Impl {
 public:
-    FormulaImpl(std::string expression,
-                std::unique_ptr<FormulaInterface> formula)
-            : expr_(std::move(expression))
-            , formula_(std::move(formula)) {}
+    explicit FormulaImpl(std::unique_ptr<FormulaInterface> formula)
+            : formula_(std::move(formula)) {}
 
     [[nodiscard]] Value GetValue(const Sheet& sheet) const override {
-        FormulaInterface::Value v = formula_->Evaluate(sheet);
+        return ToValue(formula_->Evaluate(sheet));
+    }
 
+    static Value ToValue(const FormulaInterface::Value& v) {
         if (auto* err = std::get_if<FormulaError>(&v)) {
             return *err;
         }
@@ -64,13 +106,119 @@ public:
         return formula_->GetReferencedCells();
     }
 
+    [[nodiscard]] std::vector<Range> GetReferencedRanges() const override {
+        return formula_->GetReferencedRanges();
+    }
+
+    [[nodiscard]] std::vector<Position> GetConditionalCells() const override {
+        return formula_->GetConditionalCells();
+    }
+
+    [[nodiscard]] std::vector<SheetRange> GetSheetReferences() const override {
+        return formula_->GetSheetReferences();
+    }
+
+    [[nodiscard]] const FormulaInterface* GetFormula() const override {
+        return formula_.get();
+    }
+
+    bool SetNameValue(std::string_view name, double value) override {
+        return formula_->SetNameValue(name, value);
+    }
+
 private:
-    std::string expr_;
     std::unique_ptr<FormulaInterface> formula_;
 };
 
-Cell::Cell(Sheet& sheet)
+// Формула-массив. Все её элементы вычисляются вместе, когда сброшено
+// значение ячейки, и хранятся здесь; значение самой ячейки — первый элемент
+// или #SPILL!, если значения не удалось разлить. Ссылки из ветвей IF и
+// IFERROR читаются для каждого столбца, поэтому условных ссылок у неё нет.
+class Cell::ArrayFormulaImpl : public FormulaImpl {
+public:
+    ArrayFormulaImpl(std::unique_ptr<FormulaInterface> formula, Size size)
+            : FormulaImpl(std::move(formula))
+            , size_(size) {}
+
+    [[nodiscard]] Value GetValue(const Sheet& sheet) const override {
+        if (blocked_) {
+            return FormulaError(FormulaError::Category::Spill);
+        }
+        array_ = GetFormula()->EvaluateArray(sheet);
+        return GetElement(0, 0);
+    }
+
+    [[nodiscard]] std::vector<Position> GetConditionalCells() const override {
+        return {};
+    }
+
+    [[nodiscard]] std::optional<Size> GetArraySize() const override {
+        return size_;
+    }
+
+    // Значения формулы-массива лист разливает заново, см. Cell::BindNames.
+    bool SetNameValue(std::string_view, double) override {
+        return false;
+    }
+
+    [[nodiscard]] Value GetElement(int row, int col) const {
+        const size_t index = static_cast<size_t>(col) * size_.rows + row;
+        return ToValue(NanBox::ToValue(array_.values[index]));
+    }
+
+    [[nodiscard]] bool IsBlocked() const {
+        return blocked_;
+    }
+
+    void SetBlocked(bool blocked) {
+        blocked_ = blocked;
+    }
+
+private:
+    Size size_;
+    // Пока лист не разольёт значения, формула заблокирована.
+    bool blocked_ = true;
+    mutable FormulaArray array_;
+};
+
+// Ячейка, на которую разлито значение формулы-массива: своего содержимого
+// у неё нет, значение — элемент массива.
+class Cell::SpillImpl : public Impl {
+public:
+    SpillImpl(const Cell& anchor, int row, int col)
+            : anchor_(anchor)
+            , row_(row)
+            , col_(col) {}
+
+    [[nodiscard]] Value GetValue(const Sheet&) const override {
+        return anchor_.GetArrayElement(row_, col_);
+    }
+
+    [[nodiscard]] std::string GetText() const override {
+        return {};
+    }
+
+    [[nodiscard]] NumericValue GetNumericValue() const override {
+        const Value value = anchor_.GetArrayElement(row_, col_);
+        if (const auto* error = std::get_if<FormulaError>(&value)) {
+            return *error;
+        }
+        return std::get<double>(value);
+    }
+
+    [[nodiscard]] const Cell* GetSpillAnchor() const override {
+        return &anchor_;
+    }
+
+private:
+    const Cell& anchor_;
+    int row_;
+    int col_;
+};
+
+Cell::Cell(Sheet& sheet, Position pos)
         : sheet_(sheet)
+        , pos_(pos)
         , impl_(std::make_unique<EmptyImpl>()) {}
 
 Cell::~Cell() = default;
@@ -79,11 +227,30 @@ Cell::Value Cell::GetValue() const {
     if (cache_) {
         return *cache_;
     }
-    Value v = impl_->GetValue(sheet_);
+    Value v = conditional_.empty() ? impl_->GetValue(sheet_)
+                                   : EvaluateConditional(*impl_->GetFormula());
     cache_ = v;
     return v;
 }
 
+// Прочитанные в ветвях ячейки получают обратное ребро до следующего
+// вычисления, непрочитанные теряют его: их изменение это значение не сбросит.
+Cell::Value Cell::EvaluateConditional(const FormulaInterface& formula) const {
+    std::vector<Position> reads;
+    Value v = FormulaImpl::ToValue(formula.EvaluateTracked(sheet_, reads));
+    std::sort(reads.begin(), reads.end());
+
+    auto* self = const_cast<Cell*>(this);
+    for (Cell* target : conditional_) {
+        if (std::binary_search(reads.begin(), reads.end(), target->pos_)) {
+            target->dependents_.insert(self);
+        } else {
+            target->dependents_.erase(self);
+        }
+    }
+    return v;
+}
+
 std::string Cell::GetText() const {
     return impl_->GetText();
 }
@@ -98,21 +265,75 @@ void Cell::Set(std::string text) {
     if (text.empty()) {
         new_impl = std::make_unique<EmptyImpl>();
     } else if (text.size() > 1 && text[0] == FORMULA_SIGN) {
-        const std::string expr = text.substr(1);
-        auto formula = ParseFormula(expr);
-        new_impl = std::make_unique<FormulaImpl>(expr, std::move(formula));
+        // Разбор без исключений: ошибка превращается в FormulaException
+        // только здесь, один раз.
+        auto parsed = TryParseFormula(text.substr(1));
+        if (auto* diagnostic = std::get_if<FormulaDiagnostic>(&parsed)) {
+            throw FormulaException(diagnostic->ToString());
+        }
+        new_impl = MakeFormulaImpl(BindFormulaNames(
+                std::move(std::get<std::unique_ptr<FormulaInterface>>(parsed))));
     } else {
         new_impl = std::make_unique<TextImpl>(std::move(text));
     }
 
+    Apply(std::move(new_impl));
+}
+
+void Cell::SetFormula(std::unique_ptr<FormulaInterface> formula) {
+    Apply(MakeFormulaImpl(BindFormulaNames(std::move(formula))));
+}
+
+std::unique_ptr<Cell::Impl> Cell::MakeFormulaImpl(std::unique_ptr<FormulaInterface> formula) {
+    if (const auto size = formula->GetArraySize()) {
+        return std::make_unique<ArrayFormulaImpl>(std::move(formula), *size);
+    }
+    return std::make_unique<FormulaImpl>(std::move(formula));
+}
+
+bool Cell::SetNameValue(std::string_view name, double value) {
+    return impl_->SetNameValue(name, value);
+}
+
+void Cell::BindNames() {
+    const FormulaInterface* formula = impl_->GetFormula();
+    assert(formula);
+    auto bound = MakeFormulaImpl(formula->BindNames(sheet_.GetNameResolver()));
+
+    // Ссылки те же, например имя-число удалено: ни цикла, ни новых рёбер
+    // быть не может, достаточно сбросить значения. Формулу-массив лист
+    // разливает заново.
+    if (!bound->GetArraySize() && !impl_->GetArraySize()
+        && bound->GetReferencedCells() == impl_->GetReferencedCells()
+        && bound->GetConditionalCells() == impl_->GetConditionalCells()
+        && bound->GetReferencedRanges() == impl_->GetReferencedRanges()) {
+        impl_ = std::move(bound);
+        InvalidateCache();
+        return;
+    }
+    Apply(std::move(bound));
+}
+
+std::unique_ptr<FormulaInterface> Cell::BindFormulaNames(
+        std::unique_ptr<FormulaInterface> formula) const {
+    if (formula->GetNames().empty()) {
+        return formula;
+    }
+    return formula->BindNames(sheet_.GetNameResolver());
+}
+
+void Cell::Apply(std::unique_ptr<Impl> new_impl) {
     if (HasCircularReferences(*new_impl)) {
         throw CircularDependencyException("Circular References");
     }
 
-    impl_ = std::move(new_impl);
+    const auto old_area = GetSpillArea();
+    const auto old_impl = std::exchange(impl_, std::move(new_impl));
     cache_.reset();
 
-    UpdateReferences();
+    UpdateReferences(*old_impl);
+    sheet_.UpdateColumnIndexes(pos_, *this);
+    sheet_.UpdateSpills(pos_, *this, old_area);
     InvalidateCache();
 }
 
@@ -120,6 +341,22 @@ void Cell::Clear() {
     Set("");
 }
 
+Cell::NumericValue Cell::GetNumericValue() const {
+    if (!impl_->GetFormula()) {
+        return impl_->GetNumericValue();
+    }
+
+    Value value = GetValue();
+    if (auto* err = std::get_if<FormulaError>(&value)) {
+        return *err;
+    }
+    return std::get<double>(value);
+}
+
+bool Cell::IsEmpty() const {
+    return impl_->IsEmpty();
+}
+
 std::vector<Position> Cell::GetReferencedCells() const {
     if (impl_ == nullptr) {
         return {};
@@ -129,66 +366,258 @@ std::vector<Position> Cell::GetReferencedCells() const {
 }
 
 bool Cell::IsReferenced() const {
-    return !referenced_.empty();
+    return !dependents_.empty() || !conditional_dependents_.empty();
+}
+
+bool Cell::HasConditionalReferences() const {
+    return !conditional_.empty();
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    return impl_->GetFormula();
+}
+
+bool Cell::HasCachedValue() const {
+    return cache_.has_value();
+}
+
+void Cell::SetCachedValue(Value value) const {
+    cache_ = std::move(value);
+}
+
+std::optional<Range> Cell::GetSpillArea() const {
+    return GetSpillArea(*impl_);
+}
+
+std::optional<Range> Cell::GetSpillArea(const Impl& impl) const {
+    const auto size = impl.GetArraySize();
+    if (!size) {
+        return std::nullopt;
+    }
+    const Position last{std::min(pos_.row + size->rows, int{Position::MAX_ROWS}) - 1,
+                        std::min(pos_.col + size->cols, int{Position::MAX_COLS}) - 1};
+    return Range{pos_, last};
+}
+
+bool Cell::IsSpillBlocked() const {
+    assert(impl_->GetArraySize());
+    return static_cast<const ArrayFormulaImpl&>(*impl_).IsBlocked();
+}
+
+void Cell::SetSpillBlocked(bool blocked) {
+    assert(impl_->GetArraySize());
+    auto& impl = static_cast<ArrayFormulaImpl&>(*impl_);
+    if (impl.IsBlocked() != blocked) {
+        impl.SetBlocked(blocked);
+        InvalidateCache();
+    }
+}
+
+Cell::Value Cell::GetArrayElement(int row, int col) const {
+    assert(!IsSpillBlocked());
+    // Элементы вычисляются вместе со значением ячейки.
+    GetValue();
+    return static_cast<const ArrayFormulaImpl&>(*impl_).GetElement(row, col);
+}
+
+const Cell* Cell::GetSpillAnchor() const {
+    return impl_->GetSpillAnchor();
+}
+
+void Cell::SetSpill(Cell* anchor, int row, int col) {
+    assert(impl_->IsEmpty() && referenced_.empty());
+    impl_ = std::make_unique<SpillImpl>(*anchor, row, col);
+    referenced_.insert(anchor);
+    anchor->dependents_.insert(this);
+    sheet_.UpdateColumnIndexes(pos_, *this);
+    InvalidateCache();
+}
+
+void Cell::ClearSpill() {
+    assert(GetSpillAnchor());
+    for (Cell* ref_cell : referenced_) {
+        ref_cell->dependents_.erase(this);
+    }
+    referenced_.clear();
+    impl_ = std::make_unique<EmptyImpl>();
+    sheet_.UpdateColumnIndexes(pos_, *this);
+    InvalidateCache();
+}
+
+void Cell::RelinkSheets() {
+    Workbook* workbook = sheet_.GetWorkbook();
+    assert(workbook);
+    workbook->UnlinkSheetReferences(this);
+    workbook->LinkSheetReferences(sheet_, this, impl_->GetSheetReferences());
+    InvalidateCache();
 }
 
-void Cell::UpdateReferences() {
+void Cell::UpdateReferences(const Impl& old_impl) {
+    Workbook* workbook = sheet_.GetWorkbook();
+    if (workbook) {
+        workbook->UnlinkSheetReferences(this);
+    }
     for (Cell* ref_cell : referenced_) {
         if (ref_cell) {
             ref_cell->dependents_.erase(this);
         }
     }
+    for (Cell* ref_cell : conditional_) {
+        ref_cell->dependents_.erase(this);
+        auto& back = ref_cell->conditional_dependents_;
+        back.erase(std::find(back.begin(), back.end(), this));
+    }
+    for (const Range& range : old_impl.GetReferencedRanges()) {
+        sheet_.RemoveRangeDependent(range, this);
+    }
+    if (const FormulaInterface* formula = old_impl.GetFormula()) {
+        for (const auto& name : formula->GetNames()) {
+            sheet_.RemoveNameUser(name, this);
+        }
+        if (formula->IsVolatile()) {
+            sheet_.RemoveVolatile(this);
+        }
+    }
 
     referenced_.clear();
+    conditional_.clear();
 
     const auto new_refs = impl_->GetReferencedCells();
+    const auto conditional_refs = impl_->GetConditionalCells();
     for (const auto& pos : new_refs) {
         Cell* ref_cell = sheet_.GetOrCreateCell(pos);
         if (!ref_cell || ref_cell == this) {
             continue;
         }
+        // Ребро к ячейке из ветви появится, только когда её прочитают.
+        if (std::binary_search(conditional_refs.begin(), conditional_refs.end(), pos)) {
+            conditional_.push_back(ref_cell);
+            ref_cell->conditional_dependents_.push_back(this);
+            continue;
+        }
         referenced_.insert(ref_cell);
         ref_cell->dependents_.insert(this);
     }
+    for (const Range& range : impl_->GetReferencedRanges()) {
+        sheet_.AddRangeDependent(range, this);
+    }
+    if (const FormulaInterface* formula = impl_->GetFormula()) {
+        for (const auto& name : formula->GetNames()) {
+            sheet_.AddNameUser(name, this);
+        }
+        if (formula->IsVolatile()) {
+            sheet_.AddVolatile(this);
+        }
+    }
+    // Ссылки на другие листы ведёт книга: у отдельного листа их не бывает.
+    if (workbook && impl_->GetFormula()) {
+        workbook->LinkSheetReferences(sheet_, this, impl_->GetSheetReferences());
+    }
 }
 
+// Цикл возникает, если новое значение ссылается на саму ячейку или на одну
+// из ячеек, которые от неё зависят. Зависимые ячейки обходятся от этой по
+// обратным рёбрам: по отдельным ссылкам и по индексу областей листа, так что
+// ячейки областей перебирать не нужно. Ссылки из ветвей IF и IFERROR
+// учитываются все, даже из ветвей, которые сейчас не вычисляются: иначе
+// цикл появлялся бы и исчезал вместе со значением условия. По той же
+// причине вся область формулы-массива зависит от неё, даже если значения
+// не разлиты: область могут освободить позже. В книге обход переходит на
+// другие листы по их индексам областей.
 bool Cell::HasCircularReferences(Cell::Impl &impl) {
     const auto new_refs = impl.GetReferencedCells();
-    if (new_refs.empty()) {
+    const auto new_ranges = impl.GetReferencedRanges();
+    std::vector<std::pair<const Sheet*, Range>> sheet_ranges;
+    if (const Workbook* workbook = sheet_.GetWorkbook()) {
+        for (const auto& [name, range] : impl.GetSheetReferences()) {
+            if (const Sheet* sheet = workbook->GetSheet(name)) {
+                sheet_ranges.emplace_back(sheet, range);
+            }
+        }
+    }
+    if (new_refs.empty() && new_ranges.empty() && sheet_ranges.empty()) {
         return false;
     }
 
-    for (const auto& pos : new_refs) {
-        Cell* start = sheet_.GetOrCreateCell(pos);
-        if (!start) {
-            continue;
+    auto intersects = [](const Range& lhs, const Range& rhs) {
+        return lhs.first.row <= rhs.last.row && rhs.first.row <= lhs.last.row
+               && lhs.first.col <= rhs.last.col && rhs.first.col <= lhs.last.col;
+    };
+    // Читает ли новое значение ячейки области area листа sheet.
+    auto is_referenced = [&](const Sheet& sheet, const Range& area) {
+        const bool single = area.first == area.last;
+        if (&sheet == &sheet_
+            && ((single && std::binary_search(new_refs.begin(), new_refs.end(), area.first))
+                || (!single && std::any_of(new_refs.begin(), new_refs.end(),
+                                           [&](Position pos) { return area.Contains(pos); }))
+                || std::any_of(new_ranges.begin(), new_ranges.end(),
+                               [&](const Range& range) { return intersects(range, area); }))) {
+            return true;
         }
-        if (start == this) {
+        return std::any_of(sheet_ranges.begin(), sheet_ranges.end(), [&](const auto& ref) {
+            return ref.first == &sheet && intersects(ref.second, area);
+        });
+    };
+
+    std::unordered_set<const Cell*> visited;
+    std::vector<const Cell*> stack{this};
+    std::vector<Cell*> range_dependents;
+
+    // Ячейки области формулы-массива anchor и формулы, которые их читают,
+    // становятся зависимыми от неё.
+    auto visit_area = [&](const Cell& anchor, const Range& area) {
+        if (is_referenced(anchor.sheet_, area)) {
             return true;
         }
+        for (int row = area.first.row; row <= area.last.row; ++row) {
+            for (int col = area.first.col; col <= area.last.col; ++col) {
+                const Position pos{row, col};
+                if (pos == anchor.pos_) {
+                    continue;
+                }
+                if (const CellInterface* cell = anchor.sheet_.GetCell(pos)) {
+                    stack.push_back(static_cast<const Cell*>(cell));
+                }
+                range_dependents.clear();
+                anchor.sheet_.FindRangeDependents(pos, range_dependents);
+                stack.insert(stack.end(), range_dependents.begin(), range_dependents.end());
+            }
+        }
+        return false;
+    };
 
-        std::unordered_set<const Cell*> visited;
-        std::vector<const Cell*> stack;
-        stack.push_back(start);
+    if (const auto area = GetSpillArea(impl); area && visit_area(*this, *area)) {
+        return true;
+    }
 
-        while (!stack.empty()) {
-            const Cell* current = stack.back();
-            stack.pop_back();
+    while (!stack.empty()) {
+        const Cell* current = stack.back();
+        stack.pop_back();
 
-            if (!visited.insert(current).second) {
-                continue;
-            }
+        if (!visited.insert(current).second) {
+            continue;
+        }
 
-            if (current == this) {
-                return true;
-            }
+        if (is_referenced(current->sheet_, Range{current->pos_, current->pos_})) {
+            return true;
+        }
 
-            for (Cell* next : current->referenced_) {
-                if (next) {
-                    stack.push_back(next);
-                }
+        for (Cell* next : current->dependents_) {
+            // Значения, которые сейчас разлиты из этой ячейки, заменит новое.
+            if (next && !(current == this && next->GetSpillAnchor() == this)) {
+                stack.push_back(next);
             }
         }
+        stack.insert(stack.end(), current->conditional_dependents_.begin(),
+                     current->conditional_dependents_.end());
+        range_dependents.clear();
+        current->sheet_.FindRangeDependents(current->pos_, range_dependents);
+        stack.insert(stack.end(), range_dependents.begin(), range_dependents.end());
+
+        if (current != this && current->impl_->GetArraySize() && current->IsSpillBlocked()
+            && visit_area(*current, *current->GetSpillArea())) {
+            return true;
+        }
     }
 
     return false;
@@ -196,18 +625,28 @@ bool Cell::HasCircularReferences(Cell::Impl &impl) {
 
 void Cell::InvalidateCache() {
     std::unordered_set<Cell*> visited;
-    InvalidateCacheImpl(visited);
+    std::vector<Cell*> stack;
+    InvalidateCache(visited, stack);
 }
 
-void Cell::InvalidateCacheImpl(std::unordered_set<Cell*>& visited) {
-    if (!visited.insert(this).second) {
-        return;
-    }
-    cache_.reset();
+// Обход в глубину по явному стеку: зависимые по областям дописываются прямо
+// в него, без вектора на каждую ячейку.
+void Cell::InvalidateCache(std::unordered_set<Cell*>& visited, std::vector<Cell*>& stack) {
+    stack.clear();
+    stack.push_back(this);
+    while (!stack.empty()) {
+        Cell* current = stack.back();
+        stack.pop_back();
+        if (!visited.insert(current).second) {
+            continue;
+        }
+        current->cache_.reset();
 
-    for (Cell* dep : dependents_) {
-        if (dep) {
-            dep->InvalidateCacheImpl(visited);
+        for (Cell* dep : current->dependents_) {
+            if (dep) {
+                stack.push_back(dep);
+            }
         }
+        current->sheet_.FindRangeDependents(current->pos_, stack);
     }
 }
\ No newline at end of file
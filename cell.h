@@ -13,36 +13,103 @@ class Cell : public CellInterface {
 public:
     using Value = CellInterface::Value;
 
-    explicit Cell(Sheet& sheet);
+    Cell(Sheet& sheet, Position pos);
     ~Cell() override;
 
     void Set(std::string text);
+    // Задаёт уже разобранную формулу. Имена в ней связываются со значениями
+    // имён листа.
+    void SetFormula(std::unique_ptr<FormulaInterface> formula);
     void Clear();
+    // Меняет значение имени-числа прямо в формуле, не сбрасывая значений.
+    // false, если формулу надо связать заново через BindNames.
+    bool SetNameValue(std::string_view name, double value);
+    // Связывает имена формулы заново, после того как значение имени
+    // изменилось.
+    void BindNames();
+    // Связывает ссылки формулы на другие листы книги заново, после того как
+    // в книгу добавили лист.
+    void RelinkSheets();
 
     [[nodiscard]] Value GetValue() const override;
     [[nodiscard]] std::string GetText() const override;
     [[nodiscard]] std::vector<Position> GetReferencedCells() const override;
+    [[nodiscard]] NumericValue GetNumericValue() const override;
+    [[nodiscard]] bool IsEmpty() const override;
 
+    // Ссылаются ли на ячейку другие формулы отдельными ссылками, в том числе
+    // в ветвях IF и IFERROR. На ячейку области формула не ссылается: такую
+    // ячейку можно удалять.
     [[nodiscard]] bool IsReferenced() const;
 
+    // Есть ли у формулы ссылки, которые читаются не при каждом вычислении.
+    // Значение такой ячейки вычисляется только через GetValue: оно же
+    // обновляет рёбра к тем ячейкам, которые были прочитаны.
+    [[nodiscard]] bool HasConditionalReferences() const;
+
+    [[nodiscard]] const FormulaInterface* GetFormula() const;
+    [[nodiscard]] bool HasCachedValue() const;
+    void SetCachedValue(Value value) const;
+    // Сбрасывает значение ячейки и формул, которые от неё зависят. Сброшенные
+    // ячейки дописываются в visited, уже записанные там пропускаются. stack —
+    // рабочий вектор обхода, его можно передавать из вызова в вызов.
+    void InvalidateCache(std::unordered_set<Cell*>& visited, std::vector<Cell*>& stack);
+
+    // Формула-массив разливает свои значения на область от ячейки вправо и
+    // вниз, см. Sheet::UpdateSpills. Область в пределах листа; nullopt,
+    // если в ячейке не формула-массив.
+    [[nodiscard]] std::optional<Range> GetSpillArea() const;
+    // Не удалось разлить значения формулы-массива: её значение — #SPILL!.
+    [[nodiscard]] bool IsSpillBlocked() const;
+    void SetSpillBlocked(bool blocked);
+    // Элемент формулы-массива на смещении (row, col) от её ячейки.
+    [[nodiscard]] Value GetArrayElement(int row, int col) const;
+
+    // Формула-массив, значение которой разлито на эту ячейку; nullptr, если
+    // такой нет. У такой ячейки нет своего текста, но она не пуста.
+    [[nodiscard]] const Cell* GetSpillAnchor() const;
+    // Разливает на пустую ячейку элемент (row, col) формулы-массива anchor;
+    // ClearSpill снова делает её пустой.
+    void SetSpill(Cell* anchor, int row, int col);
+    void ClearSpill();
+
 private:
     class Impl;
     class EmptyImpl;
     class TextImpl;
     class FormulaImpl;
+    class ArrayFormulaImpl;
+    class SpillImpl;
+
+    // Формула или формула-массив, если формула — массив.
+    [[nodiscard]] static std::unique_ptr<Impl> MakeFormulaImpl(
+            std::unique_ptr<FormulaInterface> formula);
+    [[nodiscard]] std::optional<Range> GetSpillArea(const Impl& impl) const;
 
+    void Apply(std::unique_ptr<Impl> new_impl);
+    [[nodiscard]] std::unique_ptr<FormulaInterface> BindFormulaNames(
+            std::unique_ptr<FormulaInterface> formula) const;
     [[nodiscard]] bool HasCircularReferences(Impl& impl);
-    void UpdateReferences();
+    void UpdateReferences(const Impl& old_impl);
     void InvalidateCache();
+    [[nodiscard]] Value EvaluateConditional(const FormulaInterface& formula) const;
 
 private:
     Sheet& sheet_;
+    Position pos_;
     std::unique_ptr<Impl> impl_;
     mutable std::optional<Value> cache_;
 
+    // Рёбра графа по отдельным ссылкам. dependents_ — ячейки, значение
+    // которых сбрасывается при изменении этой: формулы, читающие её при каждом
+    // вычислении, и формулы, прочитавшие её в ветви при последнем вычислении.
     std::unordered_set<Cell*> referenced_;
     std::unordered_set<Cell*> dependents_;
+    // Ссылки только из ветвей IF и IFERROR и обратные к ним рёбра. Они
+    // учитываются при поиске циклов, но не при сбросе значений. Их обычно
+    // нет или немного, поэтому это векторы.
+    std::vector<Cell*> conditional_;
+    std::vector<Cell*> conditional_dependents_;
 
 private:
-    void InvalidateCacheImpl(std::unordered_set<Cell*>& visited);
 };
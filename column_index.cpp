@@ -0,0 +1,167 @@
+#include "column_index.h"
+
+#include "nan_box.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace {
+    // Начальное число листьев; дерево удваивается, когда строка не помещается.
+    constexpr size_t INITIAL_SIZE = 1024;
+}
+
+void ColumnIndex::Summary::Add(const Summary& other) {
+    count += other.count;
+    empty += other.empty;
+    nan += other.nan;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+}
+
+ColumnIndex::ColumnIndex()
+        : size_(INITIAL_SIZE)
+        , tree_(2 * INITIAL_SIZE)
+        , values_(INITIAL_SIZE, GetEmptyValue()) {
+    std::fill(tree_.begin() + static_cast<ptrdiff_t>(size_), tree_.end(), MakeLeaf(0.0, true));
+    for (size_t node = size_ - 1; node > 0; --node) {
+        tree_[node] = tree_[2 * node];
+        tree_[node].Add(tree_[2 * node + 1]);
+    }
+}
+
+ColumnIndex::Summary ColumnIndex::MakeLeaf(double value, bool empty) {
+    Summary leaf;
+    leaf.count = 1;
+    leaf.empty = empty ? 1 : 0;
+    leaf.sum = value;
+    // NaN не участвует в сравнениях: он учитывается только счётчиком и суммой.
+    if (std::isnan(value)) {
+        leaf.nan = 1;
+    } else {
+        leaf.min = value;
+        leaf.max = value;
+    }
+    return leaf;
+}
+
+double ColumnIndex::GetEmptyValue() {
+    // NaN с полезной нагрузкой, которой нет ни у ошибок, ни у чисел.
+    return NanBox::FromBits(NanBox::EXPONENT_MASK | 0x000E'7A61'0000'0000ULL);
+}
+
+void ColumnIndex::SetValue(int row, double value, bool empty) {
+    error_rows_.erase(row);
+    formula_rows_.erase(row);
+    SetLeaf(row, MakeLeaf(value, empty));
+    SetDense(row, empty ? GetEmptyValue() : value);
+}
+
+void ColumnIndex::SetError(int row, double error) {
+    formula_rows_.erase(row);
+    error_rows_[row] = error;
+    SetLeaf(row, Summary{});
+    SetDense(row, error);
+}
+
+void ColumnIndex::SetFormula(int row) {
+    error_rows_.erase(row);
+    formula_rows_.insert(row);
+    SetLeaf(row, Summary{});
+    SetDense(row, GetEmptyValue());
+}
+
+void ColumnIndex::SetDense(int row, double value) {
+    // SetLeaf уже вырастил дерево, а с ним и массив значений.
+    values_[static_cast<size_t>(row)] = value;
+}
+
+void ColumnIndex::CopyKeys(int first, size_t count, double* out) const {
+    assert(first >= 0);
+    const size_t begin = std::min(static_cast<size_t>(first), size_);
+    const size_t end = std::min(static_cast<size_t>(first) + count, size_);
+    std::copy(values_.begin() + static_cast<ptrdiff_t>(begin),
+              values_.begin() + static_cast<ptrdiff_t>(end), out);
+    std::fill(out + (end - begin), out + count, GetEmptyValue());
+}
+
+void ColumnIndex::CopyValues(int first, size_t count, double* out) const {
+    assert(first >= 0);
+    const size_t begin = std::min(static_cast<size_t>(first), size_);
+    const size_t end = std::min(static_cast<size_t>(first) + count, size_);
+    // Копирование и замена пустых значений нулями за один проход.
+    const uint64_t empty = NanBox::ToBits(GetEmptyValue());
+    for (size_t i = begin; i < end; ++i) {
+        const double value = values_[i];
+        out[i - begin] = NanBox::ToBits(value) == empty ? 0.0 : value;
+    }
+    std::fill(out + (end - begin), out + count, 0.0);
+}
+
+ColumnIndex::Summary ColumnIndex::Query(int first, int last) const {
+    assert(0 <= first && first <= last);
+    Summary result;
+
+    // Строки за пределами дерева не заданы, то есть пусты.
+    const auto size = static_cast<int>(size_);
+    if (last >= size) {
+        Summary empty_tail = MakeLeaf(0.0, true);
+        empty_tail.count = empty_tail.empty = static_cast<uint32_t>(last - std::max(first, size) + 1);
+        result.Add(empty_tail);
+        last = size - 1;
+    }
+    if (first > last) {
+        return result;
+    }
+
+    for (size_t l = first + size_, r = last + size_ + 1; l < r; l /= 2, r /= 2) {
+        if (l & 1) {
+            result.Add(tree_[l++]);
+        }
+        if (r & 1) {
+            result.Add(tree_[--r]);
+        }
+    }
+    return result;
+}
+
+std::optional<std::pair<int, double>> ColumnIndex::FindFirstError(int first, int last) const {
+    auto it = error_rows_.lower_bound(first);
+    if (it == error_rows_.end() || it->first > last) {
+        return std::nullopt;
+    }
+    return *it;
+}
+
+void ColumnIndex::SetLeaf(int row, const Summary& leaf) {
+    assert(row >= 0);
+    if (static_cast<size_t>(row) >= size_) {
+        Grow(row);
+    }
+
+    size_t node = static_cast<size_t>(row) + size_;
+    tree_[node] = leaf;
+    for (node /= 2; node > 0; node /= 2) {
+        tree_[node] = tree_[2 * node];
+        tree_[node].Add(tree_[2 * node + 1]);
+    }
+}
+
+void ColumnIndex::Grow(int row) {
+    size_t size = size_;
+    while (size <= static_cast<size_t>(row)) {
+        size *= 2;
+    }
+
+    std::vector<Summary> tree(2 * size, MakeLeaf(0.0, true));
+    std::copy(tree_.begin() + static_cast<ptrdiff_t>(size_), tree_.end(),
+              tree.begin() + static_cast<ptrdiff_t>(size));
+    for (size_t node = size - 1; node > 0; --node) {
+        tree[node] = tree[2 * node];
+        tree[node].Add(tree[2 * node + 1]);
+    }
+    tree_ = std::move(tree);
+    values_.resize(size, GetEmptyValue());
+    size_ = size;
+}
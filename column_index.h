@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <optional>
+#include <set>
+#include <utility>
+#include <vector>
+
+// Индекс значений одного столбца для агрегатных функций: дерево отрезков
+// над строками хранит сумму, минимум, максимум и счётчики для
+// ячеек-констант, так что свёртка отрезка строк и обновление строки
+// занимают O(log n). Ячейки с формулами и ошибками в дерево не входят:
+// формулы перечисляются отдельно, чтобы их можно было вычислить, а ошибки —
+// чтобы найти первую из них. Отсутствующая ячейка считается пустой.
+//
+// Для функций с условием (SUMIF и др.) значения строк хранятся ещё и подряд
+// в одном массиве: условие проверяется векторно по его отрезкам.
+class ColumnIndex {
+public:
+    // Свёртка констант отрезка строк. Пустые ячейки входят в count и
+    // empty как нули.
+    struct Summary {
+        uint32_t count = 0;
+        uint32_t empty = 0;
+        uint32_t nan = 0;
+        double sum = 0.0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+
+        void Add(const Summary& other);
+    };
+
+    ColumnIndex();
+
+    // Число или пустая ячейка.
+    void SetValue(int row, double value, bool empty);
+    // Ошибка в виде NanBox.
+    void SetError(int row, double error);
+    void SetFormula(int row);
+
+    [[nodiscard]] Summary Query(int first, int last) const;
+
+    // Первая по порядку строк ошибка-константа на отрезке: строка и ошибка.
+    [[nodiscard]] std::optional<std::pair<int, double>> FindFirstError(int first,
+                                                                        int last) const;
+
+    // Строки с формулами, по возрастанию.
+    [[nodiscard]] const std::set<int>& GetFormulaRows() const {
+        return formula_rows_;
+    }
+
+    // Значения строк [first, first + count) в виде NanBox для проверки
+    // условия: у пустых ячеек и формул — NaN, то есть «нет числа».
+    void CopyKeys(int first, size_t count, double* out) const;
+    // То же для сворачиваемых значений: пустые ячейки и формулы дают ноль.
+    // Значения формул вызывающий подставляет сам.
+    void CopyValues(int first, size_t count, double* out) const;
+
+private:
+    static Summary MakeLeaf(double value, bool empty);
+    static double GetEmptyValue();
+    void SetDense(int row, double value);
+
+    void SetLeaf(int row, const Summary& leaf);
+    void Grow(int row);
+
+    // Листья занимают вторую половину массива, у узла i дети 2i и 2i + 1.
+    size_t size_;
+    std::vector<Summary> tree_;
+    // Значения строк подряд; пустые ячейки и формулы — GetEmptyValue().
+    std::vector<double> values_;
+    std::map<int, double> error_rows_;
+    std::set<int> formula_rows_;
+};
@@ -1,10 +1,13 @@
 #pragma once
 
+#include <cstddef>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -19,13 +22,31 @@ struct Position {
     bool IsValid() const;
     std::string ToString() const;
 
+    // Записывает позицию в out без выделения памяти и возвращает длину
+    // записи; для некорректной позиции ничего не пишет и возвращает 0.
+    size_t ToChars(char* out) const;
+
     static Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
     static const Position NONE;
+
+    // Длина самой длинной записи позиции, "XFD16384".
+    static constexpr size_t MAX_STRING_LENGTH = 8;
 };
 
+// Пакетное преобразование позиций, например для заголовков CSV и списков
+// ссылок. PositionsToChars пишет записи позиций в out через separator и
+// возвращает число записанных символов; out должен вмещать
+// count * (Position::MAX_STRING_LENGTH + 1) символов.
+size_t PositionsToChars(const Position* positions, size_t count, char separator, char* out);
+
+// Разбирает записи text, разделённые separator, в out и возвращает их число.
+// Пустой text не содержит записей, некорректная запись даёт Position::NONE.
+// out должен вмещать на одну позицию больше, чем separator встречается в text.
+size_t PositionsFromChars(std::string_view text, char separator, Position* out);
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -33,6 +54,28 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область ячеек: first — левый верхний угол, last — правый
+// нижний, оба входят в область.
+struct Range {
+    Position first = Position::NONE;
+    Position last = Position::NONE;
+
+    bool operator==(Range rhs) const;
+    bool operator<(Range rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    Size GetSize() const;
+    size_t GetCellCount() const;
+    std::string ToString() const;
+
+    // Область по двум противоположным углам, заданным в любом порядке.
+    static Range FromCorners(Position a, Position b);
+    // Разбирает запись вида "A1:B2"; для некорректной записи возвращает
+    // область с некорректными углами.
+    static Range FromString(std::string_view str);
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -40,6 +83,9 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Arithmetic,  // в результате вычисления возникло деление на ноль
+        NotAvailable,  // функция поиска не нашла искомое значение
+        Name,  // формула использует неопределённое имя
+        Spill,  // область формулы-массива занята другими ячейками
     };
 
     FormulaError(Category category);
@@ -81,6 +127,8 @@ public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
+    // Значение ячейки в роли аргумента формулы
+    using NumericValue = std::variant<double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
@@ -97,12 +145,31 @@ public:
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает значение ячейки так, как его видит ссылающаяся на неё
+    // формула: текст, представляющий число, трактуется как число, прочий
+    // текст — как ошибка #VALUE!, пустой текст — как ноль. Реализация по
+    // умолчанию выводит его из GetValue().
+    virtual NumericValue GetNumericValue() const;
+
+    // Пуста ли ячейка. Реализация по умолчанию проверяет текст ячейки.
+    virtual bool IsEmpty() const;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
+// Как функции поиска (VLOOKUP, MATCH) сравнивают значения с ключом.
+enum class LookupMatch {
+    Exact,           // первое значение, равное ключу
+    LessOrEqual,     // наибольшее значение, не большее ключа
+    GreaterOrEqual,  // наименьшее значение, не меньшее ключа
+};
+
 // Интерфейс таблицы
+class Aggregate;
+class Criteria;
+
 class SheetInterface {
 public:
     virtual ~SheetInterface() = default;
@@ -122,6 +189,13 @@ public:
     // начать текст со знака "=", но чтобы он не интерпретировался как формула.
     virtual void SetCell(Position pos, std::string text) = 0;
 
+    // Задаёт содержимое набора ячеек с тем же результатом, что и вызовы
+    // SetCell для них по порядку: при ошибке бросается то же исключение, а
+    // ячейки, заданные раньше ошибочной, остаются заданными. Реализация может
+    // разбирать формулы заранее в threads потоках (0 — по числу ядер).
+    virtual void SetCells(std::vector<std::pair<Position, std::string>> cells,
+                          size_t threads = 0);
+
     // Возвращает значение ячейки.
     // Если ячейка пуста, может вернуть nullptr.
     virtual const CellInterface* GetCell(Position pos) const = 0;
@@ -143,6 +217,43 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Добавляет значения ячеек области в aggregate в порядке построчного
+    // обхода и возвращает число пустых ячеек; пустая ячейка читается как
+    // ноль, остальные — как аргументы формулы. Реализация по умолчанию
+    // читает ячейки по одной.
+    virtual size_t AggregateRange(const Range& range, Aggregate& aggregate) const;
+
+    // Ищет ключ в области из одного столбца или одной строки и возвращает
+    // смещение найденной ячейки от начала области. Сравниваются только
+    // числовые значения: пустые ячейки, ошибки и текст, не являющийся
+    // числом, не совпадают ни с каким ключом. Из равных по LessOrEqual и
+    // GreaterOrEqual значений берётся последнее, поэтому результат определён
+    // и для неупорядоченных данных, а на упорядоченных совпадает с двоичным
+    // поиском. Реализация по умолчанию читает ячейки по одной.
+    virtual std::optional<int> FindInRange(const Range& vector, double key,
+                                           LookupMatch match) const;
+
+    // Добавляет в aggregate значения ячеек области values, для которых
+    // ячейка области range на том же месте удовлетворяет criteria, в порядке
+    // построчного обхода и возвращает их число. Области одного размера.
+    // Значения читаются как в AggregateRange. Реализация по умолчанию читает
+    // ячейки по одной.
+    virtual size_t AggregateRangeIf(const Range& range, const Criteria& criteria,
+                                    const Range& values, Aggregate& aggregate) const;
+
+    // Записывает в out значения count ячеек столбца col начиная со строки
+    // row в виде NanBox (ошибки закодированы в double): пустая ячейка
+    // читается как ноль, остальные — как аргументы формулы. Так формулы-
+    // массивы читают области. Реализация по умолчанию читает ячейки по одной.
+    virtual void ReadColumn(int col, int row, size_t count, double* out) const;
+
+    // Лист той же книги по имени, на который формулы ссылаются записью
+    // Лист!A1; nullptr, если такого листа нет. У отдельного листа других
+    // листов нет.
+    virtual const SheetInterface* FindSheet(std::string_view name) const {
+        return nullptr;
+    }
 };
 
 // Создаёт готовую к работе пустую таблицу.
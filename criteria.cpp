@@ -0,0 +1,54 @@
+#include "criteria.h"
+
+#include "formula.h"
+
+#include <cassert>
+#include <utility>
+
+namespace {
+    // Двухсимвольные операции идут раньше односимвольных.
+    constexpr std::pair<std::string_view, Criteria::Compare> OPERATIONS[] = {
+            {"<>", Criteria::Compare::NotEqual},
+            {"<=", Criteria::Compare::LessOrEqual},
+            {">=", Criteria::Compare::GreaterOrEqual},
+            {"=", Criteria::Compare::Equal},
+            {"<", Criteria::Compare::Less},
+            {">", Criteria::Compare::Greater},
+    };
+}
+
+std::optional<Criteria> Criteria::Parse(std::string_view text) {
+    Compare compare = Compare::Equal;
+    for (const auto& [sign, operation] : OPERATIONS) {
+        if (text.substr(0, sign.size()) == sign) {
+            compare = operation;
+            text.remove_prefix(sign.size());
+            break;
+        }
+    }
+
+    const auto operand = ParseNumberText(text);
+    if (!operand) {
+        return std::nullopt;
+    }
+    return Criteria(compare, *operand);
+}
+
+std::string_view Criteria::GetSign(Compare compare) {
+    for (const auto& [sign, operation] : OPERATIONS) {
+        if (operation == compare) {
+            return sign;
+        }
+    }
+    assert(false);
+    return {};
+}
+
+std::optional<Criteria::Compare> Criteria::FindCompare(std::string_view sign) {
+    for (const auto& [text, operation] : OPERATIONS) {
+        if (text == sign) {
+            return operation;
+        }
+    }
+    return std::nullopt;
+}
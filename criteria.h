@@ -0,0 +1,69 @@
+#pragma once
+
+#include <optional>
+#include <string_view>
+
+// Условие функций SUMIF, COUNTIF и AVERAGEIF — сравнение значения с числом.
+// В формуле записывается строкой из необязательной операции (=, <>, <, <=,
+// >, >=) и числа, например ">=10", или выражением: тогда значение должно
+// быть равно ему. Значение без числа — пустая ячейка, текст, ошибка —
+// удовлетворяет только условию «<>».
+class Criteria {
+public:
+    enum class Compare {
+        Equal,
+        NotEqual,
+        Less,
+        LessOrEqual,
+        Greater,
+        GreaterOrEqual,
+    };
+
+    Criteria(Compare compare, double operand)
+            : compare_(compare)
+            , operand_(operand) {}
+
+    // Разбирает запись условия; nullopt, если после операции стоит не число.
+    static std::optional<Criteria> Parse(std::string_view text);
+
+    // Запись операции в формуле: "=", "<>", "<", "<=", ">" или ">=".
+    static std::string_view GetSign(Compare compare);
+    // Операция по её полной записи; nullopt для любой другой строки.
+    static std::optional<Compare> FindCompare(std::string_view sign);
+
+    [[nodiscard]] Compare GetCompare() const {
+        return compare_;
+    }
+
+    [[nodiscard]] double GetOperand() const {
+        return operand_;
+    }
+
+    // value — число или любой NaN, в том числе ошибка в виде NanBox, для
+    // значения без числа.
+    [[nodiscard]] bool Matches(double value) const {
+        switch (compare_) {
+            case Compare::Equal:
+                return value == operand_;
+            case Compare::NotEqual:
+                return !(value == operand_);
+            case Compare::Less:
+                return value < operand_;
+            case Compare::LessOrEqual:
+                return value <= operand_;
+            case Compare::Greater:
+                return value > operand_;
+            case Compare::GreaterOrEqual:
+                return value >= operand_;
+        }
+        return false;
+    }
+
+    bool operator==(const Criteria& rhs) const {
+        return compare_ == rhs.compare_ && operand_ == rhs.operand_;
+    }
+
+private:
+    Compare compare_;
+    double operand_;
+};
@@ -0,0 +1,105 @@
+#include "elementwise.h"
+
+#include "nan_box.h"
+#include "simd.h"
+
+namespace {
+
+#if defined(__AVX2__) || defined(SPREADSHEET_SSE2)
+    constexpr int ALL_FINITE = (1 << Simd::LANES) - 1;
+#endif
+
+    // Ошибка — это NaN, и она переходит в результат операции. Поэтому если
+    // все дорожки результата конечны, ошибок среди операндов нет и вектор
+    // записывается как есть; иначе его дорожки считаются заново по
+    // правилам NanBox.
+    template <typename VecOp, typename ScalarOp>
+    void ApplyBinary(const double* lhs, const double* rhs, double* out, size_t count,
+                     VecOp vec_op, ScalarOp op) {
+        size_t i = 0;
+#if defined(__AVX2__) || defined(SPREADSHEET_SSE2)
+        using namespace Simd;
+        for (; i + LANES <= count; i += LANES) {
+            const Vec result = vec_op(Load(lhs + i), Load(rhs + i));
+            if (FiniteMask(result) == ALL_FINITE) {
+                Store(out + i, result);
+                continue;
+            }
+            for (size_t lane = i; lane < i + LANES; ++lane) {
+                out[lane] = op(lhs[lane], rhs[lane]);
+            }
+        }
+#endif
+        for (; i < count; ++i) {
+            out[i] = op(lhs[i], rhs[i]);
+        }
+    }
+
+    template <typename VecOp, typename ScalarOp>
+    void ApplyUnary(const double* operand, double* out, size_t count, VecOp vec_op,
+                    ScalarOp op) {
+        size_t i = 0;
+#if defined(__AVX2__) || defined(SPREADSHEET_SSE2)
+        using namespace Simd;
+        for (; i + LANES <= count; i += LANES) {
+            const Vec result = vec_op(Load(operand + i));
+            if (FiniteMask(result) == ALL_FINITE) {
+                Store(out + i, result);
+                continue;
+            }
+            for (size_t lane = i; lane < i + LANES; ++lane) {
+                out[lane] = op(operand[lane]);
+            }
+        }
+#endif
+        for (; i < count; ++i) {
+            out[i] = op(operand[i]);
+        }
+    }
+
+#if defined(__AVX2__) || defined(SPREADSHEET_SSE2)
+    // Векторные операции; без SIMD ими не пользуются.
+    inline Simd::Vec VecAdd(Simd::Vec a, Simd::Vec b) { return Simd::Add(a, b); }
+    inline Simd::Vec VecSub(Simd::Vec a, Simd::Vec b) { return Simd::Sub(a, b); }
+    inline Simd::Vec VecMul(Simd::Vec a, Simd::Vec b) { return Simd::Mul(a, b); }
+    inline Simd::Vec VecDiv(Simd::Vec a, Simd::Vec b) { return Simd::Div(a, b); }
+    inline Simd::Vec VecPlus(Simd::Vec a) { return a; }
+    inline Simd::Vec VecNeg(Simd::Vec a) { return Simd::Neg(a); }
+#else
+    inline double VecAdd(double a, double b) { return a + b; }
+    inline double VecSub(double a, double b) { return a - b; }
+    inline double VecMul(double a, double b) { return a * b; }
+    inline double VecDiv(double a, double b) { return a / b; }
+    inline double VecPlus(double a) { return a; }
+    inline double VecNeg(double a) { return -a; }
+#endif
+
+} // namespace
+
+namespace Elementwise {
+
+    void Add(const double* lhs, const double* rhs, double* out, size_t count) {
+        ApplyBinary(lhs, rhs, out, count, VecAdd, NanBox::Add);
+    }
+
+    void Subtract(const double* lhs, const double* rhs, double* out, size_t count) {
+        ApplyBinary(lhs, rhs, out, count, VecSub, NanBox::Subtract);
+    }
+
+    void Multiply(const double* lhs, const double* rhs, double* out, size_t count) {
+        ApplyBinary(lhs, rhs, out, count, VecMul, NanBox::Multiply);
+    }
+
+    void Divide(const double* lhs, const double* rhs, double* out, size_t count) {
+        ApplyBinary(lhs, rhs, out, count, VecDiv, NanBox::Divide);
+    }
+
+    void Plus(const double* operand, double* out, size_t count) {
+        ApplyUnary(operand, out, count, VecPlus, NanBox::Plus);
+    }
+
+    void Negate(const double* operand, double* out, size_t count) {
+        ApplyUnary(operand, out, count, VecNeg, NanBox::Negate);
+    }
+
+} // namespace Elementwise
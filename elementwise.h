@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+// Поэлементная арифметика над массивами значений в виде NanBox для
+// формул-массивов. Результат — как у тех же операций над отдельными
+// числами (см. nan_box.h): ошибка левого операнда, затем правого, затем
+// #ARITHM! для бесконечного или неопределённого результата. Векторы без
+// ошибок и переполнений считаются векторными операциями. out может
+// совпадать с lhs или operand.
+namespace Elementwise {
+
+    void Add(const double* lhs, const double* rhs, double* out, size_t count);
+    void Subtract(const double* lhs, const double* rhs, double* out, size_t count);
+    void Multiply(const double* lhs, const double* rhs, double* out, size_t count);
+    void Divide(const double* lhs, const double* rhs, double* out, size_t count);
+
+    void Plus(const double* operand, double* out, size_t count);
+    void Negate(const double* operand, double* out, size_t count);
+
+} // namespace Elementwise
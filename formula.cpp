@@ -1,88 +1,709 @@
 #include "formula.h"
 #include "FormulaAST.h"
+#include "aggregate.h"
 #include "common.h"
+#include "criteria.h"
+#include "nan_box.h"
 
-#include <sstream>
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cctype>
+#include <charconv>
 #include <cstdlib>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
 using namespace std;
 
 namespace {
 
-    class Formula : public FormulaInterface {
-    public:
-        explicit Formula(std::string expression)
-                : ast_(ParseFormulaAST(expression))
+    // Разобранная формула. Неизменяема, поэтому один экземпляр может
+    // разделяться всеми ячейками с одинаковым выражением. Запись и имена
+    // берутся до связывания имён. Имена-числа остаются в дереве, их
+    // значения хранит Formula; имена ячеек и областей заменяются ссылками
+    // в копии дерева, своей у каждой такой формулы (см. unbound).
+    struct CompiledFormula {
+        explicit CompiledFormula(FormulaAST parsed)
+                : ast(std::move(parsed))
+                , names(ast.GetNames())
         {
-            std::ostringstream oss;
-            ast_.PrintFormula(oss);
-            expression_ = oss.str();
+            ast.PrintFormula(canonical);
+            canonical.shrink_to_fit();
         }
 
-        [[nodiscard]] Value Evaluate(const SheetInterface& sheet) const override {
-            auto lookup = [&](const Position& pos) -> Value {
-                const CellInterface* cell = sheet.GetCell(pos);
+        FormulaAST ast;
+        std::string canonical;
+        std::vector<std::string> names;
+        // Дерево до связывания имён ячеек и областей; nullptr, если связанных
+        // имён нет и это дерево само такое.
+        std::shared_ptr<const CompiledFormula> unbound;
+    };
 
-                if (!pos.IsValid())
-                    return FormulaError(FormulaError::Category::Ref);
+    using CompiledFormulaPtr = std::shared_ptr<const CompiledFormula>;
 
-                if (!cell)
-                    return 0.0;
+    bool SameInstruction(const FormulaAST::Instruction& lhs, const FormulaAST::Instruction& rhs) {
+        using Code = FormulaAST::Instruction::Code;
+        if (lhs.code != rhs.code) {
+            return false;
+        }
+        switch (lhs.code) {
+            case Code::Number:
+                return NanBox::ToBits(lhs.number) == NanBox::ToBits(rhs.number);
+            case Code::Cell:
+                return lhs.cell == rhs.cell;
+            case Code::Range:
+            case Code::SheetReference:
+                return lhs.range == rhs.range;
+            case Code::Criteria:
+                return lhs.criteria.GetCompare() == rhs.criteria.GetCompare()
+                       && NanBox::ToBits(lhs.criteria.GetOperand())
+                          == NanBox::ToBits(rhs.criteria.GetOperand());
+            case Code::Function:
+                return lhs.function == rhs.function && lhs.argument_count == rhs.argument_count;
+            case Code::Name:
+                return lhs.name == rhs.name;
+            default:
+                return true;
+        }
+    }
 
-                auto cv = cell->GetValue();
+    // Каноническая запись печатает числа с 6 значащими цифрами, поэтому
+    // может означать другое выражение. Она точна, если разбирается в то же
+    // дерево с побитно равными числами и печатается так же.
+    bool IsCanonicalExact(const CompiledFormula& compiled) {
+        auto reparsed = TryParseTrivialFormula(compiled.canonical);
+        if (!reparsed) {
+            FormulaDiagnostic diagnostic;
+            reparsed = TryParseFormulaAST(compiled.canonical, GetFormulaParserBackend(),
+                                          diagnostic);
+            if (!reparsed) {
+                return false;
+            }
+        }
+        std::string canonical;
+        reparsed->PrintFormula(canonical);
+        if (canonical != compiled.canonical) {
+            return false;
+        }
+        const auto expected = compiled.ast.Linearize();
+        const auto actual = reparsed->Linearize();
+        return std::equal(expected.begin(), expected.end(), actual.begin(), actual.end(),
+                          SameInstruction);
+    }
 
-                if (std::holds_alternative<double>(cv))
-                    return std::get<double>(cv);
+    class FormulaCache {
+    public:
+        static constexpr size_t DEFAULT_CAPACITY = 4096;
 
-                if (std::holds_alternative<FormulaError>(cv))
-                    return std::get<FormulaError>(cv);
+        static FormulaCache& Instance() {
+            static FormulaCache cache;
+            return cache;
+        }
 
-                const string& text = std::get<std::string>(cv);
+        // Возвращает разобранную формулу или nullptr, заполнив diagnostic.
+        // Ошибочные выражения в кэш не попадают.
+        CompiledFormulaPtr Get(const std::string& expression, FormulaDiagnostic& diagnostic) {
+            {
+                std::lock_guard guard(mutex_);
+                if (capacity_ == 0) {
+                    ++stats_misses_;
+                } else if (auto found = FindLocked(expression)) {
+                    ++stats_hits_;
+                    return found;
+                } else {
+                    ++stats_misses_;
+                }
+            }
 
-                if (text.empty())
-                    return 0.0;
+            auto ast = TryParseTrivialFormula(expression);
+            const bool fast_path = ast.has_value();
+            if (!fast_path) {
+                ast = TryParseFormulaAST(expression, GetFormulaParserBackend(), diagnostic);
+                if (!ast) {
+                    return nullptr;
+                }
+            }
+            CompiledFormulaPtr compiled = std::make_shared<const CompiledFormula>(std::move(*ast));
+            const bool shares_canonical =
+                    compiled->canonical != expression && IsCanonicalExact(*compiled);
 
-                char* end = nullptr;
-                double parsed = std::strtod(text.c_str(), &end);
+            std::lock_guard guard(mutex_);
+            if (fast_path) {
+                ++stats_fast_path_;
+            }
+            if (capacity_ == 0) {
+                return compiled;
+            }
+            // Разные записи одного выражения ("1 + 2" и "1+2") разделяют
+            // один объект формулы. Запись, которую каноническая меняет
+            // (например, "=1.23456789" и "=1.23457"), хранится отдельно.
+            if (shares_canonical) {
+                if (auto same = FindLocked(compiled->canonical)) {
+                    compiled = same;
+                } else {
+                    InsertLocked(compiled->canonical, compiled);
+                }
+            }
+            InsertLocked(expression, compiled);
+            return compiled;
+        }
 
-                if (end && *end == '\0')
-                    return parsed;
+        FormulaCacheStats GetStats() const {
+            std::lock_guard guard(mutex_);
+            return {stats_hits_, stats_misses_, index_.size(), capacity_, stats_fast_path_};
+        }
 
-                return FormulaError(FormulaError::Category::Value);
-            };
+        void SetCapacity(size_t capacity) {
+            std::lock_guard guard(mutex_);
+            capacity_ = capacity;
+            ShrinkLocked();
+        }
 
-            try {
-                double res = ast_.Execute(lookup);
-                return res;
-            } catch (const FormulaError& fe) {
-                return fe;
+        void Clear() {
+            std::lock_guard guard(mutex_);
+            index_.clear();
+            entries_.clear();
+            stats_hits_ = 0;
+            stats_misses_ = 0;
+            stats_fast_path_ = 0;
+        }
+
+    private:
+        using Entry = std::pair<std::string, CompiledFormulaPtr>;
+
+        CompiledFormulaPtr FindLocked(const std::string& expression) {
+            auto it = index_.find(expression);
+            if (it == index_.end()) {
+                return nullptr;
+            }
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return it->second->second;
+        }
+
+        void InsertLocked(const std::string& expression, CompiledFormulaPtr compiled) {
+            auto it = index_.find(expression);
+            if (it != index_.end()) {
+                it->second->second = std::move(compiled);
+                entries_.splice(entries_.begin(), entries_, it->second);
+                return;
             }
+            entries_.emplace_front(expression, std::move(compiled));
+            index_.emplace(entries_.front().first, entries_.begin());
+            ShrinkLocked();
+        }
+
+        void ShrinkLocked() {
+            while (index_.size() > capacity_) {
+                index_.erase(entries_.back().first);
+                entries_.pop_back();
+            }
+        }
+
+        mutable std::mutex mutex_;
+        size_t capacity_ = DEFAULT_CAPACITY;
+        size_t stats_hits_ = 0;
+        size_t stats_misses_ = 0;
+        size_t stats_fast_path_ = 0;
+        std::list<Entry> entries_;
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+    };
+
+    class Formula : public FormulaInterface {
+    public:
+        // name_values — значения compiled->names в том же порядке, см.
+        // GetNameValue; nullptr, если формула не связана с именами.
+        explicit Formula(CompiledFormulaPtr compiled,
+                         std::unique_ptr<double[]> name_values = nullptr)
+                : compiled_(std::move(compiled))
+                , name_values_(std::move(name_values))
+        {}
+
+        [[nodiscard]] Value Evaluate(const SheetInterface& sheet) const override {
+            if (GetArraySize()) {
+                return NanBox::ToValue(EvaluateArray(sheet).values.front());
+            }
+            return Execute(sheet, nullptr);
+        }
+
+        [[nodiscard]] std::optional<Size> GetArraySize() const override {
+            return compiled_->ast.GetArraySize();
+        }
+
+        [[nodiscard]] FormulaArray EvaluateArray(const SheetInterface& sheet) const override {
+            const auto size = GetArraySize();
+            if (!size) {
+                return FormulaInterface::EvaluateArray(sheet);
+            }
+
+            FormulaArray array{*size, std::vector<double>(static_cast<size_t>(size->rows)
+                                                          * static_cast<size_t>(size->cols))};
+            auto column_lookup = [&](int col, int row, size_t count, double* out) {
+                sheet.ReadColumn(col, row, count, out);
+            };
+            WithLookups(sheet, nullptr, [&](const auto&... lookups) {
+                compiled_->ast.ExecuteArray(lookups..., column_lookup, array.values.data());
+            });
+            return array;
+        }
+
+        [[nodiscard]] Value EvaluateTracked(const SheetInterface& sheet,
+                                            std::vector<Position>& reads) const override {
+            return Execute(sheet, &reads);
         }
 
         [[nodiscard]] std::string GetExpression() const override {
-            return expression_;
+            return compiled_->canonical;
         }
 
         [[nodiscard]] std::vector<Position> GetReferencedCells() const override {
-            std::vector<Position> result;
-            for (const auto& p : ast_.GetRawReferencedCells()) {
-                if (p.IsValid())
-                    result.push_back(p);
+            return compiled_->ast.GetReferencedCells();
+        }
+
+        [[nodiscard]] std::vector<Range> GetReferencedRanges() const override {
+            return compiled_->ast.GetReferencedRanges();
+        }
+
+        [[nodiscard]] std::vector<Position> GetConditionalCells() const override {
+            return compiled_->ast.GetConditionalCells();
+        }
+
+        [[nodiscard]] std::vector<std::string> GetNames() const override {
+            return compiled_->names;
+        }
+
+        [[nodiscard]] std::vector<SheetRange> GetSheetReferences() const override {
+            return compiled_->ast.GetSheetReferences();
+        }
+
+        [[nodiscard]] bool IsVolatile() const override {
+            return compiled_->ast.IsVolatile();
+        }
+
+        // Значения имён-чисел хранятся в формуле, а дерево разделяется через
+        // кэш, поэтому повторное связывание не разбирает запись заново. Своё
+        // дерево нужно, только если имя стало ссылкой: это копия несвязанного
+        // дерева, а не разбор записи, в которой числа округлены.
+        [[nodiscard]] std::unique_ptr<FormulaInterface> BindNames(
+                const NameResolver& resolver) const override {
+            const auto& names = compiled_->names;
+            auto values = std::make_unique<double[]>(names.size());
+            bool has_references = false;
+            for (size_t i = 0; i < names.size(); ++i) {
+                const auto value = resolver(names[i]);
+                const auto* number = value ? std::get_if<double>(&*value) : nullptr;
+                values[i] = number ? NanBox::FromNumber(*number)
+                                   : NanBox::FromError(FormulaError::Category::Name);
+                has_references = has_references || (value && !number);
+            }
+
+            CompiledFormulaPtr tree = compiled_->unbound ? compiled_->unbound : compiled_;
+            if (has_references) {
+                auto bound = std::make_shared<CompiledFormula>(tree->ast.Clone());
+                bound->ast.BindNames(resolver);
+                bound->unbound = std::move(tree);
+                tree = std::move(bound);
+            }
+            return std::make_unique<Formula>(std::move(tree), std::move(values));
+        }
+
+        [[nodiscard]] double GetNameValue(std::string_view name) const override {
+            const auto& names = compiled_->names;
+            const auto it = std::lower_bound(names.begin(), names.end(), name);
+            if (!name_values_ || it == names.end() || *it != name) {
+                return NanBox::FromError(FormulaError::Category::Name);
+            }
+            return name_values_[it - names.begin()];
+        }
+
+        // Ссылка в слоте даёт #NAME?, поэтому слот с ошибкой можно менять,
+        // только если ни одно имя не стало ссылкой.
+        bool SetNameValue(std::string_view name, double value) override {
+            const auto& names = compiled_->names;
+            const auto it = std::lower_bound(names.begin(), names.end(), name);
+            if (!name_values_ || it == names.end() || *it != name) {
+                return false;
+            }
+            double& slot = name_values_[it - names.begin()];
+            if (compiled_->unbound && NanBox::IsError(slot)) {
+                return false;
             }
-            sort(result.begin(), result.end());
-            result.erase(unique(result.begin(), result.end()), result.end());
-            return result;
+            slot = NanBox::FromNumber(value);
+            return true;
+        }
+
+        [[nodiscard]] const FormulaAST* GetAST() const override {
+            return &compiled_->ast;
         }
 
     private:
-        FormulaAST ast_;
-        std::string expression_;
+        // reads может быть nullptr, если прочитанные ячейки не нужны.
+        Value Execute(const SheetInterface& sheet, std::vector<Position>* reads) const {
+            double result = 0.0;
+            WithLookups(sheet, reads, [&](const auto&... lookups) {
+                result = compiled_->ast.Execute(lookups...);
+            });
+            return NanBox::ToValue(result);
+        }
+
+        // Вызывает body с функциями чтения листа для FormulaAST::Execute.
+        template <typename Body>
+        void WithLookups(const SheetInterface& sheet, std::vector<Position>* reads,
+                         Body body) const {
+            auto lookup = [&](const Position& pos) -> double {
+                if (!pos.IsValid())
+                    return NanBox::FromError(FormulaError::Category::Ref);
+
+                if (reads) {
+                    reads->push_back(pos);
+                }
+                return NanBox::FromValue(ReadCellAsNumber(sheet.GetCell(pos)));
+            };
+
+            auto range_lookup = [&](const Range& range, Aggregate& aggregate) {
+                return sheet.AggregateRange(range, aggregate);
+            };
+
+            auto match_lookup = [&](const Range& vector, double key, LookupMatch match) {
+                return sheet.FindInRange(vector, key, match);
+            };
+
+            auto criteria_lookup = [&](const Range& range, const Criteria& criteria,
+                                       const Range& values, Aggregate& aggregate) {
+                return sheet.AggregateRangeIf(range, criteria, values, aggregate);
+            };
+
+            auto sheet_lookup = [&](std::string_view name) {
+                return sheet.FindSheet(name);
+            };
+
+            auto name_lookup = [this](std::string_view name) {
+                return GetNameValue(name);
+            };
+
+            body(FormulaAST::CellLookup(lookup), FormulaAST::RangeLookup(range_lookup),
+                 FormulaAST::MatchLookup(match_lookup),
+                 FormulaAST::CriteriaLookup(criteria_lookup),
+                 FormulaAST::SheetLookup(sheet_lookup), FormulaAST::NameLookup(name_lookup));
+        }
+
+        CompiledFormulaPtr compiled_;
+        std::unique_ptr<double[]> name_values_;
     };
 
+    // Встроенный набор для прогрева: все виды лексем, все пары операций в
+    // разных сочетаниях приоритета и вложенности, а также типичные ошибки,
+    // чтобы прогрелся и путь повторного разбора с полным LL.
+    std::vector<std::string> MakeWarmUpCorpus() {
+        const std::vector<std::string> operands = {
+                "1", "2.5", ".5", "1e3", "1.5E-2", "A1", "ZZ99", "(B2)", "-C3", "+4",
+        };
+        const std::string operations = "+-*/";
+
+        std::vector<std::string> corpus;
+        for (const auto& operand : operands) {
+            corpus.push_back(operand);
+            for (char lhs_op : operations) {
+                for (char rhs_op : operations) {
+                    corpus.push_back(operand + lhs_op + "A1" + rhs_op + "(2" + lhs_op + "-B3)");
+                    corpus.push_back("(" + operand + lhs_op + "1)" + rhs_op + "--" + operand);
+                }
+            }
+            corpus.push_back("SUM(" + operand + ",A1:B2)-AVERAGE(C3:D4," + operand + ")");
+        }
+        for (const char* function : {"SUM", "MIN", "MAX", "AVERAGE", "COUNT"}) {
+            corpus.push_back(std::string(function) + "(A1:C3)");
+            corpus.push_back(std::string(function) + "(A1,B2:B9,3)*2");
+        }
+        for (const char* lookup : {"VLOOKUP(A1,B1:D99,3,0)", "MATCH(A1,B1:B99)",
+                                   "INDEX(B1:D99,MATCH(A1,B1:B99,0),2)",
+                                   "SUMIF(A1:A99,\">=2\",B1:B99)", "COUNTIF(A1:A99,A1)",
+                                   "AVERAGEIF(A1:A99,\"<>0\")", "IF(A1>=0,B1,-B1)",
+                                   "IFERROR(1/A1,0)", "(A1<>B1)+(A1<=2)*(B1=3)",
+                                   "A1:A99*B1:B99", "-A1:C3+1", "SUM(A1:A99*2)"}) {
+            corpus.emplace_back(lookup);
+        }
+        for (const char* invalid : {"", "1+", "(1", "1)", "1 2", "+", "*1", "()", "1**2",
+                                    "A1B2", "1.5.5", "(1+2))", "((A1)", "1 + * 2",
+                                    "SUM(", "SUM()", "SUM(A1,)", "SUM A1", "Data!A1:B2",
+                                    "FOO(1)", "SUM(A1:B2 1)"}) {
+            corpus.emplace_back(invalid);
+        }
+        return corpus;
+    }
+
 } // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
+    auto result = TryParseFormula(std::move(expression));
+    if (auto* diagnostic = std::get_if<FormulaDiagnostic>(&result)) {
+        throw FormulaException(diagnostic->ToString());
+    }
+    return std::move(std::get<std::unique_ptr<FormulaInterface>>(result));
+}
+
+std::variant<std::unique_ptr<FormulaInterface>, FormulaDiagnostic> TryParseFormula(
+        std::string expression) {
+    FormulaDiagnostic diagnostic;
+    if (auto compiled = FormulaCache::Instance().Get(expression, diagnostic)) {
+        return std::make_unique<Formula>(std::move(compiled));
+    }
+    return diagnostic;
+}
+
+std::optional<FormulaDiagnostic> ValidateFormula(std::string_view expression) {
+    FormulaDiagnostic diagnostic;
+    if (TryParseTrivialFormula(expression)
+        || TryParseFormulaAST(expression, GetFormulaParserBackend(), diagnostic)) {
+        return std::nullopt;
+    }
+    return diagnostic;
+}
+
+std::string FormulaDiagnostic::ToString() const {
+    std::string result = message;
+    if (offset != std::string::npos) {
+        result += " at position " + std::to_string(offset);
+    }
+    if (!expected.empty()) {
+        result += ", expecting {";
+        for (size_t i = 0; i < expected.size(); ++i) {
+            result += (i == 0 ? "" : ", ") + expected[i];
+        }
+        result += '}';
+    }
+    return result;
+}
+
+FormulaInterface::Value ReadCellAsNumber(const CellInterface* cell) {
+    if (!cell)
+        return 0.0;
+
+    return cell->GetNumericValue();
+}
+
+std::optional<double> ParseNumberText(std::string_view text) {
+    if (text.empty()) {
+        return std::nullopt;
+    }
+    // strtod видит строку только до первого нулевого символа; если он стоит
+    // в начале, strtod ничего не разбирает, но и не оставляет лишних символов.
+    text = text.substr(0, text.find('\0'));
+    if (text.empty()) {
+        return 0.0;
+    }
+
+    const char* first = text.data();
+    const char* last = text.data() + text.size();
+    while (first != last && std::isspace(static_cast<unsigned char>(*first))) {
+        ++first;
+    }
+    if (first == last) {
+        return std::nullopt;
+    }
+
+    bool negative = false;
+    if (*first == '+' || *first == '-') {
+        negative = *first == '-';
+        ++first;
+    }
+    // from_chars сам принимает минус, strtod — только один знак.
+    if (first == last || *first == '+' || *first == '-') {
+        return std::nullopt;
+    }
+
+    auto format = std::chars_format::general;
+    if (last - first > 2 && first[0] == '0' && (first[1] == 'x' || first[1] == 'X')) {
+        first += 2;
+        if (*first == '+' || *first == '-') {
+            return std::nullopt;
+        }
+        format = std::chars_format::hex;
+    }
+
+    double value = 0.0;
+    auto [ptr, ec] = std::from_chars(first, last, value, format);
+    if (ec == std::errc::invalid_argument || ptr != last) {
+        return std::nullopt;
+    }
+    if (ec == std::errc::result_out_of_range) {
+        // Переполнение и потеря точности редки, их значение (HUGE_VAL,
+        // денормализованное число) берём у strtod.
+        const std::string copy(text);
+        return std::strtod(copy.c_str(), nullptr);
+    }
+
+    return negative ? -value : value;
+}
+
+CellInterface::NumericValue CellInterface::GetNumericValue() const {
+    auto cv = GetValue();
+
+    if (std::holds_alternative<double>(cv))
+        return std::get<double>(cv);
+
+    if (std::holds_alternative<FormulaError>(cv))
+        return std::get<FormulaError>(cv);
+
+    const string& text = std::get<std::string>(cv);
+
+    if (text.empty())
+        return 0.0;
+
+    if (auto number = ParseNumberText(text))
+        return *number;
+
+    return FormulaError(FormulaError::Category::Value);
+}
+
+size_t SheetInterface::AggregateRange(const Range& range, Aggregate& aggregate) const {
+    // Значения читаются порциями, чтобы сворачивать их векторными операциями.
+    constexpr size_t CHUNK = 1024;
+    std::array<double, CHUNK> values;
+
+    size_t empty = 0;
+    size_t count = 0;
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            const CellInterface* cell = GetCell({row, col});
+            if (!cell || cell->IsEmpty()) {
+                values[count++] = 0.0;
+                ++empty;
+            } else {
+                values[count++] = NanBox::FromValue(ReadCellAsNumber(cell));
+            }
+            if (count == CHUNK) {
+                aggregate.Add(values.data(), count);
+                count = 0;
+            }
+        }
+    }
+    aggregate.Add(values.data(), count);
+    return empty;
+}
+
+double FormulaInterface::GetNameValue(std::string_view) const {
+    return NanBox::FromError(FormulaError::Category::Name);
+}
+
+FormulaArray FormulaInterface::EvaluateArray(const SheetInterface& sheet) const {
+    return {{1, 1}, {NanBox::FromValue(Evaluate(sheet))}};
+}
+
+void SheetInterface::ReadColumn(int col, int row, size_t count, double* out) const {
+    for (size_t i = 0; i < count; ++i) {
+        const CellInterface* cell = GetCell({row + static_cast<int>(i), col});
+        out[i] = cell && !cell->IsEmpty() ? NanBox::FromValue(ReadCellAsNumber(cell)) : 0.0;
+    }
+}
+
+size_t SheetInterface::AggregateRangeIf(const Range& range, const Criteria& criteria,
+                                        const Range& values, Aggregate& aggregate) const {
+    assert(range.GetSize() == values.GetSize());
+    const Position shift{values.first.row - range.first.row,
+                         values.first.col - range.first.col};
+
+    size_t matched = 0;
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            const CellInterface* key = GetCell({row, col});
+            if (!criteria.Matches(key && !key->IsEmpty()
+                                          ? NanBox::FromValue(ReadCellAsNumber(key))
+                                          : std::numeric_limits<double>::quiet_NaN())) {
+                continue;
+            }
+            ++matched;
+            const CellInterface* cell = GetCell({row + shift.row, col + shift.col});
+            aggregate.Add(cell && !cell->IsEmpty() ? NanBox::FromValue(ReadCellAsNumber(cell))
+                                                   : 0.0);
+        }
+    }
+    return matched;
+}
+
+std::optional<int> SheetInterface::FindInRange(const Range& vector, double key,
+                                               LookupMatch match) const {
+    const Size size = vector.GetSize();
+    assert(size.rows == 1 || size.cols == 1);
+    const int length = std::max(size.rows, size.cols);
+
+    std::optional<int> found;
+    double best = 0.0;
+    for (int i = 0; i < length; ++i) {
+        const Position pos = size.cols == 1 ? Position{vector.first.row + i, vector.first.col}
+                                            : Position{vector.first.row, vector.first.col + i};
+        const CellInterface* cell = GetCell(pos);
+        if (!cell || cell->IsEmpty()) {
+            continue;
+        }
+        const double value = NanBox::FromValue(ReadCellAsNumber(cell));
+        if (NanBox::IsError(value)) {
+            continue;
+        }
+
+        switch (match) {
+            case LookupMatch::Exact:
+                if (value == key) {
+                    return i;
+                }
+                break;
+            case LookupMatch::LessOrEqual:
+                if (value <= key && (!found || value >= best)) {
+                    found = i;
+                    best = value;
+                }
+                break;
+            case LookupMatch::GreaterOrEqual:
+                if (value >= key && (!found || value <= best)) {
+                    found = i;
+                    best = value;
+                }
+                break;
+        }
+    }
+    return found;
+}
+
+bool CellInterface::IsEmpty() const {
+    return GetText().empty();
+}
+
+FormulaCacheStats GetFormulaCacheStats() {
+    return FormulaCache::Instance().GetStats();
+}
+
+void SetFormulaCacheCapacity(size_t capacity) {
+    FormulaCache::Instance().SetCapacity(capacity);
+}
+
+void ClearFormulaCache() {
+    FormulaCache::Instance().Clear();
+}
+
+void WarmUpFormulaParser() {
+    WarmUpFormulaParser(MakeWarmUpCorpus());
+}
+
+void WarmUpFormulaParser(const std::vector<std::string>& corpus) {
+    for (const auto& expression : corpus) {
+        try {
+            ParseFormulaAST(expression, FormulaParserBackend::Antlr);
+        } catch (const FormulaException&) {
+            // Ошибочные формулы тоже заполняют кеши.
+        }
+    }
+}
+
+std::future<void> WarmUpFormulaParserAsync(std::vector<std::string> corpus) {
+    return std::async(std::launch::async, [corpus = std::move(corpus)] {
+        if (corpus.empty()) {
+            WarmUpFormulaParser();
+        } else {
+            WarmUpFormulaParser(corpus);
+        }
+    });
 }
 
 FormulaError::FormulaError(Category category)
@@ -106,6 +727,12 @@ std::string_view FormulaError::ToString() const {
             return "#VALUE!";
         case Category::Arithmetic:
             return "#ARITHM!";
+        case Category::NotAvailable:
+            return "#N/A";
+        case Category::Name:
+            return "#NAME?";
+        case Category::Spill:
+            return "#SPILL!";
     }
     return "#VALUE!";
 }
@@ -2,9 +2,46 @@
 
 #include "common.h"
 
+#include <cstddef>
+#include <functional>
+#include <future>
 #include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
 #include <vector>
 
+class FormulaAST;
+
+// Значение имени листа: число или ссылка на ячейку либо область.
+using NameValue = std::variant<double, Position, Range>;
+// Значение имени; nullopt, если имя не определено.
+using NameResolver = std::function<std::optional<NameValue>(std::string_view name)>;
+
+// Ссылка на другой лист книги: Лист1!A1 — область из одной ячейки,
+// Лист1!A1:B2 — область.
+struct SheetRange {
+    std::string sheet;
+    Range range;
+
+    bool operator==(const SheetRange& rhs) const {
+        return sheet == rhs.sheet && range == rhs.range;
+    }
+
+    bool operator<(const SheetRange& rhs) const {
+        return sheet != rhs.sheet ? sheet < rhs.sheet : range < rhs.range;
+    }
+};
+
+// Значение формулы-массива: size.rows * size.cols значений по столбцам,
+// сначала все строки первого столбца. Ошибки закодированы в double, см.
+// nan_box.h.
+struct FormulaArray {
+    Size size;
+    std::vector<double> values;
+};
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
@@ -32,10 +69,153 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
+    // ячеек. Ячейки областей в него не входят, см. GetReferencedRanges.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает области, значения которых задействованы в вычислении
+    // формулы, по возрастанию и без повторов.
+    virtual std::vector<Range> GetReferencedRanges() const {
+        return {};
+    }
+
+    // Ячейки из GetReferencedCells, которые читаются только в ветвях IF и
+    // IFERROR, то есть не при каждом вычислении. По возрастанию.
+    virtual std::vector<Position> GetConditionalCells() const {
+        return {};
+    }
+
+    // Имена, которые встречаются в выражении, по возрастанию и без повторов.
+    virtual std::vector<std::string> GetNames() const {
+        return {};
+    }
+
+    // Ссылки на другие листы, по возрастанию и без повторов. Они не входят
+    // в GetReferencedCells и GetReferencedRanges.
+    virtual std::vector<SheetRange> GetSheetReferences() const {
+        return {};
+    }
+
+    // Вызывает ли формула изменчивые функции (NOW, RAND): её значение
+    // может измениться без изменения ячеек.
+    virtual bool IsVolatile() const {
+        return false;
+    }
+
+    // Размер результата формулы-массива — поэлементной арифметики над
+    // областями: =A1:A9*B1:B9 даёт столбец из 9 значений. nullopt у обычной
+    // формулы. Evaluate формулы-массива возвращает её первый элемент.
+    virtual std::optional<Size> GetArraySize() const {
+        return std::nullopt;
+    }
+
+    // Вычисляет все элементы формулы-массива; у обычной формулы это один
+    // элемент — значение Evaluate.
+    virtual FormulaArray EvaluateArray(const SheetInterface& sheet) const;
+
+    // Формула с тем же выражением, в которой определённые имена заменены
+    // значениями: числа подставляются как константы, ячейки и области
+    // становятся обычными ссылками. Неопределённые имена дают #NAME?.
+    // Связывать можно и уже связанную формулу: значения берутся заново.
+    virtual std::unique_ptr<FormulaInterface> BindNames(const NameResolver& resolver) const = 0;
+
+    // Значение имени-числа, с которым связана формула, в виде NanBox;
+    // #NAME?, если имя не определено, стало ссылкой или формула не связана.
+    virtual double GetNameValue(std::string_view name) const;
+
+    // Меняет значение имени-числа прямо в связанной формуле. false, если
+    // так нельзя и формулу надо связать заново: имени в формуле нет, она не
+    // связана или имя могло быть связано со ссылкой.
+    virtual bool SetNameValue(std::string_view name, double value) {
+        return false;
+    }
+
+    // Как Evaluate, но дописывает в reads ячейки, прочитанные по ссылкам в
+    // этот раз, — в порядке чтения, возможно с повторами.
+    virtual Value EvaluateTracked(const SheetInterface& sheet,
+                                  std::vector<Position>& reads) const {
+        const auto cells = GetReferencedCells();
+        reads.insert(reads.end(), cells.begin(), cells.end());
+        return Evaluate(sheet);
+    }
+
+    // Возвращает дерево разбора формулы, если реализация его предоставляет.
+    // Используется пакетным вычислителем.
+    virtual const FormulaAST* GetAST() const {
+        return nullptr;
+    }
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Описание ошибки в тексте формулы.
+struct FormulaDiagnostic {
+    // Смещение ошибки от начала выражения; npos, если оно неизвестно.
+    size_t offset = 0;
+    std::string message;
+    // Лексемы, допустимые в месте ошибки, например "NUMBER" или "')'".
+    std::vector<std::string> expected;
+
+    [[nodiscard]] std::string ToString() const;
+};
+
+// Может ли строка быть именем в формуле: [A-Z]* [a-z_] [A-Za-z0-9_]* или
+// [A-Z]+, если за ним не следует скобка. Строка вида ссылки (A1) — не имя.
+bool IsValidFormulaName(std::string_view name);
+
+// Может ли строка быть именем листа в ссылке Лист!A1: [A-Za-z_] [A-Za-z0-9_]*.
+bool IsValidSheetName(std::string_view name);
+
+// Разбирает выражение, не бросая исключений: возвращает формулу или
+// описание ошибки.
+std::variant<std::unique_ptr<FormulaInterface>, FormulaDiagnostic> TryParseFormula(
+        std::string expression);
+
+// Проверяет выражение, не бросая исключений и не создавая формулу; nullopt
+// для корректного выражения.
+std::optional<FormulaDiagnostic> ValidateFormula(std::string_view expression);
+
+// Значение ячейки в роли аргумента формулы (см. CellInterface::GetNumericValue).
+// Отсутствующая ячейка (nullptr) трактуется как ноль.
+FormulaInterface::Value ReadCellAsNumber(const CellInterface* cell);
+
+// Прогрев разбора формул. Первые разборы ANTLR медленнее остальных: кеши
+// предсказания лексера и парсера заполняются по мере разбора. Прогрев
+// разбирает набор формул (свой или встроенный, покрывающий все конструкции
+// грамматики и типичные ошибки) и заполняет кеши, общие для всех потоков.
+// Кэш разобранных формул при этом не меняется.
+void WarmUpFormulaParser();
+void WarmUpFormulaParser(const std::vector<std::string>& corpus);
+
+// Прогрев в фоновом потоке. Разбирать формулы можно, не дожидаясь его
+// окончания; пустой набор означает встроенный.
+std::future<void> WarmUpFormulaParserAsync(std::vector<std::string> corpus = {});
+
+// Разбирает текст ячейки как число по тем же правилам, что и std::strtod в
+// локали "C": допускаются ведущие пробельные символы, знак, шестнадцатеричная
+// запись, inf и nan; текст должен быть разобран целиком. Пустой текст не
+// является числом. В отличие от strtod, не зависит от текущей локали.
+std::optional<double> ParseNumberText(std::string_view text);
+
+// Статистика кэша разобранных формул. Кэш хранит последние разобранные
+// выражения и позволяет ParseFormula не запускать парсер повторно для уже
+// встречавшегося текста.
+struct FormulaCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t size = 0;
+    size_t capacity = 0;
+    // Сколько промахов разобрано быстрым путём, без полного парсера: формулы
+    // вида =B7, =42 или =A1*B1.
+    size_t fast_path = 0;
+};
+
+FormulaCacheStats GetFormulaCacheStats();
+
+// Задаёт максимальное число формул в кэше. Нулевая ёмкость выключает кэш.
+// При уменьшении ёмкости лишние записи вытесняются сразу.
+void SetFormulaCacheCapacity(size_t capacity);
+
+// Удаляет все записи кэша и обнуляет статистику.
+void ClearFormulaCache();
@@ -0,0 +1,413 @@
+#include "formula_batch.h"
+
+#include "nan_box.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+    using ErrorCode = FormulaShape::ErrorCode;
+    using Code = FormulaAST::Instruction::Code;
+
+    constexpr size_t CHUNK_SIZE = 1024;
+
+    using namespace Simd;
+
+    // Код ошибки дорожки: ошибка левого операнда, затем правого, затем
+    // #ARITHM! для бесконечного или неопределённого результата.
+    inline ErrorCode LaneError(ErrorCode lhs, ErrorCode rhs, bool finite, ErrorCode arithmetic) {
+        if (lhs != FormulaShape::NO_ERROR) {
+            return lhs;
+        }
+        if (rhs != FormulaShape::NO_ERROR) {
+            return rhs;
+        }
+        return finite ? FormulaShape::NO_ERROR : arithmetic;
+    }
+
+#if defined(__AVX2__) || defined(SPREADSHEET_SSE2)
+    constexpr int ALL_FINITE = (1 << LANES) - 1;
+
+    // Коды ошибок LANES дорожек, прочитанные одним словом: ноль означает, что
+    // ни в одной дорожке ошибки нет.
+    inline uint32_t LoadErrorWord(const ErrorCode* errors) {
+        uint32_t word = 0;
+        std::memcpy(&word, errors, LANES);
+        return word;
+    }
+#endif
+
+    template <typename Op>
+    void ApplyBinary(const double* lhs, const ErrorCode* lhs_errors,
+                     const double* rhs, const ErrorCode* rhs_errors,
+                     double* out, ErrorCode* out_errors, size_t n,
+                     ErrorCode arithmetic, Op op) {
+        size_t i = 0;
+#if defined(__AVX2__) || defined(SPREADSHEET_SSE2)
+        for (; i + LANES <= n; i += LANES) {
+            Vec result = op(Load(lhs + i), Load(rhs + i));
+            Store(out + i, result);
+            int finite = FiniteMask(result);
+            if (finite == ALL_FINITE
+                && (LoadErrorWord(lhs_errors + i) | LoadErrorWord(rhs_errors + i)) == 0) {
+                std::memset(out_errors + i, FormulaShape::NO_ERROR, LANES);
+                continue;
+            }
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                out_errors[i + lane] = LaneError(lhs_errors[i + lane], rhs_errors[i + lane],
+                                                 finite & (1 << lane), arithmetic);
+            }
+        }
+#endif
+        for (; i < n; ++i) {
+            out[i] = op(lhs[i], rhs[i]);
+            out_errors[i] = LaneError(lhs_errors[i], rhs_errors[i],
+                                      std::isfinite(out[i]), arithmetic);
+        }
+    }
+
+    template <typename Op>
+    void ApplyUnary(const double* operand, const ErrorCode* operand_errors,
+                    double* out, ErrorCode* out_errors, size_t n,
+                    ErrorCode arithmetic, Op op) {
+        size_t i = 0;
+#if defined(__AVX2__) || defined(SPREADSHEET_SSE2)
+        for (; i + LANES <= n; i += LANES) {
+            Vec result = op(Load(operand + i));
+            Store(out + i, result);
+            int finite = FiniteMask(result);
+            if (finite == ALL_FINITE && LoadErrorWord(operand_errors + i) == 0) {
+                std::memset(out_errors + i, FormulaShape::NO_ERROR, LANES);
+                continue;
+            }
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                out_errors[i + lane] = LaneError(operand_errors[i + lane], FormulaShape::NO_ERROR,
+                                                 finite & (1 << lane), arithmetic);
+            }
+        }
+#endif
+        for (; i < n; ++i) {
+            out[i] = op(operand[i]);
+            out_errors[i] = LaneError(operand_errors[i], FormulaShape::NO_ERROR,
+                                      std::isfinite(out[i]), arithmetic);
+        }
+    }
+
+    void AppendBytes(std::string& key, const void* data, size_t size) {
+        key.append(static_cast<const char*>(data), size);
+    }
+
+} // namespace
+
+FormulaShape::ErrorCode FormulaShape::ToErrorCode(FormulaError::Category category) {
+    return static_cast<ErrorCode>(static_cast<int>(category) + 1);
+}
+
+FormulaError FormulaShape::FromErrorCode(ErrorCode code) {
+    assert(code != NO_ERROR);
+    return FormulaError(static_cast<FormulaError::Category>(code - 1));
+}
+
+FormulaShape::FormulaShape(const FormulaAST& ast, Position origin,
+                           const FormulaAST::NameLookup& names) {
+    size_t depth = 0;
+    for (auto instruction : ast.Linearize()) {
+        // Имя-число в пачке — та же константа.
+        if (instruction.code == Code::Name && names) {
+            const double value = names(instruction.name);
+            if (!NanBox::IsError(value)) {
+                instruction.code = Code::Number;
+                instruction.number = value;
+            }
+        }
+
+        Step step{instruction.code};
+        char tag = static_cast<char>(instruction.code);
+        AppendBytes(key_, &tag, sizeof(tag));
+
+        switch (instruction.code) {
+            case Code::Number:
+                step.number = instruction.number;
+                AppendBytes(key_, &step.number, sizeof(step.number));
+                ++depth;
+                break;
+            case Code::Cell: {
+                Position offset{instruction.cell.row - origin.row,
+                                instruction.cell.col - origin.col};
+                step.input = offsets_.size();
+                offsets_.push_back(offset);
+                AppendBytes(key_, &offset.row, sizeof(offset.row));
+                AppendBytes(key_, &offset.col, sizeof(offset.col));
+                ++depth;
+                break;
+            }
+            case Code::UnaryPlus:
+            case Code::UnaryMinus:
+                break;
+            case Code::Add:
+            case Code::Subtract:
+            case Code::Multiply:
+            case Code::Divide:
+            case Code::Equal:
+            case Code::NotEqual:
+            case Code::Less:
+            case Code::LessOrEqual:
+            case Code::Greater:
+            case Code::GreaterOrEqual:
+                --depth;
+                break;
+            case Code::Range:
+            case Code::Criteria:
+            case Code::Function:
+            case Code::Name:
+            case Code::SheetReference:
+                batchable_ = false;
+                break;
+        }
+
+        max_depth_ = std::max(max_depth_, depth);
+        steps_.push_back(step);
+    }
+}
+
+bool FormulaShape::IsBatchable() const {
+    return batchable_;
+}
+
+const std::string& FormulaShape::GetKey() const {
+    return key_;
+}
+
+size_t FormulaShape::GetInputCount() const {
+    return offsets_.size();
+}
+
+Position FormulaShape::GetInput(Position origin, size_t index) const {
+    return {origin.row + offsets_[index].row, origin.col + offsets_[index].col};
+}
+
+void FormulaShape::Evaluate(const std::vector<const double*>& inputs,
+                            const std::vector<const ErrorCode*>& input_errors,
+                            size_t count, double* out, ErrorCode* out_errors) const {
+    struct Operand {
+        const double* values;
+        const ErrorCode* errors;
+    };
+
+    const ErrorCode arithmetic = ToErrorCode(FormulaError::Category::Arithmetic);
+
+    // Дорожки обрабатываются порциями, чтобы промежуточные массивы
+    // оставались в кэше процессора.
+    const size_t chunk = std::min(count, CHUNK_SIZE);
+    std::vector<double> values(max_depth_ * chunk);
+    std::vector<ErrorCode> errors(max_depth_ * chunk);
+    std::vector<Operand> stack;
+    stack.reserve(max_depth_);
+
+    auto slot_values = [&](size_t depth) { return values.data() + depth * chunk; };
+    auto slot_errors = [&](size_t depth) { return errors.data() + depth * chunk; };
+
+    for (size_t base = 0; base < count; base += chunk) {
+        const size_t n = std::min(chunk, count - base);
+        stack.clear();
+
+        for (const Step& step : steps_) {
+            switch (step.code) {
+                case Code::Number: {
+                    double* dst = slot_values(stack.size());
+                    ErrorCode* dst_errors = slot_errors(stack.size());
+                    std::fill(dst, dst + n, step.number);
+                    std::fill(dst_errors, dst_errors + n, NO_ERROR);
+                    stack.push_back({dst, dst_errors});
+                    break;
+                }
+                case Code::Cell:
+                    stack.push_back({inputs[step.input] + base, input_errors[step.input] + base});
+                    break;
+                case Code::UnaryPlus:
+                case Code::UnaryMinus: {
+                    Operand operand = stack.back();
+                    double* dst = slot_values(stack.size() - 1);
+                    ErrorCode* dst_errors = slot_errors(stack.size() - 1);
+                    auto apply = [&](auto op) {
+                        ApplyUnary(operand.values, operand.errors, dst, dst_errors, n,
+                                   arithmetic, op);
+                    };
+                    if (step.code == Code::UnaryMinus) {
+                        apply([](auto a) { return Neg(a); });
+                    } else {
+                        apply([](auto a) { return a; });
+                    }
+                    stack.back() = {dst, dst_errors};
+                    break;
+                }
+                default: {
+                    Operand rhs = stack.back();
+                    stack.pop_back();
+                    Operand lhs = stack.back();
+                    double* dst = slot_values(stack.size() - 1);
+                    ErrorCode* dst_errors = slot_errors(stack.size() - 1);
+
+                    auto apply = [&](auto op) {
+                        ApplyBinary(lhs.values, lhs.errors, rhs.values, rhs.errors,
+                                    dst, dst_errors, n, arithmetic, op);
+                    };
+                    switch (step.code) {
+                        case Code::Add:
+                            apply([](auto a, auto b) { return Add(a, b); });
+                            break;
+                        case Code::Subtract:
+                            apply([](auto a, auto b) { return Sub(a, b); });
+                            break;
+                        case Code::Multiply:
+                            apply([](auto a, auto b) { return Mul(a, b); });
+                            break;
+                        case Code::Divide:
+                            // Деление на ноль даёт бесконечность или NaN и
+                            // отмечается как #ARITHM! вместе с переполнением.
+                            apply([](auto a, auto b) { return Div(a, b); });
+                            break;
+                        case Code::Equal:
+                            apply([](auto a, auto b) { return Equal(a, b); });
+                            break;
+                        case Code::NotEqual:
+                            apply([](auto a, auto b) { return NotEqual(a, b); });
+                            break;
+                        case Code::Less:
+                            apply([](auto a, auto b) { return Less(a, b); });
+                            break;
+                        case Code::LessOrEqual:
+                            apply([](auto a, auto b) { return LessEqual(a, b); });
+                            break;
+                        case Code::Greater:
+                            apply([](auto a, auto b) { return Greater(a, b); });
+                            break;
+                        case Code::GreaterOrEqual:
+                            apply([](auto a, auto b) { return GreaterEqual(a, b); });
+                            break;
+                        default:
+                            assert(false);
+                    }
+
+                    stack.back() = {dst, dst_errors};
+                    break;
+                }
+            }
+        }
+
+        assert(stack.size() == 1);
+        const Operand& result = stack.back();
+        std::copy(result.values, result.values + n, out + base);
+        std::copy(result.errors, result.errors + n, out_errors + base);
+    }
+}
+
+FormulaBatchEvaluator::FormulaBatchEvaluator(const SheetInterface& sheet)
+        : sheet_(sheet) {}
+
+void FormulaBatchEvaluator::Add(Position origin, const FormulaInterface& formula) {
+    items_.push_back({origin, &formula});
+}
+
+std::vector<FormulaInterface::Value> FormulaBatchEvaluator::Evaluate() const {
+    std::vector<FormulaInterface::Value> results(items_.size(), 0.0);
+
+    std::vector<FormulaShape> shapes;
+    std::vector<std::vector<size_t>> groups;
+    std::unordered_map<std::string_view, size_t> group_by_key;
+    std::vector<size_t> singles;
+
+    shapes.reserve(items_.size());
+    for (size_t i = 0; i < items_.size(); ++i) {
+        const FormulaAST* ast = items_[i].formula->GetAST();
+        if (!ast) {
+            singles.push_back(i);
+            continue;
+        }
+        const auto& formula = *items_[i].formula;
+        FormulaShape shape(*ast, items_[i].origin, [&formula](std::string_view name) {
+            return formula.GetNameValue(name);
+        });
+        if (!shape.IsBatchable()) {
+            singles.push_back(i);
+            continue;
+        }
+        auto it = group_by_key.find(shape.GetKey());
+        if (it == group_by_key.end()) {
+            shapes.push_back(std::move(shape));
+            groups.emplace_back();
+            it = group_by_key.emplace(shapes.back().GetKey(), shapes.size() - 1).first;
+        }
+        groups[it->second].push_back(i);
+    }
+
+    for (size_t g = 0; g < groups.size(); ++g) {
+        if (groups[g].size() < MIN_BATCH_SIZE) {
+            singles.insert(singles.end(), groups[g].begin(), groups[g].end());
+            continue;
+        }
+        EvaluateGroup(shapes[g], groups[g], results);
+    }
+
+    for (size_t i : singles) {
+        results[i] = items_[i].formula->Evaluate(sheet_);
+    }
+
+    return results;
+}
+
+void FormulaBatchEvaluator::EvaluateGroup(const FormulaShape& shape,
+                                          const std::vector<size_t>& group,
+                                          std::vector<FormulaInterface::Value>& results) const {
+    const size_t input_count = shape.GetInputCount();
+    const size_t chunk = std::min(CHUNK_SIZE, group.size());
+
+    std::vector<double> input_values(input_count * chunk);
+    std::vector<ErrorCode> input_errors(input_count * chunk);
+    std::vector<const double*> inputs(input_count);
+    std::vector<const ErrorCode*> errors(input_count);
+    for (size_t k = 0; k < input_count; ++k) {
+        inputs[k] = input_values.data() + k * chunk;
+        errors[k] = input_errors.data() + k * chunk;
+    }
+
+    std::vector<double> out(chunk);
+    std::vector<ErrorCode> out_errors(chunk);
+
+    for (size_t start = 0; start < group.size(); start += chunk) {
+        const size_t count = std::min(chunk, group.size() - start);
+
+        for (size_t k = 0; k < input_count; ++k) {
+            double* values = input_values.data() + k * chunk;
+            ErrorCode* lane_errors = input_errors.data() + k * chunk;
+            for (size_t lane = 0; lane < count; ++lane) {
+                Position pos = shape.GetInput(items_[group[start + lane]].origin, k);
+                auto value = ReadCellAsNumber(sheet_.GetCell(pos));
+                if (auto* number = std::get_if<double>(&value)) {
+                    values[lane] = *number;
+                    lane_errors[lane] = FormulaShape::NO_ERROR;
+                } else {
+                    values[lane] = 0.0;
+                    lane_errors[lane] = FormulaShape::ToErrorCode(
+                            std::get<FormulaError>(value).GetCategory());
+                }
+            }
+        }
+
+        shape.Evaluate(inputs, errors, count, out.data(), out_errors.data());
+
+        for (size_t lane = 0; lane < count; ++lane) {
+            auto& result = results[group[start + lane]];
+            if (out_errors[lane] == FormulaShape::NO_ERROR) {
+                result = out[lane];
+            } else {
+                result = FormulaShape::FromErrorCode(out_errors[lane]);
+            }
+        }
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "FormulaAST.h"
+#include "common.h"
+#include "formula.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Формула, приведённая к относительной форме: ссылки хранятся как смещения
+// от ячейки, в которой записана формула. У ячеек столбца с формулами вида
+// =A{i}*B{i}+C{i} форма одна и та же, поэтому их можно вычислять пачкой.
+class FormulaShape {
+public:
+    // Код ошибки вычисления в дорожке пачки: 0 — ошибки нет, иначе категория
+    // FormulaError, увеличенная на единицу.
+    using ErrorCode = uint8_t;
+
+    static constexpr ErrorCode NO_ERROR = 0;
+
+    static ErrorCode ToErrorCode(FormulaError::Category category);
+    static FormulaError FromErrorCode(ErrorCode code);
+
+    // names даёт значения имён-чисел, связанных с формулой: такие имена
+    // входят в форму как константы. Без names форма с именем не пакетная.
+    FormulaShape(const FormulaAST& ast, Position origin,
+                 const FormulaAST::NameLookup& names = {});
+
+    // Можно ли вычислять форму пачкой. Формулы с функциями и областями
+    // вычисляются только по одной.
+    [[nodiscard]] bool IsBatchable() const;
+
+    // Ключ формы: у формул одинаковой относительной формы ключи совпадают.
+    [[nodiscard]] const std::string& GetKey() const;
+
+    // Число ссылок формулы; каждая ссылка — отдельный вход пачки.
+    [[nodiscard]] size_t GetInputCount() const;
+    [[nodiscard]] Position GetInput(Position origin, size_t index) const;
+
+    // Вычисляет count экземпляров формы. inputs[k][i] и input_errors[k][i] —
+    // значение k-й ссылки i-го экземпляра. Ошибки распространяются так же,
+    // как при вычислении по дереву: побеждает первая ошибка в порядке
+    // вычисления, нечисловой результат операции даёт #ARITHM!.
+    void Evaluate(const std::vector<const double*>& inputs,
+                  const std::vector<const ErrorCode*>& input_errors,
+                  size_t count, double* out, ErrorCode* out_errors) const;
+
+private:
+    struct Step {
+        FormulaAST::Instruction::Code code;
+        double number = 0.0;
+        size_t input = 0;
+    };
+
+    std::vector<Step> steps_;
+    std::vector<Position> offsets_;
+    std::string key_;
+    size_t max_depth_ = 0;
+    bool batchable_ = true;
+};
+
+// Вычисляет набор формул листа: формулы одной относительной формы
+// группируются и вычисляются векторными операциями, остальные — по одной.
+// Результат i-го элемента записывается в results[i].
+class FormulaBatchEvaluator {
+public:
+    // Пачки меньшего размера не окупают сбор входов, такие формулы
+    // вычисляются обычным образом.
+    static constexpr size_t MIN_BATCH_SIZE = 8;
+
+    explicit FormulaBatchEvaluator(const SheetInterface& sheet);
+
+    void Add(Position origin, const FormulaInterface& formula);
+
+    [[nodiscard]] std::vector<FormulaInterface::Value> Evaluate() const;
+
+private:
+    struct Item {
+        Position origin;
+        const FormulaInterface* formula;
+    };
+
+    void EvaluateGroup(const FormulaShape& shape, const std::vector<size_t>& group,
+                       std::vector<FormulaInterface::Value>& results) const;
+
+    const SheetInterface& sheet_;
+    std::vector<Item> items_;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#define PROFILE_CONCAT_INTERNAL(X, Y) X##Y
+#define PROFILE_CONCAT(X, Y) PROFILE_CONCAT_INTERNAL(X, Y)
+#define UNIQUE_VAR_NAME_PROFILE PROFILE_CONCAT(profileGuard, __LINE__)
+#define LOG_DURATION(x) LogDuration UNIQUE_VAR_NAME_PROFILE(x)
+#define LOG_DURATION_STREAM(x, y) LogDuration UNIQUE_VAR_NAME_PROFILE(x, y)
+
+class LogDuration {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit LogDuration(std::string id, std::ostream& out = std::cerr)
+            : id_(std::move(id))
+            , out_(out) {}
+
+    LogDuration(const LogDuration&) = delete;
+    LogDuration& operator=(const LogDuration&) = delete;
+
+    ~LogDuration() {
+        using namespace std::chrono;
+        using namespace std::literals;
+
+        const auto dur = Clock::now() - start_time_;
+        out_ << id_ << ": "s << duration_cast<milliseconds>(dur).count() << " ms"s << std::endl;
+    }
+
+private:
+    const std::string id_;
+    std::ostream& out_;
+    const Clock::time_point start_time_ = Clock::now();
+};
@@ -0,0 +1,111 @@
+#include "lookup_index.h"
+
+#include <cassert>
+#include <cmath>
+
+void LookupIndex::SetValue(int row, double value) {
+    Erase(row);
+    // NaN не равен никакому ключу и не сравним с ним.
+    if (std::isnan(value)) {
+        return;
+    }
+
+    auto [it, inserted] = sorted_.try_emplace(value);
+    it->second.insert(row);
+    if (inserted) {
+        exact_.emplace(value, it);
+    }
+    values_.emplace(row, value);
+}
+
+void LookupIndex::SetFormula(int row) {
+    Erase(row);
+    formula_rows_.insert(row);
+}
+
+void LookupIndex::Erase(int row) {
+    formula_rows_.erase(row);
+    auto it = values_.find(row);
+    if (it == values_.end()) {
+        return;
+    }
+
+    auto node = sorted_.find(it->second);
+    assert(node != sorted_.end());
+    node->second.erase(row);
+    if (node->second.empty()) {
+        exact_.erase(node->first);
+        sorted_.erase(node);
+    }
+    values_.erase(it);
+}
+
+std::optional<LookupIndex::Match> LookupIndex::Find(double key, int first, int last,
+                                                    LookupMatch match) const {
+    if (std::isnan(key)) {
+        return std::nullopt;
+    }
+
+    // Из равных значений берётся последняя строка отрезка.
+    auto last_row = [&](const std::set<int>& rows) -> std::optional<int> {
+        auto it = rows.upper_bound(last);
+        if (it == rows.begin() || *--it < first) {
+            return std::nullopt;
+        }
+        return *it;
+    };
+
+    switch (match) {
+        case LookupMatch::Exact: {
+            auto it = exact_.find(key);
+            if (it == exact_.end()) {
+                return std::nullopt;
+            }
+            const auto& rows = it->second->second;
+            auto row = rows.lower_bound(first);
+            if (row == rows.end() || *row > last) {
+                return std::nullopt;
+            }
+            return Match{it->second->first, *row};
+        }
+        case LookupMatch::LessOrEqual:
+            for (auto it = sorted_.upper_bound(key); it != sorted_.begin();) {
+                --it;
+                if (auto row = last_row(it->second)) {
+                    return Match{it->first, *row};
+                }
+            }
+            return std::nullopt;
+        case LookupMatch::GreaterOrEqual:
+            for (auto it = sorted_.lower_bound(key); it != sorted_.end(); ++it) {
+                if (auto row = last_row(it->second)) {
+                    return Match{it->first, *row};
+                }
+            }
+            return std::nullopt;
+    }
+    return std::nullopt;
+}
+
+const std::set<int>* LookupIndex::FindRows(double key) const {
+    auto it = exact_.find(key);
+    return it == exact_.end() ? nullptr : &it->second->second;
+}
+
+bool LookupIndex::IsBetter(LookupMatch match, const Match& candidate,
+                           const std::optional<Match>& current) {
+    if (!current) {
+        return true;
+    }
+    switch (match) {
+        case LookupMatch::Exact:
+            return candidate.row < current->row;
+        case LookupMatch::LessOrEqual:
+            return candidate.value > current->value
+                   || (candidate.value == current->value && candidate.row > current->row);
+        case LookupMatch::GreaterOrEqual:
+            return candidate.value < current->value
+                   || (candidate.value == current->value && candidate.row > current->row);
+    }
+    return false;
+}
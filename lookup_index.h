@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.h"
+
+#include <map>
+#include <optional>
+#include <set>
+#include <unordered_map>
+
+// Индекс значений одного столбца для функций поиска. Числовые константы
+// хранятся в упорядоченном словаре «значение → строки»: поиск
+// наибольшего не большего или наименьшего не меньшего ключа идёт по нему,
+// а точный поиск находит запись словаря через хеш-таблицу за O(1).
+// Ячейки с формулами перечисляются отдельно: их значения меняются без
+// изменения ячейки, поэтому их вычисляют при каждом поиске. Пустые
+// ячейки, ошибки и нечисловой текст в индекс не входят.
+class LookupIndex {
+public:
+    // Найденная ячейка столбца.
+    struct Match {
+        double value;
+        int row;
+    };
+
+    void SetValue(int row, double value);
+    void SetFormula(int row);
+    // Строка больше ни с чем не совпадает.
+    void Erase(int row);
+
+    // Лучшее совпадение с key среди констант строк [first, last]. Для
+    // LessOrEqual и GreaterOrEqual перебирает значения начиная с ближайшего
+    // к ключу, пока у очередного не найдётся строки в отрезке.
+    [[nodiscard]] std::optional<Match> Find(double key, int first, int last,
+                                            LookupMatch match) const;
+
+    // Строки констант, равных key, по возрастанию; nullptr, если таких нет.
+    [[nodiscard]] const std::set<int>* FindRows(double key) const;
+
+    // Лучше ли candidate, чем current, по правилам SheetInterface::FindInRange.
+    // Оба значения уже удовлетворяют ключу.
+    static bool IsBetter(LookupMatch match, const Match& candidate,
+                         const std::optional<Match>& current);
+
+    // Строки с формулами, по возрастанию.
+    [[nodiscard]] const std::set<int>& GetFormulaRows() const {
+        return formula_rows_;
+    }
+
+private:
+    using SortedValues = std::map<double, std::set<int>>;
+
+    SortedValues sorted_;
+    std::unordered_map<double, SortedValues::iterator> exact_;
+    std::unordered_map<int, double> values_;
+    std::set<int> formula_rows_;
+};
@@ -1,8 +1,24 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
+#include <random>
+#include <thread>
 
+#include "FormulaAST.h"
+#include "aggregate.h"
+#include "allocation_counter.h"
+#include "benchmarks.h"
 #include "common.h"
 #include "formula.h"
+#include "formula_batch.h"
+#include "nan_box.h"
+#include "range_index.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "workbook.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -12,6 +28,10 @@ inline Position operator"" _pos(const char* str, std::size_t) {
     return Position::FromString(str);
 }
 
+inline std::ostream& operator<<(std::ostream& output, const Range& range) {
+    return output << range.ToString();
+}
+
 inline std::ostream& operator<<(std::ostream& output, Size size) {
     return output << "(" << size.rows << ", " << size.cols << ")";
 }
@@ -346,9 +366,2313 @@ namespace {
         ASSERT(caught);
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
     }
-}  // namespace
 
-int main() {
+    void TestFormulaCache() {
+        ClearFormulaCache();
+
+        auto first = ParseFormula("A1 + 2*B2");
+        auto second = ParseFormula("A1 + 2*B2");
+        auto canonical = ParseFormula("A1+2*B2");
+
+        auto stats = GetFormulaCacheStats();
+        ASSERT_EQUAL(stats.misses, 1u);
+        ASSERT_EQUAL(stats.hits, 2u);
+        ASSERT_EQUAL(second->GetExpression(), "A1+2*B2");
+        ASSERT_EQUAL(canonical->GetReferencedCells(), (std::vector{"A1"_pos, "B2"_pos}));
+
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "3");
+        sheet->SetCell("B2"_pos, "4");
+        ASSERT_EQUAL(std::get<double>(first->Evaluate(*sheet)), 11);
+        ASSERT_EQUAL(std::get<double>(second->Evaluate(*sheet)), 11);
+
+        try {
+            ParseFormula("1+");
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+        ASSERT_EQUAL(GetFormulaCacheStats().misses, 2u);
+    }
+
+    void TestFormulaCacheExactNumbers() {
+        auto sheet = CreateSheet();
+        auto value = [&](const std::string& expression) {
+            return std::get<double>(ParseFormula(expression)->Evaluate(*sheet));
+        };
+
+        // Каноническая запись округляет числа, поэтому не подменяет
+        // точную запись ни до, ни после неё.
+        ClearFormulaCache();
+        ASSERT_EQUAL(value("1.23456789"), 1.23456789);
+        ASSERT_EQUAL(value("1.23457"), 1.23457);
+        ClearFormulaCache();
+        ASSERT_EQUAL(value("1.23457"), 1.23457);
+        ASSERT_EQUAL(value("1.23456789"), 1.23456789);
+
+        ClearFormulaCache();
+        ASSERT_EQUAL(value("1234567"), 1234567.0);
+        ASSERT_EQUAL(value("1.23457e+06"), 1.23457e+06);
+        ClearFormulaCache();
+        ASSERT_EQUAL(value("1.23457e+06"), 1.23457e+06);
+        ASSERT_EQUAL(value("1234567"), 1234567.0);
+
+        // Точная каноническая запись по-прежнему общая.
+        ClearFormulaCache();
+        ASSERT_EQUAL(value("1.5 + A1"), 1.5);
+        ASSERT_EQUAL(value("1.5+A1"), 1.5);
+        ASSERT_EQUAL(GetFormulaCacheStats().hits, 1u);
+    }
+
+    void TestFormulaCacheEviction() {
+        const size_t capacity = GetFormulaCacheStats().capacity;
+        SetFormulaCacheCapacity(2);
+        ClearFormulaCache();
+
+        ParseFormula("1");
+        ParseFormula("2");
+        ParseFormula("1");
+        ParseFormula("3");
+        ASSERT_EQUAL(GetFormulaCacheStats().size, 2u);
+
+        ParseFormula("1");
+        ParseFormula("2");
+        auto stats = GetFormulaCacheStats();
+        ASSERT_EQUAL(stats.hits, 2u);
+        ASSERT_EQUAL(stats.misses, 4u);
+
+        SetFormulaCacheCapacity(0);
+        ParseFormula("1");
+        stats = GetFormulaCacheStats();
+        ASSERT_EQUAL(stats.size, 0u);
+        ASSERT_EQUAL(stats.misses, 5u);
+
+        SetFormulaCacheCapacity(capacity);
+        ClearFormulaCache();
+    }
+
+    void TestBatchEvaluationMatchesSingle() {
+        auto sheet = CreateSheet();
+        constexpr int ROWS = 37;
+        const std::vector<std::string> inputs = {
+                "1", "0", "-2.5", "", "abc", "1e308", "=1/0", "'7", "=A1", "3",
+        };
+        for (int row = 0; row < ROWS; ++row) {
+            sheet->SetCell(Position{row, 0}, inputs[row % inputs.size()]);
+            sheet->SetCell(Position{row, 1}, inputs[(row * 3 + 1) % inputs.size()]);
+        }
+
+        const std::vector<std::string> shapes = {
+                "A{}*B{}+2",
+                "B{}*A{}",
+                "A{}/B{}",
+                "-A{}-(B{}*1e308)",
+                "+A{}+B{}*B{}",
+                "(A{}<B{})+(A{}=B{})*2-(A{}>=1)+(B{}<>0)",
+        };
+        for (const auto& shape : shapes) {
+            std::vector<std::unique_ptr<FormulaInterface>> formulas;
+            FormulaBatchEvaluator batch(*sheet);
+            for (int row = 0; row < ROWS; ++row) {
+                std::string text;
+                for (char c : shape) {
+                    text += c == '{' ? std::to_string(row + 1) : (c == '}' ? "" : std::string(1, c));
+                }
+                formulas.push_back(ParseFormula(text));
+                batch.Add(Position{row, 2}, *formulas.back());
+            }
+
+            auto values = batch.Evaluate();
+            ASSERT_EQUAL(values.size(), formulas.size());
+            for (size_t i = 0; i < formulas.size(); ++i) {
+                auto expected = formulas[i]->Evaluate(*sheet);
+                ASSERT(expected == values[i]);
+            }
+        }
+    }
+
+    void TestSheetRecalculateInBatches() {
+        auto sheet = CreateSheet();
+        constexpr int ROWS = 100;
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string r = std::to_string(row + 1);
+            sheet->SetCell(Position{row, 0}, std::to_string(row));
+            sheet->SetCell(Position{row, 1}, row % 10 == 0 ? "x" : "2");
+            sheet->SetCell(Position{row, 2}, "=A" + r + "*B" + r + "+1");
+            sheet->SetCell(Position{row, 3}, "=C" + r + "/A" + r);
+        }
+
+        std::ostringstream values;
+        sheet->PrintValues(values);
+
+        for (int row = 0; row < ROWS; ++row) {
+            auto c = sheet->GetCell(Position{row, 2})->GetValue();
+            auto d = sheet->GetCell(Position{row, 3})->GetValue();
+            if (row % 10 == 0) {
+                ASSERT_EQUAL(c, CellInterface::Value(FormulaError::Category::Value));
+                ASSERT_EQUAL(d, CellInterface::Value(FormulaError::Category::Value));
+            } else {
+                ASSERT_EQUAL(c, CellInterface::Value(row * 2.0 + 1));
+                ASSERT_EQUAL(d, CellInterface::Value((row * 2.0 + 1) / row));
+            }
+        }
+    }
+
+    void TestNanBoxEncoding() {
+        using Category = FormulaError::Category;
+        const std::vector<Category> categories = {
+                Category::Ref, Category::Value, Category::Arithmetic,
+                Category::NotAvailable, Category::Name, Category::Spill,
+        };
+        for (Category category : categories) {
+            double boxed = NanBox::FromError(category);
+            ASSERT(NanBox::IsError(boxed));
+            ASSERT(NanBox::GetCategory(boxed) == category);
+            ASSERT(NanBox::ToValue(boxed) == FormulaInterface::Value(FormulaError(category)));
+        }
+
+        constexpr double inf = std::numeric_limits<double>::infinity();
+        const std::vector<double> numbers = {
+                0.0, -0.0, 1.0, -2.5, std::numeric_limits<double>::max(),
+                std::numeric_limits<double>::denorm_min(), inf, -inf,
+                std::numeric_limits<double>::quiet_NaN(),
+                NanBox::FromBits(NanBox::ERROR_TAG | 2),
+        };
+        for (double number : numbers) {
+            double boxed = NanBox::FromNumber(number);
+            ASSERT(!NanBox::IsError(boxed));
+            if (number == number) {
+                ASSERT_EQUAL(NanBox::ToBits(boxed), NanBox::ToBits(number));
+            }
+        }
+    }
+
+    void TestNanBoxArithmeticMatchesVariant() {
+        using Value = FormulaInterface::Value;
+        using Category = FormulaError::Category;
+        constexpr double max = std::numeric_limits<double>::max();
+        constexpr double inf = std::numeric_limits<double>::infinity();
+
+        // Эталон: вычисление над variant с ветвлениями, как до NaN-boxing.
+        auto reference = [](char op, const Value& lhs, const Value& rhs) -> Value {
+            if (std::holds_alternative<FormulaError>(lhs)) {
+                return lhs;
+            }
+            const bool unary = op == 'n' || op == 'p';
+            if (!unary && std::holds_alternative<FormulaError>(rhs)) {
+                return rhs;
+            }
+            double a = std::get<double>(lhs);
+            double b = unary ? 0.0 : std::get<double>(rhs);
+            double result = 0.0;
+            switch (op) {
+                case '+': result = a + b; break;
+                case '-': result = a - b; break;
+                case '*': result = a * b; break;
+                case '/':
+                    if (b == 0.0) {
+                        return FormulaError(Category::Arithmetic);
+                    }
+                    result = a / b;
+                    break;
+                case 'n': result = -a; break;
+                case 'p': result = +a; break;
+            }
+            if (!std::isfinite(result)) {
+                return FormulaError(Category::Arithmetic);
+            }
+            return result;
+        };
+        auto boxed = [](char op, double a, double b) {
+            switch (op) {
+                case '+': return NanBox::Add(a, b);
+                case '-': return NanBox::Subtract(a, b);
+                case '*': return NanBox::Multiply(a, b);
+                case '/': return NanBox::Divide(a, b);
+                case 'n': return NanBox::Negate(a);
+                default: return NanBox::Plus(a);
+            }
+        };
+
+        const std::vector<Value> operands = {
+                0.0, -0.0, 1.0, -1.0, 0.5, 3.0, max, -max, 1e-308, inf, -inf,
+                std::numeric_limits<double>::quiet_NaN(),
+                FormulaError(Category::Ref), FormulaError(Category::Value),
+                FormulaError(Category::Arithmetic),
+        };
+        for (char op : {'+', '-', '*', '/', 'n', 'p'}) {
+            for (const auto& lhs : operands) {
+                for (const auto& rhs : operands) {
+                    Value expected = reference(op, lhs, rhs);
+                    Value actual = NanBox::ToValue(
+                            boxed(op, NanBox::FromValue(lhs), NanBox::FromValue(rhs)));
+                    ASSERT_EQUAL(expected.index(), actual.index());
+                    if (std::holds_alternative<double>(expected)) {
+                        ASSERT_EQUAL(NanBox::ToBits(std::get<double>(expected)),
+                                     NanBox::ToBits(std::get<double>(actual)));
+                    } else {
+                        ASSERT(expected == actual);
+                    }
+                }
+            }
+        }
+    }
+
+    void TestParseNumberTextMatchesStrtod() {
+        auto reference = [](const std::string& text) -> std::optional<double> {
+            char* end = nullptr;
+            double parsed = std::strtod(text.c_str(), &end);
+            if (end && *end == '\0') {
+                return parsed;
+            }
+            return std::nullopt;
+        };
+
+        const std::vector<std::string> texts = {
+                "0", "1", "-1", "+1", "42", "007", "1.5", "-.5", ".5", "5.", ".", "-", "+",
+                "1e5", "1E+5", "1e-5", "1e", "1e+", "2.5e3x", " 1", "\t\n 1", "1 ", "  ",
+                "+-1", "-+1", "--1", "0x1A", "0X1a", "-0x10", "0x", "0x-1", "0x1p3",
+                "0x1.8p1", "0x1p", "0xg", "inf", "-INF", "Infinity", "infinit", "nan",
+                "NaN(123)", "nan(", "1e400", "-1e400", "1e-400", "4.9e-324",
+                "1,5", "abc", "3D", "A1", "1.2.3", std::string("1\0abc", 5),
+                std::string("\0x", 2), "\v\f\r7",
+        };
+        for (const auto& text : texts) {
+            auto expected = reference(text);
+            auto actual = ParseNumberText(text);
+            ASSERT_EQUAL(expected.has_value(), actual.has_value());
+            if (expected && *expected == *expected) {
+                ASSERT_EQUAL(NanBox::ToBits(*expected), NanBox::ToBits(*actual));
+            } else if (expected) {
+                ASSERT(*actual != *actual);
+            }
+        }
+        ASSERT(!ParseNumberText("").has_value());
+    }
+
+    void TestTextCellNumericValue() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, " 2.5");
+        sheet->SetCell("A2"_pos, "'3");
+        sheet->SetCell("A3"_pos, "x");
+        sheet->SetCell("A4"_pos, "'");
+        sheet->SetCell("A5"_pos, "=A1*A2");
+
+        auto numeric = [&](Position pos) { return sheet->GetCell(pos)->GetNumericValue(); };
+        ASSERT(numeric("A1"_pos) == CellInterface::NumericValue(2.5));
+        ASSERT(numeric("A2"_pos) == CellInterface::NumericValue(3.0));
+        ASSERT(numeric("A3"_pos)
+               == CellInterface::NumericValue(FormulaError(FormulaError::Category::Value)));
+        ASSERT(numeric("A4"_pos) == CellInterface::NumericValue(0.0));
+        ASSERT(numeric("A5"_pos) == CellInterface::NumericValue(7.5));
+
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value("3"));
+        sheet->SetCell("A6"_pos, "=A3+A4");
+        ASSERT_EQUAL(sheet->GetCell("A6"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Value));
+    }
+
+    void TestFormulaMemoryFootprint() {
+        AllocationCounter::Scope counting;
+        constexpr int COUNT = 1000;
+        const size_t capacity = GetFormulaCacheStats().capacity;
+        SetFormulaCacheCapacity(0);
+
+        auto row = [](int i) { return std::to_string(i + 1); };
+        // Короткое и длинное выражения с одним деревом ссылок; длинное
+        // отличается только числом, которое длиннее в записи.
+        auto expression = [&](int i, bool long_text) {
+            return "A" + row(i) + "+B" + row(i) + "*C" + row(i) + "-A" + row(i)
+                   + (long_text ? "*1.25e-100" : "*2");
+        };
+
+        // Байты на формулу и на ячейку с формулой, в среднем по COUNT штукам.
+        auto per_formula = [&](bool long_text) {
+            std::vector<std::unique_ptr<FormulaInterface>> formulas;
+            formulas.reserve(COUNT);
+            const long long before = AllocationCounter::GetLiveBytes();
+            for (int i = 0; i < COUNT; ++i) {
+                formulas.push_back(ParseFormula(expression(i, long_text)));
+            }
+            return (AllocationCounter::GetLiveBytes() - before) / COUNT;
+        };
+        auto per_cell = [&](bool long_text) {
+            auto sheet = CreateSheet();
+            for (int i = 0; i < COUNT; ++i) {
+                sheet->SetCell(Position{i, 0}, "1");
+                sheet->SetCell(Position{i, 1}, "2");
+                sheet->SetCell(Position{i, 2}, "3");
+            }
+            const long long before = AllocationCounter::GetLiveBytes();
+            for (int i = 0; i < COUNT; ++i) {
+                sheet->SetCell(Position{i, 3}, "=" + expression(i, long_text));
+            }
+            return (AllocationCounter::GetLiveBytes() - before) / COUNT;
+        };
+
+        // Выражение хранится один раз: в ячейке длинная запись дороже
+        // короткой ровно настолько же, насколько в самой формуле.
+        const long long text_bytes = per_formula(true) - per_formula(false);
+        ASSERT(text_bytes > 0);
+        ASSERT_EQUAL(per_cell(true) - per_cell(false), text_bytes);
+
+        // Ссылки хранятся одним массивом без повторов: три лишние разные
+        // ссылки стоят ровно три элемента массива.
+        auto bytes_of = [](const std::string& text) {
+            const long long before = AllocationCounter::GetLiveBytes();
+            auto formula = ParseFormula(text);
+            return AllocationCounter::GetLiveBytes() - before;
+        };
+        ASSERT_EQUAL(bytes_of("A1+B1+C1+D1") - bytes_of("A1+A1+A1+A1"),
+                     static_cast<long long>(3 * sizeof(Position)));
+
+        // Ссылки печатаются в каноническом виде.
+        auto sheet = CreateSheet();
+        sheet->SetCell("E1"_pos, "=A01+A1");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetText(), "=A1+A1");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetReferencedCells().size(), 1u);
+
+        SetFormulaCacheCapacity(capacity);
+    }
+
+    // Результат разбора в сравнимом виде: обратная польская запись с точными
+    // битами чисел, ссылки, области и каноническая запись; для ошибки — "<error>".
+    std::string DescribeAST(const FormulaAST& ast) {
+        using Code = FormulaAST::Instruction::Code;
+        std::ostringstream out;
+        for (const auto& instruction : ast.Linearize()) {
+            out << static_cast<int>(instruction.code) << ':'
+                << NanBox::ToBits(instruction.number) << ':'
+                << instruction.cell.ToString();
+            if (instruction.code == Code::Range) {
+                out << ':' << instruction.range.ToString();
+            } else if (instruction.code == Code::Criteria) {
+                out << ':' << static_cast<int>(instruction.criteria.GetCompare()) << ':'
+                    << NanBox::ToBits(instruction.criteria.GetOperand());
+            } else if (instruction.code == Code::Function) {
+                out << ':' << GetFormulaFunctionName(instruction.function)
+                    << ':' << instruction.argument_count;
+            }
+            out << ' ';
+        }
+        out << '|';
+        for (const auto& pos : ast.GetReferencedCells()) {
+            out << pos.ToString() << ' ';
+        }
+        out << '|';
+        for (const auto& pos : ast.GetConditionalCells()) {
+            out << pos.ToString() << ' ';
+        }
+        out << '|';
+        for (const auto& range : ast.GetReferencedRanges()) {
+            out << range.ToString() << ' ';
+        }
+        out << '|';
+        ast.PrintFormula(out);
+        return out.str();
+    }
+
+    std::string DescribeParse(const std::string& expression, FormulaParserBackend backend) {
+        try {
+            return DescribeAST(ParseFormulaAST(expression, backend));
+        } catch (const FormulaException&) {
+            return "<error>";
+        }
+    }
+
+    std::string RandomExpression(std::mt19937& rng, int depth) {
+        auto pick = [&](int n) { return static_cast<int>(rng() % n); };
+        if (depth == 0 || pick(3) == 0) {
+            switch (pick(4)) {
+                case 0:
+                    return std::to_string(pick(1000));
+                case 1:
+                    return std::to_string(pick(100)) + "." + std::to_string(pick(100))
+                           + (pick(2) ? "e" + std::to_string(pick(40) - 20) : "");
+                default:
+                    return Position{pick(100), pick(60)}.ToString();
+            }
+        }
+        switch (pick(5)) {
+            case 0:
+                return "(" + RandomExpression(rng, depth - 1) + ")";
+            case 1:
+                return std::string(1, "+-"[pick(2)]) + RandomExpression(rng, depth - 1);
+            case 2: {
+                static const char* const functions[] = {"SUM", "MIN", "MAX", "AVERAGE", "COUNT"};
+                std::string result = std::string(functions[pick(5)]) + "(";
+                const int args = 1 + pick(3);
+                for (int i = 0; i < args; ++i) {
+                    result += i > 0 ? "," : "";
+                    result += pick(2) ? Position{pick(100), pick(60)}.ToString() + ":"
+                                        + Position{pick(100), pick(60)}.ToString()
+                                      : RandomExpression(rng, depth - 1);
+                }
+                return result + ")";
+            }
+            default:
+                return RandomExpression(rng, depth - 1) + std::string(1, "+-*/"[pick(4)])
+                       + (pick(4) == 0 ? " " : "") + RandomExpression(rng, depth - 1);
+        }
+    }
+
+    void TestPrattParserMatchesAntlr() {
+        std::vector<std::string> corpus = {
+                "1", "1.5", ".5", "1.", ".", "1e5", "1E+5", "1e-5", "1.5e3", ".5E-2",
+                "1e", "1e+", "1E", "1EA1", "1e999", "1e-400", "4.9e-324", "00012",
+                "A1", "A01", "ZZZ1", "XFD16384", "XFE1", "A16385", "A0", "AB", "a1",
+                "1+2", "1+-2", "--1", "-+-1", "-1*2", "2*-3", "1-2-3", "8/4/2",
+                "1+2*3", "(1+2)*3", "-(1+2)", "((A1))", "()", "(1", "1)", "1 2",
+                "A1B2", "1.5.5", "", " ", "\t1\n+\r2 ", "1\f+2", "+", "1+", "*1",
+                "1**2", "=1", "1;", "$A$1", "A1:B2", "SUM(A1)", "1,5",
+                "SUM(A1:B2)", "SUM(B2:A1,3)", "sum(A1)", "SUM()", "SUM(,)", "SUM(1,)",
+                "SUM(A1:B2+1)", "SUM(A1:)", "SUM(A1:B)", "SUM(A0:B2)", "SUM (1)",
+                "FOO(1)", "SUM", "COUNT(A1:A3)*-AVERAGE(MIN(1,2),MAX(C1:C2))",
+                "SUM(SUM(A1:B2))", "-SUM(1)", "SUM(A1:XFD16384)", "A1:B2:C3",
+                "VLOOKUP(A1,B1:C9,2)", "VLOOKUP(1,2,3)", "MATCH(1,A1:A9,0,1)",
+                "INDEX(A1,1)", "INDEX(A1:B2,A1:B2)", "VLOOKUP(1,A1:B2)",
+                "SUMIF(A1:A9,\">=2\",B1:B9)", "COUNTIF(A1:A9,\"<>1.50\")",
+                "AVERAGEIF(A1:A9,A1+1)", "COUNTIF(A1:A9,\"x\")", "COUNTIF(A1:A9,\"\")",
+                "SUMIF(\"1\",A1:A9)", "\"1\"", "1+\"1\"", "COUNTIF(A1:A9,\"=-1e3\")",
+                "1<2", "1<>2", "1<=2=1", "1>=-2", "1>2<3", "1=<2", "1=>2", "1<", "<1",
+                "-(A1<2)", "(1<2)+1", "1<(2<3)", "1+2>3*4", "IF(A1>0,B1,C1)", "IF(1,2)",
+                "IF(1)", "IFERROR(A1/B1,C1+IF(D1,E1,A1))", "SUM(A1<>B1,IF(0,B1:C2,1))",
+                "TaxRate*2", "SUM(Prices)", "_x", "AB", "a1", "TAX+1", "IF(Rate>0,Rate,0)",
+                "SUM", "SUM+1", "A1B", "Ab1:B2", "x(1)", "COUNTIF(Data,\">1\")",
+                "Sheet1!A1", "Data!B2*2", "SUM(Data!A1:B3)", "Data!A1:B3", "Data! A1",
+                "Data!", "!A1", "1x!A1", "A1!A1", "_!A1+B1", "SUM(Data!A1)", "Data!SUM(1)",
+                "SUMIF(Data!A1:A9,\">1\",B1:B9)", "VLOOKUP(1,Data!A1:B9,2)", "Data!x",
+                "A1:B2*2", "-A1:A3", "A1:A3*B1:B3+1", "SUM(A1:A3*2)", "Data!A1:B2*2",
+                "(A1:A3)/2", "A1:A3<1", "SUM(A1:B2 1)",
+                "NOW()", "RAND()*2+A1", "NOW(1)", "RAND", "NOW ( )", "IF(RAND()<0.5,A1,B1)",
+        };
+
+        std::mt19937 rng(20241018);
+        const std::string alphabet = "0123456789.eE+-*/() \tABZ,:<>=x_!";
+        for (int i = 0; i < 20000; ++i) {
+            std::string text(1 + rng() % 12, ' ');
+            for (char& c : text) {
+                c = alphabet[rng() % alphabet.size()];
+            }
+            corpus.push_back(std::move(text));
+        }
+        for (int i = 0; i < 5000; ++i) {
+            corpus.push_back(RandomExpression(rng, 1 + static_cast<int>(rng() % 6)));
+        }
+
+        size_t valid = 0;
+        for (const auto& expression : corpus) {
+            const auto expected = DescribeParse(expression, FormulaParserBackend::Antlr);
+            const auto actual = DescribeParse(expression, FormulaParserBackend::Pratt);
+            AssertEqual(actual, expected, "expression: \"" + expression + "\"");
+            valid += expected != "<error>";
+        }
+        // Корпус проверяет обе ветви: и разобранные формулы, и ошибки.
+        ASSERT(valid > corpus.size() / 5);
+        ASSERT(valid < corpus.size());
+    }
+
+    void TestParserBackendSelection() {
+        const auto backend = GetFormulaParserBackend();
+        ASSERT(backend == FormulaParserBackend::Pratt);
+
+        for (auto selected : {FormulaParserBackend::Antlr, FormulaParserBackend::Pratt}) {
+            SetFormulaParserBackend(selected);
+            ASSERT(GetFormulaParserBackend() == selected);
+
+            std::ostringstream out;
+            ParseFormulaAST("1 + A2*(3 - B4)").PrintFormula(out);
+            ASSERT_EQUAL(out.str(), "1+A2*(3-B4)");
+
+            bool caught = false;
+            try {
+                ParseFormulaAST("1 +");
+            } catch (const FormulaException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+
+        SetFormulaParserBackend(backend);
+    }
+
+    // Контекст ANTLR переиспользуется: ошибка разбора не должна влиять на
+    // следующие разборы, а у каждого потока свой контекст.
+    void TestAntlrContextReuse() {
+        const std::vector<std::pair<std::string, std::string>> cases = {
+                {"1+2*3", "1+2*3"},
+                {"1 +", ""},
+                {"(A1 - B2) / 4", "(A1-B2)/4"},
+                {"A0", ""},
+                {"-(C3)", "-C3"},
+                {"1..2", ""},
+        };
+
+        auto run = [&](int rounds) {
+            for (int i = 0; i < rounds; ++i) {
+                for (const auto& [expression, expected] : cases) {
+                    std::string printed;
+                    try {
+                        std::ostringstream out;
+                        ParseFormulaAST(expression, FormulaParserBackend::Antlr).PrintFormula(out);
+                        printed = out.str();
+                    } catch (const FormulaException&) {
+                    }
+                    if (printed != expected) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        };
+
+        ASSERT(run(100));
+
+        std::vector<std::thread> threads;
+        std::vector<char> ok(4, false);
+        for (size_t i = 0; i < ok.size(); ++i) {
+            threads.emplace_back([&, i] { ok[i] = run(200); });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (char thread_ok : ok) {
+            ASSERT(thread_ok);
+        }
+    }
+
+    void TestFormulaParserWarmUp() {
+        const auto stats = GetFormulaCacheStats();
+
+        ClearAntlrPredictionCaches();
+        WarmUpFormulaParser();
+        WarmUpFormulaParser({"1 +", "A1*(B2-3)", "A0"});
+
+        auto warm_up = WarmUpFormulaParserAsync();
+        // Разбор не ждёт окончания фонового прогрева.
+        for (const std::string expression : {"A1*(B2-3)", "-(1+2)/C3", "1 +"}) {
+            AssertEqual(DescribeParse(expression, FormulaParserBackend::Antlr),
+                        DescribeParse(expression, FormulaParserBackend::Pratt), expression);
+        }
+        warm_up.get();
+        WarmUpFormulaParserAsync({"(1)", "2*"}).get();
+
+        // Прогрев не трогает кэш разобранных формул.
+        const auto after = GetFormulaCacheStats();
+        ASSERT_EQUAL(after.hits, stats.hits);
+        ASSERT_EQUAL(after.misses, stats.misses);
+        ASSERT_EQUAL(after.size, stats.size);
+    }
+
+    void TestFormulaDiagnostics() {
+        ASSERT(!ValidateFormula("1 + A2*(3 - B4)"));
+
+        auto check = [](std::string_view expression, size_t offset, std::string_view message,
+                        std::string_view expected) {
+            auto diagnostic = ValidateFormula(expression);
+            ASSERT(diagnostic.has_value());
+            AssertEqual(diagnostic->offset, offset, std::string(expression));
+            AssertEqual(diagnostic->message.find(message) != std::string::npos, true,
+                        diagnostic->message);
+            if (!expected.empty()) {
+                const auto& tokens = diagnostic->expected;
+                AssertEqual(std::find(tokens.begin(), tokens.end(), expected) != tokens.end(),
+                            true, diagnostic->ToString());
+            }
+        };
+
+        check("1+", 2, "<EOF>", "NUMBER");
+        check("1 2", 2, "'2'", "<EOF>");
+        check("(1+A1", 5, "<EOF>", "')'");
+        check("1$", 1, "token recognition error", "");
+        check("A0", 0, "Invalid position", "");
+        check("1e999", 0, "Invalid number", "");
+        // Синтаксическая ошибка важнее некорректной ссылки перед ней.
+        check("A0 2", 3, "'2'", "<EOF>");
+
+        auto parsed = TryParseFormula("A1 + 1");
+        auto* formula = std::get_if<std::unique_ptr<FormulaInterface>>(&parsed);
+        ASSERT(formula != nullptr);
+        ASSERT_EQUAL((*formula)->GetExpression(), "A1+1");
+
+        parsed = TryParseFormula("A1 +");
+        auto* diagnostic = std::get_if<FormulaDiagnostic>(&parsed);
+        ASSERT(diagnostic != nullptr);
+        ASSERT_EQUAL(diagnostic->offset, 4u);
+
+        // Позиции ошибок ANTLR указывают на ту же лексему.
+        for (const std::string expression : {"1+", "1$", "(1"}) {
+            FormulaDiagnostic expected;
+            FormulaDiagnostic actual;
+            TryParseFormulaAST(expression, FormulaParserBackend::Pratt, expected);
+            ASSERT(!TryParseFormulaAST(expression, FormulaParserBackend::Antlr, actual));
+            AssertEqual(actual.offset, expected.offset, expression);
+        }
+
+        auto sheet = CreateSheet();
+        try {
+            sheet->SetCell("A1"_pos, "=1+*2");
+            ASSERT(false);
+        } catch (const FormulaException& e) {
+            ASSERT(std::string(e.what()).find("at position 2") != std::string::npos);
+        }
+    }
+
+    void TestBulkSetCellsMatchesSequential() {
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < 300; ++row) {
+            const auto r = std::to_string(row + 1);
+            cells.emplace_back(Position{row, 0}, std::to_string(row) + ".5");
+            cells.emplace_back(Position{row, 1}, row % 7 == 0 ? "text" : "=A" + r + "*2");
+            cells.emplace_back(Position{row, 2}, "=A" + r + " + B" + r + "/(1 - A" + r + ")");
+            cells.emplace_back(Position{row, 3}, row % 5 == 0 ? "'=escaped" : "=C" + r + "+D1");
+        }
+        // Повторная запись той же ячейки: побеждает последняя.
+        cells.emplace_back(Position{0, 0}, "=1+2");
+
+        auto sequential = CreateSheet();
+        for (const auto& [pos, text] : cells) {
+            sequential->SetCell(pos, text);
+        }
+
+        for (size_t threads : {1, 2, 4, 0}) {
+            auto bulk = CreateSheet();
+            bulk->SetCells(cells, threads);
+
+            std::ostringstream expected_texts, actual_texts, expected_values, actual_values;
+            sequential->PrintTexts(expected_texts);
+            bulk->PrintTexts(actual_texts);
+            sequential->PrintValues(expected_values);
+            bulk->PrintValues(actual_values);
+            ASSERT_EQUAL(actual_texts.str(), expected_texts.str());
+            ASSERT_EQUAL(actual_values.str(), expected_values.str());
+        }
+    }
+
+    void TestBulkSetCellsErrors() {
+        auto sheet = CreateSheet();
+        try {
+            sheet->SetCells({{"A1"_pos, "1"}, {"A2"_pos, "=A1+"}, {"A3"_pos, "3"}}, 4);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "1");
+        ASSERT(sheet->GetCell("A3"_pos) == nullptr);
+
+        try {
+            sheet->SetCells({{"B1"_pos, "=B2"}, {"B2"_pos, "=B1"}, {"B3"_pos, "3"}}, 4);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=B2");
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "");
+        ASSERT(sheet->GetCell("B3"_pos) == nullptr);
+
+        try {
+            sheet->SetCells({{"C1"_pos, "=1"}, {Position{-1, 0}, "=2"}}, 4);
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetText(), "=1");
+    }
+    void TestTrivialFormulaFastPath() {
+        const std::vector<std::string> trivial = {
+                "B7", "42", "1.5", ".5", "1e5", "1.5E-3", "00012", "XFD16384",
+                "A1+B1", "A1-1", "2*B3", "C4/D5", "A1+A1", " A1 ", "\tA1 *\n2\r",
+                "4.9e-324",
+        };
+        for (const auto& expression : trivial) {
+            auto ast = TryParseTrivialFormula(expression);
+            Assert(ast.has_value(), "expression: \"" + expression + "\"");
+            AssertEqual(DescribeAST(*ast), DescribeParse(expression, FormulaParserBackend::Antlr),
+                        "expression: \"" + expression + "\"");
+        }
+
+        // Другие формы и ошибки остаются полному разбору.
+        const std::vector<std::string> other = {
+                "", " ", "-1", "+A1", "(A1)", "A1+B1+C1", "A1+-1", "1 2", "A1B2",
+                "1.5.5", "1.", "1e", "1EA1", "A0", "XFE1", "A16385", "a1", "1e999",
+                "1e-400", "A1+", "*A1", "A1:B2", "SUM(A1)", "1,5",
+        };
+        for (const auto& expression : other) {
+            Assert(!TryParseTrivialFormula(expression), "expression: \"" + expression + "\"");
+        }
+
+        std::mt19937 rng(20241020);
+        const std::string alphabet = "0123456789.eE+-*/ AZ";
+        size_t hits = 0;
+        for (int i = 0; i < 20000; ++i) {
+            std::string text(1 + rng() % 8, ' ');
+            for (char& c : text) {
+                c = alphabet[rng() % alphabet.size()];
+            }
+            if (auto ast = TryParseTrivialFormula(text)) {
+                AssertEqual(DescribeAST(*ast), DescribeParse(text, FormulaParserBackend::Antlr),
+                            "expression: \"" + text + "\"");
+                ++hits;
+            }
+        }
+        ASSERT(hits > 0);
+
+        ClearFormulaCache();
+        ParseFormula("B7");
+        ParseFormula("42");
+        ParseFormula("A1 * B2");
+        ParseFormula("A1+B1+C1");
+        ParseFormula("B7");
+        try {
+            ParseFormula("A0");
+        } catch (const FormulaException&) {
+        }
+        auto stats = GetFormulaCacheStats();
+        ASSERT_EQUAL(stats.hits, 1u);
+        ASSERT_EQUAL(stats.misses, 5u);
+        ASSERT_EQUAL(stats.fast_path, 3u);
+
+        ClearFormulaCache();
+        ASSERT_EQUAL(GetFormulaCacheStats().fast_path, 0u);
+    }
+    void TestPositionCodec() {
+        // Запись каждого столбца: буквы в системе счисления по основанию 26 без нуля.
+        auto column_letters = [](int col) {
+            std::string letters;
+            for (++col; col > 0; col = (col - 1) / 26) {
+                letters.insert(letters.begin(), static_cast<char>('A' + (col - 1) % 26));
+            }
+            return letters;
+        };
+        for (int col = 0; col < Position::MAX_COLS; ++col) {
+            for (int row : {0, 8, 9, 98, 99, 999, 9999, Position::MAX_ROWS - 1}) {
+                const Position pos{row, col};
+                const std::string expected = column_letters(col) + std::to_string(row + 1);
+                char buffer[Position::MAX_STRING_LENGTH];
+                const size_t length = pos.ToChars(buffer);
+                ASSERT(length <= Position::MAX_STRING_LENGTH);
+                AssertEqual(std::string(buffer, length), expected);
+                AssertEqual(Position::FromString(expected), pos, expected);
+            }
+        }
+
+        char buffer[Position::MAX_STRING_LENGTH];
+        ASSERT_EQUAL(Position::NONE.ToChars(buffer), 0u);
+        ASSERT_EQUAL((Position{0, Position::MAX_COLS}).ToChars(buffer), 0u);
+
+        // Разбор не проверяет границы листа, только запись.
+        ASSERT_EQUAL(Position::FromString("A0"), (Position{-1, 0}));
+        ASSERT_EQUAL(Position::FromString("ZZZ1"), (Position{0, 18277}));
+        ASSERT_EQUAL(Position::FromString("A00012"), (Position{11, 0}));
+        for (const char* text : {"", "A", "1", "a1", "A-1", "A+1", "A 1", "A1 ", " A1",
+                                 "AAAA1", "A1B", "A99999999999", "A1.0"}) {
+            ASSERT_EQUAL(Position::FromString(text), Position::NONE);
+        }
+
+        const std::vector<Position> positions = {
+                {0, 0}, {15, 27}, Position::NONE, {Position::MAX_ROWS - 1, Position::MAX_COLS - 1},
+        };
+        std::string text(positions.size() * (Position::MAX_STRING_LENGTH + 1), '\0');
+        text.resize(PositionsToChars(positions.data(), positions.size(), ',', text.data()));
+        ASSERT_EQUAL(text, "A1,AB16,,XFD16384");
+
+        std::vector<Position> decoded(positions.size());
+        ASSERT_EQUAL(PositionsFromChars(text, ',', decoded.data()), positions.size());
+        ASSERT_EQUAL(decoded, positions);
+        ASSERT_EQUAL(PositionsFromChars("", ',', decoded.data()), 0u);
+        ASSERT_EQUAL(PositionsFromChars("B2", ',', decoded.data()), 1u);
+        ASSERT_EQUAL(decoded[0], (Position{1, 1}));
+
+        AllocationCounter::Scope counting;
+        const long long allocations = AllocationCounter::GetAllocations();
+        size_t length = 0;
+        for (const auto& pos : positions) {
+            length += pos.ToChars(buffer);
+            length += pos.ToString().size();
+            length += Position::FromString("XFD16384").col;
+        }
+        const long long codec_allocations = AllocationCounter::GetAllocations() - allocations;
+        ASSERT(length > 0);
+        ASSERT_EQUAL(codec_allocations, 0);
+    }
+    // Каноническая запись чисел совпадает с выводом ostream по умолчанию.
+    void TestCanonicalNumberPrinting() {
+        std::vector<std::string> literals = {
+                "0", "1", "0.1", "1.5", "100000", "999999", "1000000", "1234567", "0.0001",
+                "0.00001", "123456.5", "1e21", "1.7976931348623157e308", "4.9e-324",
+                "2.2250738585072014e-308", "1e-400", "00012.500", ".5e1", "3.14159265358979",
+        };
+        std::mt19937 rng(20241022);
+        for (int i = 0; i < 5000; ++i) {
+            literals.push_back(std::to_string(rng() % 100000) + "." + std::to_string(rng() % 100000)
+                               + "e" + std::to_string(static_cast<int>(rng() % 600) - 300));
+        }
+
+        for (const auto& literal : literals) {
+            std::ostringstream expected;
+            expected << std::strtod(literal.c_str(), nullptr);
+            AssertEqual(ParseFormula(literal)->GetExpression(), expected.str(), literal);
+            AssertEqual(ParseFormula("A1+" + literal)->GetExpression(), "A1+" + expected.str(),
+                        literal);
+
+            std::ostringstream streamed;
+            const auto ast = ParseFormulaAST(literal);
+            ast.PrintFormula(streamed);
+            std::string appended = "=";
+            ast.PrintFormula(appended);
+            AssertEqual(appended, "=" + streamed.str(), literal);
+        }
+    }
+    // Векторная свёртка совпадает с поэлементной: целые значения складываются
+    // точно при любом порядке, ошибка запоминается первая.
+    void TestAggregateMatchesScalar() {
+        std::mt19937 rng(20241030);
+        for (int round = 0; round < 500; ++round) {
+            std::vector<double> values(rng() % 70);
+            for (double& value : values) {
+                value = static_cast<double>(static_cast<int>(rng() % 2001) - 1000);
+            }
+            if (!values.empty() && rng() % 3 == 0) {
+                values[rng() % values.size()] = NanBox::FromError(FormulaError::Category::Value);
+                values[rng() % values.size()] = NanBox::FromError(FormulaError::Category::Ref);
+            }
+
+            Aggregate chunked;
+            Aggregate scalar;
+            const size_t split = values.empty() ? 0 : rng() % values.size();
+            chunked.Add(values.data(), split);
+            chunked.Add(values.data() + split, values.size() - split);
+            for (double value : values) {
+                scalar.Add(value);
+            }
+
+            const std::string hint = "round " + std::to_string(round);
+            AssertEqual(chunked.GetNumberCount(), scalar.GetNumberCount(), hint);
+            AssertEqual(chunked.HasError(), scalar.HasError(), hint);
+            if (scalar.HasError()) {
+                AssertEqual(NanBox::ToBits(chunked.GetError()), NanBox::ToBits(scalar.GetError()),
+                            hint);
+                continue;
+            }
+            AssertEqual(chunked.GetSum(), scalar.GetSum(), hint);
+            AssertEqual(chunked.GetMin(), scalar.GetMin(), hint);
+            AssertEqual(chunked.GetMax(), scalar.GetMax(), hint);
+        }
+    }
+
+    void TestRangeFunctions() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "2");
+        sheet->SetCell("A3"_pos, "=A1+A2");
+        sheet->SetCell("B1"_pos, "4");
+        sheet->SetCell("B3"_pos, "5");
+
+        auto value = [&](std::string_view formula) {
+            sheet->SetCell("D1"_pos, std::string(formula));
+            return sheet->GetCell("D1"_pos)->GetValue();
+        };
+
+        // Пустая ячейка B2 читается как ноль и входит в AVERAGE, но не в COUNT.
+        ASSERT_EQUAL(value("=SUM(A1:B3)"), CellInterface::Value(15.0));
+        ASSERT_EQUAL(value("=SUM(B3:A1)"), CellInterface::Value(15.0));
+        ASSERT_EQUAL(value("=MIN(A1:B3)"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value("=MAX(A1:B3)"), CellInterface::Value(5.0));
+        ASSERT_EQUAL(value("=AVERAGE(A1:B3)"), CellInterface::Value(2.5));
+        ASSERT_EQUAL(value("=COUNT(A1:B3)"), CellInterface::Value(5.0));
+        ASSERT_EQUAL(value("=SUM(A1,A2:A3,10)"), CellInterface::Value(16.0));
+        ASSERT_EQUAL(value("=MAX(A1:A3)-MIN(A1:A3)*2"), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value("=SUM(SUM(A1:A2),-MAX(B1,B3))"), CellInterface::Value(-2.0));
+        ASSERT_EQUAL(value("=COUNT(C1:C9)"), CellInterface::Value(0.0));
+
+        // Значения читаются заново после изменения ячеек области.
+        ASSERT_EQUAL(value("=SUM(A1:A3)"), CellInterface::Value(6.0));
+        sheet->SetCell("A2"_pos, "20");
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(42.0));
+
+        const auto references = ParseFormula("SUM(B2:A1)+C3");
+        ASSERT_EQUAL(references->GetReferencedCells(), (std::vector{"C3"_pos}));
+        ASSERT_EQUAL(references->GetReferencedRanges(),
+                     (std::vector{Range{"A1"_pos, "B2"_pos}}));
+
+        try {
+            sheet->SetCell("A1"_pos, "=SUM(A1:A3)");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+
+        // Область больше порции чтения.
+        for (int row = 0; row < 3000; ++row) {
+            sheet->SetCell({row, 5}, std::to_string(row % 7));
+        }
+        ASSERT_EQUAL(value("=SUM(F1:F3000)"), CellInterface::Value(8994.0));
+        ASSERT_EQUAL(value("=AVERAGE(F1:F3000)"), CellInterface::Value(8994.0 / 3000));
+        ASSERT_EQUAL(value("=MAX(F1:F3000)"), CellInterface::Value(6.0));
+    }
+
+    void TestRangeFunctionErrors() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "=1/0");
+        sheet->SetCell("A3"_pos, "text");
+        sheet->SetCell("B1"_pos, "1e308");
+        sheet->SetCell("B2"_pos, "1e308");
+
+        auto value = [&](std::string_view formula) {
+            sheet->SetCell("D1"_pos, std::string(formula));
+            return sheet->GetCell("D1"_pos)->GetValue();
+        };
+        const CellInterface::Value arithmetic = FormulaError(FormulaError::Category::Arithmetic);
+        const CellInterface::Value type = FormulaError(FormulaError::Category::Value);
+
+        // Побеждает первая ошибка в порядке вычисления.
+        ASSERT_EQUAL(value("=SUM(A1:A3)"), arithmetic);
+        ASSERT_EQUAL(value("=MIN(A3,A1:A2)"), type);
+        ASSERT_EQUAL(value("=MAX(A2:A3)+1"), arithmetic);
+        ASSERT_EQUAL(value("=SUM(B1:B2)"), arithmetic);
+        ASSERT_EQUAL(value("=AVERAGE(B1:B2)"), arithmetic);
+        ASSERT_EQUAL(value("=AVERAGE(1/0,A1)"), arithmetic);
+        // COUNT пропускает ошибки.
+        ASSERT_EQUAL(value("=COUNT(A1:B3)"), CellInterface::Value(3.0));
+        ASSERT_EQUAL(value("=COUNT(1/0,A3,2)"), CellInterface::Value(1.0));
+    }
+
+    void TestRangeFunctionParsing() {
+        ASSERT_EQUAL(ParseFormula("SUM(B3:A1)")->GetExpression(), "SUM(A1:B3)");
+        ASSERT_EQUAL(ParseFormula(" 2 * SUM( (1+2) , A1 ) ")->GetExpression(), "2*SUM(1+2,A1)");
+        ASSERT_EQUAL(ParseFormula("-(COUNT(A1:A1))")->GetExpression(), "-COUNT(A1:A1)");
+        ASSERT_EQUAL(ParseFormula("(MIN(1))+MAX(2)")->GetExpression(), "MIN(1)+MAX(2)");
+
+        const auto ast = ParseFormulaAST("SUM(A1:B2,B2:A1,C3)+MAX(C3:C4)");
+        ASSERT_EQUAL(ast.GetReferencedRanges(),
+                     (std::vector{Range{"A1"_pos, "B2"_pos}, Range{"C3"_pos, "C4"_pos}}));
+        ASSERT_EQUAL(ast.GetReferencedCells(), (std::vector{"C3"_pos}));
+
+        auto check = [](std::string_view expression, size_t offset, std::string_view message,
+                        std::string_view expected) {
+            auto diagnostic = ValidateFormula(expression);
+            ASSERT(diagnostic.has_value());
+            AssertEqual(diagnostic->offset, offset, std::string(expression));
+            AssertEqual(diagnostic->message.find(message) != std::string::npos, true,
+                        diagnostic->message);
+            if (!expected.empty()) {
+                const auto& tokens = diagnostic->expected;
+                AssertEqual(std::find(tokens.begin(), tokens.end(), expected) != tokens.end(),
+                            true, diagnostic->ToString());
+            }
+        };
+
+        check("FOO(1)", 0, "Unknown function: FOO", "");
+        check("1+SUM()", 2, "requires at least 1 argument", "");
+        check("SUM(", 4, "<EOF>", "RANGE");
+        check("SUM(1,)", 6, "')'", "NUMBER");
+        check("SUM(A1:B2 1)", 10, "'1'", "')'");
+        check("SUM(1 2)", 6, "'2'", "','");
+        // Имя функции без скобок — имя листа, после него ждём операцию.
+        check("SUM 1", 4, "'1'", "<EOF>");
+        // Область другого листа — только аргумент функции.
+        check("Data!A1:B2", 5, "'A1:B2'", "CELL");
+        check("SUM(A0:B1)", 4, "Invalid range", "");
+        check("SUM(A1:B)", 6, "token recognition error", "");
+        // Синтаксическая ошибка важнее неизвестной функции перед ней.
+        check("FOO(1)+", 7, "<EOF>", "NUMBER");
+    }
+    // Индекс областей выдаёт ровно те записи, что содержат позицию, в том
+    // числе после удалений и при повторах.
+    void TestRangeIndexMatchesBruteForce() {
+        std::mt19937 rng(20241101);
+        std::vector<Cell*> cells;
+        for (uintptr_t i = 1; i <= 50; ++i) {
+            cells.push_back(reinterpret_cast<Cell*>(i * alignof(std::max_align_t)));
+        }
+
+        RangeIndex index;
+        std::vector<std::pair<Range, Cell*>> entries;
+        auto random_pos = [&] {
+            return Position{static_cast<int>(rng() % 40), static_cast<int>(rng() % 8)};
+        };
+        for (int step = 0; step < 3000; ++step) {
+            if (entries.empty() || rng() % 3 != 0) {
+                const Range range = Range::FromCorners(random_pos(), random_pos());
+                Cell* cell = cells[rng() % cells.size()];
+                index.Insert(range, cell);
+                entries.emplace_back(range, cell);
+                if (rng() % 5 == 0) {
+                    index.Insert(range, cell);
+                    entries.emplace_back(range, cell);
+                }
+            } else {
+                const size_t victim = rng() % entries.size();
+                index.Erase(entries[victim].first, entries[victim].second);
+                entries.erase(entries.begin() + static_cast<ptrdiff_t>(victim));
+            }
+
+            const Position pos = random_pos();
+            std::vector<Cell*> expected;
+            size_t expected_entries = 0;
+            for (const auto& [range, cell] : entries) {
+                if (range.Contains(pos)) {
+                    expected.push_back(cell);
+                }
+                expected_entries += static_cast<size_t>(range.GetSize().cols);
+            }
+            std::vector<Cell*> actual;
+            index.FindContaining(pos, actual);
+            std::sort(expected.begin(), expected.end());
+            std::sort(actual.begin(), actual.end());
+            AssertEqual(actual == expected, true, "step " + std::to_string(step));
+            AssertEqual(index.GetEntryCount(), expected_entries, "step " + std::to_string(step));
+        }
+    }
+
+    void TestRangeDependencies() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=SUM(A1:A10000)");
+        sheet->SetCell("C1"_pos, "=B1*2");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // Ячейки области не создаются, но их появление пересчитывает формулы.
+        ASSERT(sheet->GetCell("A500"_pos) == nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 3}));
+        sheet->SetCell("A500"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.0));
+        sheet->ClearCell("A500"_pos);
+        ASSERT(sheet->GetCell("A500"_pos) == nullptr);
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        auto expect_cycle = [&](Position pos, const std::string& text) {
+            try {
+                sheet->SetCell(pos, text);
+                ASSERT(false);
+            } catch (const CircularDependencyException&) {
+            }
+        };
+        // Цикл через область: прямой, через отдельную ссылку и через другую область.
+        expect_cycle("A2"_pos, "=B1");
+        expect_cycle("A3"_pos, "=C1+1");
+        sheet->SetCell("D1"_pos, "=MAX(C1:C2)");
+        expect_cycle("A4"_pos, "=SUM(D1:D3)");
+        expect_cycle("B1"_pos, "=SUM(B1:B2)");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=SUM(A1:A10000)");
+
+        // После замены формулы её области больше не связаны с ней.
+        sheet->SetCell("B1"_pos, "=SUM(E1:E2)");
+        sheet->SetCell("A2"_pos, "=B1");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        // Очищенная ячейка, на которую ссылаются, остаётся в листе.
+        sheet->SetCell("F1"_pos, "=G1");
+        sheet->SetCell("G1"_pos, "3");
+        sheet->ClearCell("G1"_pos);
+        ASSERT(sheet->GetCell("G1"_pos) != nullptr);
+        sheet->SetCell("F1"_pos, "=4");
+        ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(), CellInterface::Value(4.0));
+    }
+
+    void TestColumnIndexMatchesScan() {
+        Sheet indexed;
+        Sheet scanned;
+        scanned.SetColumnIndexesEnabled(false);
+        auto set_both = [&](Position pos, const std::string& text) {
+            indexed.SetCell(pos, text);
+            scanned.SetCell(pos, text);
+        };
+
+        // Числа целые и половинные, чтобы порядок сложения не менял суммы.
+        std::mt19937 rng(20241105);
+        auto random_text = [&](int row) -> std::string {
+            switch (rng() % 8) {
+                case 0:
+                    return "";
+                case 1:
+                    return "text";
+                case 2:
+                    return "'" + std::to_string(rng() % 10);
+                case 3:
+                    return "=F" + std::to_string(row + 1) + "*2";
+                case 4:
+                    return rng() % 4 == 0 ? "=1/0" : "=F1+0.5";
+                default:
+                    return std::to_string(static_cast<int>(rng() % 200) - 100)
+                           + (rng() % 2 == 0 ? ".5" : "");
+            }
+        };
+        auto fill = [&](int count) {
+            for (int i = 0; i < count; ++i) {
+                const Position pos{static_cast<int>(rng() % 600), static_cast<int>(rng() % 4)};
+                set_both(pos, random_text(pos.row));
+            }
+        };
+        set_both("F1"_pos, "7");
+
+        const char* functions[] = {"SUM", "MIN", "MAX", "AVERAGE", "COUNT"};
+        auto check = [&]() {
+            for (int i = 0; i < 100; ++i) {
+                const int first = static_cast<int>(rng() % 600);
+                const int rows = 1 + static_cast<int>(rng() % 300);
+                const int first_col = static_cast<int>(rng() % 4);
+                const int last_col = first_col + static_cast<int>(rng() % (4 - first_col));
+                const Range range{{first, first_col}, {first + rows - 1, last_col}};
+                const std::string text
+                        = std::string("=") + functions[i % 5] + "(" + range.ToString() + ")";
+                const Position pos{i, 7};
+                set_both(pos, text);
+                AssertEqual(indexed.GetCell(pos)->GetValue(), scanned.GetCell(pos)->GetValue(),
+                            text);
+            }
+        };
+
+        fill(800);
+        check();
+        // Изменения после построения индексов, в том числе очистка ячеек.
+        fill(400);
+        for (int i = 0; i < 100; ++i) {
+            const Position pos{static_cast<int>(rng() % 600), static_cast<int>(rng() % 4)};
+            indexed.ClearCell(pos);
+            scanned.ClearCell(pos);
+        }
+        check();
+        set_both("F1"_pos, "text");
+        check();
+    }
+
+    void TestColumnIndexErrors() {
+        Sheet sheet;
+        sheet.SetCell("A100"_pos, "=1/0");
+        sheet.SetCell("B100"_pos, "text");
+        sheet.SetCell("B50"_pos, "=B100");
+        sheet.SetCell("A300"_pos, "5");
+        sheet.SetCell("C1"_pos, "=SUM(A1:B300)");
+        sheet.SetCell("C2"_pos, "=COUNT(A1:B300)");
+        sheet.SetCell("C3"_pos, "=MAX(A1:A300)");
+        sheet.SetCell("C4"_pos, "=AVERAGE(A101:B300)");
+
+        // Первая ошибка при построчном обходе — #VALUE! в B50, хотя в столбце
+        // A ошибка-формула стоит раньше по столбцам.
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(5.0 / 400));
+
+        // Исправленные ячейки пересчитывают формулы через обновлённые индексы.
+        sheet.SetCell("B100"_pos, "4");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        sheet.SetCell("A100"_pos, "=B100-1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(16.0));
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(5.0));
+    }
+
+    void TestLookupFunctions() {
+        auto sheet = CreateSheet();
+        // Справочник: ключи по возрастанию, с повтором, пустой строкой и текстом.
+        const std::vector<std::pair<std::string, std::string>> table = {
+                {"10", "100"}, {"20", "200"}, {"20", "201"}, {"", "300"},
+                {"text", "400"}, {"'40", "=B1*5"}, {"=A1*5", "600"},
+        };
+        for (int row = 0; row < static_cast<int>(table.size()); ++row) {
+            sheet->SetCell({row, 0}, table[row].first);
+            sheet->SetCell({row, 1}, table[row].second);
+        }
+
+        auto value = [&](std::string_view formula) {
+            sheet->SetCell("D1"_pos, std::string(formula));
+            return sheet->GetCell("D1"_pos)->GetValue();
+        };
+        const CellInterface::Value not_available = FormulaError(FormulaError::Category::NotAvailable);
+        const CellInterface::Value ref = FormulaError(FormulaError::Category::Ref);
+        const CellInterface::Value type = FormulaError(FormulaError::Category::Value);
+
+        ASSERT_EQUAL(value("=VLOOKUP(20,A1:B7,2,0)"), CellInterface::Value(200.0));
+        ASSERT_EQUAL(value("=VLOOKUP(40,A1:B7,2,0)"), CellInterface::Value(500.0));
+        ASSERT_EQUAL(value("=VLOOKUP(50,A1:B7,2,0)"), CellInterface::Value(600.0));
+        ASSERT_EQUAL(value("=VLOOKUP(0,A1:B7,2,0)"), not_available);
+        // Приблизительный поиск берёт последнее из равных значений.
+        ASSERT_EQUAL(value("=VLOOKUP(25,A1:B7,2)"), CellInterface::Value(201.0));
+        ASSERT_EQUAL(value("=VLOOKUP(45,A1:B7,2,1)"), CellInterface::Value(500.0));
+        ASSERT_EQUAL(value("=VLOOKUP(5,A1:B7,2)"), not_available);
+        ASSERT_EQUAL(value("=VLOOKUP(10,A1:B7,1)"), CellInterface::Value(10.0));
+        ASSERT_EQUAL(value("=VLOOKUP(10,A1:B7,3)"), ref);
+        ASSERT_EQUAL(value("=VLOOKUP(10,A1:B7,0)"), type);
+        ASSERT_EQUAL(value("=VLOOKUP(1/0,A1:B7,2)"),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        ASSERT_EQUAL(value("=VLOOKUP(10,A1:B7,A1:A2)"), type);
+
+        ASSERT_EQUAL(value("=MATCH(20,A1:A7,0)"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(value("=MATCH(30,A1:A7)"), CellInterface::Value(3.0));
+        ASSERT_EQUAL(value("=MATCH(30,A1:A7,-1)"), CellInterface::Value(6.0));
+        ASSERT_EQUAL(value("=MATCH(60,A1:A7,-1)"), not_available);
+        ASSERT_EQUAL(value("=MATCH(200,A2:B2,0)"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(value("=MATCH(200,A1:B2,0)"), not_available);
+
+        ASSERT_EQUAL(value("=INDEX(A1:B7,6,2)"), CellInterface::Value(500.0));
+        ASSERT_EQUAL(value("=INDEX(B1:B7,3.9)"), CellInterface::Value(201.0));
+        ASSERT_EQUAL(value("=INDEX(A3:B3,2)"), CellInterface::Value(201.0));
+        ASSERT_EQUAL(value("=INDEX(A1:B7,4,1)"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value("=INDEX(A1:B7,8,1)"), ref);
+        ASSERT_EQUAL(value("=INDEX(A1:B7,1,0)"), ref);
+        ASSERT_EQUAL(value("=INDEX(A1:B7,5,1)"), type);
+        ASSERT_EQUAL(value("=INDEX(A1:B7,MATCH(40,A1:A7,0),2)+1"), CellInterface::Value(501.0));
+        ASSERT_EQUAL(value("=INDEX(C5,1)"), CellInterface::Value(0.0));
+
+        // Таблица поиска — зависимость формулы: изменения в ней её пересчитывают.
+        sheet->SetCell("E1"_pos, "=VLOOKUP(30,A1:B7,2,0)");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), not_available);
+        sheet->SetCell("A5"_pos, "30");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(400.0));
+        sheet->SetCell("B5"_pos, "=B2+1");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(201.0));
+        sheet->ClearCell("A5"_pos);
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), not_available);
+        try {
+            sheet->SetCell("B3"_pos, "=INDEX(A1:B7,1,1)");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+
+        auto check = [](std::string_view expression, std::string_view message) {
+            auto diagnostic = ValidateFormula(expression);
+            ASSERT(diagnostic.has_value());
+            AssertEqual(diagnostic->offset, 0u, std::string(expression));
+            AssertEqual(diagnostic->message, std::string(message), std::string(expression));
+        };
+        check("VLOOKUP(1,A1:B2)", "Function VLOOKUP requires at least 3 arguments");
+        check("MATCH(1,A1:A2,0,0)", "Function MATCH accepts at most 3 arguments");
+        check("VLOOKUP(1,2,1)", "Function VLOOKUP requires a range as argument 2");
+        check("INDEX(1+A1,1)", "Function INDEX requires a range as argument 1");
+        ASSERT_EQUAL(ParseFormula("VLOOKUP(A1,B1:C9,2)")->GetReferencedRanges(),
+                     (std::vector{Range{"B1"_pos, "C9"_pos}}));
+        ASSERT_EQUAL(ParseFormula("INDEX(B1,A1)")->GetReferencedCells(),
+                     (std::vector{"A1"_pos, "B1"_pos}));
+    }
+
+    void TestLookupIndexMatchesScan() {
+        Sheet indexed;
+        Sheet scanned;
+        scanned.SetColumnIndexesEnabled(false);
+        auto set_both = [&](Position pos, const std::string& text) {
+            indexed.SetCell(pos, text);
+            scanned.SetCell(pos, text);
+        };
+
+        // Немного различных ключей, чтобы были и повторы, и промахи.
+        std::mt19937 rng(20241107);
+        auto random_text = [&]() -> std::string {
+            switch (rng() % 8) {
+                case 0:
+                    return "";
+                case 1:
+                    return "text";
+                case 2:
+                    return "'" + std::to_string(rng() % 50);
+                case 3:
+                    return "=E1+" + std::to_string(rng() % 50);
+                case 4:
+                    return "=1/0";
+                default:
+                    return std::to_string(rng() % 50);
+            }
+        };
+        auto fill = [&](int count) {
+            for (int i = 0; i < count; ++i) {
+                set_both({static_cast<int>(rng() % 500), static_cast<int>(rng() % 2)},
+                         random_text());
+            }
+        };
+        set_both("E1"_pos, "3");
+
+        auto check = [&]() {
+            for (int i = 0; i < 150; ++i) {
+                const int first = static_cast<int>(rng() % 500);
+                const int last = first + static_cast<int>(rng() % 300);
+                const std::string key = std::to_string(static_cast<int>(rng() % 60) - 5);
+                const std::string column = Range{{first, 0}, {last, 0}}.ToString();
+                const std::string table = Range{{first, 0}, {last, 1}}.ToString();
+                std::string text;
+                switch (i % 3) {
+                    case 0:
+                        text = "=MATCH(" + key + "," + column + ","
+                               + std::to_string(static_cast<int>(rng() % 3) - 1) + ")";
+                        break;
+                    case 1:
+                        text = "=VLOOKUP(" + key + "," + table + ",2," + std::to_string(rng() % 2)
+                               + ")";
+                        break;
+                    default:
+                        text = "=MATCH(" + key + ".5," + column + ")";
+                }
+                const Position pos{i, 7};
+                set_both(pos, text);
+                AssertEqual(indexed.GetCell(pos)->GetValue(), scanned.GetCell(pos)->GetValue(),
+                            text);
+            }
+        };
+
+        fill(600);
+        check();
+        fill(300);
+        for (int i = 0; i < 100; ++i) {
+            const Position pos{static_cast<int>(rng() % 500), static_cast<int>(rng() % 2)};
+            indexed.ClearCell(pos);
+            scanned.ClearCell(pos);
+        }
+        check();
+        set_both("E1"_pos, "40");
+        check();
+    }
+
+    void TestAggregateAddIfMatchesScalar() {
+        using Compare = Criteria::Compare;
+        std::mt19937 rng(20241112);
+        const double empty = std::numeric_limits<double>::quiet_NaN();
+        for (int round = 0; round < 600; ++round) {
+            const size_t size = rng() % 70;
+            std::vector<double> keys(size);
+            std::vector<double> values(size);
+            for (size_t i = 0; i < size; ++i) {
+                keys[i] = rng() % 5 == 0 ? empty : static_cast<double>(rng() % 9);
+                values[i] = static_cast<double>(static_cast<int>(rng() % 2001) - 1000);
+            }
+            if (size > 0 && rng() % 3 == 0) {
+                values[rng() % size] = NanBox::FromError(FormulaError::Category::Value);
+                keys[rng() % size] = NanBox::FromError(FormulaError::Category::Ref);
+            }
+            const Criteria criteria(static_cast<Compare>(rng() % 6),
+                                    static_cast<double>(rng() % 9));
+
+            Aggregate vector;
+            Aggregate scalar;
+            const size_t matched = vector.AddIf(keys.data(), values.data(), size, criteria);
+            size_t expected = 0;
+            for (size_t i = 0; i < size; ++i) {
+                if (criteria.Matches(keys[i])) {
+                    scalar.Add(values[i]);
+                    ++expected;
+                }
+            }
+
+            const std::string hint = "round " + std::to_string(round);
+            AssertEqual(matched, expected, hint);
+            AssertEqual(vector.GetNumberCount(), scalar.GetNumberCount(), hint);
+            AssertEqual(vector.HasError(), scalar.HasError(), hint);
+            if (scalar.HasError()) {
+                AssertEqual(NanBox::ToBits(vector.GetError()), NanBox::ToBits(scalar.GetError()),
+                            hint);
+                continue;
+            }
+            AssertEqual(vector.GetSum(), scalar.GetSum(), hint);
+            AssertEqual(vector.GetMin(), scalar.GetMin(), hint);
+            AssertEqual(vector.GetMax(), scalar.GetMax(), hint);
+        }
+    }
+
+    void TestCriteriaFunctions() {
+        auto sheet = CreateSheet();
+        // Ключи с пустой строкой, текстом, формулой и ошибкой.
+        const std::vector<std::pair<std::string, std::string>> table = {
+                {"1", "10"}, {"2", "20"}, {"2", "=B1*3"}, {"", "40"},
+                {"text", "50"}, {"=A1+2", "60"}, {"'4", ""}, {"5", "text"},
+        };
+        for (int row = 0; row < static_cast<int>(table.size()); ++row) {
+            sheet->SetCell({row, 0}, table[row].first);
+            sheet->SetCell({row, 1}, table[row].second);
+        }
+
+        auto value = [&](std::string_view formula) {
+            sheet->SetCell("D1"_pos, std::string(formula));
+            return sheet->GetCell("D1"_pos)->GetValue();
+        };
+        const CellInterface::Value type = FormulaError(FormulaError::Category::Value);
+
+        ASSERT_EQUAL(value("=SUMIF(A1:A7,\"2\",B1:B7)"), CellInterface::Value(50.0));
+        ASSERT_EQUAL(value("=SUMIF(A1:A7,\"=2\",B1:B7)"), CellInterface::Value(50.0));
+        ASSERT_EQUAL(value("=SUMIF(A1:A7,\">=2\",B1:B7)"), CellInterface::Value(110.0));
+        ASSERT_EQUAL(value("=SUMIF(A1:A7,\"<2\",B1:B7)"), CellInterface::Value(10.0));
+        ASSERT_EQUAL(value("=SUMIF(A1:A7,\">3\")"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(value("=SUMIF(A1:A7,A2+1,B1:B7)"), CellInterface::Value(60.0));
+        ASSERT_EQUAL(value("=COUNTIF(A1:A8,\">1\")"), CellInterface::Value(5.0));
+        ASSERT_EQUAL(value("=COUNTIF(A1:A8,\"<=0.5e1\")"), CellInterface::Value(6.0));
+        // «<>» выполняется и для значений без числа: пустых ячеек и текста.
+        ASSERT_EQUAL(value("=COUNTIF(A1:A7,\"<>2\")"), CellInterface::Value(5.0));
+        ASSERT_EQUAL(value("=SUMIF(A1:A4,\"<>1\",B1:B4)"), CellInterface::Value(90.0));
+        ASSERT_EQUAL(value("=AVERAGEIF(A1:A7,\"2\",B1:B7)"), CellInterface::Value(25.0));
+        ASSERT_EQUAL(value("=AVERAGEIF(A1:A7,\">2\")"), CellInterface::Value(3.5));
+        ASSERT_EQUAL(value("=AVERAGEIF(A1:A7,\">9\")"),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        // Текст в области значений — ошибка, только если строка подошла.
+        ASSERT_EQUAL(value("=SUMIF(A1:A8,\"5\",B1:B8)"), type);
+        ASSERT_EQUAL(value("=SUMIF(A1:A8,\"<5\",B1:B8)"), CellInterface::Value(120.0));
+        ASSERT_EQUAL(value("=SUMIF(A1:A7,\"2\",B1:B6)"), type);
+        ASSERT_EQUAL(value("=COUNTIF(A1:A2,1/0)"),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        ASSERT_EQUAL(value("=SUMIF(A1:B2,\">1\")"), CellInterface::Value(32.0));
+
+        // Области условия и значений — зависимости формулы.
+        sheet->SetCell("E1"_pos, "=SUMIF(A1:A7,\">=3\",B1:B7)");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(60.0));
+        sheet->SetCell("A4"_pos, "7");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(100.0));
+        sheet->SetCell("A1"_pos, "0");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(40.0));
+        sheet->SetCell("B4"_pos, "=B2/4");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        ASSERT_EQUAL(ParseFormula("SUMIF(A1:A9,\">=02\",B1:B9)")->GetExpression(),
+                     "SUMIF(A1:A9,\">=02\",B1:B9)");
+        ASSERT_EQUAL(ParseFormula("COUNTIF(A1:A9,\"<>1\")")->GetReferencedRanges(),
+                     (std::vector{Range{"A1"_pos, "A9"_pos}}));
+
+        auto check = [](std::string_view expression, std::string_view message) {
+            auto diagnostic = ValidateFormula(expression);
+            ASSERT(diagnostic.has_value());
+            AssertEqual(diagnostic->message, std::string(message), std::string(expression));
+        };
+        check("COUNTIF(A1:A9,\"x\")", "Invalid criteria: \"x\"");
+        check("COUNTIF(A1:A9,\">\")", "Invalid criteria: \">\"");
+        check("COUNTIF(A1:A9)", "Function COUNTIF requires at least 2 arguments");
+        check("SUMIF(1,\"1\")", "Function SUMIF requires a range as argument 1");
+        check("SUMIF(A1:A9,1,2)", "Function SUMIF requires a range as argument 3");
+        ASSERT(ValidateFormula("COUNTIF(A1:A9,\"1)").has_value());
+        ASSERT(ValidateFormula("1+\"1\"").has_value());
+        check("SUM(\"1\")", "Function SUM does not accept a string as argument 1");
+        check("SUMIF(A1:A9,\"1\",\"1\")", "Function SUMIF requires a range as argument 3");
+    }
+
+    void TestCriteriaIndexMatchesScan() {
+        Sheet indexed;
+        Sheet scanned;
+        scanned.SetColumnIndexesEnabled(false);
+        auto set_both = [&](Position pos, const std::string& text) {
+            indexed.SetCell(pos, text);
+            scanned.SetCell(pos, text);
+        };
+
+        // Целые и половинные ключи: суммы точны при любом порядке сложения.
+        std::mt19937 rng(20241113);
+        auto random_text = [&]() -> std::string {
+            switch (rng() % 8) {
+                case 0:
+                    return "";
+                case 1:
+                    return "text";
+                case 2:
+                    return "'" + std::to_string(rng() % 20);
+                case 3:
+                    return "=E1+" + std::to_string(rng() % 20);
+                case 4:
+                    return rng() % 4 == 0 ? "=1/0" : std::to_string(rng() % 20) + ".5";
+                default:
+                    return std::to_string(rng() % 20);
+            }
+        };
+        auto fill = [&](int count) {
+            for (int i = 0; i < count; ++i) {
+                set_both({static_cast<int>(rng() % 3000), static_cast<int>(rng() % 2)},
+                         random_text());
+            }
+        };
+        set_both("E1"_pos, "3");
+
+        static constexpr std::string_view OPERATIONS[] = {"", "=", "<>", "<", "<=", ">", ">="};
+        auto check = [&]() {
+            for (int i = 0; i < 150; ++i) {
+                const int first = static_cast<int>(rng() % 2000);
+                const int last = first + static_cast<int>(rng() % 1500);
+                const std::string criteria =
+                        "\"" + std::string(OPERATIONS[rng() % std::size(OPERATIONS)])
+                        + std::to_string(rng() % 22) + (rng() % 4 == 0 ? ".5" : "") + "\"";
+                const std::string keys = Range{{first, 0}, {last, 0}}.ToString();
+                const std::string values = Range{{first, 1}, {last, 1}}.ToString();
+                std::string text;
+                switch (i % 3) {
+                    case 0:
+                        text = "=SUMIF(" + keys + "," + criteria + "," + values + ")";
+                        break;
+                    case 1:
+                        text = "=COUNTIF(" + keys + "," + criteria + ")";
+                        break;
+                    default:
+                        text = "=AVERAGEIF(" + values + "," + criteria + ")";
+                }
+                const Position pos{i, 7};
+                set_both(pos, text);
+                AssertEqual(indexed.GetCell(pos)->GetValue(), scanned.GetCell(pos)->GetValue(),
+                            text);
+            }
+        };
+
+        fill(2000);
+        check();
+        fill(600);
+        for (int i = 0; i < 300; ++i) {
+            const Position pos{static_cast<int>(rng() % 3000), static_cast<int>(rng() % 2)};
+            indexed.ClearCell(pos);
+            scanned.ClearCell(pos);
+        }
+        check();
+        set_both("E1"_pos, "15");
+        check();
+    }
+    void TestComparisonOperators() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "2");
+        sheet->SetCell("A3"_pos, "text");
+
+        auto value = [&](std::string_view formula) {
+            sheet->SetCell("B1"_pos, std::string(formula));
+            return sheet->GetCell("B1"_pos)->GetValue();
+        };
+        const CellInterface::Value yes = 1.0;
+        const CellInterface::Value no = 0.0;
+
+        ASSERT_EQUAL(value("=A1<A2"), yes);
+        ASSERT_EQUAL(value("=A1>A2"), no);
+        ASSERT_EQUAL(value("=A1<=1"), yes);
+        ASSERT_EQUAL(value("=A2>=3"), no);
+        ASSERT_EQUAL(value("=A1=1"), yes);
+        ASSERT_EQUAL(value("=A1<>1"), no);
+        // Пустая ячейка равна нулю.
+        ASSERT_EQUAL(value("=C9=0"), yes);
+        // Сравнения связывают слабее арифметики и левоассоциативны.
+        ASSERT_EQUAL(value("=1+1=2"), yes);
+        ASSERT_EQUAL(value("=3>2>1"), no);
+        ASSERT_EQUAL(value("=(1<2)*5"), CellInterface::Value(5.0));
+        ASSERT_EQUAL(value("=A3=1"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(value("=1/0<A3"),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+
+        ASSERT_EQUAL(ParseFormula("(1<2)+1")->GetExpression(), "(1<2)+1");
+        ASSERT_EQUAL(ParseFormula("-(A1<2)")->GetExpression(), "-(A1<2)");
+        ASSERT_EQUAL(ParseFormula("1<(2<3)")->GetExpression(), "1<(2<3)");
+        ASSERT_EQUAL(ParseFormula("(1<2)<3")->GetExpression(), "1<2<3");
+        ASSERT_EQUAL(ParseFormula("(1+2)<>(3*4)")->GetExpression(), "1+2<>3*4");
+        ASSERT_EQUAL(ParseFormula("A1 >= B1")->GetExpression(), "A1>=B1");
+
+        auto diagnostic = ValidateFormula("1=<2");
+        ASSERT(diagnostic.has_value());
+        ASSERT(ValidateFormula("1=>2").has_value());
+        ASSERT(ValidateFormula("<1").has_value());
+        ASSERT(!ValidateFormula("SUM(A1<2,3)").has_value());
+    }
+
+    void TestConditionalFunctions() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "5");
+        sheet->SetCell("A2"_pos, "text");
+
+        auto value = [&](std::string_view formula) {
+            sheet->SetCell("B1"_pos, std::string(formula));
+            return sheet->GetCell("B1"_pos)->GetValue();
+        };
+        const CellInterface::Value arithmetic = FormulaError(FormulaError::Category::Arithmetic);
+
+        ASSERT_EQUAL(value("=IF(A1>3,1,2)"), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value("=IF(A1>7,1,2)"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(value("=IF(A1>7,1)"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value("=IF(A1,A1*2)"), CellInterface::Value(10.0));
+        // Невыбранная ветвь не вычисляется, и её ошибка не распространяется.
+        ASSERT_EQUAL(value("=IF(1,2,1/0)"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(value("=IF(0,1/0,A1)"), CellInterface::Value(5.0));
+        ASSERT_EQUAL(value("=IF(1/0,1,2)"), arithmetic);
+        ASSERT_EQUAL(value("=IF(A2,1,2)"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+        ASSERT_EQUAL(value("=IFERROR(1/0,7)"), CellInterface::Value(7.0));
+        ASSERT_EQUAL(value("=IFERROR(A1,1/0)"), CellInterface::Value(5.0));
+        ASSERT_EQUAL(value("=IFERROR(A2+1,-1)"), CellInterface::Value(-1.0));
+        ASSERT_EQUAL(value("=IFERROR(1/0,1/0)"), arithmetic);
+        ASSERT_EQUAL(value("=IFERROR(IF(A1>3,1/0,1),2)+SUM(IF(0,1),3)"), CellInterface::Value(5.0));
+
+        ASSERT_EQUAL(ParseFormula("IF(A1>=1,B1,-(C1))")->GetExpression(), "IF(A1>=1,B1,-C1)");
+        auto check = [](std::string_view expression, std::string_view message) {
+            auto diagnostic = ValidateFormula(expression);
+            ASSERT(diagnostic.has_value());
+            AssertEqual(diagnostic->message, std::string(message), std::string(expression));
+        };
+        check("IF(1)", "Function IF requires at least 2 arguments");
+        check("IF(1,2,3,4)", "Function IF accepts at most 3 arguments");
+        check("IFERROR(1)", "Function IFERROR requires at least 2 arguments");
+        check("IFERROR(1,2,3)", "Function IFERROR accepts at most 2 arguments");
+        // Область вне функций, которые её принимают, — ошибка значения.
+        ASSERT_EQUAL(value("=IF(A1:A2,1)"),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    }
+
+    void TestConditionalDependencies() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "10");
+        sheet.SetCell("C1"_pos, "20");
+        sheet.SetCell("D1"_pos, "=IF(A1>0,B1,C1)");
+
+        auto formula = ParseFormula("IF(A1>0,B1+A1,IFERROR(C1,D1))");
+        ASSERT_EQUAL(formula->GetReferencedCells(),
+                     (std::vector{"A1"_pos, "B1"_pos, "C1"_pos, "D1"_pos}));
+        ASSERT_EQUAL(formula->GetConditionalCells(),
+                     (std::vector{"B1"_pos, "C1"_pos, "D1"_pos}));
+        ASSERT(ParseFormula("A1+IF(A1,2,3)")->GetConditionalCells().empty());
+
+        auto cached = [&](Position pos) {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->HasCachedValue();
+        };
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        // Ячейка невыбранной ветви не сбрасывает значение, выбранной — сбрасывает.
+        sheet.SetCell("C1"_pos, "21");
+        ASSERT(cached("D1"_pos));
+        sheet.SetCell("B1"_pos, "11");
+        ASSERT(!cached("D1"_pos));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(11.0));
+
+        // Смена условия переключает рёбра на другую ветвь.
+        sheet.SetCell("A1"_pos, "0");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(21.0));
+        sheet.SetCell("B1"_pos, "12");
+        ASSERT(cached("D1"_pos));
+        sheet.SetCell("C1"_pos, "22");
+        ASSERT(!cached("D1"_pos));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(22.0));
+
+        // Пересчёт листа обновляет рёбра так же, как чтение значения.
+        sheet.SetCell("A1"_pos, "1");
+        sheet.Recalculate();
+        ASSERT(cached("D1"_pos));
+        sheet.SetCell("C1"_pos, "23");
+        ASSERT(cached("D1"_pos));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+        // Ячейка, на которую ссылаются только из ветви, не удаляется.
+        sheet.ClearCell("C1"_pos);
+        ASSERT(sheet.GetCell("C1"_pos) != nullptr);
+        sheet.SetCell("D1"_pos, "1");
+        sheet.ClearCell("C1"_pos);
+        ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+
+        // Циклы проверяются по всем ссылкам, в том числе из невыбранных ветвей.
+        bool caught = false;
+        try {
+            sheet.SetCell("E1"_pos, "=IF(0,E1,1)");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        sheet.SetCell("E1"_pos, "=IF(A1,1,F1)");
+        caught = false;
+        try {
+            sheet.SetCell("F1"_pos, "=IFERROR(E1,0)");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(1.0));
+    }
+
+    void TestFormulaNames() {
+        auto formula = ParseFormula("A1*TaxRate+SUM(Prices)-_x+AB+a1");
+        ASSERT_EQUAL(formula->GetExpression(), "A1*TaxRate+SUM(Prices)-_x+AB+a1");
+        ASSERT_EQUAL(formula->GetNames(),
+                     (std::vector<std::string>{"AB", "Prices", "TaxRate", "_x", "a1"}));
+        ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{"A1"_pos}));
+        ASSERT(formula->GetReferencedRanges().empty());
+
+        const NameResolver resolver = [](std::string_view name) -> std::optional<NameValue> {
+            if (name == "TaxRate") {
+                return 0.5;
+            }
+            if (name == "Prices") {
+                return Range{"B1"_pos, "B3"_pos};
+            }
+            if (name == "AB") {
+                return "C1"_pos;
+            }
+            return std::nullopt;
+        };
+        auto bound = formula->BindNames(resolver);
+        // Запись формулы сохраняет имена, ссылки — их значения.
+        ASSERT_EQUAL(bound->GetExpression(), formula->GetExpression());
+        ASSERT_EQUAL(bound->GetNames(), formula->GetNames());
+        ASSERT_EQUAL(bound->GetReferencedCells(), (std::vector{"A1"_pos, "C1"_pos}));
+        ASSERT_EQUAL(bound->GetReferencedRanges(), (std::vector{Range{"B1"_pos, "B3"_pos}}));
+
+        // Имя-константа хранится в формуле, дерево остаётся общим, а пачкой
+        // формула вычисляется со значением имени.
+        auto unbound = ParseFormula("A1*TaxRate");
+        auto rate = unbound->BindNames(resolver);
+        ASSERT(rate->GetReferencedCells() == std::vector{"A1"_pos});
+        ASSERT(rate->GetAST() == unbound->GetAST());
+        ASSERT_EQUAL(rate->GetNameValue("TaxRate"), 0.5);
+        ASSERT(NanBox::IsError(unbound->GetNameValue("TaxRate")));
+        auto rate_lookup = [&rate](std::string_view name) { return rate->GetNameValue(name); };
+        ASSERT(FormulaShape(*rate->GetAST(), "B1"_pos, rate_lookup).IsBatchable());
+        ASSERT(!FormulaShape(*rate->GetAST(), "B1"_pos).IsBatchable());
+        ASSERT(!FormulaShape(*unbound->GetAST(), "B1"_pos,
+                             [&unbound](std::string_view name) {
+                                 return unbound->GetNameValue(name);
+                             }).IsBatchable());
+
+        for (std::string_view expression : {"TaxRate*2", "IF(Rate>0,Rate,0)", "TAX+1", "-x_1"}) {
+            ASSERT(!ValidateFormula(expression).has_value());
+        }
+        ASSERT(ValidateFormula("A2B").has_value());
+        ASSERT(ValidateFormula("SUM(1)(2)").has_value());
+
+        ASSERT(IsValidFormulaName("TaxRate"));
+        ASSERT(IsValidFormulaName("TAX"));
+        ASSERT(IsValidFormulaName("_"));
+        ASSERT(!IsValidFormulaName("A1"));
+        ASSERT(!IsValidFormulaName("1x"));
+        ASSERT(!IsValidFormulaName("Tax Rate"));
+        ASSERT(!IsValidFormulaName(""));
+    }
+
+    void TestSheetNames() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "10");
+        sheet.SetCell("A2"_pos, "20");
+        sheet.SetCell("C1"_pos, "=A1*TaxRate");
+        sheet.SetCell("C2"_pos, "=SUM(Prices)+Base");
+        sheet.SetCell("C3"_pos, "=A2*2");
+
+        const CellInterface::Value name_error = FormulaError(FormulaError::Category::Name);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), name_error);
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), name_error);
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(40.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1*TaxRate");
+
+        auto cached = [&](Position pos) {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->HasCachedValue();
+        };
+
+        // Определение имени связывает заново только формулы, которые его используют.
+        sheet.DefineName("TaxRate", 0.25);
+        ASSERT(cached("C3"_pos));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.5));
+        ASSERT(sheet.GetCell("C1"_pos)->GetReferencedCells() == std::vector{"A1"_pos});
+
+        sheet.DefineName("Prices", Range{"A1"_pos, "A2"_pos});
+        sheet.DefineName("Base", "B1"_pos);
+        ASSERT(cached("C1"_pos));
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(30.0));
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetReferencedCells(), (std::vector{"B1"_pos}));
+
+        // Ячейка и область имени — обычные ссылки.
+        sheet.SetCell("B1"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(35.0));
+        sheet.SetCell("A2"_pos, "30");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(45.0));
+
+        sheet.DefineName("TaxRate", 0.5);
+        ASSERT(cached("C2"_pos));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+        // Новые формулы связываются с текущим значением имени сразу.
+        sheet.SetCell("D1"_pos, "=TaxRate*4");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // Имя-число, ставшее ссылкой и снова числом, меняет ссылки формулы.
+        sheet.SetCell("D2"_pos, "=Base*K");
+        sheet.DefineName("K", 2.0);
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(10.0));
+        sheet.DefineName("K", "A1"_pos);
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(50.0));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetReferencedCells().size(), 2u);
+        sheet.DefineName("K", 3.0);
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(15.0));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetReferencedCells(), (std::vector{"B1"_pos}));
+        sheet.DefineName("K", 4.0);
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(20.0));
+
+        // Связывание не округляет числа формулы до канонической записи.
+        sheet.SetCell("D3"_pos, "=Price*1.0000001");
+        sheet.DefineName("Price", 20.0);
+        ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), CellInterface::Value(20.0 * 1.0000001));
+        sheet.DefineName("Price", "A1"_pos);
+        ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), CellInterface::Value(10.0 * 1.0000001));
+        sheet.DefineName("Price", 30.0);
+        ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), CellInterface::Value(30.0 * 1.0000001));
+
+        // Значение, замыкающее цикл, отвергается, и имя сохраняет прежнее.
+        bool caught = false;
+        try {
+            sheet.DefineName("Base", "C2"_pos);
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(std::get<Position>(*sheet.FindName("Base")) == "B1"_pos);
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(45.0));
+
+        auto throws_formula = [&](const std::string& name) {
+            try {
+                sheet.DefineName(name, 1.0);
+            } catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(throws_formula("B2"));
+        ASSERT(throws_formula("2x"));
+        caught = false;
+        try {
+            sheet.DefineName("Cell", Position{-1, 0});
+        } catch (const InvalidPositionException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(!sheet.FindName("Cell").has_value());
+
+        // Удалённое имя снова даёт #NAME?, а ячейка больше не пользователь имени.
+        sheet.RemoveName("TaxRate");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), name_error);
+        sheet.SetCell("C1"_pos, "=1");
+        sheet.SetCell("D1"_pos, "=2");
+        sheet.DefineName("TaxRate", 3.0);
+        ASSERT(cached("C2"_pos));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+    }
+
+    void TestSheetReferenceParsing() {
+        auto formula = ParseFormula("Data!A1*2+SUM(Data!A1:B3,Other!C1:C2)+B1");
+        ASSERT_EQUAL(formula->GetExpression(), "Data!A1*2+SUM(Data!A1:B3,Other!C1:C2)+B1");
+        ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{"B1"_pos}));
+        ASSERT(formula->GetReferencedRanges().empty());
+        const std::vector<SheetRange> expected = {
+                {"Data", Range{"A1"_pos, "A1"_pos}},
+                {"Data", Range{"A1"_pos, "B3"_pos}},
+                {"Other", Range{"C1"_pos, "C2"_pos}},
+        };
+        ASSERT(formula->GetSheetReferences() == expected);
+
+        // У отдельного листа других листов нет.
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=Data!A1+1");
+        sheet.SetCell("A2"_pos, "=SUM(Data!A1:A3)");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Ref));
+
+        auto throws_formula = [](const std::string& expression) {
+            try {
+                ParseFormula(expression);
+            } catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+        // Условие и значения *IF проверяются по одному листу.
+        ASSERT(throws_formula("SUMIF(Data!A1:A9,\">1\",B1:B9)"));
+        ASSERT(!throws_formula("SUMIF(Data!A1:A9,\">1\",Data!B1:B9)"));
+        ASSERT(throws_formula("Data!A0"));
+        ASSERT(throws_formula("1Data!A1"));
+
+        ASSERT(IsValidSheetName("Sheet_1"));
+        ASSERT(!IsValidSheetName("1Sheet"));
+        ASSERT(!IsValidSheetName("My Sheet"));
+        ASSERT(!IsValidSheetName(""));
+    }
+
+    void TestWorkbook() {
+        Workbook book;
+        Sheet& data = book.AddSheet("Data");
+        Sheet& report = book.AddSheet("Report");
+        ASSERT_EQUAL(book.GetSheetCount(), 2u);
+        ASSERT(book.GetSheet("Data") == &data);
+        ASSERT(book.GetSheet("Missing") == nullptr);
+        ASSERT_EQUAL(report.GetName(), "Report");
+
+        data.SetCell("A1"_pos, "1");
+        data.SetCell("A2"_pos, "2");
+        data.SetCell("A3"_pos, "=A1+A2");
+        report.SetCell("A1"_pos, "=Data!A3*10");
+        report.SetCell("A2"_pos, "=SUM(Data!A1:A3)+A1");
+        report.SetCell("A3"_pos, "=VLOOKUP(2,Data!A1:A3,1)");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(30.0));
+        ASSERT_EQUAL(report.GetCell("A2"_pos)->GetValue(), CellInterface::Value(36.0));
+        ASSERT_EQUAL(report.GetCell("A3"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // Изменение ячейки другого листа сбрасывает значения зависимых формул.
+        data.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(70.0));
+        ASSERT_EQUAL(report.GetCell("A2"_pos)->GetValue(), CellInterface::Value(84.0));
+
+        // Ссылка на лист, которого нет, даёт #REF! до его добавления.
+        report.SetCell("B1"_pos, "=Later!A1+1");
+        ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Ref));
+        Sheet& later = book.AddSheet("Later");
+        ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+        later.SetCell("A1"_pos, "4");
+        ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        // Циклы находятся и через границы листов.
+        auto throws_circular = [](Sheet& sheet, Position pos, const std::string& text) {
+            try {
+                sheet.SetCell(pos, text);
+            } catch (const CircularDependencyException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(throws_circular(data, "A2"_pos, "=Report!A1"));
+        ASSERT(throws_circular(later, "A1"_pos, "=SUM(Report!A1:B1)"));
+        ASSERT(throws_circular(data, "B1"_pos, "=Data!B1"));
+        ASSERT_EQUAL(data.GetCell("A2"_pos)->GetText(), "2");
+        ASSERT(!throws_circular(data, "B1"_pos, "=Later!A1"));
+        ASSERT_EQUAL(data.GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+        // После замены формулы старые ссылки на другие листы не действуют.
+        report.SetCell("B1"_pos, "=1");
+        ASSERT(!throws_circular(later, "A1"_pos, "=Report!B1"));
+
+        auto throws_formula = [&](const std::string& name) {
+            try {
+                book.AddSheet(name);
+            } catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(throws_formula("Data"));
+        ASSERT(throws_formula("Bad Name"));
+        ASSERT(throws_formula("1st"));
+        ASSERT_EQUAL(book.GetSheetCount(), 3u);
+    }
+
+    void TestWorkbookNames() {
+        Workbook book;
+        Sheet& first = book.AddSheet("First");
+        Sheet& second = book.AddSheet("Second");
+        first.SetCell("A1"_pos, "10");
+        first.SetCell("B1"_pos, "=A1*Rate");
+        second.SetCell("B1"_pos, "=Rate+1");
+        const CellInterface::Value name_error = FormulaError(FormulaError::Category::Name);
+        ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), name_error);
+
+        // Имя книги видят формулы всех листов.
+        book.DefineName("Rate", 0.5);
+        ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+        ASSERT_EQUAL(second.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.5));
+        book.DefineName("Rate", 2.0);
+        ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+        ASSERT_EQUAL(second.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+        // Имя книги скрывает имя листа, пока его не удалят.
+        first.DefineName("Rate", "A1"_pos);
+        ASSERT_EQUAL(std::get<double>(*first.FindName("Rate")), 2.0);
+        ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+        ASSERT(first.GetCell("B1"_pos)->GetReferencedCells() == std::vector{"A1"_pos});
+        book.RemoveName("Rate");
+        ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), CellInterface::Value(100.0));
+        ASSERT_EQUAL(second.GetCell("B1"_pos)->GetValue(), name_error);
+
+        // Имя листа, открытое удалением, не может замкнуть цикл.
+        book.DefineName("Loop", 1.0);
+        first.SetCell("C1"_pos, "=Loop+1");
+        first.DefineName("Loop", "C1"_pos);
+        bool caught = false;
+        try {
+            book.RemoveName("Loop");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(*book.FindName("Loop"), 1.0);
+        ASSERT_EQUAL(first.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        caught = false;
+        try {
+            book.DefineName("A1", 1.0);
+        } catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    void TestWorkbookParallelRecalculation() {
+        constexpr int SHEETS = 12;
+        constexpr int ROWS = 200;
+
+        auto fill = [&](Workbook& book) {
+            std::vector<Sheet*> sheets;
+            for (int s = 0; s < SHEETS; ++s) {
+                sheets.push_back(&book.AddSheet("S" + std::to_string(s)));
+            }
+            for (int s = 0; s < SHEETS; ++s) {
+                for (int r = 0; r < ROWS; ++r) {
+                    const std::string row = std::to_string(r + 1);
+                    sheets[s]->SetCell(Position{r, 0}, std::to_string(s * ROWS + r));
+                    // Все листы читают S0, вторая половина — ещё и предыдущий лист.
+                    const std::string source = s < SHEETS / 2
+                            ? "A" + row
+                            : "S" + std::to_string(s - 1) + "!B" + row;
+                    sheets[s]->SetCell(Position{r, 1}, "=" + source + "*2+A" + row);
+                    sheets[s]->SetCell(Position{r, 2},
+                                       "=SUM(S0!A1:A" + row + ")+MATCH(" + std::to_string(r)
+                                               + ",S0!A1:A" + std::to_string(ROWS) + ",0)");
+                }
+            }
+            // Два листа ссылаются друг на друга: они вычисляются после волн.
+            sheets[SHEETS - 2]->SetCell(Position{0, 3}, "=S11!A1");
+            sheets[SHEETS - 1]->SetCell(Position{0, 3}, "=S10!A2");
+        };
+
+        Workbook serial;
+        Workbook parallel;
+        fill(serial);
+        fill(parallel);
+        serial.Recalculate(1);
+        parallel.Recalculate(4);
+        for (int s = 0; s < SHEETS; ++s) {
+            const Sheet* a = serial.GetSheet("S" + std::to_string(s));
+            const Sheet* b = parallel.GetSheet("S" + std::to_string(s));
+            for (int r = 0; r < ROWS; ++r) {
+                for (int c = 1; c < 3; ++c) {
+                    const auto* cell = static_cast<const Cell*>(b->GetCell(Position{r, c}));
+                    ASSERT(cell->HasCachedValue());
+                    ASSERT_EQUAL(cell->GetValue(), a->GetCell(Position{r, c})->GetValue());
+                }
+            }
+        }
+        // S5!B1 = 3 * 1000, S6!B1 = S5!B1 * 2 + 1200.
+        ASSERT_EQUAL(parallel.GetSheet("S6")->GetCell("B1"_pos)->GetValue(),
+                     CellInterface::Value(7200.0));
+    }
+
+    void TestWorkbookMemoryFootprint() {
+        AllocationCounter::Scope counting;
+        constexpr int ROWS = 20;
+        const size_t capacity = GetFormulaCacheStats().capacity;
+        SetFormulaCacheCapacity(0);
+
+        // Байты на значения и формулы, ссылающиеся на свой лист.
+        auto fill = [&](SheetInterface& sheet) {
+            const long long before = AllocationCounter::GetLiveBytes();
+            for (int i = 0; i < ROWS; ++i) {
+                const std::string row = std::to_string(i + 1);
+                sheet.SetCell(Position{i, 0}, "1");
+                sheet.SetCell(Position{i, 1}, "2");
+                sheet.SetCell(Position{i, 2}, "3");
+                sheet.SetCell(Position{i, 3}, "=A" + row + "+B" + row + "*C" + row + "-A" + row);
+            }
+            return AllocationCounter::GetLiveBytes() - before;
+        };
+
+        // Ссылки на другие листы хранит книга, и только для формул, у которых
+        // они есть: содержимое листа книги стоит столько же, сколько у
+        // отдельного листа.
+        auto standalone = CreateSheet();
+        Workbook book;
+        book.AddSheet("Data");
+        ASSERT_EQUAL(fill(book.AddSheet("Report")), fill(*standalone));
+        SetFormulaCacheCapacity(capacity);
+    }
+
+    void TestVolatileFunctions() {
+        ASSERT_EQUAL(ParseFormula("NOW ( )")->GetExpression(), "NOW()");
+        ASSERT(ParseFormula("RAND()*2+A1")->IsVolatile());
+        ASSERT(ParseFormula("IF(A1,1,NOW())")->IsVolatile());
+        ASSERT(!ParseFormula("A1+1")->IsVolatile());
+        ASSERT(!ParseFormula("RAND")->IsVolatile());
+        bool caught = false;
+        try {
+            ParseFormula("RAND(1)");
+        } catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=RAND()");
+        sheet.SetCell("A2"_pos, "3");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=B1+1");
+        sheet.SetCell("D1"_pos, "=A2*2");
+        sheet.SetCell("E1"_pos, "=SUM(A1:A2)");
+        sheet.SetCell("F1"_pos, "=NOW()");
+        ASSERT_EQUAL(sheet.GetVolatileCount(), 2u);
+
+        auto value = [&](Position pos) {
+            return std::get<double>(sheet.GetCell(pos)->GetValue());
+        };
+        auto cached = [&](Position pos) {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->HasCachedValue();
+        };
+        const double first = value("A1"_pos);
+        ASSERT(first >= 0.0 && first < 1.0);
+        ASSERT_EQUAL(value("C1"_pos), first * 2 + 1);
+        ASSERT_EQUAL(value("D1"_pos), 6.0);
+        ASSERT_EQUAL(value("E1"_pos), first + 3);
+        // 1.1.2020 — день 43831.
+        ASSERT(value("F1"_pos) > 43831.0);
+
+        // Значение хранится до шага времени.
+        ASSERT_EQUAL(value("A1"_pos), first);
+        // Шаг вычисляет заново только изменчивые формулы и зависящие от них.
+        ASSERT_EQUAL(sheet.Tick(), 5u);
+        ASSERT(cached("A1"_pos) && cached("C1"_pos) && cached("E1"_pos));
+        ASSERT(cached("D1"_pos));
+        const double second = value("A1"_pos);
+        ASSERT(second != first);
+        ASSERT_EQUAL(value("C1"_pos), second * 2 + 1);
+        ASSERT_EQUAL(value("E1"_pos), second + 3);
+
+        sheet.SetCell("A1"_pos, "=1");
+        sheet.ClearCell("F1"_pos);
+        ASSERT_EQUAL(sheet.GetVolatileCount(), 0u);
+        ASSERT_EQUAL(sheet.Tick(), 0u);
+        ASSERT_EQUAL(value("C1"_pos), 3.0);
+
+        // В книге шаг проходит и по зависимым формулам других листов.
+        Workbook book;
+        Sheet& data = book.AddSheet("Data");
+        Sheet& report = book.AddSheet("Report");
+        data.SetCell("A1"_pos, "=RAND()");
+        report.SetCell("A1"_pos, "=Data!A1+1");
+        report.SetCell("A2"_pos, "=2");
+        const auto before = report.GetCell("A1"_pos)->GetValue();
+        report.GetCell("A2"_pos)->GetValue();
+        ASSERT_EQUAL(book.Tick(), 2u);
+        ASSERT(!(report.GetCell("A1"_pos)->GetValue() == before));
+        ASSERT_EQUAL(std::get<double>(report.GetCell("A1"_pos)->GetValue()),
+                     std::get<double>(data.GetCell("A1"_pos)->GetValue()) + 1);
+        ASSERT(static_cast<const Cell*>(report.GetCell("A2"_pos))->HasCachedValue());
+    }
+
+    void TestArrayFormulas() {
+        ASSERT_EQUAL(ParseFormula("A1:B2 * 2")->GetExpression(), "A1:B2*2");
+        ASSERT_EQUAL(ParseFormula("-(A1:A3)+B1:B3")->GetExpression(), "-A1:A3+B1:B3");
+        ASSERT_EQUAL(*ParseFormula("A1:B3+1")->GetArraySize(), (Size{3, 2}));
+        ASSERT(!ParseFormula("SUM(A1:B3)+1")->GetArraySize());
+        // Размеры операндов не совпадают — обычная формула со значением #VALUE!.
+        ASSERT(!ParseFormula("A1:A3+B1:B2")->GetArraySize());
+
+        Sheet sheet;
+        for (int row = 0; row < 3; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row + 1));
+            sheet.SetCell({row, 1}, std::to_string(10 * (row + 1)));
+        }
+        auto value = [&](Position pos) {
+            const CellInterface* cell = sheet.GetCell(pos);
+            return cell ? cell->GetValue() : CellInterface::Value();
+        };
+        using Value = CellInterface::Value;
+        const Value spill = FormulaError(FormulaError::Category::Spill);
+
+        // Значения разливаются вниз и вправо от ячейки формулы.
+        sheet.SetCell("C1"_pos, "=A1:B3*2+1");
+        ASSERT_EQUAL(value("C1"_pos), Value(3.0));
+        ASSERT_EQUAL(value("D1"_pos), Value(21.0));
+        ASSERT_EQUAL(value("C3"_pos), Value(7.0));
+        ASSERT_EQUAL(value("D3"_pos), Value(61.0));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 4}));
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(values.str(), "1\t10\t3\t21\n2\t20\t5\t41\n3\t30\t7\t61\n");
+
+        // Разлитые ячейки читают другие формулы, и их значения сбрасываются
+        // вместе со входами формулы-массива.
+        sheet.SetCell("E1"_pos, "=D3+SUM(C1:C3)");
+        ASSERT_EQUAL(value("E1"_pos), Value(76.0));
+        sheet.SetCell("B3"_pos, "1");
+        ASSERT_EQUAL(value("D3"_pos), Value(3.0));
+        ASSERT_EQUAL(value("E1"_pos), Value(18.0));
+        // Очистка разлитой ячейки ничего не меняет.
+        sheet.ClearCell("D2"_pos);
+        ASSERT_EQUAL(value("D2"_pos), Value(41.0));
+
+        // Занятая ячейка области блокирует формулу, освобождение — разливает.
+        sheet.SetCell("D2"_pos, "x");
+        ASSERT_EQUAL(value("C1"_pos), spill);
+        ASSERT_EQUAL(value("C2"_pos), Value());
+        ASSERT_EQUAL(value("E1"_pos), spill);
+        ASSERT_EQUAL(sheet.GetBlockedSpillCount(), 1u);
+        sheet.ClearCell("D2"_pos);
+        ASSERT_EQUAL(value("C2"_pos), Value(5.0));
+        ASSERT_EQUAL(value("E1"_pos), Value(18.0));
+        ASSERT_EQUAL(sheet.GetBlockedSpillCount(), 0u);
+
+        // Две формулы с пересекающимися областями: вторая ждёт, пока первая
+        // не освободит место.
+        sheet.SetCell("F2"_pos, "=A1:A2");
+        sheet.SetCell("F1"_pos, "=A1:A3");
+        ASSERT_EQUAL(value("F1"_pos), spill);
+        sheet.SetCell("F2"_pos, "");
+        ASSERT_EQUAL(value("F3"_pos), Value(3.0));
+
+        // Формула не может читать свою область, в том числе через другие ячейки.
+        auto throws_cycle = [&](Position pos, const std::string& text) {
+            try {
+                sheet.SetCell(pos, text);
+            } catch (const CircularDependencyException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(throws_cycle("G1"_pos, "=G2:G3+A1:A2"));
+        ASSERT(throws_cycle("G1"_pos, "=A1:A3+SUM(G3)"));
+        sheet.SetCell("H1"_pos, "=C2");
+        ASSERT(throws_cycle("A2"_pos, "=H1"));
+        ASSERT_EQUAL(value("H1"_pos), Value(5.0));
+
+        // Обычная формула вместо массива убирает разлитые значения.
+        sheet.SetCell("C1"_pos, "=A1");
+        ASSERT_EQUAL(value("C1"_pos), Value(1.0));
+        ASSERT_EQUAL(value("D3"_pos), Value());
+        ASSERT_EQUAL(value("H1"_pos), Value(0.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 8}));
+
+        // Блоки вычисления начинаются в середине столбца, широкий массив
+        // считается так же, как высокий.
+        Sheet wide;
+        for (int row = 0; row < 700; ++row) {
+            wide.SetCell({row, 0}, std::to_string(row));
+            wide.SetCell({row, 1}, std::to_string(2 * row));
+        }
+        wide.SetCell("D1"_pos, "=(A1:B700+1)*2-A1:B700/2+SUM(A1:A2)");
+        for (int row : {0, 511, 699}) {
+            for (int col : {0, 1}) {
+                const double input = (col + 1) * row;
+                ASSERT_EQUAL(wide.GetCell({row, col + 3})->GetValue(),
+                             Value((input + 1) * 2 - input / 2 + 1));
+            }
+        }
+        wide.SetCell("A702"_pos, "=-A2:C2*2+1");
+        ASSERT_EQUAL(wide.GetCell("B702"_pos)->GetValue(), Value(-3.0));
+        ASSERT_EQUAL(wide.GetCell("C702"_pos)->GetValue(), Value(1.0));
+
+        // Ошибки поэлементные, длинные столбцы читаются через индекс так же,
+        // как по ячейкам.
+        for (bool indexed : {true, false}) {
+            Sheet column;
+            column.SetColumnIndexesEnabled(indexed);
+            for (int row = 0; row < 100; ++row) {
+                column.SetCell({row, 0}, row % 10 == 0 ? "=" + std::to_string(row) + "+1"
+                                                      : std::to_string(row));
+            }
+            column.SetCell("A50"_pos, "=1/0");
+            column.SetCell("A60"_pos, "text");
+            column.SetCell("B1"_pos, "=1/A1:A100");
+            auto at = [&](Position pos) { return column.GetCell(pos)->GetValue(); };
+            ASSERT_EQUAL(at("B1"_pos), Value(1.0));
+            ASSERT_EQUAL(at("B5"_pos), Value(0.25));
+            ASSERT_EQUAL(at("B11"_pos), Value(1.0 / 11));
+            ASSERT_EQUAL(at("B50"_pos), Value(FormulaError(FormulaError::Category::Arithmetic)));
+            ASSERT_EQUAL(at("B60"_pos), Value(FormulaError(FormulaError::Category::Value)));
+            ASSERT_EQUAL(at("B100"_pos), Value(1.0 / 99));
+            column.SetCell("A5"_pos, "8");
+            ASSERT_EQUAL(at("B5"_pos), Value(0.125));
+        }
+    }
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::strcmp(argv[1], "--bench") == 0) {
+        RunBenchmarks(std::cout);
+        return 0;
+    }
+
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
@@ -369,4 +2693,49 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestFormulaCacheExactNumbers);
+    RUN_TEST(tr, TestFormulaCacheEviction);
+    RUN_TEST(tr, TestBatchEvaluationMatchesSingle);
+    RUN_TEST(tr, TestSheetRecalculateInBatches);
+    RUN_TEST(tr, TestNanBoxEncoding);
+    RUN_TEST(tr, TestNanBoxArithmeticMatchesVariant);
+    RUN_TEST(tr, TestParseNumberTextMatchesStrtod);
+    RUN_TEST(tr, TestTextCellNumericValue);
+    RUN_TEST(tr, TestFormulaMemoryFootprint);
+    RUN_TEST(tr, TestPrattParserMatchesAntlr);
+    RUN_TEST(tr, TestParserBackendSelection);
+    RUN_TEST(tr, TestAntlrContextReuse);
+    RUN_TEST(tr, TestFormulaParserWarmUp);
+    RUN_TEST(tr, TestFormulaDiagnostics);
+    RUN_TEST(tr, TestBulkSetCellsMatchesSequential);
+    RUN_TEST(tr, TestBulkSetCellsErrors);
+    RUN_TEST(tr, TestTrivialFormulaFastPath);
+    RUN_TEST(tr, TestPositionCodec);
+    RUN_TEST(tr, TestCanonicalNumberPrinting);
+    RUN_TEST(tr, TestAggregateMatchesScalar);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestRangeFunctionErrors);
+    RUN_TEST(tr, TestRangeFunctionParsing);
+    RUN_TEST(tr, TestRangeIndexMatchesBruteForce);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestColumnIndexMatchesScan);
+    RUN_TEST(tr, TestColumnIndexErrors);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestLookupIndexMatchesScan);
+    RUN_TEST(tr, TestAggregateAddIfMatchesScalar);
+    RUN_TEST(tr, TestCriteriaFunctions);
+    RUN_TEST(tr, TestCriteriaIndexMatchesScan);
+    RUN_TEST(tr, TestComparisonOperators);
+    RUN_TEST(tr, TestConditionalFunctions);
+    RUN_TEST(tr, TestConditionalDependencies);
+    RUN_TEST(tr, TestFormulaNames);
+    RUN_TEST(tr, TestSheetNames);
+    RUN_TEST(tr, TestSheetReferenceParsing);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestWorkbookNames);
+    RUN_TEST(tr, TestWorkbookParallelRecalculation);
+    RUN_TEST(tr, TestWorkbookMemoryFootprint);
+    RUN_TEST(tr, TestVolatileFunctions);
+    RUN_TEST(tr, TestArrayFormulas);
 }
\ No newline at end of file
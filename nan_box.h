@@ -0,0 +1,107 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Внутреннее представление результата формулы одним double: число хранится
+// как есть, а FormulaError — как NaN со своей полезной нагрузкой. Операции
+// над такими значениями не ветвятся и не бросают исключений; в
+// FormulaInterface::Value результат превращается только на выходе из формулы.
+//
+// Семантика совпадает с вычислением по дереву: если операнд — ошибка,
+// результатом становится ошибка левого операнда, затем правого; бесконечный
+// или неопределённый результат операции даёт #ARITHM!.
+namespace NanBox {
+
+    constexpr uint64_t EXPONENT_MASK = 0x7FF0'0000'0000'0000ULL;
+    constexpr uint64_t ERROR_TAG = 0x7FFE'7A60'0000'0000ULL;
+    constexpr uint64_t ERROR_TAG_MASK = ~uint64_t{0xFF};
+    constexpr uint64_t CANONICAL_NAN = 0x7FF8'0000'0000'0000ULL;
+
+    inline uint64_t ToBits(double value) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    inline double FromBits(uint64_t bits) {
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    inline uint64_t ErrorBits(FormulaError::Category category) {
+        return ERROR_TAG | (static_cast<uint64_t>(category) + 1);
+    }
+
+    inline bool IsErrorBits(uint64_t bits) {
+        return (bits & ERROR_TAG_MASK) == ERROR_TAG;
+    }
+
+    inline bool IsFiniteBits(uint64_t bits) {
+        return (bits & EXPONENT_MASK) != EXPONENT_MASK;
+    }
+
+    inline double FromError(FormulaError::Category category) {
+        return FromBits(ErrorBits(category));
+    }
+
+    // Обычное число. NaN приводится к каноническому, чтобы его полезная
+    // нагрузка не могла совпасть с кодом ошибки.
+    inline double FromNumber(double value) {
+        uint64_t bits = ToBits(value);
+        return FromBits(value == value ? bits : CANONICAL_NAN);
+    }
+
+    inline bool IsError(double value) {
+        return IsErrorBits(ToBits(value));
+    }
+
+    inline FormulaError::Category GetCategory(double value) {
+        return static_cast<FormulaError::Category>((ToBits(value) & 0xFF) - 1);
+    }
+
+    inline double FromValue(const FormulaInterface::Value& value) {
+        if (const auto* error = std::get_if<FormulaError>(&value)) {
+            return FromError(error->GetCategory());
+        }
+        return FromNumber(std::get<double>(value));
+    }
+
+    inline FormulaInterface::Value ToValue(double value) {
+        if (IsError(value)) {
+            return FormulaError(GetCategory(value));
+        }
+        return value;
+    }
+
+    // Результат операции с учётом ошибок операндов.
+    inline double Finish(double lhs, double rhs, double result) {
+        const uint64_t lhs_bits = ToBits(lhs);
+        const uint64_t rhs_bits = ToBits(rhs);
+        const uint64_t result_bits = ToBits(result);
+
+        uint64_t bits = IsFiniteBits(result_bits)
+                        ? result_bits
+                        : ErrorBits(FormulaError::Category::Arithmetic);
+        bits = IsErrorBits(rhs_bits) ? rhs_bits : bits;
+        bits = IsErrorBits(lhs_bits) ? lhs_bits : bits;
+        return FromBits(bits);
+    }
+
+    // Результат вычисления без операндов-ошибок, например свёртки области.
+    inline double FromResult(double result) {
+        return Finish(0.0, 0.0, result);
+    }
+
+    inline double Add(double lhs, double rhs) { return Finish(lhs, rhs, lhs + rhs); }
+    inline double Subtract(double lhs, double rhs) { return Finish(lhs, rhs, lhs - rhs); }
+    inline double Multiply(double lhs, double rhs) { return Finish(lhs, rhs, lhs * rhs); }
+    inline double Divide(double lhs, double rhs) { return Finish(lhs, rhs, lhs / rhs); }
+    inline double Plus(double operand) { return Finish(operand, 0.0, +operand); }
+    inline double Negate(double operand) { return Finish(operand, 0.0, -operand); }
+
+} // namespace NanBox
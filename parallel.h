@@ -0,0 +1,65 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Вызывает body(i) для всех i из [0, count) в threads потоках (0 — по числу
+// ядер), вызывающий поток работает наравне с остальными. Индексы раздаются
+// блоками по мере освобождения потоков, поэтому неравномерная работа
+// распределяется сама. Первое исключение из body пробрасывается после
+// завершения всех потоков. Для мелкой работы подходят блоки по 64 индекса,
+// для крупной (например, целых листов) — по одному.
+template <typename Body>
+void ParallelFor(size_t count, size_t threads, Body body, size_t block = 64) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, (count + block - 1) / block);
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            body(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next{0};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    auto worker = [&] {
+        try {
+            for (size_t begin = next.fetch_add(block); begin < count;
+                 begin = next.fetch_add(block)) {
+                const size_t end = std::min(count, begin + block);
+                for (size_t i = begin; i < end; ++i) {
+                    body(i);
+                }
+            }
+        } catch (...) {
+            std::lock_guard guard(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next = count;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (size_t i = 1; i < threads; ++i) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,150 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+void RangeIndex::Insert(const Range& range, Cell* cell) {
+    assert(range.IsValid());
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        columns_[col].Insert(range.first.row, range.last.row, cell);
+    }
+    entries_ += static_cast<size_t>(range.last.col - range.first.col + 1);
+}
+
+void RangeIndex::Erase(const Range& range, Cell* cell) {
+    assert(range.IsValid());
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        auto it = columns_.find(col);
+        assert(it != columns_.end());
+        it->second.Erase(range.first.row, range.last.row, cell);
+        if (it->second.GetSize() == 0) {
+            columns_.erase(it);
+        }
+    }
+    entries_ -= static_cast<size_t>(range.last.col - range.first.col + 1);
+}
+
+void RangeIndex::FindContaining(Position pos, std::vector<Cell*>& out) const {
+    auto it = columns_.find(pos.col);
+    if (it != columns_.end()) {
+        it->second.FindContaining(pos.row, out);
+    }
+}
+
+size_t RangeIndex::GetEntryCount() const {
+    return entries_;
+}
+
+void RangeIndex::ColumnTree::Insert(int first, int last, Cell* cell) {
+    // xorshift32: приоритеты узлов должны быть лишь случайными и различными.
+    seed_ ^= seed_ << 13;
+    seed_ ^= seed_ >> 17;
+    seed_ ^= seed_ << 5;
+
+    int32_t node;
+    if (free_.empty()) {
+        node = static_cast<int32_t>(nodes_.size());
+        nodes_.emplace_back();
+    } else {
+        node = free_.back();
+        free_.pop_back();
+    }
+    nodes_[node] = Node{first, last, last, seed_, cell};
+
+    int32_t left;
+    int32_t right;
+    Split(root_, GetKey(first, last, cell), false, left, right);
+    root_ = Merge(Merge(left, node), right);
+}
+
+void RangeIndex::ColumnTree::Erase(int first, int last, Cell* cell) {
+    const Key key = GetKey(first, last, cell);
+    int32_t less;
+    int32_t rest;
+    Split(root_, key, false, less, rest);
+    int32_t equal;
+    int32_t greater;
+    Split(rest, key, true, equal, greater);
+
+    assert(equal != NIL);
+    if (equal != NIL) {
+        const int32_t removed = equal;
+        equal = Merge(nodes_[removed].left, nodes_[removed].right);
+        free_.push_back(removed);
+    }
+    root_ = Merge(Merge(less, equal), greater);
+
+    if (root_ == NIL) {
+        nodes_.clear();
+        free_.clear();
+    }
+}
+
+void RangeIndex::ColumnTree::FindContaining(int row, std::vector<Cell*>& out) const {
+    Find(root_, row, out);
+}
+
+void RangeIndex::ColumnTree::Update(int32_t node) {
+    Node& n = nodes_[node];
+    n.max_last = n.last;
+    if (n.left != NIL) {
+        n.max_last = std::max(n.max_last, nodes_[n.left].max_last);
+    }
+    if (n.right != NIL) {
+        n.max_last = std::max(n.max_last, nodes_[n.right].max_last);
+    }
+}
+
+void RangeIndex::ColumnTree::Split(int32_t node, const Key& key, bool inclusive,
+                                   int32_t& left, int32_t& right) {
+    if (node == NIL) {
+        left = right = NIL;
+        return;
+    }
+
+    Node& n = nodes_[node];
+    const Key node_key = GetKey(n.first, n.last, n.cell);
+    if (inclusive ? node_key <= key : node_key < key) {
+        Split(n.right, key, inclusive, nodes_[node].right, right);
+        left = node;
+    } else {
+        Split(n.left, key, inclusive, left, nodes_[node].left);
+        right = node;
+    }
+    Update(node);
+}
+
+int32_t RangeIndex::ColumnTree::Merge(int32_t left, int32_t right) {
+    if (left == NIL) {
+        return right;
+    }
+    if (right == NIL) {
+        return left;
+    }
+
+    if (nodes_[left].priority > nodes_[right].priority) {
+        nodes_[left].right = Merge(nodes_[left].right, right);
+        Update(left);
+        return left;
+    }
+    nodes_[right].left = Merge(left, nodes_[right].left);
+    Update(right);
+    return right;
+}
+
+void RangeIndex::ColumnTree::Find(int32_t node, int row, std::vector<Cell*>& out) const {
+    // Отрезки поддерева заканчиваются раньше row — в нём искать нечего.
+    if (node == NIL || nodes_[node].max_last < row) {
+        return;
+    }
+
+    const Node& n = nodes_[node];
+    Find(n.left, row, out);
+    // Справа отрезки начинаются не раньше текущего.
+    if (n.first <= row) {
+        if (row <= n.last) {
+            out.push_back(n.cell);
+        }
+        Find(n.right, row, out);
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+
+// Зависимости формул от областей. Область хранится целиком, а не ребром на
+// каждую её ячейку: в каждом столбце, который она покрывает, — одним
+// отрезком строк в дереве отрезков этого столбца. Поиск формул, зависящих
+// от ячейки, обходит одно дерево и занимает в среднем O(log n + k), где k —
+// число найденных записей.
+class RangeIndex {
+public:
+    // Одна и та же пара (область, ячейка) может добавляться несколько раз;
+    // каждое добавление снимается своим вызовом Erase.
+    void Insert(const Range& range, Cell* cell);
+    void Erase(const Range& range, Cell* cell);
+
+    // Дописывает в out ячейки, чьи области содержат pos. Ячейка попадает в
+    // out столько раз, сколько её областей содержат pos.
+    void FindContaining(Position pos, std::vector<Cell*>& out) const;
+
+    // Число записей по всем столбцам.
+    [[nodiscard]] size_t GetEntryCount() const;
+
+private:
+    // Декартово дерево отрезков строк, упорядоченное по началу отрезка; в
+    // каждом узле хранится наибольший конец отрезка в его поддереве. Узлы
+    // лежат в одном массиве, освободившиеся места переиспользуются.
+    class ColumnTree {
+    public:
+        void Insert(int first, int last, Cell* cell);
+        void Erase(int first, int last, Cell* cell);
+        void FindContaining(int row, std::vector<Cell*>& out) const;
+
+        [[nodiscard]] size_t GetSize() const {
+            return nodes_.size() - free_.size();
+        }
+
+    private:
+        static constexpr int32_t NIL = -1;
+
+        struct Node {
+            int first;
+            int last;
+            int max_last;
+            uint32_t priority;
+            Cell* cell;
+            int32_t left = NIL;
+            int32_t right = NIL;
+        };
+
+        using Key = std::tuple<int, int, uintptr_t>;
+
+        static Key GetKey(int first, int last, const Cell* cell) {
+            return {first, last, reinterpret_cast<uintptr_t>(cell)};
+        }
+
+        void Update(int32_t node);
+        // Делит дерево на узлы с ключом меньше key (или не больше, если
+        // inclusive) и остальные.
+        void Split(int32_t node, const Key& key, bool inclusive, int32_t& left, int32_t& right);
+        int32_t Merge(int32_t left, int32_t right);
+        void Find(int32_t node, int row, std::vector<Cell*>& out) const;
+
+        std::vector<Node> nodes_;
+        std::vector<int32_t> free_;
+        int32_t root_ = NIL;
+        uint32_t seed_ = 2463534242u;
+    };
+
+    std::unordered_map<int, ColumnTree> columns_;
+    size_t entries_ = 0;
+};
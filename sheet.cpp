@@ -1,11 +1,21 @@
 #include "sheet.h"
 
+#include "aggregate.h"
 #include "cell.h"
 #include "common.h"
+#include "formula_batch.h"
+#include "nan_box.h"
+#include "parallel.h"
+#include "workbook.h"
 
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <optional>
 #include <sstream>
 #include <unordered_set>
+#include <utility>
 
 namespace {
     inline void CheckPositionValid(Position pos) {
@@ -14,6 +24,25 @@ namespace {
     }
 }
 
+Sheet::Sheet(Workbook& workbook, std::string name)
+        : workbook_(&workbook)
+        , name_(std::move(name)) {}
+
+Workbook* Sheet::GetWorkbook() const {
+    return workbook_;
+}
+
+const std::string& Sheet::GetName() const {
+    return name_;
+}
+
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    if (!workbook_) {
+        return nullptr;
+    }
+    return static_cast<const Workbook*>(workbook_)->GetSheet(name);
+}
+
 void Sheet::SetCell(Position pos, std::string text) {
     CheckPositionValid(pos);
 
@@ -25,6 +54,47 @@ void Sheet::SetCell(Position pos, std::string text) {
     cell->Set(std::move(text));
 }
 
+void SheetInterface::SetCells(std::vector<std::pair<Position, std::string>> cells, size_t) {
+    for (auto& [pos, text] : cells) {
+        SetCell(pos, std::move(text));
+    }
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells, size_t threads) {
+    using ParsedFormula = std::variant<std::unique_ptr<FormulaInterface>, FormulaDiagnostic>;
+
+    auto is_formula = [](Position pos, const std::string& text) {
+        return pos.IsValid() && text.size() > 1 && text[0] == FORMULA_SIGN;
+    };
+
+    // Разбор формул не зависит от листа и выполняется параллельно.
+    std::vector<std::optional<ParsedFormula>> parsed(cells.size());
+    ParallelFor(cells.size(), threads, [&](size_t i) {
+        const auto& [pos, text] = cells[i];
+        if (is_formula(pos, text)) {
+            parsed[i] = TryParseFormula(text.substr(1));
+        }
+    });
+
+    for (size_t i = 0; i < cells.size(); ++i) {
+        auto& [pos, text] = cells[i];
+        CheckPositionValid(pos);
+
+        Cell* cell = GetOrCreateCell(pos);
+        if (cell->GetText() == text) {
+            continue;
+        }
+        if (!parsed[i]) {
+            cell->Set(std::move(text));
+            continue;
+        }
+        if (auto* diagnostic = std::get_if<FormulaDiagnostic>(&*parsed[i])) {
+            throw FormulaException(diagnostic->ToString());
+        }
+        cell->SetFormula(std::move(std::get<std::unique_ptr<FormulaInterface>>(*parsed[i])));
+    }
+}
+
 [[nodiscard]] const CellInterface* Sheet::GetCell(Position pos) const {
     CheckPositionValid(pos);
 
@@ -57,8 +127,10 @@ void Sheet::ClearCell(Position pos) {
 
     cell->Clear();
 
-    if (!cell->IsReferenced()) {
-        cells_.erase(it);
+    // На очищенную ячейку могли разлиться значения формулы-массива, а
+    // разлитые ячейки могли добавиться в таблицу: итератор уже недействителен.
+    if (!cell->IsReferenced() && !cell->GetSpillAnchor()) {
+        cells_.erase(pos);
     }
 }
 
@@ -71,11 +143,8 @@ void Sheet::ClearCell(Position pos) {
     int max_col = -1;
 
     for (const auto& [pos, cell_ptr] : cells_) {
-        if (!cell_ptr) {
-            continue;
-        }
-        const std::string text = cell_ptr->GetText();
-        if (text.empty()) {
+        // Разлитые значения формул-массивов печатаются, хотя текста у них нет.
+        if (!cell_ptr || cell_ptr->IsEmpty()) {
             continue;
         }
         if (pos.row > max_row) {
@@ -94,6 +163,8 @@ void Sheet::ClearCell(Position pos) {
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
+    Recalculate();
+
     Size size = GetPrintableSize();
     for (int r = 0; r < size.rows; ++r) {
         for (int c = 0; c < size.cols; ++c) {
@@ -108,8 +179,7 @@ void Sheet::PrintValues(std::ostream& output) const {
             }
 
             const auto& cell = it->second;
-            const std::string text = cell->GetText();
-            if (text.empty()) {
+            if (cell->IsEmpty()) {
                 continue;
             }
 
@@ -153,12 +223,547 @@ Cell *Sheet::GetOrCreateCell(Position pos) {
         return it->second.get();
     }
 
-    auto cell = std::make_unique<Cell>(*this);
+    auto cell = std::make_unique<Cell>(*this, pos);
     Cell* raw = cell.get();
     cells_.emplace(pos, std::move(cell));
     return raw;
 }
 
+void Sheet::AddRangeDependent(const Range& range, Cell* cell) {
+    range_dependents_.Insert(range, cell);
+}
+
+void Sheet::RemoveRangeDependent(const Range& range, Cell* cell) {
+    range_dependents_.Erase(range, cell);
+}
+
+void Sheet::FindRangeDependents(Position pos, std::vector<Cell*>& out) const {
+    range_dependents_.FindContaining(pos, out);
+}
+
+size_t Sheet::GetRangeDependencyCount() const {
+    return range_dependents_.GetEntryCount();
+}
+
+void Sheet::DefineName(const std::string& name, NameValue value) {
+    if (!IsValidFormulaName(name)) {
+        throw FormulaException("Invalid name: " + name);
+    }
+    if (const auto* pos = std::get_if<Position>(&value)) {
+        CheckPositionValid(*pos);
+    } else if (const auto* range = std::get_if<Range>(&value); range && !range->IsValid()) {
+        throw InvalidPositionException("Invalid range");
+    }
+
+    std::optional<NameValue> previous;
+    if (auto it = names_.find(name); it != names_.end()) {
+        previous = it->second;
+    }
+    names_[name] = std::move(value);
+    try {
+        BindNameUsers(name);
+    } catch (const CircularDependencyException&) {
+        // Часть формул уже связана с новым значением: возвращаем прежнее
+        // и связываем их снова.
+        if (previous) {
+            names_[name] = std::move(*previous);
+        } else {
+            names_.erase(name);
+        }
+        BindNameUsers(name);
+        throw;
+    }
+}
+
+void Sheet::RemoveName(const std::string& name) {
+    if (names_.erase(name) > 0) {
+        BindNameUsers(name);
+    }
+}
+
+std::optional<NameValue> Sheet::FindName(std::string_view name) const {
+    if (workbook_) {
+        if (auto value = workbook_->FindName(name)) {
+            return *value;
+        }
+    }
+    // Ключи — std::string: поиск по string_view требует временной строки.
+    if (auto it = names_.find(std::string(name)); it != names_.end()) {
+        return it->second;
+    }
+    return std::nullopt;
+}
+
+NameResolver Sheet::GetNameResolver() const {
+    return [this](std::string_view name) {
+        return FindName(name);
+    };
+}
+
+void Sheet::AddNameUser(const std::string& name, Cell* cell) {
+    name_users_[name].insert(cell);
+}
+
+void Sheet::RemoveNameUser(const std::string& name, Cell* cell) {
+    if (auto it = name_users_.find(name); it != name_users_.end()) {
+        it->second.erase(cell);
+        if (it->second.empty()) {
+            name_users_.erase(it);
+        }
+    }
+}
+
+void Sheet::BindNameUsers(const std::string& name) {
+    auto it = name_users_.find(name);
+    if (it == name_users_.end()) {
+        return;
+    }
+    // Число, оставшееся числом, меняется прямо в формулах, а их значения
+    // сбрасываются одним обходом. Остальные формулы связываются заново
+    // после: связывание меняет множество пользователей имени.
+    const auto value = FindName(name);
+    const double* number = value ? std::get_if<double>(&*value) : nullptr;
+    std::unordered_set<Cell*> visited;
+    visited.reserve(it->second.size());
+    std::vector<Cell*> stack;
+    std::vector<Cell*> rebind;
+    for (Cell* cell : it->second) {
+        if (number && cell->SetNameValue(name, *number)) {
+            cell->InvalidateCache(visited, stack);
+        } else {
+            rebind.push_back(cell);
+        }
+    }
+    for (Cell* cell : rebind) {
+        cell->BindNames();
+    }
+}
+
+void Sheet::UpdateColumnIndexes(Position pos, const Cell& cell) {
+    if (auto it = column_indexes_.find(pos.col); it != column_indexes_.end()) {
+        IndexCell(it->second, pos.row, cell);
+    }
+    if (auto it = lookup_indexes_.find(pos.col); it != lookup_indexes_.end()) {
+        IndexCell(it->second, pos.row, cell);
+    }
+}
+
+void Sheet::IndexCell(ColumnIndex& index, int row, const Cell& cell) {
+    if (cell.GetFormula() || cell.GetSpillAnchor()) {
+        index.SetFormula(row);
+        return;
+    }
+    const auto value = cell.GetNumericValue();
+    if (const auto* error = std::get_if<FormulaError>(&value)) {
+        index.SetError(row, NanBox::FromError(error->GetCategory()));
+    } else {
+        index.SetValue(row, NanBox::FromNumber(std::get<double>(value)), cell.IsEmpty());
+    }
+}
+
+void Sheet::IndexCell(LookupIndex& index, int row, const Cell& cell) {
+    if (cell.GetFormula() || cell.GetSpillAnchor()) {
+        index.SetFormula(row);
+        return;
+    }
+    const auto value = cell.GetNumericValue();
+    if (cell.IsEmpty() || !std::holds_alternative<double>(value)) {
+        index.Erase(row);
+    } else {
+        index.SetValue(row, std::get<double>(value));
+    }
+}
+
+const ColumnIndex& Sheet::GetColumnIndex(int col) const {
+    std::lock_guard guard(indexes_mutex_);
+    auto [it, inserted] = column_indexes_.try_emplace(col);
+    if (inserted) {
+        for (const auto& [pos, cell] : cells_) {
+            if (pos.col == col && cell) {
+                IndexCell(it->second, pos.row, *cell);
+            }
+        }
+    }
+    return it->second;
+}
+
+const LookupIndex& Sheet::GetLookupIndex(int col) const {
+    std::lock_guard guard(indexes_mutex_);
+    auto [it, inserted] = lookup_indexes_.try_emplace(col);
+    if (inserted) {
+        for (const auto& [pos, cell] : cells_) {
+            if (pos.col == col && cell) {
+                IndexCell(it->second, pos.row, *cell);
+            }
+        }
+    }
+    return it->second;
+}
+
+void Sheet::SetColumnIndexesEnabled(bool enabled) {
+    column_indexes_enabled_ = enabled;
+    if (!enabled) {
+        column_indexes_.clear();
+        lookup_indexes_.clear();
+    }
+}
+
+size_t Sheet::AggregateRange(const Range& range, Aggregate& aggregate) const {
+    if (!column_indexes_enabled_ || range.GetSize().rows < MIN_INDEXED_ROWS) {
+        return SheetInterface::AggregateRange(range, aggregate);
+    }
+
+    // Числа сворачиваются в любом порядке, а из ошибок побеждает первая при
+    // построчном обходе: самая верхняя, из ошибок одной строки — самая левая.
+    // Поэтому ошибка добавляется в свёртку последней.
+    size_t empty = 0;
+    std::optional<std::pair<Position, double>> first_error;
+    auto add_error = [&](Position pos, double error) {
+        if (!first_error || pos < first_error->first) {
+            first_error.emplace(pos, error);
+        }
+    };
+
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        const ColumnIndex& index = GetColumnIndex(col);
+
+        const auto summary = index.Query(range.first.row, range.last.row);
+        aggregate.AddSummary(summary.count, summary.sum, summary.min, summary.max,
+                             summary.nan > 0);
+        empty += summary.empty;
+
+        if (auto error = index.FindFirstError(range.first.row, range.last.row)) {
+            add_error({error->first, col}, error->second);
+        }
+
+        const auto& formulas = index.GetFormulaRows();
+        for (auto it = formulas.lower_bound(range.first.row);
+             it != formulas.end() && *it <= range.last.row; ++it) {
+            const Position pos{*it, col};
+            const double value = NanBox::FromValue(ReadCellAsNumber(GetCell(pos)));
+            if (NanBox::IsError(value)) {
+                add_error(pos, value);
+            } else {
+                aggregate.Add(value);
+            }
+        }
+    }
+
+    if (first_error) {
+        aggregate.Add(first_error->second);
+    }
+    return empty;
+}
+
+std::optional<int> Sheet::FindInRange(const Range& vector, double key,
+                                      LookupMatch match) const {
+    const Size size = vector.GetSize();
+    if (!column_indexes_enabled_ || size.cols != 1 || size.rows < MIN_INDEXED_ROWS) {
+        return SheetInterface::FindInRange(vector, key, match);
+    }
+
+    const LookupIndex& index = GetLookupIndex(vector.first.col);
+    auto found = index.Find(key, vector.first.row, vector.last.row, match);
+
+    const auto& formulas = index.GetFormulaRows();
+    for (auto it = formulas.lower_bound(vector.first.row);
+         it != formulas.end() && *it <= vector.last.row; ++it) {
+        // Точное совпадение выше найденного уже не улучшить.
+        if (match == LookupMatch::Exact && found && found->row < *it) {
+            break;
+        }
+        const double value
+                = NanBox::FromValue(ReadCellAsNumber(GetCell({*it, vector.first.col})));
+        if (NanBox::IsError(value) || std::isnan(value)) {
+            continue;
+        }
+        const bool fits = match == LookupMatch::Exact       ? value == key
+                          : match == LookupMatch::LessOrEqual ? value <= key
+                                                              : value >= key;
+        if (fits && LookupIndex::IsBetter(match, {value, *it}, found)) {
+            found = LookupIndex::Match{value, *it};
+        }
+    }
+
+    if (!found) {
+        return std::nullopt;
+    }
+    return found->row - vector.first.row;
+}
+
+double Sheet::ReadValue(Position pos, double empty) const {
+    const CellInterface* cell = GetCell(pos);
+    if (!cell || cell->IsEmpty()) {
+        return empty;
+    }
+    return NanBox::FromValue(ReadCellAsNumber(cell));
+}
+
+size_t Sheet::AggregateRangeIf(const Range& range, const Criteria& criteria,
+                               const Range& values, Aggregate& aggregate) const {
+    if (!column_indexes_enabled_ || range.GetSize().cols != 1
+        || range.GetSize().rows < MIN_INDEXED_ROWS) {
+        return SheetInterface::AggregateRangeIf(range, criteria, values, aggregate);
+    }
+
+    const int first = range.first.row;
+    const int last = range.last.row;
+    const int shift = values.first.row - first;
+    const int key_col = range.first.col;
+    const int value_col = values.first.col;
+    const double no_number = std::numeric_limits<double>::quiet_NaN();
+
+    if (criteria.GetCompare() == Criteria::Compare::Equal) {
+        // Строки констант с нужным значением и подходящие формулы, по
+        // возрастанию строк.
+        const LookupIndex& index = GetLookupIndex(key_col);
+        std::vector<int> rows;
+        if (const auto* found = index.FindRows(criteria.GetOperand())) {
+            for (auto it = found->lower_bound(first); it != found->end() && *it <= last; ++it) {
+                rows.push_back(*it);
+            }
+        }
+        const auto& formulas = index.GetFormulaRows();
+        const size_t constants = rows.size();
+        for (auto it = formulas.lower_bound(first); it != formulas.end() && *it <= last; ++it) {
+            if (criteria.Matches(ReadValue({*it, key_col}, no_number))) {
+                rows.push_back(*it);
+            }
+        }
+        std::inplace_merge(rows.begin(), rows.begin() + static_cast<ptrdiff_t>(constants),
+                           rows.end());
+
+        // Значения констант берутся из массива индекса, а не из ячеек.
+        const ColumnIndex& sums = GetColumnIndex(value_col);
+        std::vector<double> matched(rows.size());
+        for (size_t i = 0; i < rows.size(); ++i) {
+            const int row = rows[i] + shift;
+            if (sums.GetFormulaRows().count(row) != 0) {
+                matched[i] = ReadValue({row, value_col}, 0.0);
+            } else {
+                sums.CopyValues(row, 1, &matched[i]);
+            }
+        }
+        aggregate.Add(matched.data(), matched.size());
+        return rows.size();
+    }
+
+    const ColumnIndex& keys = GetColumnIndex(key_col);
+    const ColumnIndex& sums = GetColumnIndex(value_col);
+    constexpr int CHUNK = 1024;
+    std::array<double, CHUNK> key_buffer;
+    std::array<double, CHUNK> value_buffer;
+    size_t matched = 0;
+    for (int row = first; row <= last; row += CHUNK) {
+        const int count = std::min(CHUNK, last - row + 1);
+        keys.CopyKeys(row, count, key_buffer.data());
+        sums.CopyValues(row + shift, count, value_buffer.data());
+
+        // Значения формул в массивах не хранятся: они подставляются здесь.
+        for (auto it = keys.GetFormulaRows().lower_bound(row);
+             it != keys.GetFormulaRows().end() && *it < row + count; ++it) {
+            key_buffer[*it - row] = ReadValue({*it, key_col}, no_number);
+        }
+        const auto& value_formulas = sums.GetFormulaRows();
+        for (auto it = value_formulas.lower_bound(row + shift);
+             it != value_formulas.end() && *it < row + shift + count; ++it) {
+            value_buffer[*it - row - shift] = ReadValue({*it, value_col}, 0.0);
+        }
+
+        matched += aggregate.AddIf(key_buffer.data(), value_buffer.data(), count, criteria);
+    }
+    return matched;
+}
+
+void Sheet::ReadColumn(int col, int row, size_t count, double* out) const {
+    if (!column_indexes_enabled_ || count < static_cast<size_t>(MIN_INDEXED_ROWS)) {
+        SheetInterface::ReadColumn(col, row, count, out);
+        return;
+    }
+
+    const ColumnIndex& index = GetColumnIndex(col);
+    index.CopyValues(row, count, out);
+    // Значения формул в индексе не хранятся: они подставляются здесь.
+    const auto& formulas = index.GetFormulaRows();
+    const int end = row + static_cast<int>(count);
+    for (auto it = formulas.lower_bound(row); it != formulas.end() && *it < end; ++it) {
+        out[*it - row] = ReadValue({*it, col}, 0.0);
+    }
+}
+
+void Sheet::UpdateSpills(Position pos, Cell& cell, const std::optional<Range>& old_area) {
+    // Освободившиеся места, на которые могут разлиться заблокированные
+    // формулы.
+    std::vector<Range> freed;
+    if (old_area) {
+        spill_areas_.Erase(*old_area, &cell);
+        blocked_spills_.erase(pos);
+        Unspill(cell, *old_area);
+        freed.push_back(*old_area);
+    }
+    if (cell.IsEmpty()) {
+        freed.push_back({pos, pos});
+    }
+
+    // Своё содержимое в чужой области блокирует формулу, которая туда
+    // разлита.
+    std::vector<Cell*> anchors;
+    spill_areas_.FindContaining(pos, anchors);
+    for (Cell* anchor : anchors) {
+        if (anchor == &cell || cell.IsEmpty() || cell.GetSpillAnchor() == anchor
+            || anchor->IsSpillBlocked()) {
+            continue;
+        }
+        const Range area = *anchor->GetSpillArea();
+        Unspill(*anchor, area);
+        anchor->SetSpillBlocked(true);
+        blocked_spills_.emplace(area.first, anchor);
+        freed.push_back(area);
+    }
+
+    if (const auto area = cell.GetSpillArea()) {
+        spill_areas_.Insert(*area, &cell);
+        TrySpill(cell, *area);
+    }
+
+    if (freed.empty() || blocked_spills_.empty()) {
+        return;
+    }
+    auto intersects = [](const Range& lhs, const Range& rhs) {
+        return lhs.first.row <= rhs.last.row && rhs.first.row <= lhs.last.row
+               && lhs.first.col <= rhs.last.col && rhs.first.col <= lhs.last.col;
+    };
+    std::vector<std::pair<Cell*, Range>> candidates;
+    for (const auto& [anchor_pos, anchor] : blocked_spills_) {
+        const Range area = *anchor->GetSpillArea();
+        if (std::any_of(freed.begin(), freed.end(),
+                        [&](const Range& range) { return intersects(range, area); })) {
+            candidates.emplace_back(anchor, area);
+        }
+    }
+    for (const auto& [anchor, area] : candidates) {
+        TrySpill(*anchor, area);
+    }
+}
+
+size_t Sheet::GetBlockedSpillCount() const {
+    return blocked_spills_.size();
+}
+
+void Sheet::TrySpill(Cell& anchor, const Range& area) {
+    const Size size = *anchor.GetFormula()->GetArraySize();
+    bool free = area.GetSize() == size;
+    for (int row = area.first.row; free && row <= area.last.row; ++row) {
+        for (int col = area.first.col; free && col <= area.last.col; ++col) {
+            auto it = cells_.find({row, col});
+            free = it == cells_.end() || it->second.get() == &anchor || it->second->IsEmpty()
+                   || it->second->GetSpillAnchor() == &anchor;
+        }
+    }
+    if (!free) {
+        anchor.SetSpillBlocked(true);
+        blocked_spills_.emplace(area.first, &anchor);
+        return;
+    }
+
+    blocked_spills_.erase(area.first);
+    for (int row = area.first.row; row <= area.last.row; ++row) {
+        for (int col = area.first.col; col <= area.last.col; ++col) {
+            Cell* cell = GetOrCreateCell({row, col});
+            if (cell != &anchor && !cell->GetSpillAnchor()) {
+                cell->SetSpill(&anchor, row - area.first.row, col - area.first.col);
+            }
+        }
+    }
+    anchor.SetSpillBlocked(false);
+}
+
+void Sheet::Unspill(const Cell& anchor, const Range& area) {
+    for (int row = area.first.row; row <= area.last.row; ++row) {
+        for (int col = area.first.col; col <= area.last.col; ++col) {
+            auto it = cells_.find({row, col});
+            if (it == cells_.end() || it->second->GetSpillAnchor() != &anchor) {
+                continue;
+            }
+            it->second->ClearSpill();
+            if (!it->second->IsReferenced()) {
+                cells_.erase(it);
+            }
+        }
+    }
+}
+
+void Sheet::Recalculate() const {
+    FormulaBatchEvaluator batch(*this);
+    std::vector<const Cell*> pending;
+    std::vector<const Cell*> conditional;
+
+    for (const auto& [pos, cell] : cells_) {
+        if (!cell || cell->HasCachedValue()) {
+            continue;
+        }
+        const FormulaInterface* formula = cell->GetFormula();
+        if (!formula) {
+            continue;
+        }
+        // Рёбра к ячейкам из ветвей обновляет только Cell::GetValue, он же
+        // вычисляет все элементы формулы-массива.
+        if (cell->HasConditionalReferences() || cell->GetSpillArea()) {
+            conditional.push_back(cell.get());
+            continue;
+        }
+        batch.Add(pos, *formula);
+        pending.push_back(cell.get());
+    }
+
+    if (!pending.empty()) {
+        auto values = batch.Evaluate();
+        for (size_t i = 0; i < pending.size(); ++i) {
+            pending[i]->SetCachedValue(std::visit(
+                    [](auto value) -> Cell::Value { return value; }, values[i]));
+        }
+    }
+    for (const Cell* cell : conditional) {
+        cell->GetValue();
+    }
+}
+
+void Sheet::AddVolatile(Cell* cell) {
+    volatile_cells_.insert(cell);
+}
+
+void Sheet::RemoveVolatile(Cell* cell) {
+    volatile_cells_.erase(cell);
+}
+
+size_t Sheet::GetVolatileCount() const {
+    return volatile_cells_.size();
+}
+
+void Sheet::InvalidateVolatile(std::unordered_set<Cell*>& dirty) {
+    std::vector<Cell*> stack;
+    for (Cell* cell : volatile_cells_) {
+        cell->InvalidateCache(dirty, stack);
+    }
+}
+
+size_t Sheet::Tick() {
+    std::unordered_set<Cell*> dirty;
+    InvalidateVolatile(dirty);
+    return RecalculateDirty(dirty);
+}
+
+size_t Sheet::RecalculateDirty(const std::unordered_set<Cell*>& dirty) {
+    size_t count = 0;
+    for (const Cell* cell : dirty) {
+        if (cell->GetFormula()) {
+            cell->GetValue();
+            ++count;
+        }
+    }
+    return count;
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
 }
\ No newline at end of file
@@ -1,17 +1,42 @@
 #pragma once
 
 #include "cell.h"
+#include "column_index.h"
 #include "common.h"
+#include "lookup_index.h"
+#include "range_index.h"
 
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
+
+class Workbook;
 
 class Sheet : public SheetInterface {
 public:
+    Sheet() = default;
+    // Лист книги: его формулы могут ссылаться на другие листы книги.
+    Sheet(Workbook& workbook, std::string name);
     ~Sheet() override = default;
 
+    // Книга листа; nullptr у отдельного листа.
+    [[nodiscard]] Workbook* GetWorkbook() const;
+    [[nodiscard]] const std::string& GetName() const;
+
+    [[nodiscard]] const SheetInterface* FindSheet(std::string_view name) const override;
+
     void SetCell(Position pos, std::string text) override;
 
+    // Сначала разбирает все формулы параллельно, затем по порядку, в одном
+    // потоке, записывает ячейки, связывает ссылки и проверяет циклы.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells,
+                  size_t threads = 0) override;
+
     [[nodiscard]] const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
@@ -22,8 +47,107 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Области высотой от MIN_INDEXED_ROWS строк сворачиваются по индексам
+    // столбцов: константы — за O(log n) на столбец, формулы области
+    // вычисляются по одной. Индекс столбца строится при первой такой свёртке
+    // и дальше обновляется при каждом изменении ячейки.
+    size_t AggregateRange(const Range& range, Aggregate& aggregate) const override;
+
+    // Поиск в столбце от MIN_INDEXED_ROWS строк идёт по индексу поиска
+    // этого столбца; он тоже строится при первом поиске.
+    std::optional<int> FindInRange(const Range& vector, double key,
+                                   LookupMatch match) const override;
+
+    // Условие по столбцу от MIN_INDEXED_ROWS строк проверяется по индексам
+    // столбцов: равенство — через индекс поиска, который сразу даёт строки
+    // с нужным значением, остальные сравнения — векторно по значениям
+    // столбца, хранящимся подряд. Индексы общие для всех формул, которые
+    // проверяют условия по этому столбцу.
+    size_t AggregateRangeIf(const Range& range, const Criteria& criteria, const Range& values,
+                            Aggregate& aggregate) const override;
+
+    // Столбец от MIN_INDEXED_ROWS строк копируется из индекса столбца, где
+    // значения лежат подряд; подставляются только значения формул.
+    void ReadColumn(int col, int row, size_t count, double* out) const override;
+
+    static constexpr int MIN_INDEXED_ROWS = 64;
+
+    // Позволяет отключить индексы столбцов (агрегатные и поисковые), чтобы
+    // сравнить результат и скорость с поячеечным чтением. По умолчанию
+    // индексы включены.
+    void SetColumnIndexesEnabled(bool enabled);
+
     Cell* GetOrCreateCell(Position pos);
 
+    // Зависимости формул от областей. Ячейки областей не создаются: формула
+    // cell находится по позиции любой ячейки области через индекс.
+    void AddRangeDependent(const Range& range, Cell* cell);
+    void RemoveRangeDependent(const Range& range, Cell* cell);
+    // Дописывает в out формулы, в области которых входит pos; формула может
+    // встретиться несколько раз.
+    void FindRangeDependents(Position pos, std::vector<Cell*>& out) const;
+    [[nodiscard]] size_t GetRangeDependencyCount() const;
+
+    // Сообщает индексам столбца, если они построены, новое содержимое ячейки.
+    void UpdateColumnIndexes(Position pos, const Cell& cell);
+
+    // Формула-массив разливает свои значения на область от своей ячейки
+    // вправо и вниз (см. Cell::GetSpillArea), если остальные ячейки области
+    // пусты и не заняты другой формулой-массивом. Иначе значения не
+    // разливаются, а значение формулы — #SPILL!, пока область не освободят.
+    // Ячейки области, занятые своим содержимым, не меняются.
+    //
+    // Сообщает листу, что содержимое ячейки pos изменилось, а old_area —
+    // область её прежней формулы-массива. Разливает новую формулу-массив,
+    // убирает значения прежней и блокирует или разливает заново формулы,
+    // в область которых входит pos или прежняя область. Вызывает ячейка.
+    void UpdateSpills(Position pos, Cell& cell, const std::optional<Range>& old_area);
+    // Число заблокированных формул-массивов листа.
+    [[nodiscard]] size_t GetBlockedSpillCount() const;
+
+    // Имена формул листа. Имя обозначает число, ячейку или область: число
+    // подставляется в формулы как константа, ячейка и область становятся
+    // обычными ссылками. При изменении или удалении имени заново связываются
+    // только формулы, которые его используют. Бросает FormulaException для
+    // некорректного имени (см. IsValidFormulaName), InvalidPositionException
+    // для некорректной ссылки и CircularDependencyException, если новое
+    // значение замыкает цикл; тогда имя сохраняет прежнее значение.
+    void DefineName(const std::string& name, NameValue value);
+    void RemoveName(const std::string& name);
+    // Значение имени для формул листа: сначала имя книги, затем имя листа.
+    [[nodiscard]] std::optional<NameValue> FindName(std::string_view name) const;
+    [[nodiscard]] NameResolver GetNameResolver() const;
+    // Связывает заново формулы листа, которые используют имя; вызывается
+    // при смене имени листа или книги.
+    void BindNameUsers(const std::string& name);
+
+    // Формулы, которые используют имя; их ведут ячейки.
+    void AddNameUser(const std::string& name, Cell* cell);
+    void RemoveNameUser(const std::string& name, Cell* cell);
+
+    // Вычисляет все формулы, значения которых устарели. Формулы одинаковой
+    // относительной формы вычисляются пачками.
+    void Recalculate() const;
+
+    // Изменчивые формулы листа (NOW, RAND); их ведут ячейки.
+    void AddVolatile(Cell* cell);
+    void RemoveVolatile(Cell* cell);
+    [[nodiscard]] size_t GetVolatileCount() const;
+
+    // Сбрасывает значения изменчивых формул листа и формул, которые от них
+    // зависят, в том числе на других листах книги. Сброшенные ячейки
+    // дописываются в dirty; ячейки, которые уже там есть, пропускаются.
+    void InvalidateVolatile(std::unordered_set<Cell*>& dirty);
+
+    // Шаг времени: вычисляет заново изменчивые формулы и только те формулы,
+    // которые от них зависят; остальные значения остаются вычисленными.
+    // Возвращает число вычисленных формул.
+    size_t Tick();
+
+    // Вычисляет значения формул из dirty, в том числе с других листов книги:
+    // формулы, от которых они зависят, вычисляются по мере чтения.
+    static size_t RecalculateDirty(const std::unordered_set<Cell*>& dirty);
+
 private:
     struct PositionHasher {
         size_t operator()(const Position& pos) const noexcept {
@@ -32,5 +156,35 @@ private:
         }
     };
 
+    const ColumnIndex& GetColumnIndex(int col) const;
+    const LookupIndex& GetLookupIndex(int col) const;
+    static void IndexCell(ColumnIndex& index, int row, const Cell& cell);
+    static void IndexCell(LookupIndex& index, int row, const Cell& cell);
+
+    // Значение ячейки как аргумента формулы; пустая ячейка — empty.
+    double ReadValue(Position pos, double empty) const;
+
+    // Разливает значения формулы-массива anchor на её область area или
+    // блокирует её, если область занята.
+    void TrySpill(Cell& anchor, const Range& area);
+    // Убирает разлитые значения anchor из её области area.
+    void Unspill(const Cell& anchor, const Range& area);
+
+    Workbook* workbook_ = nullptr;
+    std::string name_;
     std::unordered_map<Position, std::unique_ptr<Cell>, PositionHasher> cells_;
+    RangeIndex range_dependents_;
+    // Индексы строятся лениво при чтении, а лист книги могут читать формулы
+    // других листов из разных потоков.
+    mutable std::mutex indexes_mutex_;
+    mutable std::unordered_map<int, ColumnIndex> column_indexes_;
+    mutable std::unordered_map<int, LookupIndex> lookup_indexes_;
+    bool column_indexes_enabled_ = true;
+    std::unordered_map<std::string, NameValue> names_;
+    std::unordered_map<std::string, std::unordered_set<Cell*>> name_users_;
+    std::unordered_set<Cell*> volatile_cells_;
+    // Области формул-массивов и заблокированные из них по позиции формулы:
+    // освободившуюся область получает верхняя левая из претендующих формул.
+    RangeIndex spill_areas_;
+    std::map<Position, Cell*> blocked_spills_;
 };
\ No newline at end of file
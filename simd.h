@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstddef>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SPREADSHEET_SSE2
+#endif
+
+// Векторные операции над double для пакетного вычисления формул и свёрток
+// областей. Ширина вектора выбирается при сборке: AVX2, SSE2 или скалярный
+// вариант с одной дорожкой.
+namespace Simd {
+
+    // Скалярные операции: ими досчитываются хвосты, не кратные ширине
+    // вектора, и ими же работает сборка без SIMD.
+    inline double Add(double a, double b) { return a + b; }
+    inline double Sub(double a, double b) { return a - b; }
+    inline double Mul(double a, double b) { return a * b; }
+    inline double Div(double a, double b) { return a / b; }
+    inline double Neg(double a) { return -a; }
+    inline double Equal(double a, double b) { return a == b ? 1.0 : 0.0; }
+    inline double NotEqual(double a, double b) { return a != b ? 1.0 : 0.0; }
+    inline double Less(double a, double b) { return a < b ? 1.0 : 0.0; }
+    inline double LessEqual(double a, double b) { return a <= b ? 1.0 : 0.0; }
+    inline double Greater(double a, double b) { return a > b ? 1.0 : 0.0; }
+    inline double GreaterEqual(double a, double b) { return a >= b ? 1.0 : 0.0; }
+
+#if defined(__AVX2__)
+    constexpr size_t LANES = 4;
+    using Vec = __m256d;
+
+    inline Vec Load(const double* p) { return _mm256_loadu_pd(p); }
+    inline void Store(double* p, Vec v) { _mm256_storeu_pd(p, v); }
+    inline Vec Splat(double value) { return _mm256_set1_pd(value); }
+    inline Vec Add(Vec a, Vec b) { return _mm256_add_pd(a, b); }
+    inline Vec Sub(Vec a, Vec b) { return _mm256_sub_pd(a, b); }
+    inline Vec Mul(Vec a, Vec b) { return _mm256_mul_pd(a, b); }
+    inline Vec Div(Vec a, Vec b) { return _mm256_div_pd(a, b); }
+    inline Vec Neg(Vec a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+    inline Vec Min(Vec a, Vec b) { return _mm256_min_pd(a, b); }
+    inline Vec Max(Vec a, Vec b) { return _mm256_max_pd(a, b); }
+
+    // Бит i установлен, если i-я дорожка конечна: x - x равно нулю только
+    // для конечных x, для бесконечностей и NaN получается NaN.
+    inline int FiniteMask(Vec v) {
+        return _mm256_movemask_pd(
+                _mm256_cmp_pd(_mm256_sub_pd(v, v), _mm256_setzero_pd(), _CMP_EQ_OQ));
+    }
+
+    // Бит i установлен, если i-я дорожка — NaN.
+    inline int NanMask(Vec v) {
+        return _mm256_movemask_pd(_mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+    }
+
+    // Сравнения дают маску из дорожек со всеми единичными битами. С NaN
+    // верно только «не равно».
+    inline Vec CmpEq(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+    inline Vec CmpNeq(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_NEQ_UQ); }
+    inline Vec CmpLt(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    inline Vec CmpLe(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+    inline Vec CmpGt(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+    inline Vec CmpGe(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+
+    // Дорожки a там, где маска установлена, и b в остальных.
+    inline Vec Select(Vec mask, Vec a, Vec b) { return _mm256_blendv_pd(b, a, mask); }
+    inline int MoveMask(Vec mask) { return _mm256_movemask_pd(mask); }
+    inline Vec And(Vec a, Vec b) { return _mm256_and_pd(a, b); }
+
+    // Сравнения формул: 1 там, где сравнение верно, и 0 в остальных дорожках.
+    inline Vec Equal(Vec a, Vec b) { return And(CmpEq(a, b), Splat(1.0)); }
+    inline Vec NotEqual(Vec a, Vec b) { return And(CmpNeq(a, b), Splat(1.0)); }
+    inline Vec Less(Vec a, Vec b) { return And(CmpLt(a, b), Splat(1.0)); }
+    inline Vec LessEqual(Vec a, Vec b) { return And(CmpLe(a, b), Splat(1.0)); }
+    inline Vec Greater(Vec a, Vec b) { return And(CmpGt(a, b), Splat(1.0)); }
+    inline Vec GreaterEqual(Vec a, Vec b) { return And(CmpGe(a, b), Splat(1.0)); }
+#elif defined(SPREADSHEET_SSE2)
+    constexpr size_t LANES = 2;
+    using Vec = __m128d;
+
+    inline Vec Load(const double* p) { return _mm_loadu_pd(p); }
+    inline void Store(double* p, Vec v) { _mm_storeu_pd(p, v); }
+    inline Vec Splat(double value) { return _mm_set1_pd(value); }
+    inline Vec Add(Vec a, Vec b) { return _mm_add_pd(a, b); }
+    inline Vec Sub(Vec a, Vec b) { return _mm_sub_pd(a, b); }
+    inline Vec Mul(Vec a, Vec b) { return _mm_mul_pd(a, b); }
+    inline Vec Div(Vec a, Vec b) { return _mm_div_pd(a, b); }
+    inline Vec Neg(Vec a) { return _mm_xor_pd(a, _mm_set1_pd(-0.0)); }
+    inline Vec Min(Vec a, Vec b) { return _mm_min_pd(a, b); }
+    inline Vec Max(Vec a, Vec b) { return _mm_max_pd(a, b); }
+
+    inline int FiniteMask(Vec v) {
+        return _mm_movemask_pd(_mm_cmpeq_pd(_mm_sub_pd(v, v), _mm_setzero_pd()));
+    }
+
+    inline int NanMask(Vec v) {
+        return _mm_movemask_pd(_mm_cmpunord_pd(v, v));
+    }
+
+    inline Vec CmpEq(Vec a, Vec b) { return _mm_cmpeq_pd(a, b); }
+    inline Vec CmpNeq(Vec a, Vec b) { return _mm_cmpneq_pd(a, b); }
+    inline Vec CmpLt(Vec a, Vec b) { return _mm_cmplt_pd(a, b); }
+    inline Vec CmpLe(Vec a, Vec b) { return _mm_cmple_pd(a, b); }
+    inline Vec CmpGt(Vec a, Vec b) { return _mm_cmpgt_pd(a, b); }
+    inline Vec CmpGe(Vec a, Vec b) { return _mm_cmpge_pd(a, b); }
+
+    inline Vec Select(Vec mask, Vec a, Vec b) {
+        return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+    }
+    inline int MoveMask(Vec mask) { return _mm_movemask_pd(mask); }
+    inline Vec And(Vec a, Vec b) { return _mm_and_pd(a, b); }
+
+    // Сравнения формул: 1 там, где сравнение верно, и 0 в остальных дорожках.
+    inline Vec Equal(Vec a, Vec b) { return And(CmpEq(a, b), Splat(1.0)); }
+    inline Vec NotEqual(Vec a, Vec b) { return And(CmpNeq(a, b), Splat(1.0)); }
+    inline Vec Less(Vec a, Vec b) { return And(CmpLt(a, b), Splat(1.0)); }
+    inline Vec LessEqual(Vec a, Vec b) { return And(CmpLe(a, b), Splat(1.0)); }
+    inline Vec Greater(Vec a, Vec b) { return And(CmpGt(a, b), Splat(1.0)); }
+    inline Vec GreaterEqual(Vec a, Vec b) { return And(CmpGe(a, b), Splat(1.0)); }
+#else
+    constexpr size_t LANES = 1;
+#endif
+
+    // Число установленных битов маски дорожек.
+    inline size_t PopCount(int mask) {
+        size_t count = 0;
+        for (; mask != 0; mask &= mask - 1) {
+            ++count;
+        }
+        return count;
+    }
+
+} // namespace Simd
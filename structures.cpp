@@ -1,13 +1,76 @@
 #include "common.h"
 
-#include <cctype>
-#include <sstream>
 #include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <system_error>
+#include <tuple>
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
 const int MAX_POS_LETTER_COUNT = 3;
 
+namespace {
+
+    // Пары десятичных цифр "00".."99": номер строки записывается по две
+    // цифры за шаг.
+    struct DigitPairs {
+        char digits[200];
+
+        constexpr DigitPairs()
+                : digits() {
+            for (int i = 0; i < 100; ++i) {
+                digits[2 * i] = static_cast<char>('0' + i / 10);
+                digits[2 * i + 1] = static_cast<char>('0' + i % 10);
+            }
+        }
+    };
+
+    constexpr DigitPairs DIGIT_PAIRS;
+
+    bool IsUpperLetter(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    size_t WriteColumn(int col, char* out) {
+        if (col < LETTERS) {
+            out[0] = static_cast<char>('A' + col);
+            return 1;
+        }
+        col -= LETTERS;
+        if (col < LETTERS * LETTERS) {
+            out[0] = static_cast<char>('A' + col / LETTERS);
+            out[1] = static_cast<char>('A' + col % LETTERS);
+            return 2;
+        }
+        col -= LETTERS * LETTERS;
+        out[0] = static_cast<char>('A' + col / (LETTERS * LETTERS));
+        out[1] = static_cast<char>('A' + col / LETTERS % LETTERS);
+        out[2] = static_cast<char>('A' + col % LETTERS);
+        return 3;
+    }
+
+    size_t WriteNumber(int value, char* out) {
+        char buffer[std::numeric_limits<int>::digits10 + 1];
+        char* const end = buffer + sizeof(buffer);
+        char* begin = end;
+        while (value >= 100) {
+            begin -= 2;
+            std::memcpy(begin, DIGIT_PAIRS.digits + value % 100 * 2, 2);
+            value /= 100;
+        }
+        if (value >= 10) {
+            begin -= 2;
+            std::memcpy(begin, DIGIT_PAIRS.digits + value * 2, 2);
+        } else {
+            *--begin = static_cast<char>('0' + value);
+        }
+        std::memcpy(out, begin, end - begin);
+        return end - begin;
+    }
+
+} // namespace
+
 const Position Position::NONE = {-1, -1};
 
 bool Position::operator==(const Position rhs) const {
@@ -22,57 +85,136 @@ bool Position::IsValid() const {
     return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
 }
 
-std::string Position::ToString() const {
+size_t Position::ToChars(char* out) const {
     if (!IsValid()) {
-        return "";
+        return 0;
     }
+    const size_t letters = WriteColumn(col, out);
+    return letters + WriteNumber(row + 1, out + letters);
+}
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
-    }
-
-    result += std::to_string(row + 1);
-
-    return result;
+std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    return std::string(buffer, ToChars(buffer));
 }
 
 Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
+    size_t letters = 0;
+    while (letters < str.size() && IsUpperLetter(str[letters])) {
+        ++letters;
+    }
 
-    if (letters.empty() || digits.empty()) {
+    if (letters == 0 || letters == str.size()) {
         return Position::NONE;
     }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
+    if (letters > MAX_POS_LETTER_COUNT) {
         return Position::NONE;
     }
 
-    if (!std::isdigit(digits[0])) {
+    // Номер строки — только цифры: ни знака, ни пробелов.
+    const char* const digits = str.data() + letters;
+    const char* const end = str.data() + str.size();
+    if (*digits < '0' || *digits > '9') {
         return Position::NONE;
     }
 
-    int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    int row = 0;
+    auto [ptr, ec] = std::from_chars(digits, end, row);
+    if (ec != std::errc() || ptr != end) {
         return Position::NONE;
     }
 
     int col = 0;
-    for (char ch : letters) {
+    for (size_t i = 0; i < letters; ++i) {
         col *= LETTERS;
-        col += ch - 'A' + 1;
+        col += str[i] - 'A' + 1;
     }
 
     return {row - 1, col - 1};
 }
 
+size_t PositionsToChars(const Position* positions, size_t count, char separator, char* out) {
+    char* end = out;
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0) {
+            *end++ = separator;
+        }
+        end += positions[i].ToChars(end);
+    }
+    return end - out;
+}
+
+size_t PositionsFromChars(std::string_view text, char separator, Position* out) {
+    if (text.empty()) {
+        return 0;
+    }
+    size_t count = 0;
+    while (true) {
+        const size_t next = text.find(separator);
+        out[count++] = Position::FromString(text.substr(0, next));
+        if (next == std::string_view::npos) {
+            return count;
+        }
+        text.remove_prefix(next + 1);
+    }
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
-}
\ No newline at end of file
+}
+
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::operator<(Range rhs) const {
+    return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid()
+           && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row
+           && pos.col >= first.col && pos.col <= last.col;
+}
+
+Size Range::GetSize() const {
+    return {last.row - first.row + 1, last.col - first.col + 1};
+}
+
+size_t Range::GetCellCount() const {
+    const Size size = GetSize();
+    return static_cast<size_t>(size.rows) * static_cast<size_t>(size.cols);
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    char buffer[2 * Position::MAX_STRING_LENGTH + 1];
+    size_t length = first.ToChars(buffer);
+    buffer[length++] = ':';
+    length += last.ToChars(buffer + length);
+    return std::string(buffer, length);
+}
+
+Range Range::FromCorners(Position a, Position b) {
+    return {{std::min(a.row, b.row), std::min(a.col, b.col)},
+            {std::max(a.row, b.row), std::max(a.col, b.col)}};
+}
+
+Range Range::FromString(std::string_view str) {
+    const size_t colon = str.find(':');
+    if (colon == std::string_view::npos) {
+        return {};
+    }
+    const Position a = Position::FromString(str.substr(0, colon));
+    const Position b = Position::FromString(str.substr(colon + 1));
+    if (!a.IsValid() || !b.IsValid()) {
+        return {};
+    }
+    return FromCorners(a, b);
+}
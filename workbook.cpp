@@ -0,0 +1,171 @@
+#include "workbook.h"
+
+#include "cell.h"
+#include "parallel.h"
+
+#include <algorithm>
+
+Sheet& Workbook::AddSheet(std::string name) {
+    if (!IsValidSheetName(name)) {
+        throw FormulaException("Invalid sheet name: " + name);
+    }
+    if (sheets_by_name_.count(name) != 0) {
+        throw FormulaException("Duplicate sheet name: " + name);
+    }
+
+    sheets_.push_back(std::make_unique<Sheet>(*this, name));
+    Sheet& sheet = *sheets_.back();
+    sheets_by_name_.emplace(name, &sheet);
+
+    // Новый лист пуст, поэтому цикла через него быть не может.
+    if (auto it = waiting_.find(name); it != waiting_.end()) {
+        const std::vector<Cell*> cells(it->second.begin(), it->second.end());
+        for (Cell* cell : cells) {
+            cell->RelinkSheets();
+        }
+    }
+    return sheet;
+}
+
+void Workbook::DefineName(const std::string& name, double value) {
+    if (!IsValidFormulaName(name)) {
+        throw FormulaException("Invalid name: " + name);
+    }
+    // Число не добавляет ссылок, поэтому цикла быть не может.
+    names_[name] = value;
+    for (const auto& sheet : sheets_) {
+        sheet->BindNameUsers(name);
+    }
+}
+
+void Workbook::RemoveName(const std::string& name) {
+    auto it = names_.find(name);
+    if (it == names_.end()) {
+        return;
+    }
+    const double previous = it->second;
+    names_.erase(it);
+    try {
+        for (const auto& sheet : sheets_) {
+            sheet->BindNameUsers(name);
+        }
+    } catch (const CircularDependencyException&) {
+        // Часть листов уже связана с именами листа: возвращаем имя книги и
+        // связываем их снова.
+        DefineName(name, previous);
+        throw;
+    }
+}
+
+std::optional<double> Workbook::FindName(std::string_view name) const {
+    // Ключи — std::string: поиск по string_view требует временной строки.
+    if (auto it = names_.find(std::string(name)); it != names_.end()) {
+        return it->second;
+    }
+    return std::nullopt;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    auto it = sheets_by_name_.find(std::string(name));
+    return it == sheets_by_name_.end() ? nullptr : it->second;
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    auto it = sheets_by_name_.find(std::string(name));
+    return it == sheets_by_name_.end() ? nullptr : it->second;
+}
+
+size_t Workbook::GetSheetCount() const {
+    return sheets_.size();
+}
+
+void Workbook::Recalculate(size_t threads) const {
+    std::unordered_map<const Sheet*, std::unordered_set<const Sheet*>> sources;
+    for (const auto& [cell, links] : links_) {
+        for (const auto& [target, range] : links.ranges) {
+            if (target != links.sheet) {
+                sources[links.sheet].insert(target);
+            }
+        }
+    }
+
+    std::vector<const Sheet*> pending;
+    for (const auto& sheet : sheets_) {
+        pending.push_back(sheet.get());
+    }
+    std::unordered_set<const Sheet*> done;
+    while (!pending.empty()) {
+        std::vector<const Sheet*> wave;
+        std::vector<const Sheet*> rest;
+        for (const Sheet* sheet : pending) {
+            auto it = sources.find(sheet);
+            const bool ready = it == sources.end()
+                               || std::all_of(it->second.begin(), it->second.end(),
+                                              [&](const Sheet* source) {
+                                                  return done.count(source) != 0;
+                                              });
+            (ready ? wave : rest).push_back(sheet);
+        }
+        if (wave.empty()) {
+            break;
+        }
+
+        // Листы волны читают только вычисленные листы, а их значения уже не
+        // меняются.
+        ParallelFor(wave.size(), threads, [&](size_t i) { wave[i]->Recalculate(); }, 1);
+        done.insert(wave.begin(), wave.end());
+        pending = std::move(rest);
+    }
+
+    // Значения листов из циклов по листам вычисляются по требованию, в том
+    // числе через границы листов, поэтому здесь порядок не важен.
+    for (const Sheet* sheet : pending) {
+        sheet->Recalculate();
+    }
+}
+
+size_t Workbook::Tick() {
+    std::unordered_set<Cell*> dirty;
+    for (const auto& sheet : sheets_) {
+        sheet->InvalidateVolatile(dirty);
+    }
+    return Sheet::RecalculateDirty(dirty);
+}
+
+void Workbook::LinkSheetReferences(Sheet& sheet, Cell* cell,
+                                   const std::vector<SheetRange>& references) {
+    if (references.empty()) {
+        return;
+    }
+
+    Links& links = links_[cell];
+    links.sheet = &sheet;
+    for (const auto& [name, range] : references) {
+        if (Sheet* target = GetSheet(name)) {
+            target->AddRangeDependent(range, cell);
+            links.ranges.emplace_back(target, range);
+        } else {
+            waiting_[name].insert(cell);
+            links.missing.push_back(name);
+        }
+    }
+}
+
+void Workbook::UnlinkSheetReferences(Cell* cell) {
+    auto it = links_.find(cell);
+    if (it == links_.end()) {
+        return;
+    }
+
+    for (const auto& [target, range] : it->second.ranges) {
+        target->RemoveRangeDependent(range, cell);
+    }
+    for (const auto& name : it->second.missing) {
+        auto waiting = waiting_.find(name);
+        waiting->second.erase(cell);
+        if (waiting->second.empty()) {
+            waiting_.erase(waiting);
+        }
+    }
+    links_.erase(it);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+class Cell;
+
+// Книга из нескольких листов. Формула листа книги ссылается на другой лист
+// записью Лист1!A1 или, в аргументе функции, Лист1!A1:B2. Граф зависимостей
+// общий для всей книги: ссылка на другой лист — это запись в индексе
+// областей того листа, поэтому сброс значений и поиск циклов проходят через
+// границы листов так же, как внутри листа.
+class Workbook {
+public:
+    Workbook() = default;
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+
+    // Добавляет пустой лист. Имя — как в ссылке на лист, см. IsValidSheetName;
+    // для некорректного или уже занятого имени бросается FormulaException.
+    // Формулы, которые уже ссылаются на лист с этим именем, связываются с ним.
+    Sheet& AddSheet(std::string name);
+
+    // Имена-числа всей книги, общие для формул всех листов. Имя книги
+    // ищется раньше имени листа и скрывает его, см. Sheet::FindName. Имена
+    // ячеек и областей есть только у листов: ссылка имени книги была бы
+    // ссылкой на другой лист. Бросает FormulaException для некорректного
+    // имени. RemoveName бросает CircularDependencyException, если открытое
+    // им имя листа замыкает цикл; тогда имя книги остаётся.
+    void DefineName(const std::string& name, double value);
+    void RemoveName(const std::string& name);
+    [[nodiscard]] std::optional<double> FindName(std::string_view name) const;
+
+    // Лист по имени; nullptr, если его нет.
+    [[nodiscard]] Sheet* GetSheet(std::string_view name);
+    [[nodiscard]] const Sheet* GetSheet(std::string_view name) const;
+    [[nodiscard]] size_t GetSheetCount() const;
+
+    // Вычисляет все устаревшие формулы книги. Листы вычисляются волнами:
+    // в волну входят листы, все листы-источники которых уже вычислены, и
+    // листы одной волны вычисляются одновременно в threads потоках (0 — по
+    // числу ядер). Листы, ссылающиеся друг на друга по кругу, вычисляются
+    // после всех волн в одном потоке.
+    void Recalculate(size_t threads = 0) const;
+
+    // Шаг времени для всей книги, см. Sheet::Tick. Значения сначала
+    // сбрасываются на всех листах, поэтому формула, зависящая от изменчивых
+    // формул нескольких листов, вычисляется один раз. Возвращает число
+    // вычисленных формул.
+    size_t Tick();
+
+    // Ссылки формулы cell листа sheet на другие листы. Их ведёт ячейка:
+    // Link — при новом значении, Unlink — перед сменой значения.
+    void LinkSheetReferences(Sheet& sheet, Cell* cell, const std::vector<SheetRange>& references);
+    void UnlinkSheetReferences(Cell* cell);
+
+private:
+    struct Links {
+        Sheet* sheet = nullptr;
+        // Области других листов, добавленные в их индексы областей.
+        std::vector<std::pair<Sheet*, Range>> ranges;
+        // Листы, которых ещё нет.
+        std::vector<std::string> missing;
+    };
+
+    std::vector<std::unique_ptr<Sheet>> sheets_;
+    std::unordered_map<std::string, Sheet*> sheets_by_name_;
+    std::unordered_map<Cell*, Links> links_;
+    std::unordered_map<std::string, double> names_;
+    // Формулы, ссылающиеся на лист, которого нет: они связываются, когда
+    // лист добавят.
+    std::unordered_map<std::string, std::unordered_set<Cell*>> waiting_;
+};